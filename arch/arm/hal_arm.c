@@ -277,8 +277,8 @@ void hal_get_platform_info(char* buffer, size_t size) {
     snprintf(buffer, size, "STM32F4 ARM Cortex-M4 @ %lu MHz", SystemCoreClock / 1000000);
 }
 
-uint32_t hal_get_cpu_frequency(void) {
-    return SystemCoreClock;
+uint32_t hal_get_cpu_khz(void) {
+    return SystemCoreClock / 1000;
 }
 
 void hal_idle(void) {
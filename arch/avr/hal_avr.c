@@ -524,8 +524,8 @@ void hal_get_platform_info(char* buffer, size_t size) {
     snprintf(buffer, size, "AVR ATmega MCU @ %d MHz", F_CPU / 1000000);
 }
 
-uint32_t hal_get_cpu_frequency(void) {
-    return F_CPU;
+uint32_t hal_get_cpu_khz(void) {
+    return F_CPU / 1000;
 }
 
 void hal_idle(void) {
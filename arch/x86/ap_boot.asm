@@ -0,0 +1,90 @@
+; Application processor startup code for REXUS kernel
+; smp.c copies ap_trampoline_start..ap_trampoline_end to AP_TRAMPOLINE_BASE
+; (a page below 1MB) and fills in the parameter block before sending the
+; startup IPI. The AP starts here in real mode at CS:IP = 0x0800:0000.
+
+AP_TRAMPOLINE_BASE equ 0x8000
+
+; Address of a trampoline label in the copy at AP_TRAMPOLINE_BASE
+%define TRAMPOLINE(label) (AP_TRAMPOLINE_BASE + (label - ap_trampoline_start))
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_boot_params
+
+section .text
+[bits 16]
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    
+    ; Load the temporary GDT and enter protected mode
+    lgdt [TRAMPOLINE(ap_gdt_ptr)]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword 0x08:TRAMPOLINE(ap_protected_mode)
+
+[bits 32]
+ap_protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    
+    ; Enable large pages, and PAE and NX if the BSP uses them, then
+    ; paging with the kernel page directory
+    mov eax, cr4
+    or eax, [TRAMPOLINE(ap_boot_cr4)]
+    mov cr4, eax
+    mov ebx, [TRAMPOLINE(ap_boot_efer)]
+    test ebx, ebx
+    jz .no_efer
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, ebx
+    wrmsr
+.no_efer:
+    mov eax, [TRAMPOLINE(ap_boot_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80010000          ; PG, and WP for copy-on-write pages
+    mov cr0, eax
+    
+    ; Switch to the AP's kernel stack and call entry(cpu) in the higher half
+    mov esp, [TRAMPOLINE(ap_boot_stack)]
+    push dword [TRAMPOLINE(ap_boot_cpu)]
+    mov eax, [TRAMPOLINE(ap_boot_entry)]
+    call eax
+    
+    ; The entry point never returns
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+; Flat code and data segments, replaced by the kernel GDT in the entry point
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF
+    dq 0x00CF92000000FFFF
+ap_gdt_ptr:
+    dw ap_gdt_ptr - ap_gdt - 1
+    dd TRAMPOLINE(ap_gdt)
+
+; Parameter block, filled in by smp.c (layout of ap_boot_params_t)
+align 4
+ap_boot_params:
+ap_boot_cr3:    dd 0
+ap_boot_stack:  dd 0
+ap_boot_entry:  dd 0
+ap_boot_cpu:    dd 0
+ap_boot_cr4:    dd 0
+ap_boot_efer:   dd 0
+
+ap_trampoline_end:
@@ -0,0 +1,135 @@
+#include "apic.h"
+#include "cpu.h"
+#include "../../core/hal.h"
+#include "../../mem/vmm.h"
+#include "../../drivers/vga.h"
+#include <stddef.h>
+
+// Local APIC registers (byte offsets)
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ESR           0x280
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE       0x100
+#define LAPIC_LVT_MASKED       0x10000
+#define LAPIC_TIMER_PERIODIC   0x20000
+#define LAPIC_TIMER_DIVIDE_16  0x3
+#define LAPIC_ICR_PENDING      0x1000
+
+#define APIC_BASE_MSR_ENABLE   0x800
+#define CPUID_EDX_APIC         (1u << 9)
+
+// Identity-mapped register window, shared by all CPUs
+static volatile uint32_t* lapic = NULL;
+
+// Timer counts per millisecond at divide-by-16
+static uint32_t lapic_timer_per_ms = 0;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+// True if CPUID reports a local APIC
+bool apic_supported(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (edx & CPUID_EDX_APIC) != 0;
+}
+
+// Map the local APIC and enable it on the bootstrap processor
+bool apic_init(uint32_t base) {
+    if (!vmm_map_page(vmm_get_current_directory(), base, base,
+                      VMM_PRESENT | VMM_WRITABLE | VMM_WRITE_THROUGH | VMM_CACHE_DISABLE)) {
+        vga_puts("APIC: Failed to map local APIC registers\n");
+        return false;
+    }
+    lapic = (volatile uint32_t*)base;
+    
+    apic_init_cpu();
+    
+    vga_puts("APIC: Local APIC enabled, BSP APIC ID ");
+    vga_putint(apic_id());
+    vga_puts("\n");
+    return true;
+}
+
+// Enable the local APIC of the calling CPU
+void apic_init_cpu(void) {
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_MSR_ENABLE);
+    
+    // Accept all priorities, mask the error LVT, and software-enable
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// APIC ID of the calling CPU
+uint32_t apic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+// Signal end of interrupt
+void apic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// Send an inter-processor interrupt
+void apic_send_ipi(uint32_t dest_apic_id, uint32_t icr_low) {
+    unsigned long flags = irq_save();
+    
+    lapic_write(LAPIC_ICR_HIGH, dest_apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr_low);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __builtin_ia32_pause();
+    }
+    
+    irq_restore(flags);
+}
+
+// Busy-wait using the TSC
+void apic_delay_us(uint32_t us) {
+    uint32_t mhz = hal_get_cpu_khz() / 1000;
+    uint64_t end = rdtsc() + (uint64_t)mhz * us;
+    while (rdtsc() < end) {
+        __builtin_ia32_pause();
+    }
+}
+
+// Count the timer down for 10 ms to find its rate
+static void apic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    apic_delay_us(10000);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    
+    lapic_timer_per_ms = elapsed / 10;
+}
+
+// Start the periodic local APIC timer on the calling CPU
+void apic_timer_start(uint32_t hz) {
+    if (!lapic_timer_per_ms) {
+        apic_timer_calibrate();
+    }
+    
+    uint32_t count = (lapic_timer_per_ms * 1000) / hz;
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, count ? count : 1);
+}
@@ -0,0 +1,50 @@
+#ifndef REXUS_APIC_H
+#define REXUS_APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Physical address of the local APIC unless ACPI or MP tables say otherwise
+#define APIC_DEFAULT_BASE 0xFEE00000
+
+// Interrupt vectors owned by the local APIC, at the top of the IDT and
+// clear of the PIC's 32 to 47
+#define APIC_TIMER_VECTOR    0xF0
+#define APIC_RESCHED_VECTOR  0xF1
+#define APIC_TLB_VECTOR      0xF2
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// Interrupt command register: delivery modes and flags
+#define APIC_ICR_FIXED          0x00000000
+#define APIC_ICR_INIT           0x00000500
+#define APIC_ICR_STARTUP        0x00000600
+#define APIC_ICR_LEVEL_ASSERT   0x00004000
+#define APIC_ICR_TRIGGER_LEVEL  0x00008000
+#define APIC_ICR_ALL_BUT_SELF   0x000C0000
+
+// True if CPUID reports a local APIC
+bool apic_supported(void);
+
+// Map the local APIC registers and enable the APIC of the calling CPU
+bool apic_init(uint32_t base);
+
+// Enable the local APIC of the calling CPU (application processors)
+void apic_init_cpu(void);
+
+// APIC ID of the calling CPU
+uint32_t apic_id(void);
+
+// Signal end of interrupt for a vector delivered by the local APIC
+void apic_eoi(void);
+
+// Send an inter-processor interrupt and wait until it is delivered
+void apic_send_ipi(uint32_t dest_apic_id, uint32_t icr_low);
+
+// Start the periodic local APIC timer on the calling CPU. The bus clock
+// is measured against the TSC the first time this is called.
+void apic_timer_start(uint32_t hz);
+
+// Busy-wait using the TSC
+void apic_delay_us(uint32_t us);
+
+#endif /* REXUS_APIC_H */
@@ -36,9 +36,13 @@ boot_page_directory:
     ; Map the first 4MB of memory
     dd 0x00000083
     times (KERNEL_PAGE_NUMBER - 1) dd 0
-    ; Map 3GB+ to 0+
+    ; Map 3GB+ to the first 16MB (VMM_BOOT_MAP_SIZE) of the direct map, so the
+    ; PMM can reach the boot info and its bitmap before vmm_init
     dd 0x00000083
-    times (1024 - KERNEL_PAGE_NUMBER - 1) dd 0
+    dd 0x00400083
+    dd 0x00800083
+    dd 0x00C00083
+    times (1024 - KERNEL_PAGE_NUMBER - 4) dd 0
 
 section .bss
 align 16
@@ -0,0 +1,117 @@
+#ifndef REXUS_CPU_H
+#define REXUS_CPU_H
+
+#include <stdint.h>
+
+// Read the time-stamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Disable interrupts, returning the previous flags for irq_restore.
+// The host build of net/ runs in userspace, where cli is not allowed.
+static inline unsigned long irq_save(void) {
+#ifdef REXUS_HOST
+    return 0;
+#else
+    unsigned long flags;
+    __asm__ volatile("pushf\n"
+                     "pop %0\n"
+                     "cli"
+                     : "=r"(flags) : : "memory");
+    return flags;
+#endif
+}
+
+// Re-enable interrupts if they were enabled when irq_save was called
+static inline void irq_restore(unsigned long flags) {
+#ifdef REXUS_HOST
+    (void)flags;
+#else
+    if (flags & 0x200) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+#endif
+}
+
+// Enable interrupts and halt until the next one arrives. sti only takes
+// effect after the following instruction, so no interrupt can slip in
+// between the two and leave the CPU halted with its wakeup already gone.
+static inline void cpu_wait_for_interrupt(void) {
+#ifndef REXUS_HOST
+    __asm__ volatile("sti\n"
+                     "hlt" : : : "memory");
+#endif
+}
+
+// Control registers
+#define CR0_MP  (1u << 1)   // Monitor coprocessor: WAIT/FWAIT honour TS
+#define CR0_EM  (1u << 2)   // Emulate: x87 instructions raise #NM
+#define CR0_TS  (1u << 3)   // Task switched: next FPU/SSE use raises #NM
+#define CR0_NE  (1u << 5)   // Native x87 error reporting
+#define CR0_WP  (1u << 16)  // Ring 0 writes honour read-only pages
+#define CR4_PSE        (1u << 4)    // 4MB pages in 32-bit paging
+#define CR4_PAE        (1u << 5)    // PAE paging: 64-bit entries, 2MB large pages
+#define CR4_OSFXSR     (1u << 9)    // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT (1u << 10)   // Unmasked SSE exceptions raise #XM
+
+static inline unsigned long read_cr0(void) {
+    unsigned long value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(unsigned long value) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline unsigned long read_cr3(void) {
+    unsigned long value;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(unsigned long value) {
+    __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline unsigned long read_cr4(void) {
+    unsigned long value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(unsigned long value) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+// Clear CR0.TS
+static inline void clts(void) {
+    __asm__ volatile("clts" : : : "memory");
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(0));
+}
+
+// Model-specific registers
+#define MSR_APIC_BASE 0x1B
+#define MSR_PAT       0x277
+#define MSR_EFER      0xC0000080
+#define EFER_NXE      (1u << 11)    // No-execute bit in PAE entries
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+#endif /* REXUS_CPU_H */
@@ -0,0 +1,121 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "isr.h"
+#include "smp.h"
+#include "../../drivers/vga.h"
+#include <stddef.h>
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_EDX_FPU  (1u << 0)
+#define CPUID_EDX_FXSR (1u << 24)
+#define CPUID_EDX_SSE  (1u << 25)
+
+// Device-not-available exception
+#define FPU_TRAP_VECTOR 7
+
+// MXCSR reset value: all SSE exceptions masked, round to nearest
+#define FPU_MXCSR_DEFAULT 0x1F80
+
+// Whether fpu_init found FXSAVE and SSE
+static bool fpu_enabled = false;
+static fpu_stats_t fpu_stats;
+
+// #NM: the running task touched the FPU with CR0.TS set
+static void fpu_trap(registers_t* regs) {
+    (void)regs;
+    
+    cpu_t* cpu = this_cpu();
+    fpu_state_t* current = cpu->fpu_current;
+    
+    clts();
+    __atomic_fetch_add(&fpu_stats.traps, 1, __ATOMIC_RELAXED);
+    
+    // The owner was saved when it was switched out, so just load
+    if (current && current->valid) {
+        __asm__ volatile("fxrstor %0" : : "m"(current->fxsave));
+        __atomic_fetch_add(&fpu_stats.restores, 1, __ATOMIC_RELAXED);
+    } else {
+        uint32_t mxcsr = FPU_MXCSR_DEFAULT;
+        __asm__ volatile("fninit\n"
+                         "ldmxcsr %0" : : "m"(mxcsr));
+    }
+    
+    if (current) {
+        current->cpu = cpu->id;
+    }
+    cpu->fpu_owner = current;
+}
+
+// Enable x87 and SSE with lazy switching
+bool fpu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    
+    if ((edx & (CPUID_EDX_FPU | CPUID_EDX_FXSR | CPUID_EDX_SSE)) !=
+        (CPUID_EDX_FPU | CPUID_EDX_FXSR | CPUID_EDX_SSE)) {
+        fpu_init_cpu();
+        vga_puts("FPU: FXSAVE/SSE not supported, FPU disabled\n");
+        return false;
+    }
+    
+    fpu_enabled = true;
+    fpu_init_cpu();
+    isr_register_handler(FPU_TRAP_VECTOR, fpu_trap);
+    
+    vga_puts("FPU: Enabled x87/SSE with lazy state switching\n");
+    return true;
+}
+
+// Enable the FPU on the calling CPU
+void fpu_init_cpu(void) {
+    if (!fpu_enabled) {
+        write_cr0(read_cr0() | CR0_EM);
+        return;
+    }
+    
+    write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    
+    // Leave TS set so the first FPU use traps and starts from reset
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+}
+
+// Context switch: save prev if it used the FPU, trap on next's first use
+void fpu_switch(fpu_state_t* prev, fpu_state_t* next) {
+    cpu_t* cpu = this_cpu();
+    unsigned long cr0 = read_cr0();
+    
+    // TS clear means prev trapped in and its state is live in the registers
+    if (prev && cpu->fpu_owner == prev && !(cr0 & CR0_TS)) {
+        __asm__ volatile("fxsave %0" : "=m"(prev->fxsave));
+        prev->valid = true;
+        __atomic_fetch_add(&fpu_stats.saves, 1, __ATOMIC_RELAXED);
+    }
+    
+    cpu->fpu_current = next;
+    
+    // The registers still match next's saved image if it last ran here
+    if (next && cpu->fpu_owner == next && next->cpu == cpu->id) {
+        if (cr0 & CR0_TS) {
+            clts();
+        }
+    } else if (!(cr0 & CR0_TS)) {
+        write_cr0(cr0 | CR0_TS);
+    }
+}
+
+// Forget a state that is about to be freed
+void fpu_release(fpu_state_t* state) {
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if (cpus[i].fpu_owner == state) {
+            cpus[i].fpu_owner = NULL;
+        }
+        if (cpus[i].fpu_current == state) {
+            cpus[i].fpu_current = NULL;
+        }
+    }
+}
+
+// Get FPU statistics
+void fpu_get_stats(fpu_stats_t* stats) {
+    *stats = fpu_stats;
+}
@@ -0,0 +1,40 @@
+#ifndef REXUS_FPU_H
+#define REXUS_FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Saved x87/MMX/SSE register state of one task, in FXSAVE format
+typedef struct {
+    uint8_t fxsave[512];
+    bool valid;                 // fxsave holds state; otherwise start from reset
+    uint32_t cpu;               // CPU whose registers were last loaded from it
+} __attribute__((aligned(16))) fpu_state_t;
+
+// FPU statistics
+typedef struct {
+    uint32_t traps;             // #NM traps taken
+    uint32_t saves;             // Register images written back to a task
+    uint32_t restores;          // Register images loaded from a task
+} fpu_stats_t;
+
+// Enable x87 and SSE with lazy switching. Returns false if the CPU lacks
+// FXSAVE or SSE, in which case any FPU use stays a fatal #NM.
+bool fpu_init(void);
+
+// Enable the FPU on an application processor
+void fpu_init_cpu(void);
+
+// Called on every context switch. An outgoing task that used the FPU is
+// saved, since it may next run on another CPU; the incoming task gets
+// CR0.TS set and only pays for a restore if it uses the FPU. A task that
+// comes back to a CPU whose registers still hold its state skips both.
+void fpu_switch(fpu_state_t* prev, fpu_state_t* next);
+
+// Forget a state that is about to be freed
+void fpu_release(fpu_state_t* state);
+
+// Get FPU statistics
+void fpu_get_stats(fpu_stats_t* stats);
+
+#endif /* REXUS_FPU_H */
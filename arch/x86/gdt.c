@@ -1,23 +1,18 @@
 #include "gdt.h"
 #include <string.h>
 
-// GDT entries
-gdt_entry_t gdt_entries[6];  // null, kernel code, kernel data, user code, user data, tss
+// GDT entries (see GDT_ENTRIES for the layout)
+gdt_entry_t gdt_entries[GDT_ENTRIES];
 gdt_ptr_t   gdt_ptr;
-tss_entry_t tss_entry;
+tss_entry_t tss_entries[SMP_MAX_CPUS];
 
 void gdt_init(void) {
     // Setup GDT pointer
-    gdt_ptr.limit = (sizeof(gdt_entry_t) * 6) - 1;
+    gdt_ptr.limit = (sizeof(gdt_entry_t) * GDT_ENTRIES) - 1;
     gdt_ptr.base  = (uint32_t)&gdt_entries;
     
     // Setup TSS
-    memset(&tss_entry, 0, sizeof(tss_entry_t));
-    tss_entry.ss0 = 0x10;  // Kernel data segment
-    tss_entry.esp0 = 0;    // Will be set when needed
-    
-    // IO map to end of TSS
-    tss_entry.iomap_base = sizeof(tss_entry_t);
+    memset(&tss_entries, 0, sizeof(tss_entries));
     
     // GDT Entries
     // Format: index, base, limit, access, granularity
@@ -54,7 +49,7 @@ void gdt_init(void) {
     gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
     
     // TSS segment - 0x28
-    tss_set_gate(5, 0x10, 0);
+    tss_set_gate(GDT_TSS_BSP, &tss_entries[0], 0x10, 0);
     
     // Flush the changes to GDT and TSS
     gdt_flush((uint32_t)&gdt_ptr);
@@ -75,19 +70,39 @@ void gdt_set_gate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, ui
 }
 
 // Set TSS entry
-void tss_set_gate(int32_t num, uint16_t ss0, uint32_t esp0) {
-    uint32_t base = (uint32_t)&tss_entry;
+void tss_set_gate(int32_t num, tss_entry_t* tss, uint16_t ss0, uint32_t esp0) {
+    uint32_t base = (uint32_t)tss;
     uint32_t limit = base + sizeof(tss_entry_t);
     
     // As above, first create a normal segment
     gdt_set_gate(num, base, limit, 0xE9, 0x00);
     
-    // Update the TSS state
-    tss_entry.ss0 = ss0;
-    tss_entry.esp0 = esp0;
+    // Update the TSS state; IO map to end of TSS
+    tss->ss0 = ss0;
+    tss->esp0 = esp0;
+    tss->iomap_base = sizeof(tss_entry_t);
 }
 
-// Set kernel stack for TSS
+// Set kernel stack for the calling CPU's TSS
 void tss_set_kernel_stack(uint32_t stack) {
-    tss_entry.esp0 = stack;
+    tss_entries[cpu_id()].esp0 = stack;
+}
+
+// Per-CPU GDT setup, run on the CPU itself
+void gdt_init_cpu(uint32_t cpu, uint32_t percpu_base) {
+    // Per-CPU data segment: ring 0, writable, byte granular
+    gdt_set_gate(GDT_PERCPU_FIRST + cpu, percpu_base, 0xFFFF, 0x92, 0x40);
+    if (cpu) {
+        tss_set_gate(GDT_TSS_AP_FIRST + cpu - 1, &tss_entries[cpu], 0x10, 0);
+    }
+    
+    gdt_flush((uint32_t)&gdt_ptr);
+    
+    uint16_t gs = (GDT_PERCPU_FIRST + cpu) * sizeof(gdt_entry_t);
+    __asm__ volatile("mov %0, %%gs" : : "r"(gs));
+    
+    if (cpu) {
+        uint16_t tss = (GDT_TSS_AP_FIRST + cpu - 1) * sizeof(gdt_entry_t);
+        __asm__ volatile("ltr %0" : : "r"(tss));
+    }
 } 
\ No newline at end of file
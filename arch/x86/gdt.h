@@ -2,6 +2,14 @@
 #define REXUS_GDT_H
 
 #include <stdint.h>
+#include "smp.h"
+
+// GDT layout: null, kernel code/data, user code/data, TSS of CPU 0, then
+// the per-CPU GS segments and the TSSs of the application processors
+#define GDT_TSS_BSP         5
+#define GDT_PERCPU_FIRST    6
+#define GDT_TSS_AP_FIRST    (GDT_PERCPU_FIRST + SMP_MAX_CPUS)
+#define GDT_ENTRIES         (GDT_TSS_AP_FIRST + SMP_MAX_CPUS - 1)
 
 // GDT entry structure (Global Descriptor Table entry)
 typedef struct {
@@ -53,8 +61,12 @@ typedef struct {
 // Function declarations
 void gdt_init(void);
 void gdt_set_gate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
-void tss_set_gate(int32_t num, uint16_t ss0, uint32_t esp0);
+void tss_set_gate(int32_t num, tss_entry_t* tss, uint16_t ss0, uint32_t esp0);
 void tss_set_kernel_stack(uint32_t stack);
+
+// Load the GDT on the calling CPU and point its GS at its per-CPU data.
+// Application processors also get their own TSS.
+void gdt_init_cpu(uint32_t cpu, uint32_t percpu_base);
 extern void gdt_flush(uint32_t);
 extern void tss_flush(void);
 
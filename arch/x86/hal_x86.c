@@ -1,5 +1,7 @@
 #include "../../core/hal.h"
+#include "../../core/timer.h"
 #include "io.h"
+#include "cpu.h"
 #include "gdt.h"
 #include "idt.h"
 #include "pic.h"
@@ -33,7 +35,7 @@ void hal_free_page(void* page) {
 
 void hal_map_page(void* phys, void* virt, uint32_t flags) {
     page_dir_t* dir = vmm_get_current_directory();
-    vmm_map_page(dir, (physical_addr_t)phys, (virtual_addr_t)virt, flags);
+    vmm_map_page(dir, (uint32_t)phys, (virtual_addr_t)virt, flags);
 }
 
 void hal_unmap_page(void* virt) {
@@ -78,17 +80,15 @@ void hal_register_interrupt_handler(uint32_t interrupt, void (*handler)(void)) {
     isr_register_handler(interrupt, (isr_handler_t)handler);
 }
 
-// Timer and system time
-static uint64_t system_ticks = 0;
-static uint32_t ticks_per_ms = 0;
+// Timer and system time. Ticks are counted by the kernel timer
+// subsystem (core/timer.c); the HAL only programs the PIT.
+#define PIT_FREQUENCY 1193182
 
-static void timer_handler(registers_t* regs) {
-    system_ticks++;
-}
+// Count loaded by the last one-shot, for working out elapsed time
+static uint16_t pit_oneshot_count = 0;
 
-void hal_init_timer(uint32_t frequency) {
-    uint32_t divisor = 1193180 / frequency;
-    ticks_per_ms = frequency / 1000;
+void hal_timer_periodic(uint32_t frequency) {
+    uint32_t divisor = PIT_FREQUENCY / frequency;
     
     // Set PIT mode 3 (square wave generator)
     outb(0x43, 0x36);
@@ -96,21 +96,49 @@ void hal_init_timer(uint32_t frequency) {
     // Set divisor
     outb(0x40, divisor & 0xFF);
     outb(0x40, (divisor >> 8) & 0xFF);
+}
+
+void hal_init_timer(uint32_t frequency) {
+    hal_timer_periodic(frequency);
+    vga_puts("HAL: Initialized system timer\n");
+}
+
+void hal_timer_oneshot(uint32_t us) {
+    // PIT ticks per us is 1.193182; the 16-bit counter caps this at ~54.9ms
+    uint32_t count = (us * 1193) / 1000;
+    if (count == 0) {
+        count = 1;
+    } else if (count > 0xFFFF) {
+        count = 0xFFFF;
+    }
+    pit_oneshot_count = count;
     
-    // Register handler
-    irq_register_handler(IRQ0, timer_handler);
+    // Channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    outb(0x43, 0x30);
+    outb(0x40, count & 0xFF);
+    outb(0x40, (count >> 8) & 0xFF);
+}
+
+uint32_t hal_timer_oneshot_elapsed(void) {
+    // Latch channel 0 and read the remaining count
+    outb(0x43, 0x00);
+    uint32_t remaining = inb(0x40);
+    remaining |= (uint32_t)inb(0x40) << 8;
     
-    vga_puts("HAL: Initialized system timer\n");
+    // Past terminal count the counter wraps, so treat that as expired
+    uint32_t elapsed = remaining > pit_oneshot_count ? pit_oneshot_count
+                                                     : pit_oneshot_count - remaining;
+    return (elapsed * 1000) / 1193;
 }
 
 uint64_t hal_get_system_time(void) {
-    return system_ticks / ticks_per_ms;
+    return timer_now();
 }
 
 void hal_sleep(uint32_t ms) {
-    uint64_t target_ticks = system_ticks + (ms * ticks_per_ms);
-    while (system_ticks < target_ticks) {
-        __asm__ volatile("hlt");
+    uint64_t target = timer_now() + ms;
+    while (timer_now() < target) {
+        cpu_wait_for_interrupt();
     }
 }
 
@@ -362,10 +390,34 @@ void hal_get_platform_info(char* buffer, size_t size) {
     snprintf(buffer, size, "x86 CPU: %s Family %d Model %d", vendor, family, model);
 }
 
-uint32_t hal_get_cpu_frequency(void) {
-    // Not reliable without CPUID extended features
-    // Returns a reasonable default for modern x86 CPUs
-    return 2000000000; // 2 GHz
+// Measure the TSC rate against a 10 ms one-shot on PIT channel 2
+static uint32_t tsc_calibrate_khz(void) {
+    const uint16_t count = 1193182 / 100;
+    
+    // Gate channel 2 on, speaker off
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+    
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    outb(0x43, 0xB0);
+    outb(0x42, count & 0xFF);
+    outb(0x42, (count >> 8) & 0xFF);
+    
+    uint64_t start = rdtsc();
+    while (!(inb(0x61) & 0x20));
+    uint64_t end = rdtsc();
+    
+    return (uint32_t)(end - start) / 10;
+}
+
+static uint32_t cpu_khz = 0;
+
+uint32_t hal_get_cpu_khz(void) {
+    // Calibrate the TSC once and cache the result. In kHz, since Hz
+    // overflows 32 bits above 4.29GHz.
+    if (!cpu_khz) {
+        cpu_khz = tsc_calibrate_khz();
+    }
+    return cpu_khz;
 }
 
 void hal_idle(void) {
@@ -1,4 +1,5 @@
 #include "idt.h"
+#include "apic.h"
 #include <string.h>
 
 #define IDT_ENTRIES 256
@@ -59,6 +60,12 @@ extern void irq13(void);
 extern void irq14(void);
 extern void irq15(void);
 
+// Local APIC vectors, in isr_stubs.asm
+extern void isr240(void);
+extern void isr241(void);
+extern void isr242(void);
+extern void isr255(void);
+
 void idt_init(void) {
     // Setup IDT pointer
     idt_ptr.limit = sizeof(idt_entry_t) * IDT_ENTRIES - 1;
@@ -125,10 +132,21 @@ void idt_init(void) {
     idt_set_gate(46, (uint32_t)irq14, 0x08, 0x8E);
     idt_set_gate(47, (uint32_t)irq15, 0x08, 0x8E);
     
+    // Local APIC vectors
+    idt_set_gate(APIC_TIMER_VECTOR, (uint32_t)isr240, 0x08, 0x8E);
+    idt_set_gate(APIC_RESCHED_VECTOR, (uint32_t)isr241, 0x08, 0x8E);
+    idt_set_gate(APIC_TLB_VECTOR, (uint32_t)isr242, 0x08, 0x8E);
+    idt_set_gate(APIC_SPURIOUS_VECTOR, (uint32_t)isr255, 0x08, 0x8E);
+    
     // Load the IDT
     idt_load((uint32_t)&idt_ptr);
 }
 
+// Load the shared IDT on an application processor
+void idt_init_cpu(void) {
+    idt_load((uint32_t)&idt_ptr);
+}
+
 // Set an entry in the IDT
 void idt_set_gate(uint8_t num, uint32_t base, uint16_t selector, uint8_t flags) {
     idt_entries[num].base_low = base & 0xFFFF;
@@ -21,6 +21,7 @@ typedef struct {
 // Function declarations
 void idt_init(void);
 void idt_set_gate(uint8_t num, uint32_t base, uint16_t selector, uint8_t flags);
+void idt_init_cpu(void);
 extern void idt_load(uint32_t);
 
 // Function pointers for handler delegation
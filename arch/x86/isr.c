@@ -49,8 +49,8 @@ void isr_init(void) {
 
 // This gets called from our ASM interrupt handler stub
 void isr_handler(registers_t *regs) {
-    // Handle CPU exceptions specifically (interrupts 0-31)
-    if (regs->int_no < 32) {
+    // CPU exceptions (interrupts 0-31) without a registered handler are fatal
+    if (regs->int_no < 32 && interrupt_handlers[regs->int_no] == 0) {
         vga_puts("EXCEPTION: ");
         vga_puts(exception_messages[regs->int_no]);
         vga_puts(" (");
@@ -91,12 +91,17 @@ void irq_handler(registers_t *regs) {
     }
 }
 
-// Register a handler for a specific ISR
-void isr_register_handler(uint8_t n, isr_handler_t handler) {
+// Register a handler for a specific ISR. Fails if the vector already
+// has another handler.
+bool isr_register_handler(uint8_t n, isr_handler_t handler) {
+    if (interrupt_handlers[n] && interrupt_handlers[n] != handler) {
+        return false;
+    }
     interrupt_handlers[n] = handler;
+    return true;
 }
 
 // Register a handler for a specific IRQ (convenience wrapper)
-void irq_register_handler(uint8_t n, isr_handler_t handler) {
-    isr_register_handler(n + 32, handler);
+bool irq_register_handler(uint8_t n, isr_handler_t handler) {
+    return isr_register_handler(n + 32, handler);
 } 
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define REXUS_ISR_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // This struct gets pushed to the stack when an interrupt occurs
 typedef struct {
@@ -16,25 +17,25 @@ typedef void (*isr_handler_t)(registers_t *);
 
 // Function declarations
 void isr_init(void);
-void isr_register_handler(uint8_t n, isr_handler_t handler);
-void irq_register_handler(uint8_t n, isr_handler_t handler);
+bool isr_register_handler(uint8_t n, isr_handler_t handler);
+bool irq_register_handler(uint8_t n, isr_handler_t handler);
 
-// Commonly used ISR/IRQ numbers
-#define IRQ0  32 // Timer
-#define IRQ1  33 // Keyboard
-#define IRQ2  34 // Cascade for 8259A Slave controller
-#define IRQ3  35 // Serial port 2
-#define IRQ4  36 // Serial port 1
-#define IRQ5  37 // LPT2 or sound card
-#define IRQ6  38 // Floppy disk controller
-#define IRQ7  39 // LPT1
-#define IRQ8  40 // RTC
-#define IRQ9  41 // Legacy SCSI or NIC
-#define IRQ10 42 // Available
-#define IRQ11 43 // Available
-#define IRQ12 44 // PS/2 Mouse
-#define IRQ13 45 // FPU
-#define IRQ14 46 // Primary ATA
-#define IRQ15 47 // Secondary ATA
+// PIC lines for irq_register_handler, which adds the vector base of 32
+#define IRQ0  0  // Timer
+#define IRQ1  1  // Keyboard
+#define IRQ2  2  // Cascade for 8259A Slave controller
+#define IRQ3  3  // Serial port 2
+#define IRQ4  4  // Serial port 1
+#define IRQ5  5  // LPT2 or sound card
+#define IRQ6  6  // Floppy disk controller
+#define IRQ7  7  // LPT1
+#define IRQ8  8  // RTC
+#define IRQ9  9  // Legacy SCSI or NIC
+#define IRQ10 10 // Available
+#define IRQ11 11 // Available
+#define IRQ12 12 // PS/2 Mouse
+#define IRQ13 13 // FPU
+#define IRQ14 14 // Primary ATA
+#define IRQ15 15 // Secondary ATA
 
 #endif /* REXUS_ISR_H */ 
\ No newline at end of file
@@ -52,12 +52,19 @@
 [GLOBAL irq14]
 [GLOBAL irq15]
 
+; Local APIC vectors (above 127, so they are pushed as dwords)
+[GLOBAL isr240]
+[GLOBAL isr241]
+[GLOBAL isr242]
+[GLOBAL isr255]
+
 ; C handlers
 [EXTERN isr_handler]
 [EXTERN irq_handler]
 
 ; Common ISR stub that saves processor state and sets up kernel mode segments
-; before calling the C-level interrupt handler
+; before calling the C-level interrupt handler. GS is left alone: it holds
+; the per-CPU data segment of the CPU taking the interrupt.
 isr_common_stub:
     ; Save all registers
     pusha
@@ -71,7 +78,6 @@ isr_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     
     ; Call C handler
     call isr_handler
@@ -81,7 +87,6 @@ isr_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     
     ; Restore registers
     popa
@@ -106,7 +111,6 @@ irq_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     
     ; Call C handler
     call irq_handler
@@ -116,7 +120,6 @@ irq_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     
     ; Restore registers
     popa
@@ -416,4 +419,32 @@ irq15:
     cli
     push byte 0
     push byte 47
-    jmp irq_common_stub 
\ No newline at end of file
+    jmp irq_common_stub
+
+; Local APIC timer
+isr240:
+    cli
+    push byte 0
+    push dword 240
+    jmp isr_common_stub
+
+; Reschedule IPI
+isr241:
+    cli
+    push byte 0
+    push dword 241
+    jmp isr_common_stub
+
+; TLB shootdown IPI
+isr242:
+    cli
+    push byte 0
+    push dword 242
+    jmp isr_common_stub
+
+; Local APIC spurious interrupt
+isr255:
+    cli
+    push byte 0
+    push dword 255
+    jmp isr_common_stub
@@ -0,0 +1,53 @@
+#ifndef REXUS_MULTIBOOT_H
+#define REXUS_MULTIBOOT_H
+
+#include <stdint.h>
+
+// Value of EAX when a multiboot loader enters the kernel
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+// multiboot_info_t flags: which fields are valid
+#define MULTIBOOT_INFO_MEMORY   0x001
+#define MULTIBOOT_INFO_CMDLINE  0x004
+#define MULTIBOOT_INFO_MODS     0x008
+#define MULTIBOOT_INFO_MMAP     0x040
+
+// Memory map entry types (e820)
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+// Boot information; all addresses in it are physical
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+// Memory map entry. size does not count itself, and entries may be
+// larger than this structure.
+typedef struct {
+    uint32_t size;
+    uint64_t base_addr;
+    uint64_t length;
+    uint32_t type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+// Boot module loaded along with the kernel
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;               // One past the last byte
+    uint32_t string;                // Module command line
+    uint32_t reserved;
+} __attribute__((packed)) multiboot_module_t;
+
+static inline multiboot_mmap_entry_t* multiboot_mmap_next(multiboot_mmap_entry_t* entry) {
+    return (multiboot_mmap_entry_t*)((uint32_t)entry + entry->size + sizeof(uint32_t));
+}
+
+#endif /* REXUS_MULTIBOOT_H */
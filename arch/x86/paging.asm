@@ -2,6 +2,9 @@
 
 global enable_paging
 global load_page_directory
+global enter_pae
+
+section .text
 
 ; Enable paging
 ; This function turns on paging by setting the paging bit in CR0
@@ -32,4 +35,32 @@ load_page_directory:
     ; Load page directory
     mov cr3, eax
     
-    ret 
\ No newline at end of file
+    ret
+
+section .boot
+; Switch from 32-bit to PAE paging
+; Paging must be off while CR4.PAE changes, so this runs at its load
+; address, which the old and the new tables both identity-map. The
+; stack is not touched while paging is off.
+; Parameters:
+;   - cr3: Physical address of the PDPT
+enter_pae:
+    mov edx, [esp+4]
+    
+    ; Disable paging
+    mov eax, cr0
+    and eax, 0x7FFFFFFF
+    mov cr0, eax
+    
+    ; Enable PAE and load the PDPT
+    mov eax, cr4
+    or eax, 0x00000020
+    mov cr4, eax
+    mov cr3, edx
+    
+    ; Enable paging again
+    mov eax, cr0
+    or eax, 0x80000000
+    mov cr0, eax
+    
+    ret
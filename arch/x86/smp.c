@@ -0,0 +1,399 @@
+#include "smp.h"
+#include "apic.h"
+#include "gdt.h"
+#include "idt.h"
+#include "isr.h"
+#include "cpu.h"
+#include "../../core/timer.h"
+#include "../../mem/pmm.h"
+#include "../../mem/vmm.h"
+#include "../../proc/process.h"
+#include "../../drivers/vga.h"
+#include <string.h>
+
+// Kernel stack of each application processor
+#define SMP_AP_STACK_SIZE 16384
+
+// ACPI: root pointer, table header and MADT
+#define ACPI_MADT_LOCAL_APIC    0
+#define ACPI_MADT_CPU_ENABLED   0x1
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+typedef struct {
+    acpi_header_t header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+// MP specification: floating pointer and configuration table
+#define MP_ENTRY_PROCESSOR  0
+#define MP_CPU_ENABLED      0x1
+
+typedef struct {
+    char signature[4];
+    uint32_t config_addr;
+    uint8_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t features[5];
+} __attribute__((packed)) mp_floating_t;
+
+typedef struct {
+    char signature[4];
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table_addr;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_addr;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed)) mp_config_t;
+
+// Parameter block at ap_boot_params in the trampoline (ap_boot.asm)
+typedef struct {
+    uint32_t cr3;
+    uint32_t stack;
+    uint32_t entry;
+    uint32_t cpu;
+    uint32_t cr4;                   // Paging mode bits to set before paging is on
+    uint32_t efer;                  // EFER bits to set, if any (NX)
+} __attribute__((packed)) ap_boot_params_t;
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_boot_params[];
+
+cpu_t cpus[SMP_MAX_CPUS];
+static uint32_t cpu_count = 1;
+
+// APIC IDs found in the firmware tables
+static uint32_t smp_found_ids[SMP_MAX_CPUS];
+static uint32_t smp_found_count = 0;
+
+// Identity-map firmware memory that lies outside the kernel's mappings
+static void smp_map_phys(uint32_t addr, uint32_t length) {
+    page_dir_t* dir = vmm_get_current_directory();
+    for (uint32_t page = addr & ~0xFFF; page < addr + length; page += PAGE_SIZE) {
+        physical_addr_t mapped;
+        if (!vmm_get_mapping(dir, page, &mapped)) {
+            vmm_map_page(dir, page, page, VMM_PRESENT);
+        }
+    }
+}
+
+static bool smp_checksum_ok(const void* data, uint32_t length) {
+    const uint8_t* bytes = data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+// Search a physical range for a 16-byte aligned signature
+static void* smp_scan(uint32_t start, uint32_t length, const char* signature, uint32_t sig_len) {
+    for (uint32_t addr = start; addr + sig_len <= start + length; addr += 16) {
+        if (memcmp((void*)addr, signature, sig_len) == 0) {
+            return (void*)addr;
+        }
+    }
+    return NULL;
+}
+
+// Search the EBDA and the BIOS ROM area, where both ACPI and MP place
+// their root structures
+static void* smp_scan_bios(const char* signature, uint32_t sig_len) {
+    uint32_t ebda = (uint32_t)(*(volatile uint16_t*)phys_to_virt(0x40E)) << 4;
+    void* found = NULL;
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        found = smp_scan(ebda, 1024, signature, sig_len);
+    }
+    if (!found) {
+        found = smp_scan(0x9FC00, 1024, signature, sig_len);
+    }
+    if (!found) {
+        found = smp_scan(0xE0000, 0x20000, signature, sig_len);
+    }
+    return found;
+}
+
+static void smp_add_cpu(uint32_t apic_id) {
+    if (smp_found_count < SMP_MAX_CPUS) {
+        smp_found_ids[smp_found_count++] = apic_id;
+    }
+}
+
+// Collect enabled processors from the ACPI MADT
+static bool smp_parse_madt(uint32_t* lapic_addr) {
+    acpi_rsdp_t* rsdp = smp_scan_bios("RSD PTR ", 8);
+    if (!rsdp || !smp_checksum_ok(rsdp, sizeof(acpi_rsdp_t))) {
+        return false;
+    }
+    
+    smp_map_phys(rsdp->rsdt_addr, sizeof(acpi_header_t));
+    acpi_header_t* rsdt = (acpi_header_t*)rsdp->rsdt_addr;
+    smp_map_phys(rsdp->rsdt_addr, rsdt->length);
+    if (memcmp(rsdt->signature, "RSDT", 4) != 0 || !smp_checksum_ok(rsdt, rsdt->length)) {
+        return false;
+    }
+    
+    uint32_t* tables = (uint32_t*)(rsdt + 1);
+    uint32_t table_count = (rsdt->length - sizeof(acpi_header_t)) / 4;
+    for (uint32_t i = 0; i < table_count; i++) {
+        smp_map_phys(tables[i], sizeof(acpi_header_t));
+        acpi_header_t* table = (acpi_header_t*)tables[i];
+        if (memcmp(table->signature, "APIC", 4) != 0) {
+            continue;
+        }
+        
+        smp_map_phys(tables[i], table->length);
+        acpi_madt_t* madt = (acpi_madt_t*)table;
+        *lapic_addr = madt->lapic_addr;
+        
+        // Variable-length entries: type, length, body
+        uint8_t* entry = (uint8_t*)(madt + 1);
+        uint8_t* end = (uint8_t*)madt + madt->header.length;
+        while (entry + 2 <= end && entry[1] >= 2) {
+            if (entry[0] == ACPI_MADT_LOCAL_APIC && entry[1] >= 8 &&
+                (*(uint32_t*)(entry + 4) & ACPI_MADT_CPU_ENABLED)) {
+                smp_add_cpu(entry[3]);
+            }
+            entry += entry[1];
+        }
+        return smp_found_count > 0;
+    }
+    return false;
+}
+
+// Collect enabled processors from the MP configuration table
+static bool smp_parse_mp(uint32_t* lapic_addr) {
+    mp_floating_t* mpf = smp_scan_bios("_MP_", 4);
+    if (!mpf || !mpf->config_addr) {
+        return false;
+    }
+    
+    smp_map_phys(mpf->config_addr, sizeof(mp_config_t));
+    mp_config_t* config = (mp_config_t*)mpf->config_addr;
+    smp_map_phys(mpf->config_addr, config->length);
+    if (memcmp(config->signature, "PCMP", 4) != 0) {
+        return false;
+    }
+    *lapic_addr = config->lapic_addr;
+    
+    // Processor entries are 20 bytes, all others 8
+    uint8_t* entry = (uint8_t*)(config + 1);
+    for (uint32_t i = 0; i < config->entry_count; i++) {
+        if (entry[0] == MP_ENTRY_PROCESSOR) {
+            if (entry[3] & MP_CPU_ENABLED) {
+                smp_add_cpu(entry[1]);
+            }
+            entry += 20;
+        } else {
+            entry += 8;
+        }
+    }
+    return smp_found_count > 0;
+}
+
+// Local APIC timer: per-CPU scheduler tick on the application processors
+static void smp_timer_interrupt(registers_t* regs) {
+    apic_eoi();
+    process_timer_tick(regs);
+}
+
+// Another CPU queued work for this one
+static void smp_resched_interrupt(registers_t* regs) {
+    (void)regs;
+    apic_eoi();
+    process_resched();
+}
+
+// Another CPU changed page tables this one may have cached
+static void smp_tlb_interrupt(registers_t* regs) {
+    (void)regs;
+    vmm_tlb_shootdown_interrupt();
+    apic_eoi();
+}
+
+static void smp_spurious_interrupt(registers_t* regs) {
+    // No EOI for spurious interrupts
+    (void)regs;
+}
+
+// C entry point of an application processor, called by the trampoline
+// on its own kernel stack with paging enabled
+static void smp_ap_main(uint32_t cpu) {
+    gdt_init_cpu(cpu, (uint32_t)&cpus[cpu]);
+    idt_init_cpu();
+    fpu_init_cpu();
+    vmm_init_pat();
+    apic_init_cpu();
+    process_init_cpu(cpu);
+    apic_timer_start(TIMER_HZ);
+    
+    __atomic_store_n(&cpus[cpu].online, true, __ATOMIC_RELEASE);
+    
+    // This context is the CPU's idle process from here on
+    for (;;) {
+        process_idle_wait();
+    }
+}
+
+// Start one application processor with INIT-SIPI-SIPI
+static bool smp_boot_ap(uint32_t cpu, uint32_t apic) {
+    void* stack = pmm_alloc_blocks(SMP_AP_STACK_SIZE / PAGE_SIZE);
+    if (!stack) {
+        return false;
+    }
+    
+    cpus[cpu].self = &cpus[cpu];
+    cpus[cpu].id = cpu;
+    cpus[cpu].apic_id = apic;
+    
+    // Copy the trampoline and fill in its parameters
+    uint8_t* trampoline = (uint8_t*)AP_TRAMPOLINE_BASE;
+    memcpy(trampoline, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    ap_boot_params_t* params = (ap_boot_params_t*)(trampoline + (ap_boot_params - ap_trampoline_start));
+    params->cr3 = vmm_get_cr3(vmm_get_current_directory());
+    cpus[cpu].cr3 = params->cr3;
+    params->stack = (uint32_t)stack + SMP_AP_STACK_SIZE;
+    params->entry = (uint32_t)smp_ap_main;
+    params->cpu = cpu;
+    params->cr4 = CR4_PSE | (vmm_pae_enabled() ? CR4_PAE : 0);
+    params->efer = vmm_nx_enabled() ? EFER_NXE : 0;
+    
+    // INIT, then two STARTUP IPIs pointing at the trampoline page
+    apic_send_ipi(apic, APIC_ICR_INIT | APIC_ICR_LEVEL_ASSERT);
+    apic_delay_us(10000);
+    for (int i = 0; i < 2 && !cpus[cpu].online; i++) {
+        apic_send_ipi(apic, APIC_ICR_STARTUP | (AP_TRAMPOLINE_BASE >> 12));
+        apic_delay_us(200);
+    }
+    
+    // Give it up to 100 ms to reach the scheduler
+    for (int i = 0; i < 1000 && !__atomic_load_n(&cpus[cpu].online, __ATOMIC_ACQUIRE); i++) {
+        apic_delay_us(100);
+    }
+    
+    if (!cpus[cpu].online) {
+        pmm_free_blocks(stack, SMP_AP_STACK_SIZE / PAGE_SIZE);
+        return false;
+    }
+    return true;
+}
+
+// Per-CPU data for the bootstrap processor
+void smp_early_init(void) {
+    memset(cpus, 0, sizeof(cpus));
+    cpus[0].self = &cpus[0];
+    cpus[0].id = 0;
+    cpus[0].online = true;
+    gdt_init_cpu(0, (uint32_t)&cpus[0]);
+}
+
+// Find and start the application processors
+uint32_t smp_init(void) {
+    if (!apic_supported()) {
+        vga_puts("SMP: No local APIC, running on the boot CPU only\n");
+        return cpu_count;
+    }
+    
+    uint32_t lapic_addr = APIC_DEFAULT_BASE;
+    if (!smp_parse_madt(&lapic_addr) && !smp_parse_mp(&lapic_addr)) {
+        vga_puts("SMP: No ACPI MADT or MP table, running on the boot CPU only\n");
+    }
+    
+    if (!apic_init(lapic_addr)) {
+        return cpu_count;
+    }
+    cpus[0].apic_id = apic_id();
+    
+    if (!isr_register_handler(APIC_TIMER_VECTOR, smp_timer_interrupt) ||
+        !isr_register_handler(APIC_RESCHED_VECTOR, smp_resched_interrupt) ||
+        !isr_register_handler(APIC_TLB_VECTOR, smp_tlb_interrupt) ||
+        !isr_register_handler(APIC_SPURIOUS_VECTOR, smp_spurious_interrupt)) {
+        vga_puts("SMP: APIC vectors already in use, running on the boot CPU only\n");
+        return cpu_count;
+    }
+    
+    // The boot CPU keeps the PIT as its tick: it owns jiffies and
+    // tickless idle reprograms the PIT. Only application processors
+    // run the local APIC timer (smp_ap_main).
+    
+    // Application processors start one at a time: they share the trampoline
+    for (uint32_t i = 0; i < smp_found_count && cpu_count < SMP_MAX_CPUS; i++) {
+        if (smp_found_ids[i] == cpus[0].apic_id) {
+            continue;
+        }
+        if (smp_boot_ap(cpu_count, smp_found_ids[i])) {
+            cpu_count++;
+        } else {
+            vga_puts("SMP: APIC ID ");
+            vga_putint(smp_found_ids[i]);
+            vga_puts(" did not start\n");
+        }
+    }
+    
+    vga_puts("SMP: ");
+    vga_putint(cpu_count);
+    vga_puts(" CPUs online\n");
+    return cpu_count;
+}
+
+// Number of CPUs online
+uint32_t smp_cpu_count(void) {
+    return cpu_count;
+}
+
+// Ask another CPU to look at its run queue
+void smp_send_resched(uint32_t cpu) {
+    if (cpu < cpu_count && cpu != cpu_id()) {
+        apic_send_ipi(cpus[cpu].apic_id, APIC_ICR_FIXED | APIC_RESCHED_VECTOR);
+    }
+}
+
+// Interrupt CPUs for a TLB shootdown: one broadcast if that is all of
+// them, one IPI each otherwise
+uint32_t smp_send_tlb_shootdown(uint32_t mask) {
+    uint32_t self = cpu_id();
+    uint32_t others = ((1u << cpu_count) - 1) & ~(1u << self);
+    mask &= others;
+    
+    if (mask && mask == others) {
+        apic_send_ipi(0, APIC_ICR_ALL_BUT_SELF | APIC_ICR_FIXED | APIC_TLB_VECTOR);
+        return 1;
+    }
+    
+    uint32_t sent = 0;
+    for (uint32_t cpu = 0; cpu < cpu_count; cpu++) {
+        if (mask & (1u << cpu)) {
+            apic_send_ipi(cpus[cpu].apic_id, APIC_ICR_FIXED | APIC_TLB_VECTOR);
+            sent++;
+        }
+    }
+    return sent;
+}
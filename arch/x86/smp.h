@@ -0,0 +1,64 @@
+#ifndef REXUS_SMP_H
+#define REXUS_SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "fpu.h"
+
+// Most CPUs brought up
+#define SMP_MAX_CPUS 8
+
+// Physical page the application processor startup code is copied to
+#define AP_TRAMPOLINE_BASE 0x8000
+
+struct thread;
+struct vm_space;
+
+// Per-CPU data, reached through the GS segment of each CPU
+typedef struct cpu {
+    struct cpu* self;               // At gs:0, so this_cpu() is one load
+    uint32_t id;                    // Logical CPU number, 0 is the BSP
+    uint32_t apic_id;               // Local APIC ID
+    volatile bool online;           // Set once the CPU entered the scheduler
+    uint32_t cr3;                   // Page directory loaded, for TLB shootdowns
+    struct thread* current;         // Thread running on this CPU
+    struct vm_space* vm_space;      // Its address space, for demand faults
+    fpu_state_t* fpu_owner;         // State loaded in this CPU's FPU registers
+    fpu_state_t* fpu_current;       // FPU state of the running thread
+} cpu_t;
+
+extern cpu_t cpus[SMP_MAX_CPUS];
+
+// The calling CPU's data. Only stable while the caller cannot migrate,
+// i.e. with interrupts disabled.
+static inline cpu_t* this_cpu(void) {
+    cpu_t* cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile("mov %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(cpu_t, id)));
+    return id;
+}
+
+// Set up the bootstrap processor's per-CPU data (right after gdt_init)
+void smp_early_init(void);
+
+// Find the other CPUs in the ACPI MADT or MP tables and start them.
+// Returns the number of CPUs online.
+uint32_t smp_init(void);
+
+// Number of CPUs online
+uint32_t smp_cpu_count(void);
+
+// Ask another CPU to look at its run queue
+void smp_send_resched(uint32_t cpu);
+
+// Interrupt the CPUs in a mask (other than the caller) to do their part
+// of the TLB shootdown in progress. Returns the number of IPIs sent.
+uint32_t smp_send_tlb_shootdown(uint32_t mask);
+
+#endif /* REXUS_SMP_H */
@@ -0,0 +1,55 @@
+; Kernel context switch for REXUS kernel
+
+global switch_to
+global switch_first_run
+
+extern thread_exit
+extern process_finish_switch
+
+; Switch kernel stacks
+; Saves the callee-saved registers and EFLAGS on the current stack, stores
+; the stack pointer and resumes the context saved on the next stack. The
+; caller-saved registers are already dead across the call by the cdecl ABI.
+; Parameters:
+;   - prev_esp: Where to store the current stack pointer
+;   - next_esp: Stack pointer saved by a previous switch_to
+switch_to:
+    mov eax, [esp+4]
+    mov edx, [esp+8]
+    
+    ; Save the outgoing context
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushfd
+    mov [eax], esp
+    
+    ; Load the incoming context
+    mov esp, edx
+    popfd
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    
+    ret
+
+; First run of a new thread
+; switch_to "returns" here on a stack built by thread_alloc, which holds
+; the entry point followed by its argument. Interrupts are still disabled
+; and the run queue locked from the scheduler, so finish the switch and
+; enable interrupts before entering the thread.
+switch_first_run:
+    call process_finish_switch
+    sti
+    pop eax
+    call eax
+    
+    ; The entry point returned: exit with its return value
+    push eax
+    call thread_exit
+    
+.hang:
+    hlt
+    jmp .hang
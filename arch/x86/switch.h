@@ -0,0 +1,13 @@
+#ifndef REXUS_SWITCH_H
+#define REXUS_SWITCH_H
+
+#include <stdint.h>
+
+// Save the current kernel context, storing its stack pointer in
+// *prev_esp, and resume the context saved at next_esp (switch.asm)
+void switch_to(uint32_t* prev_esp, uint32_t next_esp);
+
+// Return address for the first switch to a new process (switch.asm)
+void switch_first_run(void);
+
+#endif /* REXUS_SWITCH_H */
@@ -0,0 +1,23 @@
+#ifndef REXUS_DSP_H
+#define REXUS_DSP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Signal-processing kernels built with SSE (dsp_sse.c). These use the
+// FPU, so call them only from task context, never from an interrupt.
+
+// Dot product of two float vectors
+float dsp_dot_f32(const float* a, const float* b, size_t length);
+
+// FIR filter: y[i] = sum of h[k] * x[i + k] for k < taps, for each
+// i < length. x must hold length + taps - 1 samples.
+void dsp_fir_f32(const float* x, const float* h, size_t taps, float* y, size_t length);
+
+// Self-test for lazy FPU switching: repeatedly filter integer-valued
+// samples whose exact results are known, under a seed-dependent MXCSR
+// rounding mode. Returns the number of wrong results; run several copies
+// in parallel tasks so preemption lands in the middle of the SSE code.
+uint32_t dsp_selftest(uint32_t seed, uint32_t rounds);
+
+#endif /* REXUS_DSP_H */
@@ -0,0 +1,110 @@
+#include "dsp.h"
+
+// The intrinsics headers need a hosted libc, so the kernels use GCC
+// vector types, which compile to SSE in this translation unit. The
+// unaligned variant is for loads and stores at any float boundary.
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v4sf_unaligned __attribute__((vector_size(16), aligned(4)));
+
+// Samples and taps used by dsp_selftest
+#define DSP_SELFTEST_SAMPLES 256
+#define DSP_SELFTEST_TAPS    16
+
+// MXCSR rounding control field
+#define DSP_MXCSR_ROUND_SHIFT 13
+#define DSP_MXCSR_ROUND_MASK  (3u << DSP_MXCSR_ROUND_SHIFT)
+
+static inline v4sf dsp_load(const float* p) {
+    return *(const v4sf_unaligned*)p;
+}
+
+static inline void dsp_store(float* p, v4sf v) {
+    *(v4sf_unaligned*)p = v;
+}
+
+static inline uint32_t dsp_get_mxcsr(void) {
+    uint32_t mxcsr;
+    __asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+    return mxcsr;
+}
+
+static inline void dsp_set_mxcsr(uint32_t mxcsr) {
+    __asm__ volatile("ldmxcsr %0" : : "m"(mxcsr));
+}
+
+// Dot product of two float vectors, four lanes at a time
+float dsp_dot_f32(const float* a, const float* b, size_t length) {
+    v4sf sum = { 0, 0, 0, 0 };
+    size_t vector_end = length & ~(size_t)3;
+    
+    for (size_t i = 0; i < vector_end; i += 4) {
+        sum += dsp_load(a + i) * dsp_load(b + i);
+    }
+    
+    float result = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    for (size_t i = vector_end; i < length; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+// FIR filter, four outputs at a time
+void dsp_fir_f32(const float* x, const float* h, size_t taps, float* y, size_t length) {
+    size_t vector_end = length & ~(size_t)3;
+    
+    for (size_t i = 0; i < vector_end; i += 4) {
+        v4sf acc = { 0, 0, 0, 0 };
+        for (size_t k = 0; k < taps; k++) {
+            acc += h[k] * dsp_load(x + i + k);
+        }
+        dsp_store(y + i, acc);
+    }
+    
+    for (size_t i = vector_end; i < length; i++) {
+        y[i] = dsp_dot_f32(x + i, h, taps);
+    }
+}
+
+// Self-test for lazy FPU switching
+uint32_t dsp_selftest(uint32_t seed, uint32_t rounds) {
+    float x[DSP_SELFTEST_SAMPLES + DSP_SELFTEST_TAPS - 1];
+    float h[DSP_SELFTEST_TAPS];
+    float y[DSP_SELFTEST_SAMPLES];
+    int32_t xi[DSP_SELFTEST_SAMPLES + DSP_SELFTEST_TAPS - 1];
+    int32_t hi[DSP_SELFTEST_TAPS];
+    uint32_t errors = 0;
+    
+    // Small integers keep every partial sum exact in any rounding mode
+    for (uint32_t i = 0; i < DSP_SELFTEST_SAMPLES + DSP_SELFTEST_TAPS - 1; i++) {
+        xi[i] = (int32_t)((i * (seed | 1) + seed) % 13) - 6;
+        x[i] = (float)xi[i];
+    }
+    for (uint32_t k = 0; k < DSP_SELFTEST_TAPS; k++) {
+        hi[k] = (int32_t)((k + seed) % 7) - 3;
+        h[k] = (float)hi[k];
+    }
+    
+    // A different rounding mode per task, which must survive every switch
+    uint32_t mxcsr = (dsp_get_mxcsr() & ~DSP_MXCSR_ROUND_MASK) |
+                     ((seed & 3) << DSP_MXCSR_ROUND_SHIFT);
+    dsp_set_mxcsr(mxcsr);
+    
+    for (uint32_t r = 0; r < rounds; r++) {
+        dsp_fir_f32(x, h, DSP_SELFTEST_TAPS, y, DSP_SELFTEST_SAMPLES);
+        
+        // Check one output per round against the integer result
+        uint32_t i = r % DSP_SELFTEST_SAMPLES;
+        int32_t expected = 0;
+        for (uint32_t k = 0; k < DSP_SELFTEST_TAPS; k++) {
+            expected += hi[k] * xi[i + k];
+        }
+        if ((int32_t)y[i] != expected) {
+            errors++;
+        }
+    }
+    
+    if (dsp_get_mxcsr() != mxcsr) {
+        errors++;
+    }
+    return errors;
+}
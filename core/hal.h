@@ -12,6 +12,9 @@
     #define REXUS_ARCH_ARM
 #elif defined(__AVR__)
     #define REXUS_ARCH_AVR
+#elif defined(REXUS_HOST)
+    // Userspace build under tools/host; the HAL is provided by hal_shim.c
+    #define REXUS_ARCH_HOST
 #else
     #error "Unsupported architecture"
 #endif
@@ -39,6 +42,9 @@ void hal_register_interrupt_handler(uint32_t interrupt, void (*handler)(void));
 
 // Timer and clock management
 void hal_init_timer(uint32_t frequency);
+void hal_timer_periodic(uint32_t frequency);
+void hal_timer_oneshot(uint32_t us);
+uint32_t hal_timer_oneshot_elapsed(void);
 uint64_t hal_get_system_time(void);
 void hal_sleep(uint32_t ms);
 void hal_busy_wait(uint32_t us);
@@ -101,7 +107,7 @@ void hal_shutdown(void);
 
 // Architecture-specific operations
 void hal_get_platform_info(char* buffer, size_t size);
-uint32_t hal_get_cpu_frequency(void);
+uint32_t hal_get_cpu_khz(void);
 void hal_idle(void);
 
 #endif /* REXUS_HAL_H */ 
\ No newline at end of file
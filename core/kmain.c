@@ -1,26 +1,64 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "../arch/x86/gdt.h"
 #include "../arch/x86/idt.h"
 #include "../arch/x86/isr.h"
 #include "../arch/x86/pic.h"
+#include "../arch/x86/cpu.h"
+#include "../arch/x86/fpu.h"
+#include "../arch/x86/smp.h"
+#include "../arch/x86/multiboot.h"
 #include "../drivers/vga.h"
 #include "../drivers/keyboard.h"
 #include "../drivers/console.h"
 #include "../mem/pmm.h"
 #include "../mem/vmm.h"
+#include "../mem/vma.h"
+#include "../mem/dma.h"
+#include "../mem/kmalloc.h"
+#include "../mem/tlbbench.h"
+#include "../mem/mapbench.h"
+#include "../mem/kmallocbench.h"
 #include "../proc/process.h"
+#include "../proc/switchbench.h"
+#include "../proc/sync.h"
+#include "../proc/rttrace.h"
+#include "timer.h"
+#include "spinlock.h"
+#include "../net/ethernet.h"
+#include "../net/ipv4.h"
+#include "../net/udp.h"
+#include "../net/tcp.h"
+#include "../net/loopback.h"
+#include "../net/netbench.h"
+#include "../net/capture.h"
+#include "hal.h"
+#include "dsp.h"
 
 extern void init_cppcrt();
 
+// Kernel command line from the boot loader, "" if none
+static const char* boot_cmdline = "";
+
 static void parse_multiboot(uint32_t magic, uint32_t mboot_addr);
+static bool cmdline_has(const char* option);
 static int help_command(int argc, char* argv[]);
 static int clear_command(int argc, char* argv[]);
 static int info_command(int argc, char* argv[]);
 static int echo_command(int argc, char* argv[]);
 static int meminfo_command(int argc, char* argv[]);
+static int crc32_command(int argc, char* argv[]);
+static int netcap_command(int argc, char* argv[]);
+static int tickless_command(int argc, char* argv[]);
+static int fputest_command(int argc, char* argv[]);
+static int cpus_command(int argc, char* argv[]);
+static int locks_command(int argc, char* argv[]);
+static int synctest_command(int argc, char* argv[]);
+static int rt_command(int argc, char* argv[]);
+static int vmtest_command(int argc, char* argv[]);
 
 void kmain(uint32_t magic, uint32_t mboot_addr) {
     // Initialize VGA early for debugging output
@@ -34,6 +72,9 @@ void kmain(uint32_t magic, uint32_t mboot_addr) {
     vga_puts("Initializing GDT...\n");
     gdt_init();
     
+    // Per-CPU data for the boot processor
+    smp_early_init();
+    
     vga_puts("Initializing IDT...\n");
     idt_init();
     
@@ -48,7 +89,12 @@ void kmain(uint32_t magic, uint32_t mboot_addr) {
     pmm_init(mboot_addr);
     
     vga_puts("Initializing virtual memory manager...\n");
-    vmm_init();
+    vmm_init(!cmdline_has("nopae"));
+    dma_init();
+    kmalloc_init();
+    
+    // Enable the FPU and SSE for tasks that use them
+    fpu_init();
     
     // Initialize C++ runtime if needed
     init_cppcrt();
@@ -57,10 +103,25 @@ void kmain(uint32_t magic, uint32_t mboot_addr) {
     vga_puts("Initializing keyboard driver...\n");
     keyboard_init();
     
+    // Initialize kernel timers (used by the scheduler and network stack)
+    timer_init();
+    
     // Initialize process management
     vga_puts("Initializing process management...\n");
     process_init();
     
+    // Bring up the application processors, each with its own scheduler
+    vga_puts("Starting application processors...\n");
+    smp_init();
+    
+    // Initialize network stack with the loopback interface
+    vga_puts("Initializing network stack...\n");
+    net_init();
+    ipv4_init();
+    udp_init();
+    tcp_init();
+    loopback_init();
+    
     // Enable interrupts
     vga_puts("Enabling interrupts...\n");
     __asm__ volatile("sti");
@@ -106,33 +167,177 @@ void kmain(uint32_t magic, uint32_t mboot_addr) {
     };
     console_register_command(&meminfo_cmd);
     
+    console_command_t crc32_cmd = {
+        .name = "crc32",
+        .description = "Self-test and benchmark Ethernet CRC32",
+        .handler = crc32_command
+    };
+    console_register_command(&crc32_cmd);
+    
+    console_command_t netbench_cmd = {
+        .name = "netbench",
+        .description = "Benchmark the network stack over loopback",
+        .handler = netbench_command
+    };
+    console_register_command(&netbench_cmd);
+    
+    console_command_t netcap_cmd = {
+        .name = "netcap",
+        .description = "Capture packets and dump them as pcap over serial",
+        .handler = netcap_command
+    };
+    console_register_command(&netcap_cmd);
+    
+    console_command_t switchbench_cmd = {
+        .name = "switchbench",
+        .description = "Measure context switch latency",
+        .handler = switchbench_command
+    };
+    console_register_command(&switchbench_cmd);
+    
+    console_command_t tickless_cmd = {
+        .name = "tickless",
+        .description = "Show or set tickless idle and measure wakeups",
+        .handler = tickless_command
+    };
+    console_register_command(&tickless_cmd);
+    
+    console_command_t fputest_cmd = {
+        .name = "fputest",
+        .description = "Run SSE tasks in parallel to test lazy FPU switching",
+        .handler = fputest_command
+    };
+    console_register_command(&fputest_cmd);
+    
+    console_command_t cpus_cmd = {
+        .name = "cpus",
+        .description = "Show per-CPU scheduler statistics",
+        .handler = cpus_command
+    };
+    console_register_command(&cpus_cmd);
+    
+    console_command_t locks_cmd = {
+        .name = "locks",
+        .description = "Show lock acquisition and contention counters",
+        .handler = locks_command
+    };
+    console_register_command(&locks_cmd);
+    
+    console_command_t synctest_cmd = {
+        .name = "synctest",
+        .description = "Stress mutexes and semaphores from several tasks",
+        .handler = synctest_command
+    };
+    console_register_command(&synctest_cmd);
+    
+    console_command_t rt_cmd = {
+        .name = "rt",
+        .description = "Show deadline tasks and their trace, or start a demo",
+        .handler = rt_command
+    };
+    console_register_command(&rt_cmd);
+    
+    console_command_t vmtest_cmd = {
+        .name = "vmtest",
+        .description = "Test demand paging and stack growth",
+        .handler = vmtest_command
+    };
+    console_register_command(&vmtest_cmd);
+    
+    console_command_t tlbbench_cmd = {
+        .name = "tlbbench",
+        .description = "Compare page walks through 4KB and large pages",
+        .handler = tlbbench_command
+    };
+    console_register_command(&tlbbench_cmd);
+    
+    console_command_t mapbench_cmd = {
+        .name = "mapbench",
+        .description = "Compare per-page and batched map/unmap",
+        .handler = mapbench_command
+    };
+    console_register_command(&mapbench_cmd);
+    
+    console_command_t kmtest_cmd = {
+        .name = "kmtest",
+        .description = "Stress kmalloc/kfree from several tasks",
+        .handler = kmtest_command
+    };
+    console_register_command(&kmtest_cmd);
+    
+    console_command_t kmbench_cmd = {
+        .name = "kmbench",
+        .description = "Measure kmalloc speed and fragmentation",
+        .handler = kmbench_command
+    };
+    console_register_command(&kmbench_cmd);
+    
     // Main kernel loop
     while(1) {
         // Update console (process input)
         console_update();
         
         // Idle CPU when nothing to do
-        __asm__ volatile("hlt");
+        process_idle_wait();
     }
 }
 
 static void parse_multiboot(uint32_t magic, uint32_t mboot_addr) {
     // Check multiboot magic
-    if (magic != 0x2BADB002) {
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC) {
         vga_puts("Invalid multiboot magic number!\n");
         for(;;) {
             __asm__ volatile("hlt");
         }
     }
     
-    // 'mboot_addr' here is a physical address, but we have identity mapping
-    // for low memory at this stage anyway. We'll need to properly handle this
-    // when we set up full virtual memory.
+    // The boot loader keeps its data low, inside the part of the direct
+    // map boot.asm sets up; pmm_init reserves all of it
+    multiboot_info_t* info = (multiboot_info_t*)phys_to_virt(mboot_addr);
+    if (info->flags & MULTIBOOT_INFO_CMDLINE) {
+        boot_cmdline = (const char*)phys_to_virt(info->cmdline);
+        vga_puts("Command line: ");
+        vga_puts(boot_cmdline);
+        vga_puts("\n");
+    }
+    
+    if (info->flags & MULTIBOOT_INFO_MODS) {
+        multiboot_module_t* mods = (multiboot_module_t*)phys_to_virt(info->mods_addr);
+        for (uint32_t i = 0; i < info->mods_count; i++) {
+            vga_puts("Module ");
+            vga_puthex(mods[i].mod_start);
+            vga_puts("-");
+            vga_puthex(mods[i].mod_end);
+            if (mods[i].string) {
+                vga_puts(" ");
+                vga_puts((const char*)phys_to_virt(mods[i].string));
+            }
+            vga_puts("\n");
+        }
+    }
     
-    // More detailed multiboot info parsing will be added later
     vga_puts("Multiboot information validated.\n");
 }
 
+// Is option one of the space-separated words of the command line?
+static bool cmdline_has(const char* option) {
+    size_t length = strlen(option);
+    for (const char* word = boot_cmdline; *word; ) {
+        size_t word_length = 0;
+        while (word[word_length] && word[word_length] != ' ') {
+            word_length++;
+        }
+        if (word_length == length && memcmp(word, option, length) == 0) {
+            return true;
+        }
+        word += word_length;
+        while (*word == ' ') {
+            word++;
+        }
+    }
+    return false;
+}
+
 // Command handlers
 
 static int help_command(int argc, char* argv[]) {
@@ -142,6 +347,21 @@ static int help_command(int argc, char* argv[]) {
     console_puts("  info     - Display system information\n");
     console_puts("  echo     - Display text\n");
     console_puts("  meminfo  - Display memory information\n");
+    console_puts("  crc32    - Self-test and benchmark Ethernet CRC32\n");
+    console_puts("  netbench - Benchmark the network stack over loopback\n");
+    console_puts("  netcap   - Capture packets and dump them as pcap over serial\n");
+    console_puts("  tickless - Show or set tickless idle and measure wakeups\n");
+    console_puts("  switchbench [threads] - Measure context switch latency\n");
+    console_puts("  fputest  - Run SSE tasks in parallel to test lazy FPU switching\n");
+    console_puts("  cpus     - Show per-CPU scheduler statistics\n");
+    console_puts("  locks    - Show lock acquisition and contention counters\n");
+    console_puts("  synctest - Stress mutexes and semaphores from several tasks\n");
+    console_puts("  rt       - Show deadline tasks and their trace, or start a demo\n");
+    console_puts("  vmtest   - Test demand paging and stack growth\n");
+    console_puts("  tlbbench - Compare page walks through 4KB and large pages\n");
+    console_puts("  mapbench - Compare per-page and batched map/unmap\n");
+    console_puts("  kmtest   - Stress kmalloc/kfree from several tasks\n");
+    console_puts("  kmbench  - Measure kmalloc speed and fragmentation\n");
     return 0;
 }
 
@@ -179,5 +399,524 @@ static int meminfo_command(int argc, char* argv[]) {
     console_printf("  Total: %d KB (%d MB)\n", total_mem / 1024, total_mem / 1024 / 1024);
     console_printf("  Used:  %d KB (%d MB)\n", used_mem / 1024, used_mem / 1024 / 1024);
     console_printf("  Free:  %d KB (%d MB)\n", free_mem / 1024, free_mem / 1024 / 1024);
+    
+    uint32_t unmapped_mb, high_mb;
+    pmm_get_unmanaged(&unmapped_mb, &high_mb);
+    console_printf("  Past the direct map: %d MB, above 4GB: %d MB (not managed)\n", unmapped_mb, high_mb);
+    
+    uint32_t high_free;
+    uint32_t high_frames = pmm_get_high_frames(&high_free);
+    console_printf("  High memory: %d MB, %d MB free (%s paging%s)\n", high_frames / 256, high_free / 256,
+                   vmm_pae_enabled() ? "PAE" : "32-bit", vmm_nx_enabled() ? ", NX" : "");
+    
+    pmm_zero_stats_t zero;
+    pmm_get_zero_stats(&zero);
+    console_printf("  Zeroed pool: %d/%d blocks, %d hits, %d misses, %d cleared while idle\n",
+                   zero.pooled, zero.target, zero.hits, zero.misses, zero.refills);
+    
+    dma_stats_t dma;
+    dma_get_stats(&dma);
+    console_printf("  DMA: %d chunks in %d pool blocks, %d larger allocations, %d pages uncached/WC\n",
+                   dma.pool_chunks, dma.pool_pages, dma.block_allocs, dma.uncached_pages);
+    
+    uint32_t spans, span_blocks;
+    kmalloc_get_span_stats(&spans, &span_blocks);
+    console_printf("Heap (classes in use; spans: %d in %d blocks):\n", spans, span_blocks);
+    kmalloc_class_stats_t heap;
+    for (uint32_t i = 0; kmalloc_get_class_stats(i, &heap); i++) {
+        if (heap.slabs || heap.allocs) {
+            console_printf("  %d bytes: %d slabs, %d objects (%d cached), %d allocs, %d from magazines\n",
+                           heap.size, heap.slabs, heap.objects, heap.cached, heap.allocs, heap.hits);
+        }
+    }
+    
+    console_printf("Used by owner:\n");
+    for (page_owner_t owner = PAGE_OWNER_RESERVED; owner < PAGE_OWNER_COUNT; owner++) {
+        uint32_t blocks = pmm_get_owner_blocks(owner);
+        console_printf("  %s: %d blocks (%d KB)\n", pmm_owner_name(owner), blocks, blocks * PAGE_SIZE / 1024);
+    }
+    return 0;
+} 
+
+// Measure a CRC32 implementation, returns cycles per 100 bytes
+static uint32_t crc32_bench(uint32_t (*crc)(const void*, size_t), const uint8_t* buf,
+                            size_t length, uint32_t rounds) {
+    volatile uint32_t sink = 0;
+    uint32_t start = (uint32_t)rdtsc();
+    for (uint32_t i = 0; i < rounds; i++) {
+        sink ^= crc(buf, length);
+    }
+    uint32_t cycles = (uint32_t)rdtsc() - start;
+    (void)sink;
+    
+    return cycles / (length * rounds / 100);
+}
+
+static int crc32_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    if (!eth_crc32_self_test()) {
+        console_puts("CRC32: self-test FAILED\n");
+        return 1;
+    }
+    console_puts("CRC32: self-test passed\n");
+    
+    // Benchmark over a 64 KB buffer
+    const size_t length = 65536;
+    uint8_t* buf = pmm_alloc_blocks(length / PAGE_SIZE);
+    if (!buf) {
+        console_puts("CRC32: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < length; i++) {
+        buf[i] = (uint8_t)(i * 31 + 7);
+    }
+    
+    uint32_t bytewise = crc32_bench(eth_calculate_crc32_bytewise, buf, length, 8);
+    uint32_t sliced = crc32_bench(eth_calculate_crc32, buf, length, 8);
+    
+    console_printf("  byte-at-a-time: %d cycles per 100 bytes\n", bytewise);
+    console_printf("  slicing-by-8:   %d cycles per 100 bytes\n", sliced);
+    
+    pmm_free_blocks(buf, length / PAGE_SIZE);
+    return 0;
+}
+
+// Parse a decimal number up to max (at most 400000000, so the next
+// digit cannot overflow), returns -1 if str is not one or is larger
+static int parse_uint(const char* str, uint32_t max) {
+    uint32_t value = 0;
+    if (!*str) {
+        return -1;
+    }
+    for (; *str; str++) {
+        if (*str < '0' || *str > '9') {
+            return -1;
+        }
+        value = value * 10 + (*str - '0');
+        if (value > max) {
+            return -1;
+        }
+    }
+    return (int)value;
+}
+
+static void netcap_serial_write(const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hal_uart_putc(bytes[i]);
+    }
+}
+
+static int netcap_command(int argc, char* argv[]) {
+    static bool uart_ready = false;
+    
+    if (argc < 2) {
+        console_puts("usage: netcap start [ipv4|arp|ipv6] [tcp|udp|icmp] [port N]\n");
+        console_puts("       netcap stop | stats | dump\n");
+        return 1;
+    }
+    
+    if (strcmp(argv[1], "start") == 0) {
+        net_capture_filter_t filter = { 0 };
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "ipv4") == 0) {
+                filter.ethertype = 0x0800;
+            } else if (strcmp(argv[i], "arp") == 0) {
+                filter.ethertype = 0x0806;
+            } else if (strcmp(argv[i], "ipv6") == 0) {
+                filter.ethertype = 0x86DD;
+            } else if (strcmp(argv[i], "tcp") == 0) {
+                filter.ip_protocol = IPV4_PROTO_TCP;
+            } else if (strcmp(argv[i], "udp") == 0) {
+                filter.ip_protocol = IPV4_PROTO_UDP;
+            } else if (strcmp(argv[i], "icmp") == 0) {
+                filter.ip_protocol = IPV4_PROTO_ICMP;
+            } else if (strcmp(argv[i], "port") == 0) {
+                int port = i + 1 < argc ? parse_uint(argv[i + 1], 65535) : -1;
+                if (port < 0) {
+                    console_puts("netcap: port needs a number up to 65535\n");
+                    return 1;
+                }
+                filter.port = port;
+                i++;
+            } else {
+                console_printf("netcap: bad filter '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        if (!net_capture_start(&filter)) {
+            console_puts("netcap: out of memory\n");
+            return 1;
+        }
+        console_puts("netcap: capture started\n");
+    } else if (strcmp(argv[1], "stop") == 0) {
+        net_capture_stop();
+        console_puts("netcap: capture stopped\n");
+    } else if (strcmp(argv[1], "stats") == 0) {
+        net_capture_stats_t stats;
+        net_capture_get_stats(&stats);
+        console_printf("netcap: %s, %d captured, %d filtered, %d overwritten\n",
+                       net_capture_enabled ? "running" : "stopped",
+                       stats.captured, stats.filtered, stats.overwritten);
+    } else if (strcmp(argv[1], "dump") == 0) {
+        if (!uart_ready) {
+            hal_uart_init(115200);
+            uart_ready = true;
+        }
+        uint32_t records = net_capture_write_pcap(netcap_serial_write, hal_get_cpu_khz());
+        console_printf("netcap: wrote %d records to COM1\n", records);
+    } else {
+        console_printf("netcap: unknown subcommand '%s'\n", argv[1]);
+        return 1;
+    }
+    
+    return 0;
+}
+
+static int tickless_command(int argc, char* argv[]) {
+    if (argc > 1) {
+        if (strcmp(argv[1], "on") == 0) {
+            timer_set_tickless(true);
+        } else if (strcmp(argv[1], "off") == 0) {
+            timer_set_tickless(false);
+        } else {
+            console_puts("usage: tickless [on|off]\n");
+            return 1;
+        }
+    }
+    
+    // Idle for one second and count how often the CPU woke up. The TSC
+    // times it, so a tick that stopped shows up as jiffies falling behind
+    // instead of a hang.
+    uint32_t start_wakeups = timer_get_wakeups();
+    uint64_t start_jiffies = timer_now();
+    uint64_t deadline = rdtsc() + (uint64_t)hal_get_cpu_khz() * 1000;
+    while (rdtsc() < deadline) {
+        process_idle_wait();
+    }
+    uint32_t wakeups = timer_get_wakeups() - start_wakeups;
+    uint32_t elapsed = (uint32_t)(timer_now() - start_jiffies);
+    
+    console_printf("tickless: %s, %d wakeups/s, clock advanced %d ms\n",
+                   timer_is_tickless() ? "on" : "off", wakeups, elapsed);
+    // Halting can overshoot the second by a one-shot, never fall short
+    return elapsed >= 990 ? 0 : 1;
+}
+
+// fputest: tasks running SSE code at the same priority, so the scheduler
+// preempts them in the middle of it
+#define FPUTEST_TASKS  3
+#define FPUTEST_ROUNDS 20000
+
+static volatile uint32_t fputest_errors;
+static volatile uint32_t fputest_done;
+
+static int fputest_task(void* arg) {
+    __atomic_fetch_add(&fputest_errors, dsp_selftest((uint32_t)arg, FPUTEST_ROUNDS), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fputest_done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int fputest_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    fpu_stats_t before;
+    fpu_get_stats(&before);
+    fputest_errors = 0;
+    fputest_done = 0;
+    
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < FPUTEST_TASKS; i++) {
+        if (process_create("fputest", fputest_task, (void*)(i + 1), PROCESS_PRIORITY_NORMAL)) {
+            started++;
+        }
+    }
+    while (fputest_done < started) {
+        process_yield();
+    }
+    
+    fpu_stats_t after;
+    fpu_get_stats(&after);
+    console_printf("fputest: %d tasks, %d errors, %d traps, %d saves, %d restores\n",
+                   started, fputest_errors, after.traps - before.traps,
+                   after.saves - before.saves, after.restores - before.restores);
+    return fputest_errors ? 1 : 0;
+}
+
+static int cpus_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    console_puts("CPU  APIC  Ready  Switches  CR3 loads  Steals\n");
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        process_cpu_stats_t stats;
+        if (!process_get_cpu_stats(cpu, &stats)) {
+            continue;
+        }
+        console_printf("%d    %d     %d      %d      %d      %d\n", cpu, cpus[cpu].apic_id,
+                       stats.ready, stats.switches, stats.address_switches, stats.steals);
+    }
+    return 0;
+}
+
+static int locks_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    console_puts("Lock             Acquired  Contended\n");
+    for (lock_stats_t* stats = lock_stats_first(); stats; stats = stats->next) {
+        console_printf("%s  %d  %d\n", stats->name, stats->acquired, stats->contended);
+    }
+    return 0;
+}
+
+// synctest: tasks bump a shared counter with a read-yield-write sequence
+// that loses updates unless the mutex serializes it, and hand tokens
+// through a semaphore to the console task
+#define SYNCTEST_TASKS  4
+#define SYNCTEST_ROUNDS 2000
+
+static mutex_t synctest_mutex;
+static semaphore_t synctest_done;
+static volatile uint32_t synctest_counter;
+
+static int synctest_task(void* arg) {
+    (void)arg;
+    
+    for (uint32_t i = 0; i < SYNCTEST_ROUNDS; i++) {
+        mutex_lock(&synctest_mutex);
+        uint32_t value = synctest_counter;
+        if ((i & 15) == 0) {
+            process_yield();
+        }
+        synctest_counter = value + 1;
+        mutex_unlock(&synctest_mutex);
+    }
+    
+    semaphore_up(&synctest_done);
+    return 0;
+}
+
+static int synctest_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    static bool initialized;
+    if (!initialized) {
+        mutex_init(&synctest_mutex, "synctest_mutex");
+        semaphore_init(&synctest_done, "synctest_done", 0);
+        initialized = true;
+    }
+    synctest_counter = 0;
+    uint32_t contended = synctest_mutex.stats.contended;
+    
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < SYNCTEST_TASKS; i++) {
+        if (process_create("synctest", synctest_task, NULL, PROCESS_PRIORITY_NORMAL)) {
+            started++;
+        }
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        semaphore_down(&synctest_done);
+    }
+    
+    uint32_t expected = started * SYNCTEST_ROUNDS;
+    console_printf("synctest: %d tasks, counter %d of %d, %d contended\n",
+                   started, synctest_counter, expected,
+                   synctest_mutex.stats.contended - contended);
+    return synctest_counter == expected ? 0 : 1;
+}
+
+// rt demo: periodic deadline tasks that each busy-wait for part of every
+// job. The last one asks for more time than its budget, so it is
+// throttled and misses deadlines, which shows up in the trace.
+#define RT_DEMO_JOBS 200
+#define RT_MAX_LISTED 16
+
+typedef struct {
+    process_rt_params_t params;
+    uint32_t work_ms;
+} rt_demo_task_t;
+
+static const rt_demo_task_t rt_demo_tasks[] = {
+    { { 10, 2, 10 }, 1 },
+    { { 20, 4, 15 }, 3 },
+    { { 50, 10, 50 }, 6 },
+    { { 25, 3, 25 }, 5 },
+};
+
+static int rt_demo_task(void* arg) {
+    const rt_demo_task_t* task = (const rt_demo_task_t*)arg;
+    
+    for (uint32_t job = 0; job < RT_DEMO_JOBS; job++) {
+        uint64_t end = timer_now() + task->work_ms;
+        while (timer_now() < end) {
+            __builtin_ia32_pause();
+        }
+        process_wait_next_period();
+    }
     return 0;
-} 
\ No newline at end of file
+}
+
+static const char* rt_trace_type_name(uint32_t type) {
+    switch (type) {
+        case RT_TRACE_MISS:     return "miss";
+        case RT_TRACE_OVERRUN:  return "overrun";
+        case RT_TRACE_LATENCY:  return "latency";
+        default:                return "?";
+    }
+}
+
+static int rt_command(int argc, char* argv[]) {
+    uint32_t cpu_mhz = hal_get_cpu_khz() / 1000;
+    if (!cpu_mhz) {
+        cpu_mhz = 1;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "demo") == 0) {
+        for (uint32_t i = 0; i < sizeof(rt_demo_tasks) / sizeof(rt_demo_tasks[0]); i++) {
+            const rt_demo_task_t* task = &rt_demo_tasks[i];
+            process_t* proc = process_create_deadline("rtdemo", rt_demo_task, (void*)task, &task->params);
+            if (proc) {
+                console_printf("rt: pid %d period %d budget %d deadline %d\n", proc->pid,
+                               task->params.period, task->params.budget, task->params.deadline);
+            } else {
+                console_printf("rt: task %d rejected by admission control\n", i);
+            }
+        }
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "trace") == 0) {
+        // Too large for the console task's stack
+        static rt_trace_event_t events[RT_TRACE_SIZE];
+        uint32_t count = rt_trace_read(events, RT_TRACE_SIZE);
+        console_printf("rt trace: %d events, %d overwritten\n", count, rt_trace_get_overwritten());
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t value = events[i].value;
+            if (events[i].type == RT_TRACE_LATENCY) {
+                value /= cpu_mhz;
+            }
+            console_printf("%d ms  tid %d  %s  %d %s\n", events[i].time, events[i].tid,
+                           rt_trace_type_name(events[i].type), value,
+                           events[i].type == RT_TRACE_LATENCY ? "us" : "ms");
+        }
+        return 0;
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+        rt_trace_clear();
+        return 0;
+    }
+    
+    if (argc > 1) {
+        console_puts("usage: rt [demo|trace|clear]\n");
+        return 1;
+    }
+    
+    static process_rt_stats_t stats[RT_MAX_LISTED];
+    uint32_t count = process_get_rt_stats(stats, RT_MAX_LISTED);
+    console_puts("PID  TID  CPU  Period  Budget  Deadline  Jobs  Misses  Overruns  Worst latency\n");
+    for (uint32_t i = 0; i < count; i++) {
+        console_printf("%d  %d  %d  %d  %d  %d  %d  %d  %d  %d us\n", stats[i].pid, stats[i].tid, stats[i].cpu,
+                       stats[i].params.period, stats[i].params.budget, stats[i].params.deadline,
+                       stats[i].jobs, stats[i].misses, stats[i].overruns,
+                       stats[i].worst_latency / cpu_mhz);
+    }
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        process_cpu_stats_t cpu_stats;
+        if (process_get_cpu_stats(cpu, &cpu_stats)) {
+            console_printf("cpu %d: deadline load %d%%\n", cpu,
+                           cpu_stats.rt_utilization * 100 / 1024);
+        }
+    }
+    return 0;
+}
+
+// vmtest: reserve a region and a stack in the console's address space
+// and check that only touched pages get memory
+#define VMTEST_REGION       0x40000000
+#define VMTEST_REGION_SIZE  (64 * PAGE_SIZE)
+#define VMTEST_STACK_TOP    0x48000000
+#define VMTEST_STACK_MAX    (16 * PAGE_SIZE)
+
+static semaphore_t vmtest_child_done;
+
+// Fault in a page the console's space reserved but never touched
+static int vmtest_child(void* arg) {
+    (void)arg;
+    
+    *(volatile uint32_t*)(VMTEST_REGION + PAGE_SIZE) = 0xC0FFEE;
+    semaphore_up(&vmtest_child_done);
+    return 0;
+}
+
+static int vmtest_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    vm_space_t* space = process_get_current()->vm;
+    uint32_t free_before = pmm_get_free_block_count();
+    if (!vm_map(space, VMTEST_REGION, VMTEST_REGION_SIZE, VMA_READ | VMA_WRITE) ||
+        !vm_map_stack(space, VMTEST_STACK_TOP, PAGE_SIZE, VMTEST_STACK_MAX, VMA_READ | VMA_WRITE)) {
+        console_puts("vmtest: failed to reserve regions\n");
+        vm_unmap(space, VMTEST_REGION);
+        return 1;
+    }
+    uint32_t faults = space->faults;
+    
+    // Touch 3 of 64 pages, reading one back as zero
+    volatile uint32_t* region = (volatile uint32_t*)VMTEST_REGION;
+    bool ok = region[0] == 0;
+    region[0] = 0x12345678;
+    region[(VMTEST_REGION_SIZE - 4) / 4] = 1;
+    region[(VMTEST_REGION_SIZE / 2) / 4] = 2;
+    ok = ok && region[0] == 0x12345678;
+    uint32_t region_faults = space->faults - faults;
+    
+    // Grow the stack to 5 pages by touching its deepest one
+    volatile uint32_t* deep = (volatile uint32_t*)(VMTEST_STACK_TOP - 5 * PAGE_SIZE);
+    *deep = 3;
+    vma_t stack = { 0, 0, 0, 0 };
+    ok = ok && vm_find(space, VMTEST_STACK_TOP - 4, &stack) &&
+         stack.start == VMTEST_STACK_TOP - 5 * PAGE_SIZE;
+    
+    // The guard page and unreserved memory are real faults
+    ok = ok && !vm_handle_fault(space, VMTEST_STACK_TOP - VMTEST_STACK_MAX - 4, true);
+    ok = ok && !vm_handle_fault(space, VMTEST_REGION + VMTEST_REGION_SIZE, false);
+    
+    uint32_t used = free_before - pmm_get_free_block_count();
+    console_printf("vmtest: region 3 pages touched, %d faults; stack grew to %d pages\n",
+                   region_faults, (VMTEST_STACK_TOP - stack.start) / PAGE_SIZE);
+    console_printf("vmtest: %d frames in use (including page tables), %d resident\n",
+                   used, space->resident);
+    
+    vm_unmap(space, VMTEST_REGION);
+    vm_unmap(space, VMTEST_STACK_TOP - 4);
+    ok = ok && region_faults == 3;
+    
+    // The region's page table is still there, now empty. A child created
+    // now gets a copy of it, so a page the child faults in stays its own.
+    static bool initialized;
+    if (!initialized) {
+        semaphore_init(&vmtest_child_done, "vmtest_child_done", 0);
+        initialized = true;
+    }
+    bool isolated = false;
+    if (vm_map(space, VMTEST_REGION, VMTEST_REGION_SIZE, VMA_READ | VMA_WRITE)) {
+        if (process_create("vmtest", vmtest_child, NULL, PROCESS_PRIORITY_NORMAL)) {
+            semaphore_down(&vmtest_child_done);
+            isolated = !vmm_get_mapping(space->directory, VMTEST_REGION + PAGE_SIZE, NULL) &&
+                       region[PAGE_SIZE / 4] == 0;
+        }
+        vm_unmap(space, VMTEST_REGION);
+    }
+    console_printf("vmtest: page faulted in by a child %s\n",
+                   isolated ? "stays private" : "LEAKED into the parent");
+    ok = ok && isolated;
+    console_puts(ok ? "vmtest: passed\n" : "vmtest: FAILED\n");
+    return ok ? 0 : 1;
+}
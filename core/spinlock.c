@@ -0,0 +1,19 @@
+#include "spinlock.h"
+
+// Registered locks, newest first. Entries are only ever added, so the
+// list can be walked without a lock.
+static lock_stats_t* lock_stats_list = NULL;
+
+// Add a lock's counters to the list shown by the "locks" command
+void lock_stats_register(lock_stats_t* stats) {
+    lock_stats_t* head = __atomic_load_n(&lock_stats_list, __ATOMIC_RELAXED);
+    do {
+        stats->next = head;
+    } while (!__atomic_compare_exchange_n(&lock_stats_list, &head, stats, false,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// First registered lock
+lock_stats_t* lock_stats_first(void) {
+    return __atomic_load_n(&lock_stats_list, __ATOMIC_ACQUIRE);
+}
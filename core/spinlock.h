@@ -0,0 +1,99 @@
+#ifndef REXUS_SPINLOCK_H
+#define REXUS_SPINLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "../arch/x86/cpu.h"
+
+// Contention counters kept by every lock. They are only updated by the
+// lock holder, so plain increments are enough. Registered locks are
+// listed by the "locks" console command.
+typedef struct lock_stats {
+    const char* name;
+    uint32_t acquired;              // Successful acquisitions
+    uint32_t contended;             // Acquisitions that had to wait
+    struct lock_stats* next;        // Next registered lock
+} lock_stats_t;
+
+// Ticket spinlock: CPUs take a ticket and enter in the order they
+// arrived, so no CPU can be starved by the others. Locks taken from
+// interrupt handlers must be taken with the irqsave variants everywhere
+// else, or a CPU can spin on a lock its own interrupted code is holding.
+typedef struct {
+    union {
+        volatile uint32_t value;
+        struct {
+            volatile uint16_t owner;    // Ticket being served
+            volatile uint16_t next;     // Next ticket to hand out
+        };
+    } ticket;
+    lock_stats_t stats;
+} spinlock_t;
+
+#define SPINLOCK_INIT(lock_name) { { 0 }, { (lock_name), 0, 0, NULL } }
+
+// Add a lock's counters to the list shown by the "locks" command
+void lock_stats_register(lock_stats_t* stats);
+
+// First registered lock (follow ->next for the rest)
+lock_stats_t* lock_stats_first(void);
+
+static inline void spin_init(spinlock_t* lock, const char* name) {
+    lock->ticket.value = 0;
+    lock->stats.name = name;
+    lock->stats.acquired = 0;
+    lock->stats.contended = 0;
+    lock->stats.next = NULL;
+}
+
+static inline bool spin_trylock(spinlock_t* lock) {
+    uint32_t old = __atomic_load_n(&lock->ticket.value, __ATOMIC_RELAXED);
+    if ((old & 0xFFFF) != (old >> 16)) {
+        return false;
+    }
+    
+    // Take the ticket being served, if nobody else took it first
+    if (!__atomic_compare_exchange_n(&lock->ticket.value, &old, old + 0x10000, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    lock->stats.acquired++;
+    return true;
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->ticket.next, 1, __ATOMIC_RELAXED);
+    
+    if (__atomic_load_n(&lock->ticket.owner, __ATOMIC_ACQUIRE) != ticket) {
+        while (__atomic_load_n(&lock->ticket.owner, __ATOMIC_ACQUIRE) != ticket) {
+            __builtin_ia32_pause();
+        }
+        lock->stats.contended++;
+    }
+    lock->stats.acquired++;
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    // Only the holder writes owner, so this needs no locked instruction
+    __atomic_store_n(&lock->ticket.owner, (uint16_t)(lock->ticket.owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(spinlock_t* lock) {
+    uint32_t value = __atomic_load_n(&lock->ticket.value, __ATOMIC_RELAXED);
+    return (value & 0xFFFF) != (value >> 16);
+}
+
+// Disable interrupts on this CPU and take the lock
+static inline unsigned long spin_lock_irqsave(spinlock_t* lock) {
+    unsigned long flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, unsigned long flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif /* REXUS_SPINLOCK_H */
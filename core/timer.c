@@ -0,0 +1,267 @@
+#include "timer.h"
+#include "hal.h"
+#include "spinlock.h"
+#include "../arch/x86/cpu.h"
+#include "../drivers/vga.h"
+#include <string.h>
+
+// Armed timers live in a binary min-heap ordered by deadline, so the
+// tick only ever looks at the root and arming or cancelling is O(log n).
+// The lock is taken with interrupts disabled: the tick runs on CPU 0,
+// while timers are armed and cancelled from any CPU.
+static struct {
+    spinlock_t lock;
+    ktimer_t* heap[TIMER_MAX_ARMED];
+    uint32_t count;
+    volatile uint64_t jiffies;      // Milliseconds since boot
+    ktimer_t* running;              // Timer whose callback is executing
+    
+    // Tickless idle
+    bool tickless;
+    uint32_t oneshot_ms;            // Length of the armed idle one-shot, 0 if periodic
+    uint32_t fraction_us;           // Sub-millisecond idle time not yet accounted
+    volatile uint32_t wakeups;
+} timer_state;
+
+// Place a timer in a heap slot and record where it went
+static inline void timer_heap_set(uint32_t index, ktimer_t* timer) {
+    timer_state.heap[index] = timer;
+    timer->heap_index = index + 1;
+}
+
+// Move the timer at index towards the root until the heap is ordered
+static void timer_sift_up(uint32_t index) {
+    ktimer_t* timer = timer_state.heap[index];
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (timer_state.heap[parent]->expires <= timer->expires) {
+            break;
+        }
+        timer_heap_set(index, timer_state.heap[parent]);
+        index = parent;
+    }
+    timer_heap_set(index, timer);
+}
+
+// Move the timer at index towards the leaves until the heap is ordered
+static void timer_sift_down(uint32_t index) {
+    ktimer_t* timer = timer_state.heap[index];
+    for (;;) {
+        uint32_t child = index * 2 + 1;
+        if (child >= timer_state.count) {
+            break;
+        }
+        if (child + 1 < timer_state.count &&
+            timer_state.heap[child + 1]->expires < timer_state.heap[child]->expires) {
+            child++;
+        }
+        if (timer->expires <= timer_state.heap[child]->expires) {
+            break;
+        }
+        timer_heap_set(index, timer_state.heap[child]);
+        index = child;
+    }
+    timer_heap_set(index, timer);
+}
+
+// Take the timer at index out of the heap
+static void timer_heap_remove(uint32_t index) {
+    ktimer_t* timer = timer_state.heap[index];
+    timer->heap_index = 0;
+    
+    timer_state.count--;
+    if (index == timer_state.count) {
+        return;
+    }
+    
+    // Fill the hole with the last timer and restore heap order
+    timer_heap_set(index, timer_state.heap[timer_state.count]);
+    if (index > 0 && timer_state.heap[index]->expires < timer_state.heap[(index - 1) / 2]->expires) {
+        timer_sift_up(index);
+    } else {
+        timer_sift_down(index);
+    }
+}
+
+// Initialize the timer subsystem
+void timer_init(void) {
+    memset(&timer_state, 0, sizeof(timer_state));
+    spin_init(&timer_state.lock, "timers");
+    lock_stats_register(&timer_state.lock.stats);
+    timer_state.tickless = true;
+    hal_timer_periodic(TIMER_HZ);
+    vga_puts("Timer: Initialized timer heap\n");
+}
+
+// Milliseconds since boot
+uint64_t timer_now(void) {
+    // A 64-bit read is two loads on i386; keep the tick out of the middle
+    unsigned long flags = spin_lock_irqsave(&timer_state.lock);
+    uint64_t now = timer_state.jiffies;
+    spin_unlock_irqrestore(&timer_state.lock, flags);
+    return now;
+}
+
+// Prepare a timer
+void timer_setup(ktimer_t* timer, ktimer_callback_t callback, void* data) {
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->heap_index = 0;
+}
+
+// Arm a timer for an absolute deadline
+bool timer_start_at(ktimer_t* timer, uint64_t expires) {
+    if (!timer || !timer->callback) {
+        return false;
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&timer_state.lock);
+    
+    if (timer->heap_index) {
+        // Already armed: move it to its new place
+        uint64_t old = timer->expires;
+        timer->expires = expires;
+        if (expires < old) {
+            timer_sift_up(timer->heap_index - 1);
+        } else {
+            timer_sift_down(timer->heap_index - 1);
+        }
+        spin_unlock_irqrestore(&timer_state.lock, flags);
+        return true;
+    }
+    
+    if (timer_state.count >= TIMER_MAX_ARMED) {
+        spin_unlock_irqrestore(&timer_state.lock, flags);
+        return false;
+    }
+    
+    timer->expires = expires;
+    timer_state.heap[timer_state.count] = timer;
+    timer_state.count++;
+    timer_sift_up(timer_state.count - 1);
+    
+    spin_unlock_irqrestore(&timer_state.lock, flags);
+    return true;
+}
+
+// Arm a timer relative to now
+bool timer_start(ktimer_t* timer, uint32_t delay_ms) {
+    return timer_start_at(timer, timer_now() + delay_ms);
+}
+
+// Disarm a timer
+bool timer_cancel(ktimer_t* timer) {
+    if (!timer) {
+        return false;
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&timer_state.lock);
+    bool armed = timer->heap_index != 0;
+    if (armed) {
+        timer_heap_remove(timer->heap_index - 1);
+    }
+    spin_unlock_irqrestore(&timer_state.lock, flags);
+    
+    return armed;
+}
+
+// Is the timer's callback executing? Callbacks only run on CPU 0, one
+// at a time, so one slot is enough.
+bool timer_running(const ktimer_t* timer) {
+    return __atomic_load_n(&timer_state.running, __ATOMIC_ACQUIRE) == timer;
+}
+
+// Earliest armed deadline
+uint64_t timer_next_deadline(void) {
+    unsigned long flags = spin_lock_irqsave(&timer_state.lock);
+    uint64_t deadline = timer_state.count ? timer_state.heap[0]->expires : UINT64_MAX;
+    spin_unlock_irqrestore(&timer_state.lock, flags);
+    return deadline;
+}
+
+// Advance the clock by ms milliseconds and run expired timers. Called
+// with the lock held and interrupts disabled; callbacks run unlocked, as
+// they may arm or cancel timers themselves. The timer is marked running
+// before the lock is dropped, so whoever cancels it meanwhile can tell.
+static void timer_advance(uint32_t ms) {
+    timer_state.jiffies += ms;
+    
+    while (timer_state.count && timer_state.heap[0]->expires <= timer_state.jiffies) {
+        ktimer_t* timer = timer_state.heap[0];
+        timer_heap_remove(0);
+        timer_state.running = timer;
+        spin_unlock(&timer_state.lock);
+        timer->callback(timer->data);
+        __atomic_store_n(&timer_state.running, NULL, __ATOMIC_RELEASE);
+        spin_lock(&timer_state.lock);
+    }
+}
+
+// Account for a timer interrupt
+void timer_tick(void) {
+    uint32_t elapsed = 1;
+    
+    unsigned long flags = spin_lock_irqsave(&timer_state.lock);
+    timer_state.wakeups++;
+    
+    // An idle one-shot ran out: go back to the periodic tick
+    if (timer_state.oneshot_ms) {
+        elapsed = timer_state.oneshot_ms;
+        timer_state.oneshot_ms = 0;
+        hal_timer_periodic(TIMER_HZ);
+    }
+    
+    timer_advance(elapsed);
+    spin_unlock_irqrestore(&timer_state.lock, flags);
+}
+
+// Enable or disable tickless idle
+void timer_set_tickless(bool enable) {
+    timer_state.tickless = enable;
+}
+
+bool timer_is_tickless(void) {
+    return timer_state.tickless;
+}
+
+// Halt until the next interrupt, stopping the tick if possible
+void timer_idle(void) {
+    unsigned long flags = spin_lock_irqsave(&timer_state.lock);
+    
+    if (timer_state.tickless && !timer_state.oneshot_ms) {
+        uint64_t next = timer_state.count ? timer_state.heap[0]->expires : UINT64_MAX;
+        uint64_t delta = next > timer_state.jiffies ? next - timer_state.jiffies : 0;
+        
+        // Only worth it if at least one periodic tick would be skipped
+        if (delta > 1) {
+            uint32_t ms = delta > TIMER_ONESHOT_MAX_MS ? TIMER_ONESHOT_MAX_MS : (uint32_t)delta;
+            hal_timer_oneshot(ms * 1000);
+            timer_state.oneshot_ms = ms;
+        }
+    }
+    
+ 
+    spin_unlock(&timer_state.lock);
+    cpu_wait_for_interrupt();
+    irq_save();
+    spin_lock(&timer_state.lock);
+    
+    // Woken by some other interrupt before the one-shot ran out: account
+    // for the time actually spent halted and restart the periodic tick
+    if (timer_state.oneshot_ms) {
+        uint32_t us = hal_timer_oneshot_elapsed() + timer_state.fraction_us;
+        timer_state.oneshot_ms = 0;
+        timer_state.wakeups++;
+        hal_timer_periodic(TIMER_HZ);
+        timer_state.fraction_us = us % 1000;
+        timer_advance(us / 1000);
+    }
+    
+    spin_unlock_irqrestore(&timer_state.lock, flags);
+}
+
+// Timer interrupts plus idle wakeups since boot
+uint32_t timer_get_wakeups(void) {
+    return timer_state.wakeups;
+}
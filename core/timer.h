@@ -0,0 +1,76 @@
+#ifndef REXUS_TIMER_H
+#define REXUS_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Maximum number of timers that can be armed at once
+#define TIMER_MAX_ARMED 1024
+
+// Periodic tick rate
+#define TIMER_HZ 1000
+
+// Longest one-shot the PIT can program (16-bit count at 1.193182 MHz)
+#define TIMER_ONESHOT_MAX_MS 54
+
+// Timer callback; runs from the timer interrupt with interrupts disabled
+typedef void (*ktimer_callback_t)(void* data);
+
+// Kernel timer. Embed one in the object it belongs to, set it up once
+// with timer_setup and arm it as often as needed.
+typedef struct ktimer {
+    uint64_t expires;               // Absolute deadline in ms since boot
+    ktimer_callback_t callback;     // Called when the deadline passes
+    void* data;                     // Argument for the callback
+    uint32_t heap_index;            // Slot in the timer heap + 1, 0 when idle
+} ktimer_t;
+
+// Initialize the timer subsystem
+void timer_init(void);
+
+// Milliseconds since boot
+uint64_t timer_now(void);
+
+// Prepare a timer; it starts out idle
+void timer_setup(ktimer_t* timer, ktimer_callback_t callback, void* data);
+
+// Arm a timer for an absolute deadline, or move it if already armed
+bool timer_start_at(ktimer_t* timer, uint64_t expires);
+
+// Arm a timer to fire after delay_ms milliseconds
+bool timer_start(ktimer_t* timer, uint32_t delay_ms);
+
+// Disarm a timer; returns true if it was armed. A callback already
+// under way is not stopped: check timer_running before freeing the
+// object the timer is embedded in.
+bool timer_cancel(ktimer_t* timer);
+
+// Check whether a timer's callback is executing right now
+bool timer_running(const ktimer_t* timer);
+
+// Check whether a timer is armed
+static inline bool timer_pending(const ktimer_t* timer) {
+    return timer->heap_index != 0;
+}
+
+// Earliest armed deadline, or UINT64_MAX if no timer is armed
+uint64_t timer_next_deadline(void);
+
+// Account for a timer interrupt and run expired timers. Called from the
+// timer interrupt: one periodic tick, or the end of an idle one-shot.
+void timer_tick(void);
+
+// Enable or disable tickless idle (on by default)
+void timer_set_tickless(bool enable);
+bool timer_is_tickless(void);
+
+// Halt until the next interrupt. In tickless mode the periodic tick is
+// replaced by a one-shot for the earliest deadline while halted, and
+// kernel time is caught up on wakeup. Only call this when nothing else
+// is runnable.
+void timer_idle(void);
+
+// Timer interrupts plus idle wakeups since boot
+uint32_t timer_get_wakeups(void);
+
+#endif /* REXUS_TIMER_H */
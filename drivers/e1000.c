@@ -1,6 +1,8 @@
 #include "e1000.h"
 #include "../arch/x86/io.h"
 #include "../mem/pmm.h"
+#include "../mem/dma.h"
+#include "../net/capture.h"
 #include "../drivers/vga.h"
 #include <string.h>
 
@@ -8,6 +10,7 @@
 #define E1000_NUM_TX_DESC 32
 #define E1000_RX_BUFFER_SIZE 2048
 #define E1000_TX_BUFFER_SIZE 2048
+#define E1000_RING_ALIGN 128        // Descriptor rings start on 128 bytes
 
 // Helper functions for MMIO access
 static inline void e1000_write_reg(e1000_device_t* dev, uint32_t reg, uint32_t value) {
@@ -50,30 +53,30 @@ static bool e1000_read_mac_from_eeprom(e1000_device_t* dev) {
 // Initialize receive descriptors
 static bool e1000_init_rx(e1000_device_t* dev) {
     // Allocate descriptor array
-    dev->rx_descs = pmm_alloc_blocks(
-        (sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
+    dev->rx_descs = dma_alloc_coherent(sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC,
+                                       E1000_RING_ALIGN, DMA_ATTR_CACHED, &dev->rx_descs_bus);
     if (!dev->rx_descs) {
         return false;
     }
     
     // Allocate receive buffers
-    dev->rx_buffers = pmm_alloc_blocks(
-        (E1000_RX_BUFFER_SIZE * E1000_NUM_RX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
+    dev->rx_buffers = dma_alloc_coherent(E1000_RX_BUFFER_SIZE * E1000_NUM_RX_DESC, 0,
+                                         DMA_ATTR_CACHED, &dev->rx_buffers_bus);
     if (!dev->rx_buffers) {
-        pmm_free_blocks(dev->rx_descs, 
-            (sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
+        dma_free_coherent(dev->rx_descs, sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC);
+        dev->rx_descs = NULL;
         return false;
     }
     
     // Initialize descriptors
     for (int i = 0; i < E1000_NUM_RX_DESC; i++) {
-        dev->rx_descs[i].addr = (uint64_t)(uintptr_t)(dev->rx_buffers + i * E1000_RX_BUFFER_SIZE);
+        dev->rx_descs[i].addr = dev->rx_buffers_bus + i * E1000_RX_BUFFER_SIZE;
         dev->rx_descs[i].status = 0;
     }
     
     // Setup receive descriptor registers
-    e1000_write_reg(dev, E1000_RDBAL, (uint32_t)(uintptr_t)dev->rx_descs);
-    e1000_write_reg(dev, E1000_RDBAH, 0);
+    e1000_write_reg(dev, E1000_RDBAL, (uint32_t)dev->rx_descs_bus);
+    e1000_write_reg(dev, E1000_RDBAH, (uint32_t)(dev->rx_descs_bus >> 32));
     e1000_write_reg(dev, E1000_RDLEN, E1000_NUM_RX_DESC * sizeof(e1000_rx_desc_t));
     e1000_write_reg(dev, E1000_RDH, 0);
     e1000_write_reg(dev, E1000_RDT, E1000_NUM_RX_DESC - 1);
@@ -92,31 +95,30 @@ static bool e1000_init_rx(e1000_device_t* dev) {
 // Initialize transmit descriptors
 static bool e1000_init_tx(e1000_device_t* dev) {
     // Allocate descriptor array
-    dev->tx_descs = pmm_alloc_blocks(
-        (sizeof(e1000_tx_desc_t) * E1000_NUM_TX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
+    dev->tx_descs = dma_alloc_coherent(sizeof(e1000_tx_desc_t) * E1000_NUM_TX_DESC,
+                                       E1000_RING_ALIGN, DMA_ATTR_CACHED, &dev->tx_descs_bus);
     if (!dev->tx_descs) {
         return false;
     }
     
     // Allocate transmit buffers
-    dev->tx_buffers = pmm_alloc_blocks(
-        (E1000_TX_BUFFER_SIZE * E1000_NUM_TX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
+    dev->tx_buffers = dma_alloc_coherent(E1000_TX_BUFFER_SIZE * E1000_NUM_TX_DESC, 0,
+                                         DMA_ATTR_CACHED, &dev->tx_buffers_bus);
     if (!dev->tx_buffers) {
-        pmm_free_blocks(dev->tx_descs, 
-            (sizeof(e1000_tx_desc_t) * E1000_NUM_TX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
+        dma_free_coherent(dev->tx_descs, sizeof(e1000_tx_desc_t) * E1000_NUM_TX_DESC);
+        dev->tx_descs = NULL;
         return false;
     }
     
-    // Initialize descriptors
-    memset(dev->tx_descs, 0, sizeof(e1000_tx_desc_t) * E1000_NUM_TX_DESC);
+    // Initialize descriptors (the memory comes zeroed)
     for (int i = 0; i < E1000_NUM_TX_DESC; i++) {
-        dev->tx_descs[i].addr = (uint64_t)(uintptr_t)(dev->tx_buffers + i * E1000_TX_BUFFER_SIZE);
+        dev->tx_descs[i].addr = dev->tx_buffers_bus + i * E1000_TX_BUFFER_SIZE;
         dev->tx_descs[i].cmd = E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
     }
     
     // Setup transmit descriptor registers
-    e1000_write_reg(dev, E1000_TDBAL, (uint32_t)(uintptr_t)dev->tx_descs);
-    e1000_write_reg(dev, E1000_TDBAH, 0);
+    e1000_write_reg(dev, E1000_TDBAL, (uint32_t)dev->tx_descs_bus);
+    e1000_write_reg(dev, E1000_TDBAH, (uint32_t)(dev->tx_descs_bus >> 32));
     e1000_write_reg(dev, E1000_TDLEN, E1000_NUM_TX_DESC * sizeof(e1000_tx_desc_t));
     e1000_write_reg(dev, E1000_TDH, 0);
     e1000_write_reg(dev, E1000_TDT, 0);
@@ -194,22 +196,10 @@ void e1000_cleanup(net_interface_t* iface) {
     e1000_stop(iface);
     
     // Free receive and transmit resources
-    if (dev->rx_descs) {
-        pmm_free_blocks(dev->rx_descs, 
-            (sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
-    }
-    if (dev->rx_buffers) {
-        pmm_free_blocks(dev->rx_buffers,
-            (E1000_RX_BUFFER_SIZE * E1000_NUM_RX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
-    }
-    if (dev->tx_descs) {
-        pmm_free_blocks(dev->tx_descs,
-            (sizeof(e1000_tx_desc_t) * E1000_NUM_TX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
-    }
-    if (dev->tx_buffers) {
-        pmm_free_blocks(dev->tx_buffers,
-            (E1000_TX_BUFFER_SIZE * E1000_NUM_TX_DESC + PAGE_SIZE - 1) / PAGE_SIZE);
-    }
+    dma_free_coherent(dev->rx_descs, sizeof(e1000_rx_desc_t) * E1000_NUM_RX_DESC);
+    dma_free_coherent(dev->rx_buffers, E1000_RX_BUFFER_SIZE * E1000_NUM_RX_DESC);
+    dma_free_coherent(dev->tx_descs, sizeof(e1000_tx_desc_t) * E1000_NUM_TX_DESC);
+    dma_free_coherent(dev->tx_buffers, E1000_TX_BUFFER_SIZE * E1000_NUM_TX_DESC);
     
     // Free device structure
     pmm_free_blocks(dev, (sizeof(e1000_device_t) + PAGE_SIZE - 1) / PAGE_SIZE);
@@ -269,7 +259,7 @@ bool e1000_send_packet(net_interface_t* iface, net_packet_t* packet) {
     while (!(dev->tx_descs[dev->tx_cur].status & 0xFF));
     
     // Copy packet to buffer
-    memcpy((void*)(uintptr_t)dev->tx_descs[dev->tx_cur].addr, packet->data, packet->length);
+    memcpy(dev->tx_buffers + dev->tx_cur * E1000_TX_BUFFER_SIZE, packet->data, packet->length);
     
     // Setup descriptor
     dev->tx_descs[dev->tx_cur].length = packet->length;
@@ -280,11 +270,15 @@ bool e1000_send_packet(net_interface_t* iface, net_packet_t* packet) {
     dev->tx_packets++;
     dev->tx_bytes += packet->length;
     
-    // Advance tail pointer
+    // Advance tail pointer once the device can see the descriptor
     uint32_t old_cur = dev->tx_cur;
     dev->tx_cur = (dev->tx_cur + 1) % E1000_NUM_TX_DESC;
+    dma_wmb();
     e1000_write_reg(dev, E1000_TDT, dev->tx_cur);
     
+    // The frame has been copied into the descriptor buffer
+    net_free_packet(packet);
+    
     return true;
 }
 
@@ -315,19 +309,23 @@ net_packet_t* e1000_receive_packet(net_interface_t* iface) {
     }
     
     // Copy data from buffer
-    memcpy(packet->data, (void*)(uintptr_t)dev->rx_descs[dev->rx_cur].addr, length);
-    packet->length = length;
+    memcpy(packet->data, dev->rx_buffers + dev->rx_cur * E1000_RX_BUFFER_SIZE, length);
     
     // Update statistics
     dev->rx_packets++;
     dev->rx_bytes += length;
     
+    // Frames go straight to net_deliver_packet, past the tap in
+    // net_receive_packet
+    NET_CAPTURE_TAP(iface, packet, NET_CAPTURE_RX);
+    
     // Reset descriptor
     dev->rx_descs[dev->rx_cur].status = 0;
     
     // Advance tail pointer
     uint32_t old_cur = dev->rx_cur;
     dev->rx_cur = (dev->rx_cur + 1) % E1000_NUM_RX_DESC;
+    dma_wmb();
     e1000_write_reg(dev, E1000_RDT, old_cur);
     
     return packet;
@@ -415,11 +413,7 @@ void e1000_handle_interrupt(net_interface_t* iface) {
         net_packet_t* packet;
         while ((packet = e1000_receive_packet(iface)) != NULL) {
             // Process received packet
-            if (iface->receive) {
-                iface->receive(iface, packet);
-            } else {
-                net_free_packet(packet);
-            }
+            net_deliver_packet(iface, packet);
         }
     }
     
@@ -130,11 +130,15 @@ typedef struct {
     // Receive state
     e1000_rx_desc_t* rx_descs;    // Receive descriptors
     uint8_t* rx_buffers;          // Receive buffers
+    uint64_t rx_descs_bus;        // Their bus addresses
+    uint64_t rx_buffers_bus;
     uint32_t rx_cur;              // Current receive descriptor
     
     // Transmit state
     e1000_tx_desc_t* tx_descs;    // Transmit descriptors
     uint8_t* tx_buffers;          // Transmit buffers
+    uint64_t tx_descs_bus;        // Their bus addresses
+    uint64_t tx_buffers_bus;
     uint32_t tx_cur;              // Current transmit descriptor
     
     // Statistics
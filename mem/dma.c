@@ -0,0 +1,334 @@
+#include "dma.h"
+#include "pmm.h"
+#include "../core/spinlock.h"
+#include "../arch/x86/cpu.h"
+#include "../drivers/vga.h"
+#include <string.h>
+
+// Uncached and write-combining memory comes from an arena of blocks set
+// aside at boot, above the identity map. Its part of the direct map is
+// split into 4KB pages, and an allocation changes the memory type of its
+// own pages there, so the frames are never also mapped write-back.
+#define DMA_ARENA_PAGES 1024
+static uint8_t* dma_arena = NULL;
+static uint32_t dma_arena_used[DMA_ARENA_PAGES / 32];
+
+// Small-chunk pools: blocks carved into chunks of one power-of-two size
+// for one attribute. Every chunk is aligned to its size. Carved blocks
+// stay with the pools.
+#define DMA_POOL_MIN_SHIFT 5
+#define DMA_POOL_MAX_SHIFT 11
+#define DMA_POOL_PAGES     64
+typedef struct {
+    uint8_t* cpu;                   // CPU address of the block, NULL if unused
+    dma_addr_t bus;
+    uint8_t shift;                  // log2 of the chunk size
+    uint8_t attr;                   // dma_attr_t
+    uint16_t used;                  // Chunks handed out
+    uint32_t free_mask[PAGE_SIZE >> DMA_POOL_MIN_SHIFT >> 5];
+} dma_pool_page_t;
+static dma_pool_page_t dma_pool_pages[DMA_POOL_PAGES];
+
+// Protects the arena and the pools
+static spinlock_t dma_lock = SPINLOCK_INIT("dma");
+
+static uint32_t dma_block_allocs = 0;
+static uint32_t dma_uncached_pages = 0;
+
+// Cache line flushing for blocks about to be mapped uncached
+static uint32_t dma_clflush_line = 0;
+
+// Set up the DMA allocator
+void dma_init(void) {
+    lock_stats_register(&dma_lock.stats);
+    
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (edx & (1u << 19)) {
+        dma_clflush_line = ((ebx >> 8) & 0xFF) * 8;
+    }
+    
+    // Before any directory is cloned, so they all share the split tables.
+    // Above the identity map, whose write-back large pages every
+    // directory copies and which nothing retypes.
+    dma_arena = (uint8_t*)pmm_alloc_blocks_above(DMA_ARENA_PAGES, VMM_IDENTITY_MAP_SIZE, PAGE_OWNER_DMA);
+    if (!dma_arena || !vmm_reserve_kernel_tables((virtual_addr_t)dma_arena, DMA_ARENA_PAGES * PAGE_SIZE)) {
+        vga_puts("DMA: No arena for uncached memory\n");
+        if (dma_arena) {
+            pmm_free_blocks(dma_arena, DMA_ARENA_PAGES);
+            dma_arena = NULL;
+        }
+    }
+}
+
+// Write back and drop the cached lines of memory that just left
+// write-back. Its new type is in every TLB already, so nothing fills
+// them again.
+static void dma_flush_cache(void* cpu, uint32_t size) {
+    if (dma_clflush_line) {
+        for (uint8_t* line = cpu; line < (uint8_t*)cpu + size; line += dma_clflush_line) {
+            __asm__ volatile("clflush (%0)" : : "r"(line) : "memory");
+        }
+        dma_wmb();
+    } else {
+        __asm__ volatile("wbinvd" : : : "memory");
+    }
+}
+
+// Is cpu an address in the arena?
+static bool dma_in_arena(const void* cpu) {
+    return dma_arena && (const uint8_t*)cpu >= dma_arena &&
+           (const uint8_t*)cpu < dma_arena + DMA_ARENA_PAGES * PAGE_SIZE;
+}
+
+// Zeroed pages of the arena, their physical address aligned to align,
+// with attr's memory type. Returns NULL if the arena has no room left.
+// Changing the type shoots down other CPUs' TLBs, so dma_lock is only
+// held to pick the pages.
+static void* dma_arena_alloc(uint32_t pages, uint32_t align, dma_attr_t attr) {
+    if (!dma_arena) {
+        return NULL;
+    }
+    
+    uint32_t align_pages = align > PAGE_SIZE ? align / PAGE_SIZE : 1;
+    uint32_t skew = (uint32_t)(virt_to_phys(dma_arena) / PAGE_SIZE);
+    uint32_t first = 0;
+    uint32_t run = 0;
+    
+    unsigned long flags = spin_lock_irqsave(&dma_lock);
+    for (uint32_t i = 0; i < DMA_ARENA_PAGES && run < pages; i++) {
+        if (dma_arena_used[i / 32] & (1u << (i % 32))) {
+            run = 0;
+        } else if (run) {
+            run++;
+        } else if (((skew + i) & (align_pages - 1)) == 0) {
+            first = i;
+            run = 1;
+        }
+    }
+    if (run < pages) {
+        spin_unlock_irqrestore(&dma_lock, flags);
+        return NULL;
+    }
+    for (uint32_t i = first; i < first + pages; i++) {
+        dma_arena_used[i / 32] |= 1u << (i % 32);
+    }
+    dma_uncached_pages += pages;
+    spin_unlock_irqrestore(&dma_lock, flags);
+    
+    uint8_t* cpu = dma_arena + first * PAGE_SIZE;
+    memset(cpu, 0, pages * PAGE_SIZE);
+    vmm_set_kernel_cache((virtual_addr_t)cpu, pages * PAGE_SIZE,
+                         attr == DMA_ATTR_UNCACHED ? VMM_CACHE_UNCACHED : VMM_CACHE_WRITE_COMBINE);
+    dma_flush_cache(cpu, pages * PAGE_SIZE);
+    return cpu;
+}
+
+// Give pages back to the arena, write-back again
+static void dma_arena_free(void* cpu, uint32_t pages) {
+    vmm_set_kernel_cache((virtual_addr_t)cpu, pages * PAGE_SIZE, VMM_CACHE_WRITE_BACK);
+    
+    uint32_t first = ((uint8_t*)cpu - dma_arena) / PAGE_SIZE;
+    unsigned long flags = spin_lock_irqsave(&dma_lock);
+    for (uint32_t i = first; i < first + pages; i++) {
+        dma_arena_used[i / 32] &= ~(1u << (i % 32));
+    }
+    dma_uncached_pages -= pages;
+    spin_unlock_irqrestore(&dma_lock, flags);
+}
+
+// Zeroed, contiguous blocks aligned to align, mapped for attr
+static void* dma_alloc_blocks(uint32_t pages, uint32_t align, dma_attr_t attr, dma_addr_t* bus) {
+    if (attr != DMA_ATTR_CACHED) {
+        void* cpu = dma_arena_alloc(pages, align, attr);
+        if (cpu) {
+            *bus = virt_to_phys(cpu);
+        }
+        return cpu;
+    }
+    
+    // Over-allocate for an alignment beyond a block, then give back the ends
+    uint32_t extra = align > PAGE_SIZE ? align / PAGE_SIZE - 1 : 0;
+    uint8_t* blocks = (uint8_t*)pmm_alloc_blocks_for(pages + extra, PAGE_OWNER_DMA);
+    if (!blocks) {
+        return NULL;
+    }
+    if (extra) {
+        uint32_t head = ((align - (uint32_t)virt_to_phys(blocks)) & (align - 1)) / PAGE_SIZE;
+        if (head) {
+            pmm_free_blocks(blocks, head);
+        }
+        if (extra - head) {
+            pmm_free_blocks(blocks + (head + pages) * PAGE_SIZE, extra - head);
+        }
+        blocks += head * PAGE_SIZE;
+    }
+    
+    memset(blocks, 0, pages * PAGE_SIZE);
+    *bus = virt_to_phys(blocks);
+    return blocks;
+}
+
+// Free blocks from dma_alloc_blocks
+static void dma_free_blocks(void* cpu, uint32_t pages) {
+    if (dma_in_arena(cpu)) {
+        dma_arena_free(cpu, pages);
+    } else {
+        pmm_free_blocks(cpu, pages);
+    }
+}
+
+// Take a free chunk of a pool page (dma_lock held)
+static void* dma_pool_take(dma_pool_page_t* page, dma_addr_t* bus) {
+    for (uint32_t w = 0; w < sizeof(page->free_mask) / sizeof(uint32_t); w++) {
+        if (page->free_mask[w]) {
+            uint32_t chunk = w * 32 + __builtin_ctz(page->free_mask[w]);
+            page->free_mask[w] &= ~(1u << (chunk % 32));
+            page->used++;
+            *bus = page->bus + (chunk << page->shift);
+            return page->cpu + (chunk << page->shift);
+        }
+    }
+    return NULL;
+}
+
+// A chunk of 1 << shift bytes, carving a new pool page if none has room
+static void* dma_pool_alloc(uint32_t shift, dma_attr_t attr, dma_addr_t* bus) {
+    uint32_t chunks = PAGE_SIZE >> shift;
+    void* chunk = NULL;
+    
+    unsigned long flags = spin_lock_irqsave(&dma_lock);
+    for (uint32_t i = 0; i < DMA_POOL_PAGES && !chunk; i++) {
+        dma_pool_page_t* page = &dma_pool_pages[i];
+        if (page->cpu && page->shift == shift && page->attr == attr && page->used < chunks) {
+            chunk = dma_pool_take(page, bus);
+        }
+    }
+    spin_unlock_irqrestore(&dma_lock, flags);
+    
+    if (chunk) {
+        memset(chunk, 0, 1u << shift);
+        return chunk;
+    }
+    
+    // Carve a new block; it comes zeroed
+    dma_addr_t block_bus;
+    uint8_t* block = dma_alloc_blocks(1, 0, attr, &block_bus);
+    if (!block) {
+        return NULL;
+    }
+    
+    flags = spin_lock_irqsave(&dma_lock);
+    for (uint32_t i = 0; i < DMA_POOL_PAGES && !chunk; i++) {
+        dma_pool_page_t* page = &dma_pool_pages[i];
+        if (!page->cpu) {
+            page->cpu = block;
+            page->bus = block_bus;
+            page->shift = shift;
+            page->attr = attr;
+            page->used = 0;
+            memset(page->free_mask, 0, sizeof(page->free_mask));
+            for (uint32_t c = 0; c < chunks; c++) {
+                page->free_mask[c / 32] |= 1u << (c % 32);
+            }
+            chunk = dma_pool_take(page, bus);
+        }
+    }
+    spin_unlock_irqrestore(&dma_lock, flags);
+    
+    // No pool page left
+    if (!chunk) {
+        dma_free_blocks(block, 1);
+    }
+    return chunk;
+}
+
+// Return a chunk to its pool page; false if cpu is not a pool chunk
+static bool dma_pool_free(void* cpu) {
+    uint8_t* base = (uint8_t*)((virtual_addr_t)cpu & ~(PAGE_SIZE - 1));
+    bool found = false;
+    
+    unsigned long flags = spin_lock_irqsave(&dma_lock);
+    for (uint32_t i = 0; i < DMA_POOL_PAGES && !found; i++) {
+        dma_pool_page_t* page = &dma_pool_pages[i];
+        if (page->cpu == base) {
+            uint32_t chunk = ((uint8_t*)cpu - base) >> page->shift;
+            page->free_mask[chunk / 32] |= 1u << (chunk % 32);
+            page->used--;
+            found = true;
+        }
+    }
+    spin_unlock_irqrestore(&dma_lock, flags);
+    return found;
+}
+
+// Allocate coherent DMA memory
+void* dma_alloc_coherent(size_t size, size_t align, dma_attr_t attr, dma_addr_t* bus) {
+    if (!size || !bus || (align & (align - 1))) {
+        return NULL;
+    }
+    
+    if (size <= DMA_POOL_MAX_CHUNK && align <= DMA_POOL_MAX_CHUNK) {
+        uint32_t shift = DMA_POOL_MIN_SHIFT;
+        while ((1u << shift) < size || (1u << shift) < align) {
+            shift++;
+        }
+        return dma_pool_alloc(shift, attr, bus);
+    }
+    
+    void* cpu = dma_alloc_blocks((size + PAGE_SIZE - 1) / PAGE_SIZE, align, attr, bus);
+    if (cpu) {
+        __atomic_fetch_add(&dma_block_allocs, 1, __ATOMIC_RELAXED);
+    }
+    return cpu;
+}
+
+// Free coherent DMA memory; size as allocated
+void dma_free_coherent(void* cpu, size_t size) {
+    if (!cpu || (size <= DMA_POOL_MAX_CHUNK && dma_pool_free(cpu))) {
+        return;
+    }
+    
+    dma_free_blocks(cpu, (size + PAGE_SIZE - 1) / PAGE_SIZE);
+    __atomic_fetch_sub(&dma_block_allocs, 1, __ATOMIC_RELAXED);
+}
+
+// Bus address of kernel memory: the direct map, or one page elsewhere
+dma_addr_t dma_map_single(void* cpu, size_t size) {
+    (void)size;
+    
+    virtual_addr_t virt = (virtual_addr_t)cpu;
+    physical_addr_t phys = virt_to_phys(cpu);
+    if (virt < VMM_PHYS_OFFSET || virt >= VMM_PHYS_OFFSET + VMM_DIRECT_MAP_SIZE) {
+        phys = 0;
+        vmm_get_mapping(vmm_get_current_directory(), virt, &phys);
+    }
+    
+    dma_wmb();
+    return phys;
+}
+
+// The device is done with a mapping
+void dma_unmap_single(dma_addr_t bus, size_t size) {
+    (void)bus;
+    (void)size;
+    
+    // Reads of what the device wrote must not move above this
+    __asm__ volatile("" : : : "memory");
+}
+
+// DMA allocator statistics
+void dma_get_stats(dma_stats_t* stats) {
+    unsigned long flags = spin_lock_irqsave(&dma_lock);
+    stats->pool_pages = 0;
+    stats->pool_chunks = 0;
+    for (uint32_t i = 0; i < DMA_POOL_PAGES; i++) {
+        if (dma_pool_pages[i].cpu) {
+            stats->pool_pages++;
+            stats->pool_chunks += dma_pool_pages[i].used;
+        }
+    }
+    stats->block_allocs = dma_block_allocs;
+    stats->uncached_pages = dma_uncached_pages;
+    spin_unlock_irqrestore(&dma_lock, flags);
+}
@@ -0,0 +1,59 @@
+#ifndef REXUS_DMA_H
+#define REXUS_DMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "vmm.h"
+
+// Address a device uses for DMA. There is no IOMMU, so it is the
+// physical address.
+typedef uint64_t dma_addr_t;
+
+// How the CPU maps DMA memory. PCI devices snoop the CPU caches on x86,
+// so cached memory is coherent and right for rings and packet buffers;
+// the others are for devices that need them, or memory the CPU only
+// streams writes into.
+typedef enum {
+    DMA_ATTR_CACHED = 0,
+    DMA_ATTR_UNCACHED,
+    DMA_ATTR_WRITE_COMBINE          // Uncached where the CPU has no PAT
+} dma_attr_t;
+
+// Largest chunk carved from the small-chunk pools. Bigger requests, and
+// alignments beyond it, take whole blocks.
+#define DMA_POOL_MAX_CHUNK 2048
+
+// DMA allocator statistics
+typedef struct {
+    uint32_t pool_pages;            // Blocks carved into small chunks
+    uint32_t pool_chunks;           // Of their chunks, in use
+    uint32_t block_allocs;          // Multi-block allocations in use
+    uint32_t uncached_pages;        // Arena pages in use uncached or write-combining
+} dma_stats_t;
+
+// Set aside the arena for uncached and write-combining memory.
+// Call after vmm_init and before any process is created.
+void dma_init(void);
+
+// Physically contiguous, zeroed memory for a device: returns the CPU
+// address and stores the bus address in *bus. align is a power of two
+// (0 for none); chunks up to DMA_POOL_MAX_CHUNK share pooled blocks.
+void* dma_alloc_coherent(size_t size, size_t align, dma_attr_t attr, dma_addr_t* bus);
+void dma_free_coherent(void* cpu, size_t size);
+
+// Bus address of kernel memory handed to a device for one transfer.
+// Caches are coherent, so mapping only translates; unmap orders the
+// CPU's later reads after the device's writes.
+dma_addr_t dma_map_single(void* cpu, size_t size);
+void dma_unmap_single(dma_addr_t bus, size_t size);
+
+// Make CPU writes to DMA memory, write-combining buffers included,
+// visible before the device is told about them
+static inline void dma_wmb(void) {
+    __asm__ volatile("lock; addl $0, (%%esp)" : : : "memory");
+}
+
+void dma_get_stats(dma_stats_t* stats);
+
+#endif /* REXUS_DMA_H */
@@ -0,0 +1,358 @@
+#include "kmalloc.h"
+#include "pmm.h"
+#include "../arch/x86/smp.h"
+#include "../core/spinlock.h"
+#include "../drivers/vga.h"
+#include <string.h>
+
+// Every block the heap takes starts with this header: a slab carved into
+// objects of one class, or a span holding one large allocation. kfree
+// finds it by rounding the pointer down to its block.
+typedef struct kmalloc_slab {
+    uint16_t class_index;           // KMALLOC_SPAN for a span
+    uint16_t used;                  // Objects handed out
+    union {
+        void* free;                 // Slab: first free object
+        uint32_t blocks;            // Span: its length
+    };
+    struct kmalloc_slab* next;      // Slabs of the class with free objects
+    struct kmalloc_slab* prev;
+} kmalloc_slab_t;
+
+#define KMALLOC_HEADER 16          // sizeof(kmalloc_slab_t), objects stay 16-byte aligned
+#define KMALLOC_SPAN   0xFFFF
+#define KMALLOC_SLAB(p) ((kmalloc_slab_t*)((uintptr_t)(p) & ~(uintptr_t)(PAGE_SIZE - 1)))
+
+// Largest magazine. Classes with few objects per slab get smaller ones,
+// so the magazines do not sit on much memory.
+#define KMALLOC_MAG_MAX 32
+
+// A size class and its slabs
+typedef struct {
+    const char* name;
+    uint32_t size;
+    uint32_t per_slab;              // Objects per slab
+    uint32_t mag_size;              // Magazine capacity
+    spinlock_t lock;                // Protects the fields below
+    kmalloc_slab_t* partial;        // Slabs with free objects
+    uint32_t slabs;
+    uint32_t empty;                 // Slabs with no object out; one is kept
+    uint32_t objects;               // Objects out of the slabs
+} kmalloc_class_t;
+
+// Sizes are multiples of 16 picked so the objects fill a slab: from 336
+// bytes on, each is the largest that fits one object fewer per slab
+static kmalloc_class_t kmalloc_classes[KMALLOC_CLASSES] = {
+    { .name = "kmalloc-16", .size = 16 },
+    { .name = "kmalloc-32", .size = 32 },
+    { .name = "kmalloc-48", .size = 48 },
+    { .name = "kmalloc-64", .size = 64 },
+    { .name = "kmalloc-96", .size = 96 },
+    { .name = "kmalloc-128", .size = 128 },
+    { .name = "kmalloc-192", .size = 192 },
+    { .name = "kmalloc-256", .size = 256 },
+    { .name = "kmalloc-336", .size = 336 },
+    { .name = "kmalloc-448", .size = 448 },
+    { .name = "kmalloc-576", .size = 576 },
+    { .name = "kmalloc-816", .size = 816 },
+    { .name = "kmalloc-1008", .size = 1008 },
+    { .name = "kmalloc-1360", .size = 1360 },
+    { .name = "kmalloc-2032", .size = 2032 },
+};
+
+// Class of each 16-byte step of request size
+static uint8_t kmalloc_size_class[KMALLOC_MAX_SMALL / 16];
+
+// Per-CPU magazine: free objects of one class handed out again without
+// the class lock. Only touched by its CPU with interrupts disabled.
+typedef struct {
+    uint32_t count;
+    uint32_t allocs;                // kmalloc calls for the class on this CPU
+    uint32_t hits;                  // Of those, served from the magazine
+    void* objects[KMALLOC_MAG_MAX];
+} kmalloc_mag_t;
+
+static kmalloc_mag_t kmalloc_mags[SMP_MAX_CPUS][KMALLOC_CLASSES];
+
+static uint32_t kmalloc_spans = 0;
+static uint32_t kmalloc_span_blocks = 0;
+
+// Build the size class table
+void kmalloc_init(void) {
+    uint32_t index = 0;
+    for (uint32_t i = 0; i < KMALLOC_MAX_SMALL / 16; i++) {
+        if ((i + 1) * 16 > kmalloc_classes[index].size) {
+            index++;
+        }
+        kmalloc_size_class[i] = index;
+    }
+    
+    for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_class_t* class = &kmalloc_classes[i];
+        class->per_slab = (PAGE_SIZE - KMALLOC_HEADER) / class->size;
+        class->mag_size = 2 * class->per_slab;
+        if (class->mag_size > KMALLOC_MAG_MAX) {
+            class->mag_size = KMALLOC_MAG_MAX;
+        }
+        if (class->mag_size < 4) {
+            class->mag_size = 4;
+        }
+        spin_init(&class->lock, class->name);
+        lock_stats_register(&class->lock.stats);
+    }
+}
+
+// Unlink a slab from its class's partial list (class lock held)
+static void kmalloc_unlink(kmalloc_class_t* class, kmalloc_slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        class->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Carve a new slab, its objects linked in address order (class lock held)
+static kmalloc_slab_t* kmalloc_new_slab(kmalloc_class_t* class, uint32_t index) {
+    kmalloc_slab_t* slab = (kmalloc_slab_t*)pmm_alloc_block_for(PAGE_OWNER_HEAP);
+    if (!slab) {
+        return NULL;
+    }
+    
+    uint8_t* first = (uint8_t*)slab + KMALLOC_HEADER;
+    for (uint32_t i = 0; i < class->per_slab; i++) {
+        uint8_t* object = first + i * class->size;
+        *(void**)object = i + 1 < class->per_slab ? object + class->size : NULL;
+    }
+    slab->class_index = index;
+    slab->used = 0;
+    slab->free = first;
+    slab->prev = NULL;
+    slab->next = class->partial;
+    if (class->partial) {
+        class->partial->prev = slab;
+    }
+    class->partial = slab;
+    class->slabs++;
+    class->empty++;
+    return slab;
+}
+
+// Move up to count objects of a class into a magazine, carving new slabs
+// when none has a free object. Interrupts disabled.
+static void kmalloc_refill(uint32_t index, kmalloc_mag_t* mag, uint32_t count) {
+    kmalloc_class_t* class = &kmalloc_classes[index];
+    spin_lock(&class->lock);
+    
+    while (count--) {
+        kmalloc_slab_t* slab = class->partial;
+        if (!slab && !(slab = kmalloc_new_slab(class, index))) {
+            break;
+        }
+        
+        if (slab->used++ == 0) {
+            class->empty--;
+        }
+        void* object = slab->free;
+        slab->free = *(void**)object;
+        if (!slab->free) {
+            kmalloc_unlink(class, slab);
+        }
+        mag->objects[mag->count++] = object;
+        class->objects++;
+    }
+    
+    spin_unlock(&class->lock);
+}
+
+// Return the top count objects of a magazine to their slabs. Slabs left
+// empty go back to the PMM, but for one. Interrupts disabled.
+static void kmalloc_flush(uint32_t index, kmalloc_mag_t* mag, uint32_t count) {
+    kmalloc_class_t* class = &kmalloc_classes[index];
+    spin_lock(&class->lock);
+    
+    while (count-- && mag->count) {
+        void* object = mag->objects[--mag->count];
+        kmalloc_slab_t* slab = KMALLOC_SLAB(object);
+        class->objects--;
+        
+        if (!slab->free) {
+            slab->prev = NULL;
+            slab->next = class->partial;
+            if (class->partial) {
+                class->partial->prev = slab;
+            }
+            class->partial = slab;
+        }
+        *(void**)object = slab->free;
+        slab->free = object;
+        
+        if (--slab->used == 0) {
+            if (class->empty) {
+                kmalloc_unlink(class, slab);
+                class->slabs--;
+                pmm_free_block(slab);
+            } else {
+                class->empty++;
+            }
+        }
+    }
+    
+    spin_unlock(&class->lock);
+}
+
+// Allocate a span of whole blocks for a large request
+static void* kmalloc_span(size_t size) {
+    if (size > pmm_get_memory_size()) {
+        return NULL;
+    }
+    
+    uint32_t blocks = (size + KMALLOC_HEADER + PAGE_SIZE - 1) / PAGE_SIZE;
+    kmalloc_slab_t* span = (kmalloc_slab_t*)pmm_alloc_blocks_for(blocks, PAGE_OWNER_HEAP);
+    if (!span) {
+        return NULL;
+    }
+    
+    span->class_index = KMALLOC_SPAN;
+    span->blocks = blocks;
+    __atomic_fetch_add(&kmalloc_spans, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&kmalloc_span_blocks, blocks, __ATOMIC_RELAXED);
+    return (uint8_t*)span + KMALLOC_HEADER;
+}
+
+// Allocate size bytes
+void* kmalloc(size_t size) {
+    if (!size) {
+        return NULL;
+    }
+    if (size > KMALLOC_MAX_SMALL) {
+        return kmalloc_span(size);
+    }
+    
+    uint32_t index = kmalloc_size_class[(size - 1) >> 4];
+    void* object = NULL;
+    
+    unsigned long flags = irq_save();
+    kmalloc_mag_t* mag = &kmalloc_mags[cpu_id()][index];
+    mag->allocs++;
+    if (mag->count) {
+        mag->hits++;
+    } else {
+        kmalloc_refill(index, mag, kmalloc_classes[index].mag_size / 2);
+    }
+    if (mag->count) {
+        object = mag->objects[--mag->count];
+    }
+    irq_restore(flags);
+    return object;
+}
+
+// Free memory from kmalloc or krealloc
+void kfree(void* p) {
+    if (!p) {
+        return;
+    }
+    
+    kmalloc_slab_t* slab = KMALLOC_SLAB(p);
+    page_t* page = pmm_get_page(slab);
+    if (!page || page->owner != PAGE_OWNER_HEAP) {
+        vga_puts("kfree: pointer not from the heap\n");
+        return;
+    }
+    
+    if (slab->class_index == KMALLOC_SPAN) {
+        uint32_t blocks = slab->blocks;
+        __atomic_fetch_sub(&kmalloc_spans, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&kmalloc_span_blocks, blocks, __ATOMIC_RELAXED);
+        pmm_free_blocks(slab, blocks);
+        return;
+    }
+    
+    uint32_t index = slab->class_index;
+    unsigned long flags = irq_save();
+    kmalloc_mag_t* mag = &kmalloc_mags[cpu_id()][index];
+    if (mag->count == kmalloc_classes[index].mag_size) {
+        kmalloc_flush(index, mag, mag->count / 2);
+    }
+    mag->objects[mag->count++] = p;
+    irq_restore(flags);
+}
+
+// Bytes usable at p
+size_t kmalloc_usable_size(void* p) {
+    if (!p) {
+        return 0;
+    }
+    
+    kmalloc_slab_t* slab = KMALLOC_SLAB(p);
+    if (slab->class_index == KMALLOC_SPAN) {
+        return slab->blocks * PAGE_SIZE - KMALLOC_HEADER;
+    }
+    return kmalloc_classes[slab->class_index].size;
+}
+
+// Resize an allocation, in place when it still fits
+void* krealloc(void* p, size_t size) {
+    if (!p) {
+        return kmalloc(size);
+    }
+    if (!size) {
+        kfree(p);
+        return NULL;
+    }
+    
+    size_t usable = kmalloc_usable_size(p);
+    if (size <= usable) {
+        return p;
+    }
+    
+    void* moved = kmalloc(size);
+    if (moved) {
+        memcpy(moved, p, usable);
+        kfree(p);
+    }
+    return moved;
+}
+
+// Return the calling CPU's magazines to the slabs
+void kmalloc_drain(void) {
+    unsigned long flags = irq_save();
+    for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_mag_t* mag = &kmalloc_mags[cpu_id()][i];
+        kmalloc_flush(i, mag, mag->count);
+    }
+    irq_restore(flags);
+}
+
+// Statistics of one class. The magazine counters belong to other CPUs
+// and are read without their owners' cooperation, so they are a snapshot.
+bool kmalloc_get_class_stats(uint32_t index, kmalloc_class_stats_t* stats) {
+    if (index >= KMALLOC_CLASSES) {
+        return false;
+    }
+    
+    kmalloc_class_t* class = &kmalloc_classes[index];
+    unsigned long flags = spin_lock_irqsave(&class->lock);
+    stats->size = class->size;
+    stats->slabs = class->slabs;
+    stats->objects = class->objects;
+    spin_unlock_irqrestore(&class->lock, flags);
+    
+    stats->cached = 0;
+    stats->allocs = 0;
+    stats->hits = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        stats->cached += kmalloc_mags[cpu][index].count;
+        stats->allocs += kmalloc_mags[cpu][index].allocs;
+        stats->hits += kmalloc_mags[cpu][index].hits;
+    }
+    return true;
+}
+
+// Spans in use and the blocks they hold
+void kmalloc_get_span_stats(uint32_t* spans, uint32_t* blocks) {
+    *spans = __atomic_load_n(&kmalloc_spans, __ATOMIC_RELAXED);
+    *blocks = __atomic_load_n(&kmalloc_span_blocks, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,44 @@
+#ifndef REXUS_KMALLOC_H
+#define REXUS_KMALLOC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Kernel heap. Requests up to KMALLOC_MAX_SMALL bytes are rounded up to
+// one of KMALLOC_CLASSES size classes and carved from one-block slabs;
+// larger ones get a span of whole blocks. Each CPU keeps a magazine of
+// free objects per class, so most calls take no lock. Memory is 16-byte
+// aligned and not cleared. Callable from interrupt handlers.
+#define KMALLOC_CLASSES   15
+#define KMALLOC_MAX_SMALL 2032
+
+// Per-class statistics
+typedef struct {
+    uint32_t size;                  // Object size
+    uint32_t slabs;                 // Blocks carved into objects
+    uint32_t objects;               // Objects out of the slabs, cached ones included
+    uint32_t cached;                // Of those, waiting in magazines
+    uint32_t allocs;                // kmalloc calls served
+    uint32_t hits;                  // Of those, from the CPU's magazine
+} kmalloc_class_stats_t;
+
+// Build the size class table. Call after vmm_init.
+void kmalloc_init(void);
+
+void* kmalloc(size_t size);
+void* krealloc(void* p, size_t size);
+void kfree(void* p);
+
+// Bytes usable at p, at least what was asked for
+size_t kmalloc_usable_size(void* p);
+
+// Return the calling CPU's magazines to the slabs
+void kmalloc_drain(void);
+
+// Statistics of class index, false past the last class; spans in use
+// and the blocks they hold
+bool kmalloc_get_class_stats(uint32_t index, kmalloc_class_stats_t* stats);
+void kmalloc_get_span_stats(uint32_t* spans, uint32_t* blocks);
+
+#endif /* REXUS_KMALLOC_H */
@@ -0,0 +1,296 @@
+#include "kmallocbench.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "../proc/process.h"
+#include "../proc/sync.h"
+#include "../arch/x86/cpu.h"
+#include "../drivers/console.h"
+#include <string.h>
+
+// kmtest: every object holds its size and a tag, and the rest of it is
+// filled with the tag, so whoever frees it can check it was not
+// overwritten through another allocation
+#define KMTEST_TASKS  4
+#define KMTEST_SLOTS  64
+#define KMTEST_ROUNDS 20000
+#define KMTEST_SWAPS  16
+
+static semaphore_t kmtest_done;
+static void* volatile kmtest_swap[KMTEST_SWAPS];
+static volatile uint32_t kmtest_errors;
+
+static uint32_t kmtest_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Random size, spread evenly over the size classes, one in 16 a span
+static uint32_t kmtest_size(uint32_t* state) {
+    uint32_t r = kmtest_random(state);
+    if ((r & 15) == 0) {
+        return KMALLOC_MAX_SMALL + 1 + (r >> 4) % (2 * PAGE_SIZE);
+    }
+    uint32_t limit = 32u << ((r >> 4) % 7);
+    return 8 + (r >> 8) % (limit - 16);
+}
+
+static void kmtest_fill(uint8_t* object, uint32_t size, uint32_t tag) {
+    ((uint32_t*)object)[0] = size;
+    ((uint32_t*)object)[1] = tag;
+    memset(object + 8, (uint8_t)tag, size - 8);
+}
+
+static bool kmtest_check(uint8_t* object) {
+    uint32_t size = ((uint32_t*)object)[0];
+    uint8_t tag = (uint8_t)((uint32_t*)object)[1];
+    if (size < 8 || size > kmalloc_usable_size(object)) {
+        return false;
+    }
+    for (uint32_t i = 8; i < size; i++) {
+        if (object[i] != tag) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int kmtest_task(void* arg) {
+    uint32_t state = 0x9E3779B9u * ((uint32_t)arg + 1);
+    uint8_t* slots[KMTEST_SLOTS] = { NULL };
+    uint32_t errors = 0;
+    
+    for (uint32_t round = 0; round < KMTEST_ROUNDS; round++) {
+        uint32_t r = kmtest_random(&state);
+        uint32_t slot = r % KMTEST_SLOTS;
+        uint8_t* object = slots[slot];
+        
+        if (!object) {
+            uint32_t size = kmtest_size(&state);
+            object = kmalloc(size);
+            if (object) {
+                kmtest_fill(object, size, r);
+            }
+            slots[slot] = object;
+        } else if (!kmtest_check(object)) {
+            // Leave it be: it may be someone else's now
+            errors++;
+            slots[slot] = NULL;
+        } else if ((r >> 8) % 8 == 0) {
+            // Grow it; the contents move along
+            uint32_t size = ((uint32_t*)object)[0] + kmtest_size(&state);
+            uint8_t* moved = krealloc(object, size);
+            if (moved) {
+                if (!kmtest_check(moved)) {
+                    errors++;
+                }
+                kmtest_fill(moved, size, r);
+                slots[slot] = moved;
+            }
+        } else if ((r >> 8) % 8 == 1) {
+            // Trade it for an object another task left, freed later maybe
+            // on another CPU
+            slots[slot] = __atomic_exchange_n(&kmtest_swap[(r >> 12) % KMTEST_SWAPS], object,
+                                              __ATOMIC_ACQ_REL);
+        } else {
+            kfree(object);
+            slots[slot] = NULL;
+        }
+        
+        if ((round & 255) == 0) {
+            process_yield();
+        }
+    }
+    
+    for (uint32_t i = 0; i < KMTEST_SLOTS; i++) {
+        if (slots[i]) {
+            if (kmtest_check(slots[i])) {
+                kfree(slots[i]);
+            } else {
+                errors++;
+            }
+        }
+    }
+    
+    __atomic_fetch_add(&kmtest_errors, errors, __ATOMIC_RELAXED);
+    semaphore_up(&kmtest_done);
+    return 0;
+}
+
+// Objects handed out and not cached in a magazine, and spans
+static uint32_t kmtest_live(void) {
+    uint32_t live = 0;
+    kmalloc_class_stats_t stats;
+    for (uint32_t i = 0; kmalloc_get_class_stats(i, &stats); i++) {
+        live += stats.objects - stats.cached;
+    }
+    
+    uint32_t spans, blocks;
+    kmalloc_get_span_stats(&spans, &blocks);
+    return live + spans;
+}
+
+// kmtest console command
+int kmtest_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    static bool initialized;
+    if (!initialized) {
+        semaphore_init(&kmtest_done, "kmtest_done", 0);
+        initialized = true;
+    }
+    kmtest_errors = 0;
+    uint32_t live_before = kmtest_live();
+    
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < KMTEST_TASKS; i++) {
+        if (process_create("kmtest", kmtest_task, (void*)i, PROCESS_PRIORITY_NORMAL)) {
+            started++;
+        }
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        semaphore_down(&kmtest_done);
+    }
+    
+    for (uint32_t i = 0; i < KMTEST_SWAPS; i++) {
+        uint8_t* object = kmtest_swap[i];
+        kmtest_swap[i] = NULL;
+        if (object && kmtest_check(object)) {
+            kfree(object);
+        } else if (object) {
+            kmtest_errors++;
+        }
+    }
+    kmalloc_drain();
+    
+    // Other heap users may have allocated meanwhile, so a difference is
+    // only a hint of a leak
+    uint32_t live_after = kmtest_live();
+    console_printf("kmtest: %d tasks x %d rounds, %d corrupted objects, %d live objects before, %d after\n",
+                   started, KMTEST_ROUNDS, kmtest_errors, live_before, live_after);
+    return kmtest_errors ? 1 : 0;
+}
+
+// kmbench: speed of hot alloc/free pairs, then the heap's footprint as
+// a random quarter of KMBENCH_OBJECTS objects is kept and the rest freed
+// and allocated again
+#define KMBENCH_BATCH   32
+#define KMBENCH_ROUNDS  128
+#define KMBENCH_OBJECTS 4096
+#define KMBENCH_BLOCKS  (KMBENCH_OBJECTS * sizeof(void*) / PAGE_SIZE)
+
+// Blocks held by slabs and spans
+static uint32_t kmbench_heap_blocks(void) {
+    uint32_t blocks;
+    uint32_t spans;
+    kmalloc_get_span_stats(&spans, &blocks);
+    
+    kmalloc_class_stats_t stats;
+    for (uint32_t i = 0; kmalloc_get_class_stats(i, &stats); i++) {
+        blocks += stats.slabs;
+    }
+    return blocks;
+}
+
+// Cycles per pair of KMBENCH_BATCH allocations followed by their frees
+static uint32_t kmbench_pairs(bool heap) {
+    void* batch[KMBENCH_BATCH];
+    uint32_t start = (uint32_t)rdtsc();
+    for (uint32_t round = 0; round < KMBENCH_ROUNDS; round++) {
+        for (uint32_t i = 0; i < KMBENCH_BATCH; i++) {
+            batch[i] = heap ? kmalloc(64) : pmm_alloc_block();
+        }
+        for (uint32_t i = 0; i < KMBENCH_BATCH; i++) {
+            if (heap) {
+                kfree(batch[i]);
+            } else {
+                pmm_free_block(batch[i]);
+            }
+        }
+    }
+    return ((uint32_t)rdtsc() - start) / (KMBENCH_ROUNDS * KMBENCH_BATCH);
+}
+
+static void kmbench_report(const char* phase, uint32_t live, uint32_t base) {
+    uint32_t blocks = kmbench_heap_blocks();
+    uint32_t heap = blocks > base ? (blocks - base) * PAGE_SIZE : 0;
+    console_printf("  %s %d KB live in %d KB of heap (%d%% used)\n", phase, live / 1024, heap / 1024,
+                   heap ? (uint32_t)((uint64_t)live * 100 / heap) : 0);
+}
+
+// kmbench console command
+int kmbench_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    console_printf("kmbench: %d-byte objects in batches of %d\n", 64, KMBENCH_BATCH);
+    kmbench_pairs(true);
+    console_printf("  kmalloc/kfree: %d cycles/pair\n", kmbench_pairs(true));
+    console_printf("  pmm block:     %d cycles/pair\n", kmbench_pairs(false));
+    
+    uint8_t** objects = pmm_alloc_blocks(KMBENCH_BLOCKS);
+    uint32_t* sizes = pmm_alloc_blocks(KMBENCH_BLOCKS);
+    if (!objects || !sizes) {
+        if (objects) {
+            pmm_free_blocks(objects, KMBENCH_BLOCKS);
+        }
+        if (sizes) {
+            pmm_free_blocks(sizes, KMBENCH_BLOCKS);
+        }
+        console_puts("kmbench: out of memory\n");
+        return 1;
+    }
+    
+    console_printf("kmbench: %d objects of 8 to 1024 bytes\n", KMBENCH_OBJECTS);
+    kmalloc_drain();
+    uint32_t base = kmbench_heap_blocks();
+    uint32_t state = 0x2545F491;
+    uint32_t live = 0;
+    uint32_t usable = 0;
+    
+    for (uint32_t i = 0; i < KMBENCH_OBJECTS; i++) {
+        uint32_t r = kmtest_random(&state);
+        sizes[i] = 8 + (r >> 8) % ((32u << (r % 6)) - 16);
+        objects[i] = kmalloc(sizes[i]);
+        if (objects[i]) {
+            live += sizes[i];
+            usable += kmalloc_usable_size(objects[i]);
+        }
+    }
+    console_printf("  rounding up to classes: %d KB asked, %d KB handed out\n", live / 1024, usable / 1024);
+    kmbench_report("filled:  ", live, base);
+    
+    for (uint32_t i = 0; i < KMBENCH_OBJECTS; i++) {
+        if (objects[i] && kmtest_random(&state) % 4) {
+            kfree(objects[i]);
+            objects[i] = NULL;
+            live -= sizes[i];
+        }
+    }
+    kmalloc_drain();
+    kmbench_report("3/4 freed:", live, base);
+    
+    for (uint32_t i = 0; i < KMBENCH_OBJECTS; i++) {
+        if (!objects[i]) {
+            objects[i] = kmalloc(sizes[i]);
+            if (objects[i]) {
+                live += sizes[i];
+            }
+        }
+    }
+    kmbench_report("refilled:", live, base);
+    
+    for (uint32_t i = 0; i < KMBENCH_OBJECTS; i++) {
+        kfree(objects[i]);
+    }
+    kmalloc_drain();
+    kmbench_report("all freed:", 0, base);
+    
+    pmm_free_blocks(objects, KMBENCH_BLOCKS);
+    pmm_free_blocks(sizes, KMBENCH_BLOCKS);
+    return 0;
+}
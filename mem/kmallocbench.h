@@ -0,0 +1,13 @@
+#ifndef REXUS_KMALLOCBENCH_H
+#define REXUS_KMALLOCBENCH_H
+
+// Console command: tasks allocate, check, resize and free random-sized
+// objects, swapping some with each other so they are freed on other
+// CPUs, then check that the heap is back where it started
+int kmtest_command(int argc, char* argv[]);
+
+// Console command: cycles per kmalloc/kfree pair against the PMM, and
+// how much of the heap's memory is live after random frees and refills
+int kmbench_command(int argc, char* argv[]);
+
+#endif /* REXUS_KMALLOCBENCH_H */
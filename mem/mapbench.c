@@ -0,0 +1,97 @@
+#include "mapbench.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "../proc/process.h"
+#include "../core/hal.h"
+#include "../arch/x86/cpu.h"
+#include "../drivers/console.h"
+
+// The window maps the physical 1MB at MAPBENCH_PHYS, read-only
+#define MAPBENCH_PHYS   0x00400000
+#define MAPBENCH_VA     0xF9800000
+#define MAPBENCH_PAGES  256
+#define MAPBENCH_ROUNDS 32
+
+// Read one word from every page of the window, so each has a TLB entry
+static void mapbench_touch(void) {
+    volatile uint32_t sink = 0;
+    for (uint32_t i = 0; i < MAPBENCH_PAGES; i++) {
+        sink += *(volatile uint32_t*)(MAPBENCH_VA + i * PAGE_SIZE);
+    }
+    (void)sink;
+}
+
+// Map, touch and unmap the window MAPBENCH_ROUNDS times. Returns the
+// cycles per page spent mapping and unmapping, or 0 if a map failed.
+static uint32_t mapbench_run(page_dir_t* dir, bool batched) {
+    uint32_t cycles = 0;
+    
+    for (uint32_t round = 0; round < MAPBENCH_ROUNDS; round++) {
+        bool mapped = true;
+        uint32_t start = (uint32_t)rdtsc();
+        if (batched) {
+            mapped = vmm_map_range(dir, MAPBENCH_PHYS, MAPBENCH_VA, MAPBENCH_PAGES * PAGE_SIZE, VMM_PRESENT);
+        } else {
+            for (uint32_t i = 0; i < MAPBENCH_PAGES && mapped; i++) {
+                mapped = vmm_map_page(dir, MAPBENCH_PHYS + i * PAGE_SIZE, MAPBENCH_VA + i * PAGE_SIZE,
+                                      VMM_PRESENT);
+            }
+        }
+        cycles += (uint32_t)rdtsc() - start;
+        
+        if (mapped) {
+            mapbench_touch();
+        }
+        
+        start = (uint32_t)rdtsc();
+        if (batched) {
+            vmm_unmap_range(dir, MAPBENCH_VA, MAPBENCH_PAGES * PAGE_SIZE);
+        } else {
+            for (uint32_t i = 0; i < MAPBENCH_PAGES; i++) {
+                vmm_unmap_page(dir, MAPBENCH_VA + i * PAGE_SIZE);
+            }
+        }
+        cycles += (uint32_t)rdtsc() - start;
+        
+        if (!mapped) {
+            return 0;
+        }
+    }
+    
+    return cycles / (MAPBENCH_ROUNDS * MAPBENCH_PAGES);
+}
+
+// Print one run and the flushes it caused
+static void mapbench_report(const char* name, uint32_t cycles, const vmm_tlb_stats_t* before) {
+    vmm_tlb_stats_t after;
+    vmm_get_tlb_stats(&after);
+    console_printf("  %s %d cycles/page, %d flushes (%d by CR3), %d invlpg, %d shootdowns, %d IPIs\n",
+                   name, cycles, after.flushes - before->flushes, after.full_flushes - before->full_flushes,
+                   after.pages - before->pages, after.shootdowns - before->shootdowns,
+                   after.ipis - before->ipis);
+}
+
+// mapbench console command
+int mapbench_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    page_dir_t* dir = process_get_current()->page_directory;
+    vmm_tlb_stats_t before;
+    
+    console_printf("mapbench: %d pages x %d rounds\n", MAPBENCH_PAGES, MAPBENCH_ROUNDS);
+    
+    vmm_get_tlb_stats(&before);
+    uint32_t single = mapbench_run(dir, false);
+    mapbench_report("per page:", single, &before);
+    
+    vmm_get_tlb_stats(&before);
+    uint32_t batched = mapbench_run(dir, true);
+    mapbench_report("batched: ", batched, &before);
+    
+    if (!single || !batched) {
+        console_puts("mapbench: failed to map the window\n");
+        return 1;
+    }
+    return 0;
+}
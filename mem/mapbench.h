@@ -0,0 +1,9 @@
+#ifndef REXUS_MAPBENCH_H
+#define REXUS_MAPBENCH_H
+
+// Console command: map/unmap throughput of a 1MB window one page at a
+// time against vmm_map_range/vmm_unmap_range, with the TLB flushes and
+// shootdown IPIs each needed
+int mapbench_command(int argc, char* argv[]);
+
+#endif /* REXUS_MAPBENCH_H */
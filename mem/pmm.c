@@ -1,40 +1,107 @@
 #include "pmm.h"
+#include "vmm.h"
 #include "../drivers/vga.h"
 #include "../arch/x86/isr.h"
+#include "../arch/x86/cpu.h"
+#include "../arch/x86/multiboot.h"
+#include "../core/spinlock.h"
 #include <string.h>
 
-// Multiboot structure for memory information
-typedef struct {
-    uint32_t flags;
-    uint32_t mem_lower;
-    uint32_t mem_upper;
-    uint32_t boot_device;
-    uint32_t cmdline;
-    uint32_t mods_count;
-    uint32_t mods_addr;
-    uint32_t syms[4];
-    uint32_t mmap_length;
-    uint32_t mmap_addr;
-} __attribute__((packed)) multiboot_info_t;
-
-typedef struct {
-    uint32_t size;
-    uint64_t base_addr;
-    uint64_t length;
-    uint32_t type;
-} __attribute__((packed)) mmap_entry_t;
-
 // Memory map
 static uint32_t *pmm_memory_map = 0;
 static uint32_t pmm_memory_map_size = 0;
 
+// Descriptor of every block, right after the bitmap. Its reference
+// count lets a block shared copy-on-write be freed by whoever drops
+// the last reference.
+static page_t* pmm_pages = 0;
+
+// Free blocks, most recently freed (and most likely cached) first.
+// pmm_alloc_blocks takes runs straight from the bitmap without
+// unlinking them, so an entry whose bitmap bit is set is stale and is
+// dropped once it reaches the head.
+#define PMM_NO_BLOCK 0xFFFFFFFF
+static uint32_t pmm_free_head = PMM_NO_BLOCK;
+
+// Blocks and high frames held by each owner
+static uint32_t pmm_owner_blocks[PAGE_OWNER_COUNT];
+
+static const char* pmm_owner_names[PAGE_OWNER_COUNT] = {
+    "free", "reserved", "kernel", "net", "process", "pagetable", "dma", "heap", "zeroed"
+};
+
 // Memory tracking variables
 uint32_t mem_size = 0;
 uint32_t mem_blocks = 0;
 uint32_t mem_used_blocks = 0;
 
-// Actual maximum address of physical memory
-static uint32_t mem_max_addr = 0;
+// Below this address memory holds firmware data and the AP trampoline
+#define PMM_LOW_MEMORY 0x100000
+
+// The boot loader's memory map. Available entries are used in whole
+// blocks; any block another entry touches is reserved.
+#define PMM_MAX_REGIONS 64
+typedef struct {
+    uint64_t base;
+    uint64_t end;
+    bool available;
+} pmm_region_t;
+static pmm_region_t pmm_regions[PMM_MAX_REGIONS];
+static uint32_t pmm_region_count = 0;
+
+// Physical ranges in use before the PMM exists: the kernel image and
+// what the boot loader handed over
+#define PMM_MAX_BOOT_RANGES 32
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} pmm_boot_range_t;
+static pmm_boot_range_t pmm_boot_ranges[PMM_MAX_BOOT_RANGES];
+static uint32_t pmm_boot_range_count = 0;
+
+// Kernel image, from link.ld
+extern uint8_t _kernel_phys_start[];
+extern uint8_t _kernel_phys_end[];
+
+// Available memory left out: past the direct map, and above 4GB
+static uint64_t pmm_unmapped_size = 0;
+static uint64_t pmm_high_size = 0;
+
+// High memory: available frames past the direct map. Only page tables
+// map them, so they get descriptors and a free list of their own but
+// no bitmap and no multi-block allocations. A range's descriptors come
+// from the blocks, 2KB per MB; memory past PMM_HIGH_LIMIT is left out
+// rather than have them crowd the direct map.
+#define PMM_MAX_HIGH_RANGES 16
+#define PMM_HIGH_LIMIT      0x400000000ull
+typedef struct {
+    uint32_t first;                 // First frame number
+    uint32_t count;
+    page_t* pages;
+} pmm_high_range_t;
+static pmm_high_range_t pmm_high_ranges[PMM_MAX_HIGH_RANGES];
+static uint32_t pmm_high_range_count = 0;
+static uint32_t pmm_high_free_head = PMM_NO_BLOCK;
+static uint32_t pmm_high_frames = 0;
+static uint32_t pmm_high_free = 0;
+
+// Blocks cleared ahead of time by idle CPUs. They are allocated to
+// PAGE_OWNER_ZEROED, so nothing else hands them out; the allocators
+// fall back on them once the free list runs dry. Idle CPUs keep the
+// pool at pmm_zero_target while more than that many blocks are free.
+#define PMM_ZERO_POOL_SIZE 256
+static void* pmm_zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t pmm_zero_count = 0;
+static uint32_t pmm_zero_target = 0;
+static pmm_zero_stats_t pmm_zero_stats;
+
+// Clear blocks for the pool with non-temporal stores (SSE2), which
+// leave the cache alone: the block may not be used for a long time
+static bool pmm_clear_movnti = false;
+
+// Protects the bitmap and counters; blocks are allocated and freed from
+// every CPU and from interrupt handlers
+static spinlock_t pmm_lock = SPINLOCK_INIT("pmm");
 
 // Set a bit in the memory map (mark as used)
 void pmm_set_block(uint32_t bit) {
@@ -53,15 +120,71 @@ bool pmm_test_block(uint32_t bit) {
     return pmm_memory_map[bit / 32] & (1 << (bit % 32));
 }
 
-// Find first free block(s)
-int32_t pmm_find_first_free_blocks(size_t count) {
+// Queue a free block on the free list unless it is on it already
+static void pmm_push_free(uint32_t block) {
+    page_t* page = &pmm_pages[block];
+    if (!(page->flags & PAGE_FLAG_FREE_LIST)) {
+        page->flags |= PAGE_FLAG_FREE_LIST;
+        page->next = pmm_free_head;
+        pmm_free_head = block;
+    }
+}
+
+// Hand out a free block
+static void pmm_claim(uint32_t block, page_owner_t owner) {
+    pmm_set_block(block);
+    pmm_pages[block].refs = 0;
+    pmm_pages[block].owner = owner;
+    pmm_owner_blocks[owner]++;
+}
+
+// Take back a block whose last reference is gone
+static void pmm_release(uint32_t block) {
+    pmm_owner_blocks[pmm_pages[block].owner]--;
+    pmm_pages[block].owner = PAGE_OWNER_FREE;
+    pmm_unset_block(block);
+    pmm_push_free(block);
+}
+
+// Keep a block from ever being handed out
+static void pmm_reserve(uint32_t block) {
+    if (!pmm_test_block(block)) {
+        pmm_set_block(block);
+        pmm_pages[block].owner = PAGE_OWNER_RESERVED;
+        pmm_owner_blocks[PAGE_OWNER_RESERVED]++;
+    }
+}
+
+// Take a block from the zeroed pool for owner, NULL if it is empty
+// (pmm_lock held)
+static void* pmm_take_zeroed(page_owner_t owner) {
+    if (!pmm_zero_count) {
+        return NULL;
+    }
+    
+    void* block = pmm_zero_pool[--pmm_zero_count];
+    pmm_pages[virt_to_phys(block) / BLOCK_SIZE].owner = owner;
+    pmm_owner_blocks[PAGE_OWNER_ZEROED]--;
+    pmm_owner_blocks[owner]++;
+    return block;
+}
+
+// Give the zeroed pool back to the free list (pmm_lock held)
+static void pmm_drain_zeroed(void) {
+    while (pmm_zero_count) {
+        pmm_release(virt_to_phys(pmm_zero_pool[--pmm_zero_count]) / BLOCK_SIZE);
+    }
+}
+
+// Find the first free block(s) at block first or later
+static int32_t pmm_find_free_blocks_from(uint32_t first, size_t count) {
     if (count == 0) {
         return -1;
     }
     
     if (count == 1) {
         // Find a single free block
-        for (uint32_t i = 0; i < mem_blocks; i++) {
+        for (uint32_t i = first; i < mem_blocks; i++) {
             if (!pmm_test_block(i)) {
                 return i;
             }
@@ -71,7 +194,7 @@ int32_t pmm_find_first_free_blocks(size_t count) {
         uint32_t free_blocks = 0;
         int32_t first_free = -1;
         
-        for (uint32_t i = 0; i < mem_blocks; i++) {
+        for (uint32_t i = first; i < mem_blocks; i++) {
             if (!pmm_test_block(i)) {
                 // Found a free block
                 if (free_blocks == 0) {
@@ -93,71 +216,232 @@ int32_t pmm_find_first_free_blocks(size_t count) {
     return -1; // No free blocks found
 }
 
+// Find first free block(s)
+int32_t pmm_find_first_free_blocks(size_t count) {
+    return pmm_find_free_blocks_from(0, count);
+}
+
+// Copy the boot loader's memory map, or make one from the basic memory
+// fields if it gave none
+static void pmm_read_memory_map(multiboot_info_t* info) {
+    if (info->flags & MULTIBOOT_INFO_MMAP) {
+        multiboot_mmap_entry_t* entry = (multiboot_mmap_entry_t*)phys_to_virt(info->mmap_addr);
+        multiboot_mmap_entry_t* end = (multiboot_mmap_entry_t*)phys_to_virt(info->mmap_addr + info->mmap_length);
+        
+        for (; entry < end; entry = multiboot_mmap_next(entry)) {
+            if (pmm_region_count == PMM_MAX_REGIONS) {
+                vga_puts("PMM: Memory map too long, ignoring the rest\n");
+                break;
+            }
+            if (entry->length) {
+                pmm_region_t* region = &pmm_regions[pmm_region_count++];
+                region->base = entry->base_addr;
+                region->end = entry->base_addr + entry->length;
+                region->available = entry->type == MULTIBOOT_MEMORY_AVAILABLE;
+            }
+        }
+    } else if (info->flags & MULTIBOOT_INFO_MEMORY) {
+        // mem_upper KB from 1MB up
+        pmm_regions[0].base = 0x100000;
+        pmm_regions[0].end = 0x100000 + ((uint64_t)info->mem_upper << 10);
+        pmm_regions[0].available = true;
+        pmm_region_count = 1;
+    }
+}
+
+// Note a physical range the boot code is using
+static void pmm_add_boot_range(uint32_t start, uint32_t end) {
+    if (end <= start) {
+        return;
+    }
+    if (pmm_boot_range_count == PMM_MAX_BOOT_RANGES) {
+        vga_puts("PMM: Too many boot modules, some are not protected\n");
+        return;
+    }
+    pmm_boot_ranges[pmm_boot_range_count].start = start;
+    pmm_boot_ranges[pmm_boot_range_count].end = end;
+    pmm_boot_range_count++;
+}
+
+// The kernel image and everything the boot loader handed over
+static void pmm_find_boot_ranges(multiboot_info_t* info, uint32_t info_phys) {
+    pmm_add_boot_range((uint32_t)_kernel_phys_start, (uint32_t)_kernel_phys_end);
+    pmm_add_boot_range(info_phys, info_phys + sizeof(multiboot_info_t));
+    
+    if (info->flags & MULTIBOOT_INFO_MMAP) {
+        pmm_add_boot_range(info->mmap_addr, info->mmap_addr + info->mmap_length);
+    }
+    if (info->flags & MULTIBOOT_INFO_CMDLINE) {
+        pmm_add_boot_range(info->cmdline, info->cmdline + strlen(phys_to_virt(info->cmdline)) + 1);
+    }
+    if (info->flags & MULTIBOOT_INFO_MODS) {
+        multiboot_module_t* mods = (multiboot_module_t*)phys_to_virt(info->mods_addr);
+        pmm_add_boot_range(info->mods_addr, info->mods_addr + info->mods_count * sizeof(multiboot_module_t));
+        for (uint32_t i = 0; i < info->mods_count; i++) {
+            pmm_add_boot_range(mods[i].mod_start, mods[i].mod_end);
+            if (mods[i].string) {
+                pmm_add_boot_range(mods[i].string, mods[i].string + strlen(phys_to_virt(mods[i].string)) + 1);
+            }
+        }
+    }
+}
+
+// Bytes of [base, end) that lie within [low, high)
+static uint64_t pmm_overlap(uint64_t base, uint64_t end, uint64_t low, uint64_t high) {
+    if (base < low) {
+        base = low;
+    }
+    if (end > high) {
+        end = high;
+    }
+    return end > base ? end - base : 0;
+}
+
+// Lowest block-aligned address where size bytes fit in one available
+// region, below limit and clear of low memory and the boot ranges.
+// Returns 0 if there is none.
+static uint32_t pmm_place_metadata(uint32_t size, uint32_t limit) {
+    for (uint32_t r = 0; r < pmm_region_count; r++) {
+        pmm_region_t* region = &pmm_regions[r];
+        if (!region->available || region->base >= limit) {
+            continue;
+        }
+        
+        uint32_t end = region->end < limit ? (uint32_t)region->end : limit;
+        uint32_t start = region->base < PMM_LOW_MEMORY ? PMM_LOW_MEMORY : (uint32_t)region->base;
+        start = (start + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
+        
+        // Move past every boot range in the way
+        bool moved = true;
+        while (moved && start < end) {
+            moved = false;
+            for (uint32_t i = 0; i < pmm_boot_range_count; i++) {
+                if (pmm_boot_ranges[i].start < start + size && pmm_boot_ranges[i].end > start) {
+                    start = (pmm_boot_ranges[i].end + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
+                    moved = true;
+                }
+            }
+        }
+        
+        if (start < end && end - start >= size) {
+            return start;
+        }
+    }
+    return 0;
+}
+
+// Free the whole blocks inside [base, end)
+static void pmm_free_region(uint64_t base, uint64_t end) {
+    uint64_t first = (base + BLOCK_SIZE - 1) >> 12;
+    uint64_t last = end >> 12;
+    for (uint64_t i = first; i < last && i < mem_blocks; i++) {
+        if (pmm_test_block((uint32_t)i)) {
+            pmm_unset_block((uint32_t)i);
+            pmm_pages[i].owner = PAGE_OWNER_FREE;
+            pmm_owner_blocks[PAGE_OWNER_RESERVED]--;
+        }
+    }
+}
+
+// Reserve every block touching [base, end)
+static void pmm_reserve_region(uint64_t base, uint64_t end) {
+    uint64_t first = base >> 12;
+    uint64_t last = (end + BLOCK_SIZE - 1) >> 12;
+    for (uint64_t i = first; i < last && i < mem_blocks; i++) {
+        pmm_reserve((uint32_t)i);
+    }
+}
+
 // Initialize the PMM with multiboot info
 void pmm_init(uint32_t mboot_addr) {
-    multiboot_info_t* mboot_info = (multiboot_info_t*)mboot_addr;
+    multiboot_info_t* mboot_info = (multiboot_info_t*)phys_to_virt(mboot_addr);
     
-    // Check if memory map is available
-    if (!(mboot_info->flags & 0x40)) {
+    lock_stats_register(&pmm_lock.stats);
+    
+    pmm_read_memory_map(mboot_info);
+    if (!pmm_region_count) {
         vga_puts("PMM: No memory map provided by bootloader!\n");
         return;
     }
+    pmm_find_boot_ranges(mboot_info, mboot_addr);
     
-    // Parse memory map to find max memory address
-    mmap_entry_t* mmap = (mmap_entry_t*)mboot_info->mmap_addr;
-    mmap_entry_t* mmap_end = (mmap_entry_t*)((uint32_t)mboot_info->mmap_addr + mboot_info->mmap_length);
-    
-    while (mmap < mmap_end) {
-        // Type 1 is available memory
-        if (mmap->type == 1) {
-            uint32_t region_end = (uint32_t)(mmap->base_addr + mmap->length);
-            if (region_end > mem_max_addr) {
-                mem_max_addr = region_end;
-            }
+    // Manage available memory up to the end of the direct map. The rest
+    // is counted until pmm_init_high takes on what the paging mode
+    // reaches: all of it below 4GB, and above only with PAE.
+    uint64_t managed_end = 0;
+    for (uint32_t r = 0; r < pmm_region_count; r++) {
+        pmm_region_t* region = &pmm_regions[r];
+        if (!region->available) {
+            continue;
         }
         
-        // Go to the next entry (entries can have varying sizes)
-        mmap = (mmap_entry_t*)((uint32_t)mmap + mmap->size + sizeof(uint32_t));
+        uint64_t end = region->end < VMM_DIRECT_MAP_SIZE ? region->end : VMM_DIRECT_MAP_SIZE;
+        if (end > managed_end) {
+            managed_end = end;
+        }
+        pmm_unmapped_size += pmm_overlap(region->base, region->end, VMM_DIRECT_MAP_SIZE, 0x100000000ull);
+        pmm_high_size += pmm_overlap(region->base, region->end, 0x100000000ull, ~0ull);
     }
     
-    // Calculate total memory size in blocks
-    mem_size = mem_max_addr;
-    mem_blocks = mem_size / BLOCK_SIZE;
+    mem_blocks = (uint32_t)(managed_end >> 12);
+    mem_size = mem_blocks * BLOCK_SIZE;
     
-    // Allocate memory for the bitmap
-    pmm_memory_map_size = mem_blocks / BLOCKS_PER_BYTE;
-    if (mem_blocks % BLOCKS_PER_BYTE != 0) {
-        pmm_memory_map_size++;
+    // The bitmap, then the block descriptors, in the first free run that
+    // boot.asm's mapping reaches and nothing else is using
+    pmm_memory_map_size = (mem_blocks + 31) / 32 * sizeof(uint32_t);
+    uint32_t pages_offset = (pmm_memory_map_size + 7) & ~7u;
+    uint32_t metadata_size = (pages_offset + mem_blocks * sizeof(page_t) + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
+    uint32_t metadata = pmm_place_metadata(metadata_size, VMM_BOOT_MAP_SIZE < mem_size ? VMM_BOOT_MAP_SIZE : mem_size);
+    if (!metadata) {
+        vga_puts("PMM: No room for the memory map!\n");
+        mem_blocks = 0;
+        mem_size = 0;
+        return;
     }
+    pmm_memory_map = (uint32_t*)phys_to_virt(metadata);
+    pmm_pages = (page_t*)((uint32_t)pmm_memory_map + pages_offset);
     
-    // Align the memory map to a block boundary
-    pmm_memory_map = (uint32_t*)((mem_max_addr + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1));
-    
-    // Clear the memory map (mark all blocks as free)
-    memset(pmm_memory_map, 0, pmm_memory_map_size);
+    // Everything starts reserved
+    memset(pmm_memory_map, 0xFF, pmm_memory_map_size);
+    memset(pmm_pages, 0, mem_blocks * sizeof(page_t));
+    for (uint32_t i = 0; i < mem_blocks; i++) {
+        pmm_pages[i].owner = PAGE_OWNER_RESERVED;
+    }
+    mem_used_blocks = mem_blocks;
+    pmm_owner_blocks[PAGE_OWNER_RESERVED] = mem_blocks;
     
-    // Mark blocks used by the kernel and the PMM bitmap as used
-    uint32_t kernel_end = (uint32_t)pmm_memory_map + pmm_memory_map_size;
-    for (uint32_t i = 0; i < kernel_end / BLOCK_SIZE; i++) {
-        pmm_set_block(i);
+    // Free what the memory map offers, then take back whatever another
+    // entry reserves, the low 1MB (firmware data and the AP trampoline),
+    // the boot ranges and the metadata itself
+    for (uint32_t r = 0; r < pmm_region_count; r++) {
+        if (pmm_regions[r].available) {
+            pmm_free_region(pmm_regions[r].base, pmm_regions[r].end);
+        }
+    }
+    for (uint32_t r = 0; r < pmm_region_count; r++) {
+        if (!pmm_regions[r].available) {
+            pmm_reserve_region(pmm_regions[r].base, pmm_regions[r].end);
+        }
+    }
+    pmm_reserve_region(0, PMM_LOW_MEMORY);
+    for (uint32_t i = 0; i < pmm_boot_range_count; i++) {
+        pmm_reserve_region(pmm_boot_ranges[i].start, pmm_boot_ranges[i].end);
     }
+    pmm_reserve_region(metadata, metadata + metadata_size);
     
-    // Mark unavailable regions as used
-    mmap = (mmap_entry_t*)mboot_info->mmap_addr;
-    while (mmap < mmap_end) {
-        if (mmap->type != 1) {
-            // This region is reserved
-            uint32_t block_start = (uint32_t)mmap->base_addr / BLOCK_SIZE;
-            uint32_t block_end = ((uint32_t)mmap->base_addr + (uint32_t)mmap->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
-            
-            for (uint32_t i = block_start; i < block_end && i < mem_blocks; i++) {
-                pmm_set_block(i);
-            }
+    // Lowest blocks at the head of the free list
+    for (uint32_t i = mem_blocks; i-- > 0;) {
+        if (!pmm_test_block(i)) {
+            pmm_push_free(i);
         }
-        
-        mmap = (mmap_entry_t*)((uint32_t)mmap + mmap->size + sizeof(uint32_t));
     }
     
+    // A zeroed pool of up to 1/16th of memory
+    pmm_zero_target = mem_blocks / 16 < PMM_ZERO_POOL_SIZE ? mem_blocks / 16 : PMM_ZERO_POOL_SIZE;
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    pmm_clear_movnti = edx & (1u << 26);
+    
     vga_puts("PMM: Initialized, ");
     vga_putint(mem_size / 1024 / 1024);
     vga_puts(" MB, ");
@@ -165,62 +449,172 @@ void pmm_init(uint32_t mboot_addr) {
     vga_puts(" blocks, ");
     vga_putint(mem_blocks - mem_used_blocks);
     vga_puts(" free\n");
+    
+    if (pmm_unmapped_size || pmm_high_size) {
+        vga_puts("PMM: Not managed: ");
+        vga_putint((uint32_t)(pmm_unmapped_size >> 20));
+        vga_puts(" MB past the direct map, ");
+        vga_putint((uint32_t)(pmm_high_size >> 20));
+        vga_puts(" MB above 4GB\n");
+    }
 }
 
-// Allocate a single physical memory block
+// Allocate a single physical memory block for the kernel
 void* pmm_alloc_block(void) {
-    if (mem_used_blocks >= mem_blocks) {
-        return 0; // Out of memory
+    return pmm_alloc_block_for(PAGE_OWNER_KERNEL);
+}
+
+// Allocate a single physical memory block from the free list
+void* pmm_alloc_block_for(page_owner_t owner) {
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    
+    // Drop the stale entries at the head
+    while (pmm_free_head != PMM_NO_BLOCK && pmm_test_block(pmm_free_head)) {
+        page_t* page = &pmm_pages[pmm_free_head];
+        page->flags &= ~PAGE_FLAG_FREE_LIST;
+        pmm_free_head = page->next;
     }
     
-    int32_t free_block = pmm_find_first_free_blocks(1);
-    if (free_block == -1) {
-        return 0; // No free blocks despite counter saying otherwise
+    uint32_t block = pmm_free_head;
+    if (block == PMM_NO_BLOCK) {
+        // Out of memory but for the zeroed pool
+        void* zeroed = pmm_take_zeroed(owner);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return zeroed;
     }
     
-    pmm_set_block(free_block);
-    return (void*)(free_block * BLOCK_SIZE);
+    pmm_free_head = pmm_pages[block].next;
+    pmm_pages[block].flags &= ~PAGE_FLAG_FREE_LIST;
+    pmm_claim(block, owner);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return phys_to_virt(block * BLOCK_SIZE);
 }
 
-// Free a single physical memory block
+// Drop a reference to a single physical memory block
 void pmm_free_block(void* p) {
-    uint32_t addr = (uint32_t)p;
+    uint32_t addr = virt_to_phys(p);
     uint32_t block = addr / BLOCK_SIZE;
     
     if (block >= mem_blocks) {
         return; // Address out of range
     }
     
-    pmm_unset_block(block);
+    // Only the last reference frees the block; free and reserved
+    // blocks are left alone
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    page_t* page = &pmm_pages[block];
+    if (!pmm_test_block(block) || page->owner == PAGE_OWNER_RESERVED) {
+        // Nothing to drop
+    } else if (page->refs) {
+        page->refs--;
+    } else {
+        pmm_release(block);
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
-// Allocate multiple contiguous physical memory blocks
+// Take another reference to an allocated block. Returns false if the
+// block is free or its count would overflow.
+bool pmm_ref_block(void* p) {
+    uint32_t block = virt_to_phys(p) / BLOCK_SIZE;
+    if (block >= mem_blocks) {
+        return false;
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    bool referenced = pmm_test_block(block) && pmm_pages[block].refs != 0xFFFF;
+    if (referenced) {
+        pmm_pages[block].refs++;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return referenced;
+}
+
+// Number of references to a block (0 if it is free)
+uint32_t pmm_get_block_refs(void* p) {
+    uint32_t block = virt_to_phys(p) / BLOCK_SIZE;
+    if (block >= mem_blocks || !pmm_test_block(block)) {
+        return 0;
+    }
+    return pmm_pages[block].refs + 1u;
+}
+
+// Descriptor of the block holding p
+page_t* pmm_get_page(void* p) {
+    uint32_t block = virt_to_phys(p) / BLOCK_SIZE;
+    if (block >= mem_blocks) {
+        return NULL;
+    }
+    return &pmm_pages[block];
+}
+
+// Allocate multiple contiguous physical memory blocks for the kernel
 void* pmm_alloc_blocks(size_t size) {
-    if (mem_used_blocks + size > mem_blocks) {
-        return 0; // Not enough memory
+    return pmm_alloc_blocks_for(size, PAGE_OWNER_KERNEL);
+}
+
+// Allocate multiple contiguous physical memory blocks
+void* pmm_alloc_blocks_for(size_t size, page_owner_t owner) {
+    return pmm_alloc_blocks_above(size, 0, owner);
+}
+
+// Allocate multiple contiguous physical memory blocks at or above min
+void* pmm_alloc_blocks_above(size_t size, physical_addr_t min, page_owner_t owner) {
+    uint32_t first = (uint32_t)((min + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    int32_t starting_block = -1;
+    if (mem_used_blocks + size <= mem_blocks) {
+        starting_block = pmm_find_free_blocks_from(first, size);
+    }
+    
+    // The zeroed pool may be in the way
+    if (starting_block == -1 && pmm_zero_count) {
+        pmm_drain_zeroed();
+        if (mem_used_blocks + size <= mem_blocks) {
+            starting_block = pmm_find_free_blocks_from(first, size);
+        }
     }
     
-    int32_t starting_block = pmm_find_first_free_blocks(size);
     if (starting_block == -1) {
+        spin_unlock_irqrestore(&pmm_lock, flags);
         return 0; // No contiguous space available
     }
     
     // Mark all the blocks as used
     for (uint32_t i = 0; i < size; i++) {
-        pmm_set_block(starting_block + i);
+        pmm_claim(starting_block + i, owner);
     }
+    spin_unlock_irqrestore(&pmm_lock, flags);
     
-    return (void*)(starting_block * BLOCK_SIZE);
+    return phys_to_virt(starting_block * BLOCK_SIZE);
 }
 
 // Free multiple contiguous physical memory blocks
 void pmm_free_blocks(void* p, size_t size) {
-    uint32_t addr = (uint32_t)p;
+    uint32_t addr = virt_to_phys(p);
     uint32_t block = addr / BLOCK_SIZE;
     
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
     for (uint32_t i = 0; i < size && (block + i) < mem_blocks; i++) {
-        pmm_unset_block(block + i);
+        if (pmm_test_block(block + i) && pmm_pages[block + i].owner != PAGE_OWNER_RESERVED) {
+            pmm_release(block + i);
+        }
     }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// Blocks and high frames held by an owner (PAGE_OWNER_FREE: free blocks)
+uint32_t pmm_get_owner_blocks(page_owner_t owner) {
+    if (owner == PAGE_OWNER_FREE) {
+        return mem_blocks - mem_used_blocks;
+    }
+    return owner < PAGE_OWNER_COUNT ? pmm_owner_blocks[owner] : 0;
+}
+
+// Name of an owner for display
+const char* pmm_owner_name(page_owner_t owner) {
+    return owner < PAGE_OWNER_COUNT ? pmm_owner_names[owner] : "?";
 }
 
 // Get total memory size
@@ -241,4 +635,298 @@ uint32_t pmm_get_block_count(void) {
 // Get used block count
 uint32_t pmm_get_used_block_count(void) {
     return mem_used_blocks;
-} 
\ No newline at end of file
+}
+
+// Available memory the PMM does not manage: past the direct map, and
+// above 4GB, in MB
+void pmm_get_unmanaged(uint32_t* unmapped_mb, uint32_t* high_mb) {
+    *unmapped_mb = (uint32_t)(pmm_unmapped_size >> 20);
+    *high_mb = (uint32_t)(pmm_high_size >> 20);
+}
+
+// Descriptor of a high frame, or NULL if the frame is not one
+static page_t* pmm_high_page(uint32_t frame) {
+    for (uint32_t i = 0; i < pmm_high_range_count; i++) {
+        if (frame - pmm_high_ranges[i].first < pmm_high_ranges[i].count) {
+            return &pmm_high_ranges[i].pages[frame - pmm_high_ranges[i].first];
+        }
+    }
+    return NULL;
+}
+
+// Manage the whole frames of [base, end) as high memory
+static void pmm_add_high_range(uint64_t base, uint64_t end) {
+    uint32_t first = (uint32_t)((base + BLOCK_SIZE - 1) >> 12);
+    uint32_t last = (uint32_t)(end >> 12);
+    if (first >= last) {
+        return;
+    }
+    if (pmm_high_range_count == PMM_MAX_HIGH_RANGES) {
+        vga_puts("PMM: Too many high memory ranges, ignoring the rest\n");
+        return;
+    }
+    
+    uint32_t count = last - first;
+    uint32_t blocks = (count * sizeof(page_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    page_t* pages = (page_t*)pmm_alloc_blocks_for(blocks, PAGE_OWNER_RESERVED);
+    if (!pages) {
+        vga_puts("PMM: No room for high memory descriptors\n");
+        return;
+    }
+    memset(pages, 0, count * sizeof(page_t));
+    
+    pmm_high_range_t* range = &pmm_high_ranges[pmm_high_range_count++];
+    range->first = first;
+    range->count = count;
+    range->pages = pages;
+    
+    // Any block another memory map entry touches stays reserved
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t frame = (uint64_t)(first + i) << 12;
+        bool reserved = false;
+        for (uint32_t r = 0; r < pmm_region_count && !reserved; r++) {
+            reserved = !pmm_regions[r].available && pmm_regions[r].base < frame + BLOCK_SIZE &&
+                       pmm_regions[r].end > frame;
+        }
+        pages[i].owner = reserved ? PAGE_OWNER_RESERVED : PAGE_OWNER_FREE;
+    }
+    
+    // Lowest frames at the head of the free list
+    for (uint32_t i = count; i-- > 0;) {
+        if (pages[i].owner == PAGE_OWNER_FREE) {
+            pages[i].flags |= PAGE_FLAG_FREE_LIST;
+            pages[i].next = pmm_high_free_head;
+            pmm_high_free_head = first + i;
+            pmm_high_frames++;
+            pmm_high_free++;
+        }
+    }
+}
+
+// Take on the memory past the direct map that the paging mode reaches.
+// Called once at boot, before any other CPU runs.
+void pmm_init_high(bool pae) {
+    uint64_t limit = pae ? PMM_HIGH_LIMIT : 0x100000000ull;
+    
+    for (uint32_t r = 0; r < pmm_region_count; r++) {
+        pmm_region_t* region = &pmm_regions[r];
+        if (!region->available || region->end <= VMM_DIRECT_MAP_SIZE || region->base >= limit) {
+            continue;
+        }
+        
+        uint64_t base = region->base > VMM_DIRECT_MAP_SIZE ? region->base : VMM_DIRECT_MAP_SIZE;
+        uint64_t end = region->end < limit ? region->end : limit;
+        uint32_t ranges = pmm_high_range_count;
+        pmm_add_high_range(base, end);
+        
+        // No longer unmanaged
+        if (pmm_high_range_count > ranges) {
+            pmm_unmapped_size -= pmm_overlap(base, end, 0, 0x100000000ull);
+            pmm_high_size -= pmm_overlap(base, end, 0x100000000ull, ~0ull);
+        }
+    }
+    
+    if (pmm_high_frames) {
+        vga_puts("PMM: ");
+        vga_putint(pmm_high_frames / 256);
+        vga_puts(" MB of high memory\n");
+    }
+}
+
+// Allocate a frame: a high one if any is free
+bool pmm_alloc_frame(page_owner_t owner, physical_addr_t* phys) {
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t frame = pmm_high_free_head;
+    if (frame != PMM_NO_BLOCK) {
+        page_t* page = pmm_high_page(frame);
+        pmm_high_free_head = page->next;
+        page->flags &= ~PAGE_FLAG_FREE_LIST;
+        page->refs = 0;
+        page->owner = owner;
+        pmm_owner_blocks[owner]++;
+        pmm_high_free--;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        *phys = (physical_addr_t)frame << 12;
+        return true;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    void* block = pmm_alloc_block_for(owner);
+    if (!block) {
+        return false;
+    }
+    *phys = virt_to_phys(block);
+    return true;
+}
+
+// Drop a reference to a frame
+void pmm_free_frame(physical_addr_t phys) {
+    if (phys < VMM_DIRECT_MAP_SIZE) {
+        pmm_free_block(phys_to_virt(phys));
+        return;
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t frame = (uint32_t)(phys >> 12);
+    page_t* page = pmm_high_page(frame);
+    if (!page || page->owner == PAGE_OWNER_FREE || page->owner == PAGE_OWNER_RESERVED) {
+        // Nothing to drop
+    } else if (page->refs) {
+        page->refs--;
+    } else {
+        pmm_owner_blocks[page->owner]--;
+        page->owner = PAGE_OWNER_FREE;
+        page->flags |= PAGE_FLAG_FREE_LIST;
+        page->next = pmm_high_free_head;
+        pmm_high_free_head = frame;
+        pmm_high_free++;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// Take another reference to an allocated frame
+bool pmm_ref_frame(physical_addr_t phys) {
+    if (phys < VMM_DIRECT_MAP_SIZE) {
+        return pmm_ref_block(phys_to_virt(phys));
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    page_t* page = pmm_high_page((uint32_t)(phys >> 12));
+    bool referenced = page && page->owner != PAGE_OWNER_FREE && page->owner != PAGE_OWNER_RESERVED &&
+                      page->refs != 0xFFFF;
+    if (referenced) {
+        page->refs++;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return referenced;
+}
+
+// Number of references to a frame (0 if it is free)
+uint32_t pmm_get_frame_refs(physical_addr_t phys) {
+    if (phys < VMM_DIRECT_MAP_SIZE) {
+        return pmm_get_block_refs(phys_to_virt(phys));
+    }
+    
+    page_t* page = pmm_high_page((uint32_t)(phys >> 12));
+    if (!page || page->owner == PAGE_OWNER_FREE) {
+        return 0;
+    }
+    return page->refs + 1u;
+}
+
+// High frames managed, and of those free
+uint32_t pmm_get_high_frames(uint32_t* free) {
+    if (free) {
+        *free = pmm_high_free;
+    }
+    return pmm_high_frames;
+}
+
+// Clear a block for the pool
+static void pmm_clear_block(void* block) {
+    if (pmm_clear_movnti) {
+        for (uint32_t* p = block; p < (uint32_t*)block + BLOCK_SIZE / 4; p += 4) {
+            __asm__ volatile("movnti %1, (%0)\n"
+                             "movnti %1, 4(%0)\n"
+                             "movnti %1, 8(%0)\n"
+                             "movnti %1, 12(%0)" : : "r"(p), "r"(0) : "memory");
+        }
+        // Order the stores before the block is handed out
+        __asm__ volatile("sfence" : : : "memory");
+    } else {
+        uint32_t* p = block;
+        uint32_t count = BLOCK_SIZE / 4;
+        __asm__ volatile("rep stosl" : "+D"(p), "+c"(count) : "a"(0) : "memory");
+    }
+}
+
+// Clear a block for the zeroed pool. Returns false when the pool needs
+// no more, or free memory is too short to spare any.
+bool pmm_refill_zeroed(void) {
+    if (__atomic_load_n(&pmm_zero_count, __ATOMIC_RELAXED) >= pmm_zero_target ||
+        pmm_get_free_block_count() <= pmm_zero_target) {
+        return false;
+    }
+    
+    void* block = pmm_alloc_block_for(PAGE_OWNER_ZEROED);
+    if (!block) {
+        return false;
+    }
+    pmm_clear_block(block);
+    
+    // Another CPU may have filled the pool meanwhile
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    bool pooled = pmm_zero_count < pmm_zero_target;
+    if (pooled) {
+        pmm_zero_pool[pmm_zero_count++] = block;
+        pmm_zero_stats.refills++;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    if (!pooled) {
+        pmm_free_block(block);
+    }
+    return pooled;
+}
+
+// Allocate a cleared block for the kernel
+void* pmm_alloc_zeroed_block(void) {
+    return pmm_alloc_zeroed_block_for(PAGE_OWNER_KERNEL);
+}
+
+// Allocate a cleared block, from the pool if it has one
+void* pmm_alloc_zeroed_block_for(page_owner_t owner) {
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    void* block = pmm_take_zeroed(owner);
+    if (block) {
+        pmm_zero_stats.hits++;
+    } else {
+        pmm_zero_stats.misses++;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    if (!block) {
+        block = pmm_alloc_block_for(owner);
+        if (block) {
+            memset(block, 0, BLOCK_SIZE);
+        }
+    }
+    return block;
+}
+
+// Allocate a cleared frame, from the pool if it has one
+bool pmm_alloc_zeroed_frame(page_owner_t owner, physical_addr_t* phys) {
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    void* block = pmm_take_zeroed(owner);
+    if (block) {
+        pmm_zero_stats.hits++;
+    } else {
+        pmm_zero_stats.misses++;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    
+    if (block) {
+        *phys = virt_to_phys(block);
+        return true;
+    }
+    if (!pmm_alloc_frame(owner, phys)) {
+        return false;
+    }
+    
+    // A high frame is only reachable through a kmap slot
+    flags = irq_save();
+    void* frame = vmm_kmap(*phys);
+    memset(frame, 0, BLOCK_SIZE);
+    vmm_kunmap(frame);
+    irq_restore(flags);
+    return true;
+}
+
+// Zeroed pool statistics
+void pmm_get_zero_stats(pmm_zero_stats_t* stats) {
+    unsigned long flags = spin_lock_irqsave(&pmm_lock);
+    *stats = pmm_zero_stats;
+    stats->pooled = pmm_zero_count;
+    stats->target = pmm_zero_target;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
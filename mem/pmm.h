@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include "vmm.h"
 
 // Memory constants
 #define PAGE_SIZE 4096
@@ -11,16 +12,84 @@
 #define BLOCK_SIZE PAGE_SIZE
 #define BLOCK_ALIGN BLOCK_SIZE
 
-// Function declarations
+// Subsystem a block was allocated for
+typedef enum {
+    PAGE_OWNER_FREE = 0,
+    PAGE_OWNER_RESERVED,            // Firmware, kernel image and PMM metadata
+    PAGE_OWNER_KERNEL,
+    PAGE_OWNER_NET,
+    PAGE_OWNER_PROCESS,             // User pages
+    PAGE_OWNER_PAGETABLE,
+    PAGE_OWNER_DMA,                 // Device memory, see dma.h
+    PAGE_OWNER_HEAP,                // Slabs and spans of kmalloc
+    PAGE_OWNER_ZEROED,              // Cleared ahead of time, see pmm_alloc_zeroed_block
+    PAGE_OWNER_COUNT
+} page_owner_t;
+
+// Page flags
+#define PAGE_FLAG_FREE_LIST 0x01    // Queued on the free list (maybe stale, see pmm.c)
+
+// Per-block descriptor, indexed by block number (PFN)
+typedef struct page {
+    uint16_t refs;                  // References beyond the allocator's
+    uint8_t flags;                  // PAGE_FLAG_*
+    uint8_t owner;                  // page_owner_t
+    uint32_t next;                  // Next block on the free list
+} page_t;
+
+// Zeroed block pool statistics
+typedef struct {
+    uint32_t pooled;                // Blocks cleared and waiting
+    uint32_t target;                // Blocks the idle CPUs keep cleared
+    uint32_t hits;                  // Zeroed allocations served from the pool
+    uint32_t misses;                // Zeroed allocations cleared on the spot
+    uint32_t refills;               // Blocks cleared by idle CPUs
+} pmm_zero_stats_t;
+
+// Function declarations. Blocks are passed as kernel pointers into the
+// direct map; use virt_to_phys for page tables and devices. The plain
+// allocators charge the blocks to PAGE_OWNER_KERNEL.
 void pmm_init(uint32_t mboot_addr);
 void* pmm_alloc_block(void);
+void* pmm_alloc_block_for(page_owner_t owner);
 void pmm_free_block(void* p);
 void* pmm_alloc_blocks(size_t size);
+void* pmm_alloc_blocks_for(size_t size, page_owner_t owner);
+void* pmm_alloc_blocks_above(size_t size, physical_addr_t min, page_owner_t owner);
 void pmm_free_blocks(void* p, size_t size);
+bool pmm_ref_block(void* p);
+uint32_t pmm_get_block_refs(void* p);
+page_t* pmm_get_page(void* p);
+uint32_t pmm_get_owner_blocks(page_owner_t owner);
+const char* pmm_owner_name(page_owner_t owner);
 size_t pmm_get_memory_size(void);
 uint32_t pmm_get_free_block_count(void);
 uint32_t pmm_get_block_count(void);
 uint32_t pmm_get_used_block_count(void);
+void pmm_get_unmanaged(uint32_t* unmapped_mb, uint32_t* high_mb);
+
+// Frames by physical address, for pages only page tables need to reach
+// (user pages). They come from high memory, past the direct map, while
+// any is free, and from the blocks otherwise; use vmm_kmap to touch one.
+// pmm_init_high takes on the high memory once vmm_init has picked the
+// paging mode, above 4GB too with PAE.
+void pmm_init_high(bool pae);
+bool pmm_alloc_frame(page_owner_t owner, physical_addr_t* phys);
+void pmm_free_frame(physical_addr_t phys);
+bool pmm_ref_frame(physical_addr_t phys);
+uint32_t pmm_get_frame_refs(physical_addr_t phys);
+uint32_t pmm_get_high_frames(uint32_t* free);
+
+// Cleared blocks. Idle CPUs keep a pool of them topped up with
+// pmm_refill_zeroed, which clears one block per call and returns false
+// once the pool is full, so the allocations pay for the clear only
+// when the pool runs out. pmm_alloc_zeroed_frame takes from the same
+// pool, and otherwise clears a frame from pmm_alloc_frame.
+void* pmm_alloc_zeroed_block(void);
+void* pmm_alloc_zeroed_block_for(page_owner_t owner);
+bool pmm_alloc_zeroed_frame(page_owner_t owner, physical_addr_t* phys);
+bool pmm_refill_zeroed(void);
+void pmm_get_zero_stats(pmm_zero_stats_t* stats);
 void pmm_set_block(uint32_t bit);
 void pmm_unset_block(uint32_t bit);
 bool pmm_test_block(uint32_t bit);
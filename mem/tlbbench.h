@@ -0,0 +1,9 @@
+#ifndef REXUS_TLBBENCH_H
+#define REXUS_TLBBENCH_H
+
+// Console command: page-walk cost of 4KB against large-page mappings,
+// measured by reading the same 4MB of memory through a window of each
+// kind in an order that defeats the prefetchers
+int tlbbench_command(int argc, char* argv[]);
+
+#endif /* REXUS_TLBBENCH_H */
@@ -0,0 +1,203 @@
+#include "vma.h"
+#include "pmm.h"
+#include <string.h>
+
+// Lowest address a region keeps to itself: a stack also owns the
+// guard gap below its limit
+static virtual_addr_t vma_floor(const vma_t* vma) {
+    if (vma->flags & VMA_GROWSDOWN) {
+        return vma->limit - VMA_STACK_GUARD;
+    }
+    return vma->start;
+}
+
+// Index of the region containing addr, or -1 (space locked)
+static int vm_lookup(vm_space_t* space, virtual_addr_t addr) {
+    for (uint32_t i = 0; i < space->count; i++) {
+        vma_t* vma = &space->vmas[i];
+        virtual_addr_t low = (vma->flags & VMA_GROWSDOWN) ? vma->limit : vma->start;
+        if (addr >= low && addr < vma->end) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Insert a region in start order unless it overlaps another one
+static bool vm_insert(vm_space_t* space, const vma_t* new_vma) {
+    virtual_addr_t floor = vma_floor(new_vma);
+    if (floor < VM_USER_BASE || new_vma->end > VM_USER_END || floor >= new_vma->end) {
+        return false;
+    }
+    
+    bool inserted = false;
+    unsigned long flags = spin_lock_irqsave(&space->lock);
+    
+    uint32_t at = 0;
+    bool overlaps = false;
+    for (uint32_t i = 0; i < space->count; i++) {
+        vma_t* vma = &space->vmas[i];
+        if (floor < vma->end && vma_floor(vma) < new_vma->end) {
+            overlaps = true;
+            break;
+        }
+        if (vma->start < new_vma->start) {
+            at = i + 1;
+        }
+    }
+    
+    if (!overlaps && space->count < VM_SPACE_MAX_VMAS) {
+        memmove(&space->vmas[at + 1], &space->vmas[at], (space->count - at) * sizeof(vma_t));
+        space->vmas[at] = *new_vma;
+        space->count++;
+        inserted = true;
+    }
+    
+    spin_unlock_irqrestore(&space->lock, flags);
+    return inserted;
+}
+
+// Create an address space with no regions
+vm_space_t* vm_space_create(page_dir_t* dir) {
+    vm_space_t* space = (vm_space_t*)pmm_alloc_zeroed_block();
+    if (!space) {
+        return NULL;
+    }
+    
+    space->directory = dir;
+    spin_init(&space->lock, "vm_space");
+    return space;
+}
+
+// Create an address space with the regions of src
+vm_space_t* vm_space_clone(vm_space_t* src, page_dir_t* dir) {
+    vm_space_t* space = vm_space_create(dir);
+    if (!space || !src) {
+        return space;
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&src->lock);
+    memcpy(space->vmas, src->vmas, src->count * sizeof(vma_t));
+    space->count = src->count;
+    space->resident = src->resident;
+    spin_unlock_irqrestore(&src->lock, flags);
+    return space;
+}
+
+// Free an address space
+void vm_space_destroy(vm_space_t* space) {
+    if (space) {
+        pmm_free_block(space);
+    }
+}
+
+// Reserve a region
+bool vm_map(vm_space_t* space, virtual_addr_t start, uint32_t size, uint32_t flags) {
+    if (!space || !size || PAGE_OFFSET(start) || PAGE_OFFSET(size)) {
+        return false;
+    }
+    
+    vma_t vma = { start, start + size, start, flags & ~VMA_GROWSDOWN };
+    return vm_insert(space, &vma);
+}
+
+// Reserve a stack
+bool vm_map_stack(vm_space_t* space, virtual_addr_t top, uint32_t size, uint32_t max_size, uint32_t flags) {
+    if (!space || !size || size > max_size || PAGE_OFFSET(top) || PAGE_OFFSET(size) ||
+        PAGE_OFFSET(max_size) || max_size + VMA_STACK_GUARD > top) {
+        return false;
+    }
+    
+    vma_t vma = { top - size, top, top - max_size, flags | VMA_GROWSDOWN };
+    return vm_insert(space, &vma);
+}
+
+// Release a region
+bool vm_unmap(vm_space_t* space, virtual_addr_t addr) {
+    if (!space) {
+        return false;
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&space->lock);
+    int index = vm_lookup(space, addr);
+    if (index < 0) {
+        spin_unlock_irqrestore(&space->lock, flags);
+        return false;
+    }
+    
+    vma_t vma = space->vmas[index];
+    space->count--;
+    memmove(&space->vmas[index], &space->vmas[index + 1], (space->count - index) * sizeof(vma_t));
+    spin_unlock_irqrestore(&space->lock, flags);
+    
+    // Free the pages that were touched. The region is gone, so no fault
+    // maps them again; the shootdowns wait for other CPUs and cannot be
+    // done under the lock.
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, space->directory);
+    uint32_t freed = 0;
+    for (virtual_addr_t page = vma.start; page < vma.end; page += PAGE_SIZE) {
+        if (vmm_unmap_page_batch(&batch, page, true)) {
+            freed++;
+        }
+    }
+    vmm_tlb_flush(&batch);
+    
+    flags = spin_lock_irqsave(&space->lock);
+    space->resident -= freed;
+    spin_unlock_irqrestore(&space->lock, flags);
+    return true;
+}
+
+// Resolve a not-present fault
+bool vm_handle_fault(vm_space_t* space, virtual_addr_t addr, bool write) {
+    virtual_addr_t page = addr & ~0xFFF;
+    bool handled = false;
+    
+    unsigned long flags = spin_lock_irqsave(&space->lock);
+    int index = vm_lookup(space, addr);
+    vma_t* vma = index >= 0 ? &space->vmas[index] : NULL;
+    
+    if (vma && (!write || (vma->flags & VMA_WRITE))) {
+        if (vmm_get_mapping(space->directory, page, NULL)) {
+            // Another thread of this address space got here first
+            handled = true;
+        } else {
+            physical_addr_t frame;
+            uint32_t pte = VMM_PRESENT | VMM_USER | ((vma->flags & VMA_WRITE) ? VMM_WRITABLE : 0) |
+                           ((vma->flags & VMA_EXEC) ? 0 : VMM_NX);
+            if (pmm_alloc_zeroed_frame(PAGE_OWNER_PROCESS, &frame)) {
+                handled = vmm_map_page(space->directory, frame, page, pte);
+                if (handled) {
+                    space->resident++;
+                    space->faults++;
+                } else {
+                    pmm_free_frame(frame);
+                }
+            }
+        }
+        
+        // A stack grows to cover the page
+        if (handled && page < vma->start) {
+            vma->start = page;
+        }
+    }
+    
+    spin_unlock_irqrestore(&space->lock, flags);
+    return handled;
+}
+
+// Look up a region
+bool vm_find(vm_space_t* space, virtual_addr_t addr, vma_t* vma) {
+    if (!space) {
+        return false;
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&space->lock);
+    int index = vm_lookup(space, addr);
+    if (index >= 0 && vma) {
+        *vma = space->vmas[index];
+    }
+    spin_unlock_irqrestore(&space->lock, flags);
+    return index >= 0;
+}
@@ -0,0 +1,71 @@
+#ifndef REXUS_VMA_H
+#define REXUS_VMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vmm.h"
+#include "../core/spinlock.h"
+
+// Region flags
+#define VMA_READ       0x01
+#define VMA_WRITE      0x02
+#define VMA_GROWSDOWN  0x04    // Stack: grows down on faults below it, to its limit
+#define VMA_EXEC       0x08    // Code may run from it (others are NX where supported)
+
+// Part of the address space regions may be placed in. Below it are the
+// kernel's identity-mapped tables, above it the higher half.
+#define VM_USER_BASE 0x40000000
+#define VM_USER_END  0xC0000000
+
+// Regions per address space (the space fits in one page)
+#define VM_SPACE_MAX_VMAS 128
+
+// Unmapped gap kept below every stack's limit, so an overflowing stack
+// faults instead of running into the region underneath
+#define VMA_STACK_GUARD PAGE_SIZE
+
+// A reserved region of virtual memory. Its pages are user pages
+// allocated and zeroed on first touch, from high memory if there is any.
+typedef struct {
+    virtual_addr_t start;           // First byte
+    virtual_addr_t end;             // One past the last byte
+    virtual_addr_t limit;           // Lowest start of a VMA_GROWSDOWN region
+    uint32_t flags;                 // VMA_*
+} vma_t;
+
+// An address space: a page directory and the regions reserved in it
+typedef struct vm_space {
+    page_dir_t* directory;
+    spinlock_t lock;
+    uint32_t count;                 // Regions in use, sorted by start
+    uint32_t resident;              // Pages faulted in and still mapped
+    uint32_t faults;                // Demand faults resolved
+    vma_t vmas[VM_SPACE_MAX_VMAS];
+} vm_space_t;
+
+// Create an empty space for a directory, or one with the regions of src
+// for a directory cloned from src's (the pages are shared copy-on-write)
+vm_space_t* vm_space_create(page_dir_t* dir);
+vm_space_t* vm_space_clone(vm_space_t* src, page_dir_t* dir);
+
+// Free a space. Its pages go with the directory (vmm_free_directory).
+void vm_space_destroy(vm_space_t* space);
+
+// Reserve [start, start + size) without allocating any memory
+bool vm_map(vm_space_t* space, virtual_addr_t start, uint32_t size, uint32_t flags);
+
+// Reserve a stack below top: size bytes at first, growing on demand to
+// max_size, with a guard gap below that
+bool vm_map_stack(vm_space_t* space, virtual_addr_t top, uint32_t size, uint32_t max_size, uint32_t flags);
+
+// Release the region containing addr and free its pages
+bool vm_unmap(vm_space_t* space, virtual_addr_t addr);
+
+// Not-present fault at addr: back it with a zeroed page if it lies in a
+// region allowing the access. Returns false for a real fault.
+bool vm_handle_fault(vm_space_t* space, virtual_addr_t addr, bool write);
+
+// Region containing addr, copied to vma; false if there is none
+bool vm_find(vm_space_t* space, virtual_addr_t addr, vma_t* vma);
+
+#endif /* REXUS_VMA_H */
@@ -1,33 +1,335 @@
 #include "vmm.h"
 #include "pmm.h"
+#include "vma.h"
 #include "../arch/x86/isr.h"
+#include "../arch/x86/cpu.h"
+#include "../arch/x86/smp.h"
+#include "../core/spinlock.h"
 #include "../drivers/vga.h"
 #include <string.h>
 
+// Paging mode, fixed by vmm_init before the first directory is made.
+// Both modes are handled as two levels under CR3: in PAE mode the four
+// page directories are allocated together and indexed as one of 2048
+// entries, with the PDPT in the page after them.
+static bool vmm_pae = false;
+static bool vmm_nx = false;
+static bool vmm_pat = false;
+static uint32_t vmm_dir_shift = 22;             // Address bits below a directory entry
+static uint32_t vmm_table_entries = 1024;
+static uint64_t vmm_frame_mask = 0xFFFFF000;    // Frame address bits of an entry
+
+#define VMM_ENTRY_NX        (1ull << 63)
+#define VMM_DIR_ENTRIES     (1u << (32 - vmm_dir_shift))
+#define VMM_DIR_PAGES       (vmm_pae ? 5u : 1u)
+#define VMM_DIR_INDEX(x)    ((x) >> vmm_dir_shift)
+#define VMM_TABLE_INDEX(x)  (((x) >> 12) & (vmm_table_entries - 1))
+
+// Large pages: a directory entry with VMM_PAGE_SIZE maps 4MB, or 2MB
+// with PAE, directly
+#define VMM_LARGE_PAGE      (1u << vmm_dir_shift)
+#define VMM_LARGE_OFFSET(x) ((x) & (VMM_LARGE_PAGE - 1))
+
+// Recursive mapping: the last directory entries (one, or four with
+// PAE) point at the directory's own pages, so table i of the loaded
+// directory appears at VMM_CURRENT_TABLE(i) and the directory itself
+// at VMM_CURRENT_DIRECTORY
+#define VMM_RECURSIVE_FIRST   (VMM_DIR_ENTRIES - (vmm_pae ? 4 : 1))
+#define VMM_CURRENT_TABLE(i)  ((void*)((VMM_RECURSIVE_FIRST << vmm_dir_shift) + (i) * PAGE_SIZE))
+#define VMM_CURRENT_DIRECTORY VMM_CURRENT_TABLE(VMM_RECURSIVE_FIRST)
+
 // The kernel's page directory
 static page_dir_t* kernel_directory = NULL;
 
 // Current page directory
 static page_dir_t* current_directory = NULL;
 
+// Serializes copy-on-write state: the write-protected entries of shared
+// pages and the reference counts of the frames and tables behind them
+static spinlock_t vmm_cow_lock = SPINLOCK_INIT("vmm_cow");
+
+// Kernel stacks live in a higher-half area whose page tables exist from
+// boot, so every directory shares them. Each slot has its stack at the
+// top and at least one unmapped page below, which faults on overflow.
+// A freed slot keeps its pages mapped for the next stack, so no other
+// CPU can be left with a stale TLB entry for it.
+#define VMM_KSTACK_BASE  (VMM_PHYS_OFFSET + VMM_DIRECT_MAP_SIZE)
+#define VMM_KSTACK_SLOT  (32 * 1024)
+#define VMM_KSTACK_SLOTS 256
+static uint32_t vmm_kstack_used[VMM_KSTACK_SLOTS / 32];
+static uint8_t vmm_kstack_pages[VMM_KSTACK_SLOTS];
+static spinlock_t vmm_kstack_lock = SPINLOCK_INIT("vmm_kstack");
+
+// One vmm_kmap slot per CPU after the kernel stacks, in a page table
+// made at boot like theirs
+#define VMM_KMAP_BASE (VMM_KSTACK_BASE + VMM_KSTACK_SLOTS * VMM_KSTACK_SLOT)
+static void* vmm_kmap_table = NULL;
+
+// The TLB shootdown in progress: one at a time, the initiator waits
+// for every CPU in pending to flush batch and clear its bit
+static spinlock_t vmm_shootdown_lock = SPINLOCK_INIT("vmm_shootdown");
+static struct {
+    const vmm_tlb_batch_t* batch;
+    uint32_t pending;
+} vmm_shootdown;
+
+static vmm_tlb_stats_t vmm_tlb_stats;
+
 // Forward declarations for assembly functions
-extern void enable_paging(physical_addr_t page_dir);
-extern void load_page_directory(physical_addr_t page_dir);
+extern void enable_paging(uint32_t cr3);
+extern void load_page_directory(uint32_t cr3);
+extern void enter_pae(uint32_t cr3);
+
+// Entry i of a directory or table
+static inline uint64_t vmm_entry_get(const void* table, uint32_t i) {
+    if (vmm_pae) {
+        return ((const volatile uint64_t*)table)[i];
+    }
+    return ((const volatile uint32_t*)table)[i];
+}
+
+// Set entry i of a directory or table. The MMU reads a PAE entry in
+// two halves while it may be changing, so a present entry never pairs
+// with the high half of another: if that half changes, the entry goes
+// not present first.
+static inline void vmm_entry_set(void* table, uint32_t i, uint64_t entry) {
+    if (!vmm_pae) {
+        ((volatile uint32_t*)table)[i] = (uint32_t)entry;
+        return;
+    }
+    
+    volatile uint32_t* half = (volatile uint32_t*)table + i * 2;
+    if (half[1] != (uint32_t)(entry >> 32)) {
+        half[0] = 0;
+        half[1] = (uint32_t)(entry >> 32);
+    }
+    half[0] = (uint32_t)entry;
+}
+
+// Entry mapping phys with VMM_* flags
+static inline uint64_t vmm_make_entry(physical_addr_t phys, uint32_t flags) {
+    uint64_t entry = (phys & vmm_frame_mask) | (flags & 0xFFF);
+    if ((flags & VMM_NX) && vmm_nx) {
+        entry |= VMM_ENTRY_NX;
+    }
+    return entry & ~(uint64_t)VMM_NX;
+}
+
+// Frame of a large page entry
+static inline physical_addr_t vmm_large_frame(uint64_t pde) {
+    return pde & vmm_frame_mask & ~(uint64_t)(VMM_LARGE_PAGE - 1);
+}
+
+// Directory loaded on this CPU
+static page_dir_t* vmm_loaded_directory(void) {
+    return (page_dir_t*)phys_to_virt((read_cr3() & ~0xFFF) - (vmm_pae ? 4 * PAGE_SIZE : 0));
+}
 
 // Flush the TLB entry for a virtual address
 void vmm_flush_tlb_entry(virtual_addr_t addr) {
     __asm__ volatile("invlpg (%0)" : : "r" (addr) : "memory");
 }
 
+// Start an empty batch for changes to dir
+void vmm_tlb_batch_init(vmm_tlb_batch_t* batch, page_dir_t* dir) {
+    batch->directory = dir;
+    batch->cr3 = vmm_get_cr3(dir);
+    batch->shared = false;
+    batch->full = false;
+    batch->count = 0;
+    batch->frame_count = 0;
+}
+
+// Queue a page whose entry changed
+static void vmm_tlb_batch_add(vmm_tlb_batch_t* batch, virtual_addr_t virt) {
+    // Outside user space the tables are shared by every directory
+    if (virt < VM_USER_BASE || virt >= VM_USER_END) {
+        batch->shared = true;
+    }
+    
+    if (batch->count < VMM_TLB_BATCH_PAGES) {
+        batch->pages[batch->count++] = virt;
+    } else {
+        batch->full = true;
+    }
+}
+
+// Flush a batch's pages from this CPU's TLB
+static void vmm_tlb_flush_local(const vmm_tlb_batch_t* batch) {
+    if (batch->full) {
+        write_cr3(read_cr3());
+    } else {
+        for (uint32_t i = 0; i < batch->count; i++) {
+            vmm_flush_tlb_entry(batch->pages[i]);
+        }
+    }
+}
+
+// Do this CPU's part of the shootdown in progress, if it has one
+static void vmm_tlb_shootdown_poll(void) {
+    uint32_t self = 1u << cpu_id();
+    if (__atomic_load_n(&vmm_shootdown.pending, __ATOMIC_ACQUIRE) & self) {
+        vmm_tlb_flush_local(vmm_shootdown.batch);
+        __atomic_fetch_and(&vmm_shootdown.pending, ~self, __ATOMIC_RELEASE);
+    }
+}
+
+// Shootdown IPI
+void vmm_tlb_shootdown_interrupt(void) {
+    vmm_tlb_shootdown_poll();
+}
+
+// Flush a batch on every CPU that may cache its entries, then free the
+// frames queued on it and empty it
+void vmm_tlb_flush(vmm_tlb_batch_t* batch) {
+    if (batch->count || batch->full) {
+        unsigned long flags = irq_save();
+        
+        // CPUs that load the directory after this see the new entries;
+        // the ones that had it loaded before are in the mask
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint32_t self = 1u << cpu_id();
+        uint32_t targets = 0;
+        for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+            if (batch->shared || __atomic_load_n(&cpus[i].cr3, __ATOMIC_RELAXED) == batch->cr3) {
+                targets |= 1u << i;
+            }
+        }
+        
+        if (targets & self) {
+            vmm_tlb_flush_local(batch);
+        }
+        targets &= ~self;
+        
+        if (targets) {
+            // Keep answering other shootdowns while waiting for ours
+            while (!spin_trylock(&vmm_shootdown_lock)) {
+                vmm_tlb_shootdown_poll();
+                __builtin_ia32_pause();
+            }
+            vmm_shootdown.batch = batch;
+            __atomic_store_n(&vmm_shootdown.pending, targets, __ATOMIC_RELEASE);
+            uint32_t ipis = smp_send_tlb_shootdown(targets);
+            while (__atomic_load_n(&vmm_shootdown.pending, __ATOMIC_ACQUIRE)) {
+                __builtin_ia32_pause();
+            }
+            spin_unlock(&vmm_shootdown_lock);
+            
+            __atomic_fetch_add(&vmm_tlb_stats.shootdowns, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&vmm_tlb_stats.ipis, ipis, __ATOMIC_RELAXED);
+        }
+        irq_restore(flags);
+        
+        __atomic_fetch_add(&vmm_tlb_stats.flushes, 1, __ATOMIC_RELAXED);
+        if (batch->full) {
+            __atomic_fetch_add(&vmm_tlb_stats.full_flushes, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&vmm_tlb_stats.pages, batch->count, __ATOMIC_RELAXED);
+        }
+    }
+    
+    // No TLB maps the frames any more
+    for (uint32_t i = 0; i < batch->frame_count; i++) {
+        pmm_free_frame(batch->frames[i]);
+    }
+    
+    batch->shared = false;
+    batch->full = false;
+    batch->count = 0;
+    batch->frame_count = 0;
+}
+
+// TLB flush statistics
+void vmm_get_tlb_stats(vmm_tlb_stats_t* stats) {
+    stats->flushes = __atomic_load_n(&vmm_tlb_stats.flushes, __ATOMIC_RELAXED);
+    stats->full_flushes = __atomic_load_n(&vmm_tlb_stats.full_flushes, __ATOMIC_RELAXED);
+    stats->pages = __atomic_load_n(&vmm_tlb_stats.pages, __ATOMIC_RELAXED);
+    stats->shootdowns = __atomic_load_n(&vmm_tlb_stats.shootdowns, __ATOMIC_RELAXED);
+    stats->ipis = __atomic_load_n(&vmm_tlb_stats.ipis, __ATOMIC_RELAXED);
+}
+
+// Give the current address space a private, writable copy of a
+// copy-on-write page. Returns false if the page is not copy-on-write or
+// no frame is left for the copy.
+static bool vmm_handle_cow(virtual_addr_t virt) {
+    // The loaded directory's tables, through the recursive mapping
+    uint32_t pdidx = VMM_DIR_INDEX(virt);
+    uint32_t ptidx = VMM_TABLE_INDEX(virt);
+    uint64_t pde = vmm_entry_get(VMM_CURRENT_DIRECTORY, pdidx);
+    bool resolved = false;
+    
+    // Other CPUs running this address space may still map the old frame
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, vmm_loaded_directory());
+    
+    unsigned long flags = spin_lock_irqsave(&vmm_cow_lock);
+    void* table = NULL;
+    uint64_t entry = 0;
+    if ((pde & VMM_PRESENT) && !(pde & VMM_PAGE_SIZE)) {
+        table = VMM_CURRENT_TABLE(pdidx);
+        entry = vmm_entry_get(table, ptidx);
+    }
+    
+    if ((entry & VMM_PRESENT) && (entry & VMM_WRITABLE)) {
+        // Another thread of this address space got here first
+        resolved = true;
+    } else if ((entry & VMM_PRESENT) && (entry & VMM_COW)) {
+        physical_addr_t frame = entry & vmm_frame_mask;
+        
+        // The last sharer keeps the frame; the others copy it and drop
+        // their reference once no TLB maps the old frame
+        if (pmm_get_frame_refs(frame) > 1) {
+            physical_addr_t copy;
+            resolved = pmm_alloc_frame(PAGE_OWNER_PROCESS, &copy);
+            if (resolved) {
+                void* dest = vmm_kmap(copy);
+                memcpy(dest, (void*)(virt & ~0xFFF), PAGE_SIZE);
+                vmm_kunmap(dest);
+                batch.frames[batch.frame_count++] = frame;
+                vmm_tlb_batch_add(&batch, virt);
+                frame = copy;
+            }
+        } else {
+            resolved = true;
+        }
+        
+        if (resolved) {
+            vmm_entry_set(table, ptidx, (entry & ~vmm_frame_mask & ~(uint64_t)VMM_COW) | frame | VMM_WRITABLE);
+        }
+    }
+    
+    // A write permission added needs no shootdown: a CPU still holding
+    // the read-only entry faults and finds the page writable
+    if (resolved) {
+        vmm_flush_tlb_entry(virt);
+    }
+    spin_unlock_irqrestore(&vmm_cow_lock, flags);
+    
+    vmm_tlb_flush(&batch);
+    return resolved;
+}
+
 // Page fault handler
 static void page_fault(registers_t* regs) {
     uint32_t fault_addr;
     __asm__ volatile("mov %%cr2, %0" : "=r" (fault_addr));
     
+    // A write to a present page may be a copy-on-write share
+    if ((regs->err_code & 0x3) == 0x3 && vmm_handle_cow(fault_addr)) {
+        return;
+    }
+    
+    // A missing page may be reserved for demand paging
+    vm_space_t* space = this_cpu()->vm_space;
+    if (!(regs->err_code & 0x1) && space && vm_handle_fault(space, fault_addr, regs->err_code & 0x2)) {
+        return;
+    }
+    
     int present = !(regs->err_code & 0x1);
     int rw = regs->err_code & 0x2;
     int us = regs->err_code & 0x4;
     int reserved = regs->err_code & 0x8;
+    int fetch = regs->err_code & 0x10;
     
     vga_puts("PAGE FAULT at 0x");
     vga_puthex(fault_addr);
@@ -37,6 +339,7 @@ static void page_fault(registers_t* regs) {
     if (rw) vga_puts("read-only ");
     if (us) vga_puts("user-mode ");
     if (reserved) vga_puts("reserved ");
+    if (fetch) vga_puts("instruction-fetch ");
     
     vga_puts(")\n");
     
@@ -45,38 +348,77 @@ static void page_fault(registers_t* regs) {
     }
 }
 
-// Get a page table from a directory
-page_table_t* vmm_get_page_table(page_dir_t* dir, uint32_t idx, bool allocate) {
-    if (idx >= 1024) {
+// Get the page table behind directory entry idx
+static void* vmm_get_page_table(page_dir_t* dir, uint32_t idx, bool allocate) {
+    if (idx >= VMM_DIR_ENTRIES) {
         return NULL;
     }
     
-    if (dir->entries[idx] & VMM_PRESENT) {
+    uint64_t pde = vmm_entry_get(dir, idx);
+    if (pde & VMM_PAGE_SIZE) {
+        // A large page, not a table
+        return NULL;
+    } else if (pde & VMM_PRESENT) {
         // Page table already exists
-        return (page_table_t*)(dir->entries[idx] & ~0xFFF);
+        return phys_to_virt(pde & vmm_frame_mask);
     } else if (allocate) {
-        // Allocate a new page table
-        void* page_table = pmm_alloc_block();
+        // Allocate a new, empty page table
+        void* page_table = pmm_alloc_zeroed_block_for(PAGE_OWNER_PAGETABLE);
         if (page_table == NULL) {
             return NULL;
         }
         
-        // Clear the table
-        memset(page_table, 0, sizeof(page_table_t));
-        
         // Add it to the directory
-        dir->entries[idx] = ((uint32_t)page_table) | VMM_PRESENT | VMM_WRITABLE | VMM_USER;
+        vmm_entry_set(dir, idx, vmm_make_entry(virt_to_phys(page_table), VMM_PRESENT | VMM_WRITABLE | VMM_USER));
         
-        return (page_table_t*)page_table;
+        return page_table;
     }
     
     return NULL;
 }
 
+// Turn on PAE paging with dir loaded. CR4.PAE only changes with paging
+// off, so enter_pae runs from its load address in the .boot section:
+// the kernel directory identity-maps it, and the boot directory, still
+// loaded and never used again, does for the moment too.
+static void vmm_enter_pae(page_dir_t* dir) {
+    uint32_t* boot_directory = (uint32_t*)phys_to_virt(read_cr3() & ~0xFFF);
+    unsigned long flags = irq_save();
+    boot_directory[0] = VMM_PRESENT | VMM_WRITABLE | VMM_PAGE_SIZE;
+    enter_pae(vmm_get_cr3(dir));
+    irq_restore(flags);
+}
+
 // Initialize virtual memory
-void vmm_init(void) {
+void vmm_init(bool allow_pae) {
     // Register page fault handler
     isr_register_handler(14, page_fault);
+    lock_stats_register(&vmm_cow_lock.stats);
+    lock_stats_register(&vmm_shootdown_lock.stats);
+    
+    // PAE doubles the size of every entry, so it is only worth it for
+    // memory above 4GB or for NX
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    bool has_pae = edx & (1u << 6);
+    bool has_nx = false;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+        has_nx = edx & (1u << 20);
+    }
+    uint32_t unmapped_mb, high_mb;
+    pmm_get_unmanaged(&unmapped_mb, &high_mb);
+    if (allow_pae && has_pae && (high_mb || has_nx)) {
+        vmm_pae = true;
+        vmm_nx = has_nx;
+        vmm_dir_shift = 21;
+        vmm_table_entries = 512;
+        vmm_frame_mask = 0x000FFFFFFFFFF000ull;
+    }
+    if (vmm_nx) {
+        wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    }
     
     // Create kernel page directory
     kernel_directory = vmm_create_directory();
@@ -85,111 +427,327 @@ void vmm_init(void) {
         return;
     }
     
-    // Identity map the first 4MB (kernel space)
-    // This is already done by boot.asm for startup, but now we need to
-    // properly set it up in our page directory
-    vmm_identity_map(kernel_directory, 0, 4 * 1024 * 1024, VMM_PRESENT | VMM_WRITABLE);
+    // Identity map low memory; large pages cover most of it
+    vmm_identity_map(kernel_directory, 0, VMM_IDENTITY_MAP_SIZE, VMM_PRESENT | VMM_WRITABLE);
     
-    // Identity map the memory where kernel is loaded (typically 1MB+)
-    vmm_identity_map(kernel_directory, 1 * 1024 * 1024, 10 * 1024 * 1024, VMM_PRESENT | VMM_WRITABLE);
-    
-    // Map kernel to higher half (3GB+)
-    for (uint32_t i = 0; i < 10 * 1024 * 1024; i += PAGE_SIZE) {
-        vmm_map_page(kernel_directory, i, i + 0xC0000000, VMM_PRESENT | VMM_WRITABLE);
+    // Map all memory at 3GB+ (the direct map, which holds the kernel
+    // image), in whole large pages
+    uint32_t direct = (pmm_get_memory_size() + VMM_LARGE_PAGE - 1) & ~(VMM_LARGE_PAGE - 1);
+    if (direct < 12 * 1024 * 1024) {
+        direct = 12 * 1024 * 1024;
+    }
+    if (direct > VMM_DIRECT_MAP_SIZE) {
+        direct = VMM_DIRECT_MAP_SIZE;
     }
+    vmm_map_range(kernel_directory, 0, VMM_PHYS_OFFSET, direct, VMM_PRESENT | VMM_WRITABLE);
+    
+    // Page tables for the kernel stack area and the kmap slots, before
+    // any directory is cloned
+    lock_stats_register(&vmm_kstack_lock.stats);
+    vmm_reserve_kernel_tables(VMM_KSTACK_BASE, VMM_KSTACK_SLOTS * VMM_KSTACK_SLOT);
+    vmm_kmap_table = vmm_get_page_table(kernel_directory, VMM_DIR_INDEX(VMM_KMAP_BASE), true);
     
     // Switch to the kernel directory
+    if (vmm_pae) {
+        vmm_enter_pae(kernel_directory);
+    }
     vmm_switch_page_directory(kernel_directory);
     
-    vga_puts("VMM: Initialized virtual memory manager\n");
+    // Make kernel writes to copy-on-write pages fault too
+    write_cr0(read_cr0() | CR0_WP);
+    vmm_init_pat();
+    
+    // Frames past the direct map, which only page tables reach
+    pmm_init_high(vmm_pae);
+    
+    vga_puts("VMM: Initialized virtual memory manager, ");
+    vga_puts(vmm_pae ? (vmm_nx ? "PAE paging with NX\n" : "PAE paging\n") : "32-bit paging\n");
+}
+
+// Paging mode
+bool vmm_pae_enabled(void) {
+    return vmm_pae;
+}
+
+bool vmm_nx_enabled(void) {
+    return vmm_nx;
+}
+
+uint32_t vmm_get_large_page_size(void) {
+    return VMM_LARGE_PAGE;
+}
+
+// Make PAT entry 1 write-combining; the other entries keep their reset
+// values (0 write-back, 2 UC-, 3 uncached). Nothing maps pages with PWT
+// alone before this, so no cached line can have the old type.
+void vmm_init_pat(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1u << 16))) {
+        return;
+    }
+    
+    unsigned long flags = irq_save();
+    __asm__ volatile("wbinvd" : : : "memory");
+    wrmsr(MSR_PAT, 0x0007040600070106ull);
+    write_cr3(read_cr3());
+    irq_restore(flags);
+    vmm_pat = true;
+}
+
+// Entry flags selecting a memory type
+uint32_t vmm_get_cache_flags(vmm_cache_t type) {
+    switch (type) {
+        case VMM_CACHE_UNCACHED:
+            return VMM_CACHE_DISABLE | VMM_WRITE_THROUGH;
+        case VMM_CACHE_WRITE_COMBINE:
+            return vmm_pat ? VMM_WRITE_THROUGH : VMM_CACHE_DISABLE | VMM_WRITE_THROUGH;
+        default:
+            return 0;
+    }
+}
+
+// Replace a large page of the kernel directory by a table of 4KB pages
+// with the same frames and flags
+static bool vmm_split_large_page(uint32_t idx) {
+    uint64_t pde = vmm_entry_get(kernel_directory, idx);
+    void* table = pmm_alloc_block_for(PAGE_OWNER_PAGETABLE);
+    if (!table) {
+        return false;
+    }
+    
+    // Bit 7 is PAT in a 4KB entry, not the page size
+    uint64_t flags = (pde & 0xFFF & ~(uint64_t)VMM_PAGE_SIZE) | (pde & VMM_ENTRY_NX);
+    for (uint32_t j = 0; j < vmm_table_entries; j++) {
+        vmm_entry_set(table, j, (vmm_large_frame(pde) + j * PAGE_SIZE) | flags);
+    }
+    vmm_entry_set(kernel_directory, idx, vmm_make_entry(virt_to_phys(table), VMM_PRESENT | VMM_WRITABLE));
+    return true;
+}
+
+// Page tables for a kernel area
+bool vmm_reserve_kernel_tables(virtual_addr_t start, uint32_t size) {
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, kernel_directory);
+    
+    bool ok = true;
+    for (virtual_addr_t virt = start; virt < start + size && ok; virt = (virt & ~(VMM_LARGE_PAGE - 1)) + VMM_LARGE_PAGE) {
+        uint32_t idx = VMM_DIR_INDEX(virt);
+        if (vmm_entry_get(kernel_directory, idx) & VMM_PAGE_SIZE) {
+            ok = vmm_split_large_page(idx);
+            batch.shared = true;
+            batch.full = true;
+        } else {
+            ok = vmm_get_page_table(kernel_directory, idx, true) != NULL;
+        }
+    }
+    
+    // A change of page size needs the whole TLB flushed
+    vmm_tlb_flush(&batch);
+    return ok;
+}
+
+// Set the memory type of kernel pages
+bool vmm_set_kernel_cache(virtual_addr_t start, uint32_t size, vmm_cache_t type) {
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, kernel_directory);
+    
+    bool ok = true;
+    for (virtual_addr_t virt = start & ~0xFFF; virt < start + size && ok; virt += PAGE_SIZE) {
+        void* table = vmm_get_page_table(kernel_directory, VMM_DIR_INDEX(virt), false);
+        uint64_t entry = table ? vmm_entry_get(table, VMM_TABLE_INDEX(virt)) : 0;
+        ok = entry & VMM_PRESENT;
+        if (ok) {
+            // Bit 7 (the PAT bit of a 4KB entry) stays clear
+            entry &= ~(uint64_t)(VMM_WRITE_THROUGH | VMM_CACHE_DISABLE | VMM_PAGE_SIZE);
+            vmm_entry_set(table, VMM_TABLE_INDEX(virt), entry | vmm_get_cache_flags(type));
+            vmm_tlb_batch_add(&batch, virt);
+        }
+    }
+    
+    vmm_tlb_flush(&batch);
+    return ok;
 }
 
 // Create a new page directory
 page_dir_t* vmm_create_directory(void) {
-    page_dir_t* dir = (page_dir_t*)pmm_alloc_block();
+    // A single page comes cleared; the PAE directory has to be cleared here
+    uint8_t* dir;
+    if (VMM_DIR_PAGES == 1) {
+        dir = (uint8_t*)pmm_alloc_zeroed_block_for(PAGE_OWNER_PAGETABLE);
+    } else {
+        dir = (uint8_t*)pmm_alloc_blocks_for(VMM_DIR_PAGES, PAGE_OWNER_PAGETABLE);
+        if (dir) {
+            memset(dir, 0, VMM_DIR_PAGES * PAGE_SIZE);
+        }
+    }
     if (!dir) {
         return NULL;
     }
     
-    // Clear the directory
-    memset(dir, 0, sizeof(page_dir_t));
+    // The PDPT points at the four directories. Its entries take no
+    // other flags, and the CPU reads them only when CR3 is loaded.
+    if (vmm_pae) {
+        uint64_t* pdpt = (uint64_t*)(dir + 4 * PAGE_SIZE);
+        for (uint32_t i = 0; i < 4; i++) {
+            pdpt[i] = (virt_to_phys(dir) + i * PAGE_SIZE) | VMM_PRESENT;
+        }
+    }
+    
+    // Map the directory into itself
+    for (uint32_t i = VMM_RECURSIVE_FIRST; i < VMM_DIR_ENTRIES; i++) {
+        physical_addr_t page = virt_to_phys(dir) + (i - VMM_RECURSIVE_FIRST) * PAGE_SIZE;
+        vmm_entry_set(dir, i, vmm_make_entry(page, VMM_PRESENT | VMM_WRITABLE));
+    }
     
-    return dir;
+    return (page_dir_t*)dir;
 }
 
-// Map a physical page to a virtual address
-bool vmm_map_page(page_dir_t* dir, physical_addr_t phys, virtual_addr_t virt, uint32_t flags) {
+// Map a physical page to a virtual address, queueing a flush on batch
+// if the entry replaced was present. With VMM_PAGE_SIZE in flags this
+// maps a large page; both addresses must then be aligned to it and the
+// directory slot must not hold a page table.
+static bool vmm_map_page_batch(vmm_tlb_batch_t* batch, page_dir_t* dir, physical_addr_t phys,
+                               virtual_addr_t virt, uint32_t flags) {
+    // Beyond what the paging mode can address
+    if (phys & ~(vmm_frame_mask | 0xFFF)) {
+        return false;
+    }
+    
+    uint32_t pdidx = VMM_DIR_INDEX(virt);
+    uint64_t pde = vmm_entry_get(dir, pdidx);
+    
+    if (flags & VMM_PAGE_SIZE) {
+        if (VMM_LARGE_OFFSET(phys) || VMM_LARGE_OFFSET(virt) ||
+            ((pde & VMM_PRESENT) && !(pde & VMM_PAGE_SIZE))) {
+            return false;
+        }
+        
+        if (pde & VMM_PRESENT) {
+            vmm_tlb_batch_add(batch, virt);
+        }
+        vmm_entry_set(dir, pdidx, vmm_make_entry(phys, flags));
+        return true;
+    }
+    
     // Make sure addresses are page-aligned
-    phys &= ~0xFFF;
+    phys &= ~0xFFFull;
     virt &= ~0xFFF;
+    uint32_t ptidx = VMM_TABLE_INDEX(virt);
     
-    uint32_t pdidx = PAGE_DIR_INDEX(virt);
-    uint32_t ptidx = PAGE_TABLE_INDEX(virt);
+    // A large page already mapping phys there will do
+    if (pde & VMM_PAGE_SIZE) {
+        return vmm_large_frame(pde) + VMM_LARGE_OFFSET(virt) == phys;
+    }
     
     // Get the page table, create if not exists
-    page_table_t* table = vmm_get_page_table(dir, pdidx, true);
+    void* table = vmm_get_page_table(dir, pdidx, true);
     if (!table) {
         return false;
     }
     
-    // Set up the page table entry
-    table->entries[ptidx] = phys | (flags & 0xFFF);
-    
-    // Flush TLB for this address if it's in the current directory
-    if (dir == current_directory) {
-        vmm_flush_tlb_entry(virt);
+    // Set up the page table entry. Not-present entries are never cached,
+    // so only replacing a present one needs a flush.
+    if (vmm_entry_get(table, ptidx) & VMM_PRESENT) {
+        vmm_tlb_batch_add(batch, virt);
     }
+    vmm_entry_set(table, ptidx, vmm_make_entry(phys, flags));
     
     return true;
 }
 
-// Unmap a virtual address
-bool vmm_unmap_page(page_dir_t* dir, virtual_addr_t virt) {
-    uint32_t pdidx = PAGE_DIR_INDEX(virt);
-    uint32_t ptidx = PAGE_TABLE_INDEX(virt);
+// Map a physical page to a virtual address
+bool vmm_map_page(page_dir_t* dir, physical_addr_t phys, virtual_addr_t virt, uint32_t flags) {
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, dir);
+    bool mapped = vmm_map_page_batch(&batch, dir, phys, virt, flags);
+    vmm_tlb_flush(&batch);
+    return mapped;
+}
+
+// Unmap a virtual address through a batch. A large page goes as a
+// whole; free_frame only applies to 4KB pages.
+bool vmm_unmap_page_batch(vmm_tlb_batch_t* batch, virtual_addr_t virt, bool free_frame) {
+    page_dir_t* dir = batch->directory;
+    uint32_t pdidx = VMM_DIR_INDEX(virt);
+    uint32_t ptidx = VMM_TABLE_INDEX(virt);
+    
+    if (vmm_entry_get(dir, pdidx) & VMM_PAGE_SIZE) {
+        vmm_entry_set(dir, pdidx, 0);
+        vmm_tlb_batch_add(batch, virt);
+        return true;
+    }
     
     // Get the page table
-    page_table_t* table = vmm_get_page_table(dir, pdidx, false);
-    if (!table) {
+    void* table = vmm_get_page_table(dir, pdidx, false);
+    if (!table || !(vmm_entry_get(table, ptidx) & VMM_PRESENT)) {
         return false;
     }
     
     // Clear the entry
-    table->entries[ptidx] = 0;
+    physical_addr_t frame = vmm_entry_get(table, ptidx) & vmm_frame_mask;
+    vmm_entry_set(table, ptidx, 0);
+    vmm_tlb_batch_add(batch, virt);
     
-    // Flush TLB for this address if it's in the current directory
-    if (dir == current_directory) {
-        vmm_flush_tlb_entry(virt);
+    // The frame is freed once no TLB maps it; a full list is flushed early
+    if (free_frame) {
+        if (batch->frame_count == VMM_TLB_BATCH_PAGES) {
+            vmm_tlb_flush(batch);
+        }
+        batch->frames[batch->frame_count++] = frame;
     }
     
     return true;
 }
 
+// Unmap a virtual address
+bool vmm_unmap_page(page_dir_t* dir, virtual_addr_t virt) {
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, dir);
+    bool unmapped = vmm_unmap_page_batch(&batch, virt, false);
+    vmm_tlb_flush(&batch);
+    return unmapped;
+}
+
 // Get physical address from virtual address
 bool vmm_get_mapping(page_dir_t* dir, virtual_addr_t virt, physical_addr_t* phys) {
-    uint32_t pdidx = PAGE_DIR_INDEX(virt);
-    uint32_t ptidx = PAGE_TABLE_INDEX(virt);
+    uint32_t pdidx = VMM_DIR_INDEX(virt);
+    uint32_t ptidx = VMM_TABLE_INDEX(virt);
     uint32_t offset = PAGE_OFFSET(virt);
     
+    uint64_t pde = vmm_entry_get(dir, pdidx);
+    if (pde & VMM_PAGE_SIZE) {
+        if (phys) {
+            *phys = vmm_large_frame(pde) + VMM_LARGE_OFFSET(virt);
+        }
+        return true;
+    }
+    
     // Get the page table
-    page_table_t* table = vmm_get_page_table(dir, pdidx, false);
+    void* table = vmm_get_page_table(dir, pdidx, false);
     if (!table) {
         return false;
     }
     
     // Check if the page is present
-    if (!(table->entries[ptidx] & VMM_PRESENT)) {
+    uint64_t entry = vmm_entry_get(table, ptidx);
+    if (!(entry & VMM_PRESENT)) {
         return false;
     }
     
     // Get the physical address
     if (phys) {
-        *phys = (table->entries[ptidx] & ~0xFFF) + offset;
+        *phys = (entry & vmm_frame_mask) + offset;
     }
     
     return true;
 }
 
+// Value of CR3 that loads a directory: the PDPT with PAE
+uint32_t vmm_get_cr3(page_dir_t* dir) {
+    return (uint32_t)virt_to_phys(dir) + (vmm_pae ? 4 * PAGE_SIZE : 0);
+}
+
 // Switch to a page directory
 void vmm_switch_page_directory(page_dir_t* dir) {
     if (!dir) {
@@ -198,8 +756,10 @@ void vmm_switch_page_directory(page_dir_t* dir) {
     
     current_directory = dir;
     
-    // Load the page directory
-    load_page_directory((physical_addr_t)dir);
+    // Load the page directory. Shootdowns go to this CPU from the time
+    // its CR3 field names the directory.
+    __atomic_store_n(&this_cpu()->cr3, vmm_get_cr3(dir), __ATOMIC_SEQ_CST);
+    load_page_directory(vmm_get_cr3(dir));
 }
 
 // Get the current page directory
@@ -213,26 +773,169 @@ void vmm_free_directory(page_dir_t* dir) {
         return;
     }
     
-    // Free all page tables
-    for (uint32_t i = 0; i < 1024; i++) {
-        if (dir->entries[i] & VMM_PRESENT) {
-            page_table_t* table = (page_table_t*)(dir->entries[i] & ~0xFFF);
+    // Free all page tables. A table shared with other directories only
+    // loses a reference; the last one also drops its user pages.
+    unsigned long flags = spin_lock_irqsave(&vmm_cow_lock);
+    for (uint32_t i = 0; i < VMM_RECURSIVE_FIRST; i++) {
+        uint64_t pde = vmm_entry_get(dir, i);
+        if ((pde & VMM_PRESENT) && !(pde & VMM_PAGE_SIZE)) {
+            void* table = phys_to_virt(pde & vmm_frame_mask);
+            if (pmm_get_block_refs(table) == 1) {
+                for (uint32_t j = 0; j < vmm_table_entries; j++) {
+                    uint64_t entry = vmm_entry_get(table, j);
+                    if ((entry & (VMM_PRESENT | VMM_USER)) == (VMM_PRESENT | VMM_USER)) {
+                        pmm_free_frame(entry & vmm_frame_mask);
+                    }
+                }
+            }
             pmm_free_block(table);
         }
     }
+    spin_unlock_irqrestore(&vmm_cow_lock, flags);
     
     // Free the directory itself
-    pmm_free_block(dir);
+    pmm_free_blocks(dir, VMM_DIR_PAGES);
+}
+
+// Allocate a kernel stack
+void* vmm_alloc_kernel_stack(uint32_t size) {
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (!pages || pages >= VMM_KSTACK_SLOT / PAGE_SIZE) {
+        return NULL;
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&vmm_kstack_lock);
+    uint32_t slot = 0;
+    while (slot < VMM_KSTACK_SLOTS && (vmm_kstack_used[slot / 32] & (1u << (slot % 32)))) {
+        slot++;
+    }
+    if (slot == VMM_KSTACK_SLOTS) {
+        spin_unlock_irqrestore(&vmm_kstack_lock, flags);
+        return NULL;
+    }
+    
+    // Map whatever the slot's earlier stacks did not need, one frame at a time
+    virtual_addr_t top = VMM_KSTACK_BASE + (slot + 1) * VMM_KSTACK_SLOT;
+    while (vmm_kstack_pages[slot] < pages) {
+        void* frame = pmm_alloc_block();
+        virtual_addr_t page = top - (vmm_kstack_pages[slot] + 1) * PAGE_SIZE;
+        if (!frame || !vmm_map_page(kernel_directory, virt_to_phys(frame), page,
+                                    VMM_PRESENT | VMM_WRITABLE | VMM_NX)) {
+            if (frame) {
+                pmm_free_block(frame);
+            }
+            spin_unlock_irqrestore(&vmm_kstack_lock, flags);
+            return NULL;
+        }
+        vmm_kstack_pages[slot]++;
+    }
+    
+    vmm_kstack_used[slot / 32] |= 1u << (slot % 32);
+    spin_unlock_irqrestore(&vmm_kstack_lock, flags);
+    return (void*)(top - pages * PAGE_SIZE);
+}
+
+// Free a kernel stack; its slot keeps the pages for the next one
+void vmm_free_kernel_stack(void* stack) {
+    uint32_t slot = ((virtual_addr_t)stack - VMM_KSTACK_BASE) / VMM_KSTACK_SLOT;
+    if ((virtual_addr_t)stack < VMM_KSTACK_BASE || slot >= VMM_KSTACK_SLOTS) {
+        return;
+    }
+    
+    unsigned long flags = spin_lock_irqsave(&vmm_kstack_lock);
+    vmm_kstack_used[slot / 32] &= ~(1u << (slot % 32));
+    spin_unlock_irqrestore(&vmm_kstack_lock, flags);
+}
+
+// Map a frame for the kernel
+void* vmm_kmap(physical_addr_t frame) {
+    if (frame < VMM_DIRECT_MAP_SIZE) {
+        return phys_to_virt(frame);
+    }
+    
+    // The slot is not present until now, so there is nothing to flush
+    virtual_addr_t virt = VMM_KMAP_BASE + cpu_id() * PAGE_SIZE;
+    vmm_entry_set(vmm_kmap_table, VMM_TABLE_INDEX(virt), vmm_make_entry(frame, VMM_PRESENT | VMM_WRITABLE | VMM_NX));
+    return (void*)virt;
+}
+
+// Unmap a frame mapped by vmm_kmap. No other CPU uses the slot, so
+// only this CPU's TLB may hold it.
+void vmm_kunmap(void* addr) {
+    virtual_addr_t virt = (virtual_addr_t)addr;
+    if (virt < VMM_KMAP_BASE || virt >= VMM_KMAP_BASE + SMP_MAX_CPUS * PAGE_SIZE) {
+        return;
+    }
+    
+    vmm_entry_set(vmm_kmap_table, VMM_TABLE_INDEX(virt), 0);
+    vmm_flush_tlb_entry(virt);
+}
+
+// Map a physically contiguous range, with large pages wherever both
+// addresses are aligned to one and a whole one is left to map, and 4KB
+// pages for the rest. Replaced entries are flushed once at the end.
+bool vmm_map_range(page_dir_t* dir, physical_addr_t phys, virtual_addr_t virt, uint32_t size, uint32_t flags) {
+    phys &= ~0xFFFull;
+    virt &= ~0xFFF;
+    size = (size + 0xFFF) & ~0xFFF;
+    flags &= ~VMM_PAGE_SIZE;
+    
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, dir);
+    
+    bool mapped = true;
+    uint32_t done = 0;
+    while (done < size && mapped) {
+        uint32_t step = PAGE_SIZE;
+        uint32_t page_flags = flags;
+        if (!VMM_LARGE_OFFSET(phys + done) && !VMM_LARGE_OFFSET(virt + done) &&
+            size - done >= VMM_LARGE_PAGE && !(vmm_entry_get(dir, VMM_DIR_INDEX(virt + done)) & VMM_PRESENT)) {
+            step = VMM_LARGE_PAGE;
+            page_flags |= VMM_PAGE_SIZE;
+        }
+        mapped = vmm_map_page_batch(&batch, dir, phys + done, virt + done, page_flags);
+        done += step;
+    }
+    
+    vmm_tlb_flush(&batch);
+    return mapped;
+}
+
+// Unmap a range, flushing once at the end. Large pages and missing
+// page tables are skipped over whole.
+void vmm_unmap_range(page_dir_t* dir, virtual_addr_t virt, uint32_t size) {
+    virtual_addr_t end = (virt + size + 0xFFF) & ~0xFFF;
+    virt &= ~0xFFF;
+    
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, dir);
+    
+    while (virt < end && virt != 0) {
+        uint64_t pde = vmm_entry_get(dir, VMM_DIR_INDEX(virt));
+        bool whole = !(pde & VMM_PRESENT) || (pde & VMM_PAGE_SIZE);
+        vmm_unmap_page_batch(&batch, virt, false);
+        virt = whole ? (virt & ~(VMM_LARGE_PAGE - 1)) + VMM_LARGE_PAGE : virt + PAGE_SIZE;
+    }
+    
+    vmm_tlb_flush(&batch);
 }
 
 // Identity map a range of physical memory
 void vmm_identity_map(page_dir_t* dir, physical_addr_t start, physical_addr_t end, uint32_t flags) {
-    start &= ~0xFFF;  // Align to page boundary
-    end = (end + 0xFFF) & ~0xFFF;  // Round up to page boundary
+    start &= ~0xFFFull;  // Align to page boundary
+    end = (end + 0xFFF) & ~0xFFFull;  // Round up to page boundary
     
-    for (physical_addr_t addr = start; addr < end; addr += PAGE_SIZE) {
-        vmm_map_page(dir, addr, addr, flags);
+    vmm_map_range(dir, start, (virtual_addr_t)start, (uint32_t)(end - start), flags);
+}
+
+// Does a page table map any user pages?
+static bool vmm_table_has_user_pages(void* table) {
+    for (uint32_t j = 0; j < vmm_table_entries; j++) {
+        if ((vmm_entry_get(table, j) & (VMM_PRESENT | VMM_USER)) == (VMM_PRESENT | VMM_USER)) {
+            return true;
+        }
     }
+    return false;
 }
 
 // Clone a page directory (for process creation/fork)
@@ -243,52 +946,82 @@ page_dir_t* vmm_clone_directory(page_dir_t* src) {
         return NULL;
     }
     
-    // Clone page tables
-    for (uint32_t i = 0; i < 1024; i++) {
-        if (src->entries[i] & VMM_PRESENT) {
-            if (i >= 768) {
-                // Entries 768+ (3GB+) are kernel space, just copy them
-                dest->entries[i] = src->entries[i];
-            } else {
-                // User space - create a new page table
-                page_table_t* src_table = (page_table_t*)(src->entries[i] & ~0xFFF);
-                page_table_t* dest_table = vmm_get_page_table(dest, i, true);
-                
-                if (!dest_table) {
-                    vmm_free_directory(dest);
-                    return NULL;
+    bool ok = true;
+    bool protected = false;
+    unsigned long flags = spin_lock_irqsave(&vmm_cow_lock);
+    
+    for (uint32_t i = 0; i < VMM_RECURSIVE_FIRST && ok; i++) {
+        uint64_t pde = vmm_entry_get(src, i);
+        if (!(pde & VMM_PRESENT)) {
+            continue;
+        }
+        
+        // Large pages are kernel mappings (the identity map and the kernel image)
+        if (pde & VMM_PAGE_SIZE) {
+            vmm_entry_set(dest, i, pde);
+            continue;
+        }
+        void* src_table = phys_to_virt(pde & vmm_frame_mask);
+        
+        // 3GB+ is kernel space, and so are the low tables below the user
+        // range without user pages (the identity map): share the table
+        // itself. A table in the user range is always copied, even an
+        // empty one, or a later fault in either space would map its page
+        // into both.
+        bool user_range = i >= VMM_DIR_INDEX((virtual_addr_t)VM_USER_BASE) && i < VMM_DIR_INDEX(VM_USER_END);
+        if (!user_range && (i >= VMM_DIR_INDEX(VMM_PHYS_OFFSET) || !vmm_table_has_user_pages(src_table))) {
+            ok = pmm_ref_block(src_table);
+            if (ok) {
+                vmm_entry_set(dest, i, pde);
+            }
+            continue;
+        }
+        
+        // User space - create a new page table
+        void* dest_table = vmm_get_page_table(dest, i, true);
+        if (!dest_table) {
+            ok = false;
+            break;
+        }
+        
+        // Share every user page; writable ones become read-only in both
+        // directories until the first write copies them
+        for (uint32_t j = 0; j < vmm_table_entries; j++) {
+            uint64_t entry = vmm_entry_get(src_table, j);
+            if (!(entry & VMM_PRESENT)) {
+                continue;
+            }
+            
+            if (entry & VMM_USER) {
+                if (!pmm_ref_frame(entry & vmm_frame_mask)) {
+                    ok = false;
+                    break;
                 }
-                
-                // Copy the page table entries
-                for (uint32_t j = 0; j < 1024; j++) {
-                    if (src_table->entries[j] & VMM_PRESENT) {
-                        // Get the physical address from the source
-                        physical_addr_t phys = src_table->entries[j] & ~0xFFF;
-                        
-                        // If it's writable, we need to copy the page
-                        if (src_table->entries[j] & VMM_WRITABLE) {
-                            // Allocate a new physical page
-                            void* new_page = pmm_alloc_block();
-                            if (!new_page) {
-                                vmm_free_directory(dest);
-                                return NULL;
-                            }
-                            
-                            // Copy the data
-                            virtual_addr_t virt = (i << 22) | (j << 12);
-                            memcpy(new_page, (void*)virt, PAGE_SIZE);
-                            
-                            // Map it
-                            dest_table->entries[j] = ((uint32_t)new_page) | (src_table->entries[j] & 0xFFF);
-                        } else {
-                            // Read-only pages can be shared
-                            dest_table->entries[j] = src_table->entries[j];
-                        }
-                    }
+                if (entry & VMM_WRITABLE) {
+                    entry = (entry & ~(uint64_t)VMM_WRITABLE) | VMM_COW;
+                    vmm_entry_set(src_table, j, entry);
+                    protected = true;
                 }
             }
+            vmm_entry_set(dest_table, j, entry);
         }
     }
     
+    spin_unlock_irqrestore(&vmm_cow_lock, flags);
+    
+    // Drop the writable TLB entries for the pages just protected, on
+    // every CPU running src
+    if (protected) {
+        vmm_tlb_batch_t batch;
+        vmm_tlb_batch_init(&batch, src);
+        batch.full = true;
+        vmm_tlb_flush(&batch);
+    }
+    
+    if (!ok) {
+        vmm_free_directory(dest);
+        return NULL;
+    }
+    
     return dest;
-} 
\ No newline at end of file
+}
@@ -15,46 +15,144 @@
 #define VMM_DIRTY          0x40
 #define VMM_PAGE_SIZE      0x80
 #define VMM_GLOBAL         0x100
+#define VMM_COW            0x200    // Shared read-only until written (available bit)
+#define VMM_NX             0x400    // No execute: entry bit 63 with NX, else ignored
+
+// Memory types, as entry flags from vmm_get_cache_flags. Write-combining
+// takes PAT entry 1 (PWT alone), which vmm_init_pat reprograms from
+// write-through; without PAT it falls back to uncached.
+typedef enum {
+    VMM_CACHE_WRITE_BACK,
+    VMM_CACHE_UNCACHED,
+    VMM_CACHE_WRITE_COMBINE
+} vmm_cache_t;
 
-// Virtual memory constants
-#define PAGE_DIR_INDEX(x) (((x) >> 22) & 0x3FF)
-#define PAGE_TABLE_INDEX(x) (((x) >> 12) & 0x3FF)
 #define PAGE_OFFSET(x) ((x) & 0xFFF)
 
-typedef uint32_t page_dir_entry_t;
-typedef uint32_t page_table_entry_t;
+// Direct map: all physical memory up to VMM_DIRECT_MAP_SIZE is mapped
+// at VMM_PHYS_OFFSET, the kernel image included. Frames from the PMM
+// are used through it; page tables and devices take physical addresses.
+// Until vmm_init only the first VMM_BOOT_MAP_SIZE is (by boot.asm).
+#define VMM_PHYS_OFFSET     0xC0000000
+#define VMM_DIRECT_MAP_SIZE 0x38000000
+#define VMM_BOOT_MAP_SIZE   0x01000000
+
+// Low memory also mapped at its own address in every directory, for the
+// VGA buffer, firmware tables, the AP trampoline and enter_pae
+#define VMM_IDENTITY_MAP_SIZE 0x00A00000
+
 typedef uint32_t virtual_addr_t;
-typedef uint32_t physical_addr_t;
+typedef uint64_t physical_addr_t;
+
+static inline void* phys_to_virt(physical_addr_t phys) {
+    return (void*)(uintptr_t)(uint32_t)(phys + VMM_PHYS_OFFSET);
+}
 
-// Page table structure (1024 entries, each mapping 4KB)
+static inline physical_addr_t virt_to_phys(const void* virt) {
+    return (uint32_t)(uintptr_t)virt - VMM_PHYS_OFFSET;
+}
+
+// A page directory. Its layout depends on the paging mode vmm_init
+// picks: 32-bit paging (two levels of 1024 4-byte entries, 4MB large
+// pages) or PAE (a PDPT over four directories of 512 8-byte entries,
+// 2MB large pages, NX). Only the vmm_* functions look inside.
+typedef struct page_dir page_dir_t;
+
+// Pages a TLB batch invalidates one by one. Beyond that the batch
+// reloads CR3 instead, which is cheaper than that many invlpg.
+#define VMM_TLB_BATCH_PAGES 32
+
+// Entries of one directory changed together (mmu_gather). The TLB
+// entries they leave stale are flushed at once by vmm_tlb_flush, on
+// every CPU that may hold them and with a single shootdown IPI each;
+// frames queued on the batch are freed only after that.
 typedef struct {
-    page_table_entry_t entries[1024];
-} page_table_t;
+    page_dir_t* directory;
+    uint32_t cr3;                   // Matched against each CPU's CR3
+    bool shared;                    // Has addresses outside user space
+    bool full;                      // Too many pages: reload CR3
+    uint32_t count;
+    virtual_addr_t pages[VMM_TLB_BATCH_PAGES];
+    uint32_t frame_count;
+    physical_addr_t frames[VMM_TLB_BATCH_PAGES];
+} vmm_tlb_batch_t;
 
-// Page directory structure (1024 entries, each pointing to a page table)
+// TLB flush statistics
 typedef struct {
-    page_dir_entry_t entries[1024];
-} page_dir_t;
+    uint32_t flushes;               // Batches flushed
+    uint32_t full_flushes;          // Of those, by reloading CR3
+    uint32_t pages;                 // Pages invalidated with invlpg
+    uint32_t shootdowns;            // Batches that had other CPUs flush too
+    uint32_t ipis;                  // Shootdown IPIs sent
+} vmm_tlb_stats_t;
+
+// Function declarations. vmm_init picks PAE paging if the CPU has it
+// and it buys something (memory above 4GB or NX), unless allow_pae is
+// false. With VMM_PAGE_SIZE vmm_map_page maps one large page.
+void vmm_init(bool allow_pae);
+bool vmm_pae_enabled(void);
+bool vmm_nx_enabled(void);
+uint32_t vmm_get_large_page_size(void);
+
+// Program the PAT for vmm_cache_t on the calling CPU (each CPU at boot)
+void vmm_init_pat(void);
+uint32_t vmm_get_cache_flags(vmm_cache_t type);
+
+// Make the page tables of a kernel area, so that every directory cloned
+// after this shares its mappings. Large pages in the area are split into
+// tables mapping the same frames. Only for boot, before processes exist.
+bool vmm_reserve_kernel_tables(virtual_addr_t start, uint32_t size);
+
+// Change the memory type of mapped 4KB kernel pages (in tables from
+// vmm_reserve_kernel_tables) and flush them from every CPU's TLB. The
+// caller flushes the caches afterwards when leaving write-back.
+bool vmm_set_kernel_cache(virtual_addr_t start, uint32_t size, vmm_cache_t type);
 
-// Function declarations
-void vmm_init(void);
 bool vmm_map_page(page_dir_t* dir, physical_addr_t phys, virtual_addr_t virt, uint32_t flags);
 bool vmm_unmap_page(page_dir_t* dir, virtual_addr_t virt);
 bool vmm_get_mapping(page_dir_t* dir, virtual_addr_t virt, physical_addr_t* phys);
 void vmm_switch_page_directory(page_dir_t* dir);
 page_dir_t* vmm_get_current_directory(void);
+uint32_t vmm_get_cr3(page_dir_t* dir);
 page_dir_t* vmm_create_directory(void);
 void vmm_free_directory(page_dir_t* dir);
+bool vmm_map_range(page_dir_t* dir, physical_addr_t phys, virtual_addr_t virt, uint32_t size, uint32_t flags);
+void vmm_unmap_range(page_dir_t* dir, virtual_addr_t virt, uint32_t size);
 void vmm_identity_map(page_dir_t* dir, physical_addr_t start, physical_addr_t end, uint32_t flags);
-page_table_t* vmm_get_page_table(page_dir_t* dir, uint32_t idx, bool allocate);
 
 // Page fault handler
 void page_fault_handler(void);
 
-// Clone a directory (for fork/process creation)
+// Clone a directory (for fork/process creation). Kernel page tables are
+// shared; user pages are shared copy-on-write, so the cost is one page
+// table per user table rather than one copy per page.
 page_dir_t* vmm_clone_directory(page_dir_t* src);
 
+// Kernel stacks of up to 28 KB in the shared higher half, built from
+// single frames and with an unmapped guard page below. Returns the
+// lowest address of the stack.
+void* vmm_alloc_kernel_stack(uint32_t size);
+void vmm_free_kernel_stack(void* stack);
+
+// Temporarily map a frame the direct map may not reach (a high frame,
+// see pmm_alloc_frame). Each CPU has one slot: call with interrupts
+// disabled and unmap before mapping another.
+void* vmm_kmap(physical_addr_t frame);
+void vmm_kunmap(void* addr);
+
 // Flush a TLB entry
 void vmm_flush_tlb_entry(virtual_addr_t addr);
 
+// TLB batches. Unmapping through a batch queues the page for a flush,
+// and with free_frame also the frame behind it. vmm_tlb_flush may wait
+// for other CPUs, so no spinlock may be held across it.
+void vmm_tlb_batch_init(vmm_tlb_batch_t* batch, page_dir_t* dir);
+bool vmm_unmap_page_batch(vmm_tlb_batch_t* batch, virtual_addr_t virt, bool free_frame);
+void vmm_tlb_flush(vmm_tlb_batch_t* batch);
+
+// Shootdown IPI: do this CPU's part of the shootdown in progress
+void vmm_tlb_shootdown_interrupt(void);
+
+void vmm_get_tlb_stats(vmm_tlb_stats_t* stats);
+
 #endif /* REXUS_VMM_H */ 
\ No newline at end of file
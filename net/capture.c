@@ -0,0 +1,343 @@
+#include "capture.h"
+#include "ipv4.h"
+#include "udp.h"
+#include "tcp.h"
+#include "../mem/pmm.h"
+#include "../arch/x86/cpu.h"
+#include <string.h>
+
+// pcap file format
+#define PCAP_MAGIC             0xA1B2C3D4
+#define PCAP_VERSION_MAJOR     2
+#define PCAP_VERSION_MINOR     4
+#define PCAP_LINKTYPE_ETHERNET 1
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_ARP  0x0806
+#define ETHERTYPE_IPV6 0x86DD
+#define ETH_HEADER_LEN 14
+
+#define NET_CAPTURE_RING_MASK (NET_CAPTURE_RING_SIZE - 1)
+
+// One captured packet. seq is ticket + 1 once the record is complete and
+// 0 while a writer is filling it in, so readers can skip torn records.
+typedef struct {
+    volatile uint32_t seq;
+    uint32_t orig_len;
+    uint64_t tsc;
+    uint16_t caplen;
+    uint8_t direction;
+    uint8_t protocol;
+    uint8_t mac[6];
+    uint8_t data[NET_CAPTURE_SNAPLEN];
+} net_capture_record_t;
+
+#define NET_CAPTURE_RING_BLOCKS \
+    ((NET_CAPTURE_RING_SIZE * sizeof(net_capture_record_t) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+volatile bool net_capture_enabled = false;
+
+// Capture state
+static struct {
+    net_capture_record_t* ring;
+    volatile uint32_t head;         // Next ticket to hand out
+    volatile uint32_t filtered;
+    net_capture_filter_t filter;
+    uint64_t start_tsc;
+} capture_state;
+
+static uint16_t capture_be16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void capture_put_be16(uint8_t* p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+static uint16_t capture_swap16(uint16_t value) {
+    return (uint16_t)((value >> 8) | (value << 8));
+}
+
+static uint32_t capture_swap32(uint32_t value) {
+    return (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+}
+
+// Ethertype of a packet as it sits at the interface
+static uint16_t capture_ethertype(const net_packet_t* packet) {
+    switch (packet->protocol) {
+        case NET_PROTO_IPV4:
+            return ETHERTYPE_IPV4;
+        case NET_PROTO_IPV6:
+            return ETHERTYPE_IPV6;
+        case NET_PROTO_ARP:
+            return ETHERTYPE_ARP;
+        case NET_PROTO_NONE:
+            // Raw Ethernet frame straight from a driver
+            return packet->length >= ETH_HEADER_LEN ? capture_be16(packet->data + 12) : 0;
+        default:
+            return 0;
+    }
+}
+
+// Check a packet against the capture filter
+static bool capture_matches(const net_packet_t* packet) {
+    const net_capture_filter_t* filter = &capture_state.filter;
+    
+    uint16_t ethertype = capture_ethertype(packet);
+    if (filter->ethertype && filter->ethertype != ethertype) {
+        return false;
+    }
+    if (!filter->ip_protocol && !filter->port) {
+        return true;
+    }
+    if (ethertype != ETHERTYPE_IPV4) {
+        return false;
+    }
+    
+    // Frames from a driver still carry the Ethernet header and wire byte order
+    bool raw = packet->protocol == NET_PROTO_NONE;
+    size_t offset = raw ? ETH_HEADER_LEN : 0;
+    if (packet->length < offset + sizeof(ipv4_header_t)) {
+        return false;
+    }
+    const uint8_t* ip = packet->data + offset;
+    uint8_t protocol = ip[9];
+    if (filter->ip_protocol && filter->ip_protocol != protocol) {
+        return false;
+    }
+    if (!filter->port) {
+        return true;
+    }
+    if (protocol != IPV4_PROTO_TCP && protocol != IPV4_PROTO_UDP) {
+        return false;
+    }
+    
+    offset += (ip[0] & 0x0F) * 4;
+    if (packet->length < offset + 4) {
+        return false;
+    }
+    uint16_t ports[2];
+    memcpy(ports, packet->data + offset, sizeof(ports));
+    if (raw) {
+        ports[0] = capture_swap16(ports[0]);
+        ports[1] = capture_swap16(ports[1]);
+    }
+    return ports[0] == filter->port || ports[1] == filter->port;
+}
+
+// Start capturing into a freshly cleared ring
+bool net_capture_start(const net_capture_filter_t* filter) {
+    net_capture_enabled = false;
+    
+    // The ring is allocated once and kept, so the tap never allocates
+    if (!capture_state.ring) {
+        capture_state.ring = pmm_alloc_blocks_for(NET_CAPTURE_RING_BLOCKS, PAGE_OWNER_NET);
+        if (!capture_state.ring) {
+            return false;
+        }
+    }
+    
+    memset(capture_state.ring, 0, NET_CAPTURE_RING_SIZE * sizeof(net_capture_record_t));
+    capture_state.head = 0;
+    capture_state.filtered = 0;
+    if (filter) {
+        capture_state.filter = *filter;
+    } else {
+        memset(&capture_state.filter, 0, sizeof(capture_state.filter));
+    }
+    capture_state.start_tsc = rdtsc();
+    
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    net_capture_enabled = true;
+    return true;
+}
+
+// Stop capturing
+void net_capture_stop(void) {
+    net_capture_enabled = false;
+}
+
+// Record a packet. Writers claim a slot with a single atomic increment,
+// so taps in interrupt context and normal context never wait on each other.
+void net_capture_packet(net_interface_t* iface, const net_packet_t* packet, uint8_t direction) {
+    if (!packet || !capture_state.ring) {
+        return;
+    }
+    if (!capture_matches(packet)) {
+        __atomic_fetch_add(&capture_state.filtered, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    uint32_t ticket = __atomic_fetch_add(&capture_state.head, 1, __ATOMIC_RELAXED);
+    net_capture_record_t* record = &capture_state.ring[ticket & NET_CAPTURE_RING_MASK];
+    
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    
+    size_t caplen = packet->length < NET_CAPTURE_SNAPLEN ? packet->length : NET_CAPTURE_SNAPLEN;
+    record->tsc = rdtsc();
+    record->orig_len = packet->length;
+    record->caplen = caplen;
+    record->direction = direction;
+    record->protocol = packet->protocol;
+    if (iface) {
+        memcpy(record->mac, iface->mac, sizeof(record->mac));
+    } else {
+        memset(record->mac, 0, sizeof(record->mac));
+    }
+    memcpy(record->data, packet->data, caplen);
+    
+    __atomic_store_n(&record->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+// Get capture statistics
+void net_capture_get_stats(net_capture_stats_t* stats) {
+    if (!stats) {
+        return;
+    }
+    
+    uint32_t head = __atomic_load_n(&capture_state.head, __ATOMIC_ACQUIRE);
+    stats->captured = head;
+    stats->filtered = capture_state.filtered;
+    stats->overwritten = head > NET_CAPTURE_RING_SIZE ? head - NET_CAPTURE_RING_SIZE : 0;
+}
+
+// Divide *value by divisor in place and return the remainder. The kernel
+// links without libgcc, so 64-bit division is done by hand.
+static uint32_t capture_div64(uint64_t* value, uint32_t divisor) {
+    uint64_t quotient = 0;
+    uint64_t remainder = 0;
+    
+    for (int bit = 63; bit >= 0; bit--) {
+        remainder = (remainder << 1) | ((*value >> bit) & 1);
+        if (remainder >= divisor) {
+            remainder -= divisor;
+            quotient |= (uint64_t)1 << bit;
+        }
+    }
+    
+    *value = quotient;
+    return (uint32_t)remainder;
+}
+
+// The stack keeps headers in host byte order; put a captured IPv4 packet
+// back into wire order so standard tools decode it
+static void capture_to_wire_order(uint8_t* data, size_t caplen) {
+    if (caplen < sizeof(ipv4_header_t)) {
+        return;
+    }
+    
+    ipv4_header_t ip;
+    memcpy(&ip, data, sizeof(ip));
+    bool first_fragment = !(ip.flags_offset & IPV4_FRAGMENT_OFFSET_MASK);
+    ip.total_length = capture_swap16(ip.total_length);
+    ip.id = capture_swap16(ip.id);
+    ip.flags_offset = capture_swap16(ip.flags_offset);
+    ip.checksum = 0;
+    memcpy(data, &ip, sizeof(ip));
+    ip.checksum = ipv4_checksum(data, sizeof(ip));
+    memcpy(data, &ip, sizeof(ip));
+    
+    size_t offset = (ip.version_ihl & 0x0F) * 4;
+    if (!first_fragment) {
+        return;
+    }
+    
+    if (ip.protocol == IPV4_PROTO_UDP && caplen >= offset + sizeof(udp_header_t)) {
+        udp_header_t udp;
+        memcpy(&udp, data + offset, sizeof(udp));
+        udp.src_port = capture_swap16(udp.src_port);
+        udp.dest_port = capture_swap16(udp.dest_port);
+        udp.length = capture_swap16(udp.length);
+        udp.checksum = 0;
+        memcpy(data + offset, &udp, sizeof(udp));
+    } else if (ip.protocol == IPV4_PROTO_TCP && caplen >= offset + sizeof(tcp_header_t)) {
+        tcp_header_t tcp;
+        memcpy(&tcp, data + offset, sizeof(tcp));
+        tcp.src_port = capture_swap16(tcp.src_port);
+        tcp.dest_port = capture_swap16(tcp.dest_port);
+        tcp.seq_num = capture_swap32(tcp.seq_num);
+        tcp.ack_num = capture_swap32(tcp.ack_num);
+        tcp.window = capture_swap16(tcp.window);
+        tcp.urgent_ptr = capture_swap16(tcp.urgent_ptr);
+        memcpy(data + offset, &tcp, sizeof(tcp));
+    }
+}
+
+// Write the ring contents as a pcap file
+uint32_t net_capture_write_pcap(net_capture_write_t write, uint32_t tsc_khz) {
+    if (!write) {
+        return 0;
+    }
+    
+    uint32_t header[6] = {
+        PCAP_MAGIC,
+        PCAP_VERSION_MAJOR | (PCAP_VERSION_MINOR << 16),
+        0,
+        0,
+        ETH_HEADER_LEN + NET_CAPTURE_SNAPLEN,
+        PCAP_LINKTYPE_ETHERNET
+    };
+    write(header, sizeof(header));
+    
+    if (!capture_state.ring) {
+        return 0;
+    }
+    
+    static net_capture_record_t record;
+    static uint8_t frame[ETH_HEADER_LEN + NET_CAPTURE_SNAPLEN];
+    uint32_t written = 0;
+    
+    uint32_t head = __atomic_load_n(&capture_state.head, __ATOMIC_ACQUIRE);
+    uint32_t first = head > NET_CAPTURE_RING_SIZE ? head - NET_CAPTURE_RING_SIZE : 0;
+    for (uint32_t ticket = first; ticket != head; ticket++) {
+        net_capture_record_t* slot = &capture_state.ring[ticket & NET_CAPTURE_RING_MASK];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ticket + 1) {
+            continue;
+        }
+        memcpy(&record, slot, sizeof(record));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != ticket + 1) {
+            continue;  // Overwritten while we were copying it
+        }
+        
+        // Frames from drivers already have a link header; synthesize one
+        // for packets that were tapped above the driver
+        size_t frame_len = 0;
+        uint32_t orig_len = record.orig_len;
+        if (record.protocol != NET_PROTO_NONE) {
+            memset(frame, 0, ETH_HEADER_LEN);
+            memcpy(frame + (record.direction == NET_CAPTURE_TX ? 6 : 0), record.mac, 6);
+            net_packet_t view = { .protocol = record.protocol };
+            capture_put_be16(frame + 12, capture_ethertype(&view));
+            frame_len = ETH_HEADER_LEN;
+            orig_len += ETH_HEADER_LEN;
+        }
+        memcpy(frame + frame_len, record.data, record.caplen);
+        if (record.protocol == NET_PROTO_IPV4) {
+            capture_to_wire_order(frame + frame_len, record.caplen);
+        }
+        frame_len += record.caplen;
+        
+        // Timestamp relative to capture start
+        uint64_t elapsed = record.tsc - capture_state.start_tsc;
+        uint32_t usec = 0;
+        if (tsc_khz) {
+            uint32_t cycles = capture_div64(&elapsed, tsc_khz);   // elapsed is now ms
+            uint32_t msec = capture_div64(&elapsed, 1000);        // elapsed is now s
+            uint64_t fraction = (uint64_t)cycles * 1000;
+            capture_div64(&fraction, tsc_khz);
+            usec = msec * 1000 + (uint32_t)fraction;
+        } else {
+            elapsed = 0;
+        }
+        
+        uint32_t record_header[4] = { (uint32_t)elapsed, usec, frame_len, orig_len };
+        write(record_header, sizeof(record_header));
+        write(frame, frame_len);
+        written++;
+    }
+    
+    return written;
+}
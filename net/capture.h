@@ -0,0 +1,61 @@
+#ifndef REXUS_CAPTURE_H
+#define REXUS_CAPTURE_H
+
+#include "net.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bytes of each packet kept in the capture ring
+#define NET_CAPTURE_SNAPLEN 128
+
+// Number of records in the capture ring (power of two)
+#define NET_CAPTURE_RING_SIZE 256
+
+// Capture direction
+#define NET_CAPTURE_RX 0
+#define NET_CAPTURE_TX 1
+
+// Capture filter; zero fields match anything
+typedef struct {
+    uint16_t ethertype;     // e.g. 0x0800 for IPv4
+    uint8_t ip_protocol;    // e.g. IPV4_PROTO_UDP
+    uint16_t port;          // TCP/UDP source or destination port
+} net_capture_filter_t;
+
+// Capture statistics
+typedef struct {
+    uint32_t captured;      // Records written to the ring
+    uint32_t filtered;      // Packets rejected by the filter
+    uint32_t overwritten;   // Records lost to ring wrap-around
+} net_capture_stats_t;
+
+// Set while a capture is running; tested by NET_CAPTURE_TAP
+extern volatile bool net_capture_enabled;
+
+// Tap point: costs a single predicted-not-taken branch while capture is off
+#define NET_CAPTURE_TAP(iface, packet, direction) \
+    do { \
+        if (__builtin_expect(net_capture_enabled, 0)) { \
+            net_capture_packet((iface), (packet), (direction)); \
+        } \
+    } while (0)
+
+// Start capturing into a freshly cleared ring (filter may be NULL)
+bool net_capture_start(const net_capture_filter_t* filter);
+
+// Stop capturing; the ring keeps its contents until the next start
+void net_capture_stop(void);
+
+// Record a packet (called through NET_CAPTURE_TAP)
+void net_capture_packet(net_interface_t* iface, const net_packet_t* packet, uint8_t direction);
+
+// Get capture statistics
+void net_capture_get_stats(net_capture_stats_t* stats);
+
+// Write the ring contents as a pcap file, oldest record first.
+// Timestamps are relative to the start of the capture.
+typedef void (*net_capture_write_t)(const void* data, size_t length);
+uint32_t net_capture_write_pcap(net_capture_write_t write, uint32_t tsc_khz);
+
+#endif /* REXUS_CAPTURE_H */
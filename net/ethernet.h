@@ -99,6 +99,8 @@ bool eth_set_multicast(net_interface_t* iface, bool enable);
 
 // Helper functions
 uint32_t eth_calculate_crc32(const void* data, size_t length);
+uint32_t eth_calculate_crc32_bytewise(const void* data, size_t length);
+bool eth_crc32_self_test(void);
 bool eth_is_valid_mac(const uint8_t* mac);
 void eth_format_mac(char* str, const uint8_t* mac);
 bool eth_parse_mac(const char* str, uint8_t* mac);
@@ -1,12 +1,20 @@
 #include "ipv4.h"
 #include "../mem/pmm.h"
+#include "../mem/kmalloc.h"
+#include "../core/timer.h"
+#include "../arch/x86/cpu.h"
 #include "../drivers/vga.h"
 #include <string.h>
 #include <stdio.h>
 
-// Maximum number of fragments per packet
+// Maximum number of datagrams being reassembled at once
 #define MAX_FRAGMENTS 64
 
+// Reassembly bookkeeping works in 8-byte fragment blocks
+#define FRAGMENT_BLOCKS ((IPV4_MAX_PACKET_SIZE + 7) / 8)
+#define FRAGMENT_BITMAP_WORDS ((FRAGMENT_BLOCKS + 31) / 32)
+#define REASSEMBLY_BUFFER_BLOCKS ((IPV4_MAX_PACKET_SIZE + PAGE_SIZE - 1) / PAGE_SIZE)
+
 // Fragment timeout in milliseconds
 #define FRAGMENT_TIMEOUT 30000
 
@@ -22,17 +30,18 @@ static struct {
         ipv4_addr_t src;
         ipv4_addr_t dest;
         uint8_t protocol;
-        uint32_t timestamp;
+        ktimer_t timer;             // Drops the datagram after FRAGMENT_TIMEOUT
         uint16_t total_length;
         uint8_t* data;
-        bool fragments[MAX_FRAGMENTS];
-        uint8_t fragment_count;
+        uint32_t fragments[FRAGMENT_BITMAP_WORDS];
+        uint16_t fragment_count;
     } reassembly_buffers[MAX_FRAGMENTS];
 } ipv4_state;
 
 // Initialize IPv4 subsystem
 void ipv4_init(void) {
     memset(&ipv4_state, 0, sizeof(ipv4_state));
+    net_register_protocol_handler(NET_PROTO_IPV4, ipv4_receive_packet);
     vga_puts("IPv4: Protocol initialized\n");
 }
 
@@ -42,9 +51,10 @@ void ipv4_cleanup(void) {
     
     // Free reassembly buffers
     for (int i = 0; i < MAX_FRAGMENTS; i++) {
+        timer_cancel(&ipv4_state.reassembly_buffers[i].timer);
         if (ipv4_state.reassembly_buffers[i].data) {
-            pmm_free_blocks(ipv4_state.reassembly_buffers[i].data,
-                (ipv4_state.reassembly_buffers[i].total_length + PAGE_SIZE - 1) / PAGE_SIZE);
+            pmm_free_blocks(ipv4_state.reassembly_buffers[i].data, REASSEMBLY_BUFFER_BLOCKS);
+            ipv4_state.reassembly_buffers[i].data = NULL;
         }
     }
 }
@@ -104,10 +114,14 @@ uint16_t ipv4_pseudo_checksum(const ipv4_pseudo_header_t* pseudo_header,
     return ~sum;
 }
 
-// Send IPv4 packet
+// Send IPv4 packet (consumes the packet)
 bool ipv4_send_packet(net_packet_t* packet, const ipv4_addr_t* dest_addr,
                      uint8_t protocol, uint8_t ttl) {
-    if (!packet || !dest_addr) {
+    if (!packet) {
+        return false;
+    }
+    if (!dest_addr) {
+        net_free_packet(packet);
         return false;
     }
     
@@ -115,6 +129,7 @@ bool ipv4_send_packet(net_packet_t* packet, const ipv4_addr_t* dest_addr,
     ipv4_route_t* route = ipv4_find_route(dest_addr);
     if (!route) {
         ipv4_state.stats.packets_dropped++;
+        net_free_packet(packet);
         return false;
     }
     
@@ -122,14 +137,20 @@ bool ipv4_send_packet(net_packet_t* packet, const ipv4_addr_t* dest_addr,
     ipv4_config_t config;
     if (!ipv4_get_interface_config(route->iface, &config)) {
         ipv4_state.stats.packets_dropped++;
+        net_free_packet(packet);
         return false;
     }
     
-    // Prepare IPv4 header
-    ipv4_header_t* header = (ipv4_header_t*)packet->data;
+    // Prepend IPv4 header in front of the payload
+    ipv4_header_t* header = (ipv4_header_t*)net_packet_push(packet, sizeof(ipv4_header_t));
+    if (!header) {
+        ipv4_state.stats.packets_dropped++;
+        net_free_packet(packet);
+        return false;
+    }
     header->version_ihl = (IPV4_VERSION << 4) | IPV4_IHL_MIN;
     header->tos = 0;
-    header->total_length = sizeof(ipv4_header_t) + packet->length;
+    header->total_length = packet->length;
     header->id = ipv4_state.ip_id++;
     header->flags_offset = 0;
     header->ttl = ttl ? ttl : IPV4_TTL_DEFAULT;
@@ -141,13 +162,20 @@ bool ipv4_send_packet(net_packet_t* packet, const ipv4_addr_t* dest_addr,
     // Calculate header checksum
     header->checksum = ipv4_checksum(header, sizeof(ipv4_header_t));
     
-    // Fragment packet if necessary
+    packet->network_header = packet->data;
+    packet->protocol = NET_PROTO_IPV4;
+    packet->iface = route->iface;
+    
+    // Fragment packet if necessary; the fragments replace the original
     if (header->total_length > route->iface->mtu) {
-        if (!ipv4_fragment_packet(packet, route->iface->mtu)) {
+        bool success = ipv4_fragment_packet(packet, route->iface->mtu);
+        if (success) {
+            ipv4_state.stats.fragments_sent++;
+        } else {
             ipv4_state.stats.fragmentation_failures++;
-            return false;
         }
-        ipv4_state.stats.fragments_sent++;
+        net_free_packet(packet);
+        return success;
     }
     
     // Update statistics
@@ -158,10 +186,14 @@ bool ipv4_send_packet(net_packet_t* packet, const ipv4_addr_t* dest_addr,
     return net_send_packet(route->iface, packet);
 }
 
-// Process received IPv4 packet
+// Process received IPv4 packet (consumes the packet)
 void ipv4_receive_packet(net_interface_t* iface, net_packet_t* packet) {
-    if (!iface || !packet || packet->length < sizeof(ipv4_header_t)) {
+    if (!packet) {
+        return;
+    }
+    if (!iface || packet->length < sizeof(ipv4_header_t)) {
         ipv4_state.stats.packets_dropped++;
+        net_free_packet(packet);
         return;
     }
     
@@ -173,20 +205,32 @@ void ipv4_receive_packet(net_interface_t* iface, net_packet_t* packet) {
     header->checksum = 0;
     if (ipv4_checksum(header, sizeof(ipv4_header_t)) != orig_checksum) {
         ipv4_state.stats.packets_dropped++;
+        net_free_packet(packet);
         return;
     }
     header->checksum = orig_checksum;
     
+    // Reject bogus lengths and drop any link-layer padding
+    if (header->total_length < sizeof(ipv4_header_t) || header->total_length > packet->length) {
+        ipv4_state.stats.packets_dropped++;
+        net_free_packet(packet);
+        return;
+    }
+    net_packet_trim(packet, header->total_length);
+    
     // Update statistics
     ipv4_state.stats.packets_received++;
     ipv4_state.stats.bytes_received += packet->length;
     
     // Handle fragments
     if (header->flags_offset & (IPV4_FLAG_MORE_FRAGMENTS | IPV4_FRAGMENT_OFFSET_MASK)) {
-        packet = ipv4_reassemble_packet(packet);
-        if (!packet) {
+        net_packet_t* whole = ipv4_reassemble_packet(packet);
+        net_free_packet(packet);
+        if (!whole) {
             return;  // Packet is incomplete or reassembly failed
         }
+        packet = whole;
+        header = (ipv4_header_t*)packet->data;
         ipv4_state.stats.fragments_reassembled++;
     }
     
@@ -214,25 +258,27 @@ void ipv4_receive_packet(net_interface_t* iface, net_packet_t* packet) {
             break;
         default:
             ipv4_state.stats.packets_dropped++;
+            net_free_packet(packet);
             return;
     }
     
-    // Adjust packet data and length to remove IP header
-    packet->data += sizeof(ipv4_header_t);
-    packet->length -= sizeof(ipv4_header_t);
+    // Strip the IP header, keeping a pointer to it for the upper layer
+    packet->network_header = packet->data;
+    net_packet_pull(packet, sizeof(ipv4_header_t));
     packet->protocol = proto;
     
-    // Pass to network stack
-    net_receive_packet(iface, packet);
+    // Pass to the upper layer handler
+    net_deliver_packet(iface, packet);
 }
 
-// Forward IPv4 packet
+// Forward IPv4 packet (consumes the packet)
 bool ipv4_forward_packet(net_packet_t* packet) {
     ipv4_header_t* header = (ipv4_header_t*)packet->data;
     
     // Check TTL
     if (header->ttl <= 1) {
         // Should send ICMP Time Exceeded here
+        net_free_packet(packet);
         return false;
     }
     
@@ -246,14 +292,16 @@ bool ipv4_forward_packet(net_packet_t* packet) {
     // Find route to destination
     ipv4_route_t* route = ipv4_find_route(&header->dest_addr);
     if (!route) {
+        net_free_packet(packet);
         return false;
     }
     
-    // Fragment packet if necessary
+    // Fragment packet if necessary; the fragments replace the original
     if (packet->length > route->iface->mtu) {
-        if (!ipv4_fragment_packet(packet, route->iface->mtu)) {
-            return false;
-        }
+        packet->iface = route->iface;
+        bool success = ipv4_fragment_packet(packet, route->iface->mtu);
+        net_free_packet(packet);
+        return success;
     }
     
     // Forward packet
@@ -308,9 +356,9 @@ bool ipv4_fragment_packet(net_packet_t* packet, uint16_t mtu) {
         frag_header->checksum = 0;
         frag_header->checksum = ipv4_checksum(frag_header, sizeof(ipv4_header_t));
         
-        // Send fragment
+        // Send fragment (consumes it)
+        frag->protocol = NET_PROTO_IPV4;
         if (!net_send_packet(packet->iface, frag)) {
-            net_free_packet(frag);
             return false;
         }
         
@@ -320,10 +368,48 @@ bool ipv4_fragment_packet(net_packet_t* packet, uint16_t mtu) {
     return true;
 }
 
-// Reassemble IPv4 packet
+// Fragment timer callback: give up on a datagram that never completed
+static void ipv4_reassembly_timeout(void* data) {
+    int i = (int)(intptr_t)data;
+    
+    if (ipv4_state.reassembly_buffers[i].data) {
+        pmm_free_blocks(ipv4_state.reassembly_buffers[i].data, REASSEMBLY_BUFFER_BLOCKS);
+        ipv4_state.stats.reassembly_failures++;
+    }
+    memset(&ipv4_state.reassembly_buffers[i], 0, sizeof(ipv4_state.reassembly_buffers[0]));
+}
+
+static net_packet_t* ipv4_reassemble_locked(net_packet_t* fragment);
+
+// Reassemble IPv4 packet. The fragment timer can fire from the timer
+// interrupt, so the reassembly buffers are only touched with it held off.
 net_packet_t* ipv4_reassemble_packet(net_packet_t* fragment) {
+    unsigned long flags = irq_save();
+    net_packet_t* packet = ipv4_reassemble_locked(fragment);
+    irq_restore(flags);
+    return packet;
+}
+
+static net_packet_t* ipv4_reassemble_locked(net_packet_t* fragment) {
+    if (!fragment || fragment->length < sizeof(ipv4_header_t)) {
+        return NULL;
+    }
+    
     ipv4_header_t* header = (ipv4_header_t*)fragment->data;
-    uint16_t offset = (header->flags_offset & IPV4_FRAGMENT_OFFSET_MASK) * 8;
+    uint32_t offset = (header->flags_offset & IPV4_FRAGMENT_OFFSET_MASK) * 8;
+    bool more_fragments = (header->flags_offset & IPV4_FLAG_MORE_FRAGMENTS) != 0;
+    
+    // Validate the fragment before touching any reassembly state
+    if (header->total_length < sizeof(ipv4_header_t) || header->total_length > fragment->length) {
+        ipv4_state.stats.reassembly_failures++;
+        return NULL;
+    }
+    uint32_t data_len = header->total_length - sizeof(ipv4_header_t);
+    if (data_len == 0 || offset + data_len > IPV4_MAX_PACKET_SIZE - sizeof(ipv4_header_t) ||
+        (more_fragments && (data_len % 8) != 0)) {
+        ipv4_state.stats.reassembly_failures++;
+        return NULL;
+    }
     
     // Find or allocate reassembly buffer
     int buf_index = -1;
@@ -356,41 +442,48 @@ net_packet_t* ipv4_reassemble_packet(net_packet_t* fragment) {
         ipv4_state.reassembly_buffers[buf_index].src = header->src_addr;
         ipv4_state.reassembly_buffers[buf_index].dest = header->dest_addr;
         ipv4_state.reassembly_buffers[buf_index].protocol = header->protocol;
-        ipv4_state.reassembly_buffers[buf_index].timestamp = 0; // TODO: Get current time
         ipv4_state.reassembly_buffers[buf_index].total_length = 0;
         ipv4_state.reassembly_buffers[buf_index].fragment_count = 0;
-        memset(ipv4_state.reassembly_buffers[buf_index].fragments, 0, MAX_FRAGMENTS);
+        memset(ipv4_state.reassembly_buffers[buf_index].fragments, 0,
+               sizeof(ipv4_state.reassembly_buffers[buf_index].fragments));
         
         // Allocate data buffer
-        ipv4_state.reassembly_buffers[buf_index].data = pmm_alloc_blocks(
-            (IPV4_MAX_PACKET_SIZE + PAGE_SIZE - 1) / PAGE_SIZE);
+        ipv4_state.reassembly_buffers[buf_index].data = pmm_alloc_blocks_for(REASSEMBLY_BUFFER_BLOCKS,
+                                                                             PAGE_OWNER_NET);
         if (!ipv4_state.reassembly_buffers[buf_index].data) {
             ipv4_state.stats.reassembly_failures++;
             return NULL;
         }
+        
+        // Drop the datagram if it is not complete in time
+        timer_setup(&ipv4_state.reassembly_buffers[buf_index].timer,
+                    ipv4_reassembly_timeout, (void*)(intptr_t)buf_index);
+        timer_start(&ipv4_state.reassembly_buffers[buf_index].timer, FRAGMENT_TIMEOUT);
     }
     
     // Copy fragment data
-    uint16_t data_len = header->total_length - sizeof(ipv4_header_t);
     memcpy(ipv4_state.reassembly_buffers[buf_index].data + offset,
            fragment->data + sizeof(ipv4_header_t), data_len);
     
-    // Mark fragment as received
-    ipv4_state.reassembly_buffers[buf_index].fragments[offset / 8] = true;
+    // Mark every 8-byte block covered by this fragment as received
+    uint32_t* bitmap = ipv4_state.reassembly_buffers[buf_index].fragments;
+    for (uint32_t block = offset / 8; block < (offset + data_len + 7) / 8; block++) {
+        bitmap[block / 32] |= 1u << (block % 32);
+    }
     ipv4_state.reassembly_buffers[buf_index].fragment_count++;
     
     // Update total length if this is the last fragment
-    if (!(header->flags_offset & IPV4_FLAG_MORE_FRAGMENTS)) {
+    if (!more_fragments) {
         ipv4_state.reassembly_buffers[buf_index].total_length = offset + data_len;
     }
     
     // Check if packet is complete
     if (ipv4_state.reassembly_buffers[buf_index].total_length > 0) {
-        uint16_t num_fragments = (ipv4_state.reassembly_buffers[buf_index].total_length + 7) / 8;
+        uint32_t num_blocks = (ipv4_state.reassembly_buffers[buf_index].total_length + 7) / 8;
         bool complete = true;
         
-        for (int i = 0; i < num_fragments; i++) {
-            if (!ipv4_state.reassembly_buffers[buf_index].fragments[i]) {
+        for (uint32_t block = 0; block < num_blocks; block++) {
+            if (!(bitmap[block / 32] & (1u << (block % 32)))) {
                 complete = false;
                 break;
             }
@@ -420,8 +513,8 @@ net_packet_t* ipv4_reassemble_packet(net_packet_t* fragment) {
             new_header->checksum = ipv4_checksum(new_header, sizeof(ipv4_header_t));
             
             // Free reassembly buffer
-            pmm_free_blocks(ipv4_state.reassembly_buffers[buf_index].data,
-                (IPV4_MAX_PACKET_SIZE + PAGE_SIZE - 1) / PAGE_SIZE);
+            timer_cancel(&ipv4_state.reassembly_buffers[buf_index].timer);
+            pmm_free_blocks(ipv4_state.reassembly_buffers[buf_index].data, REASSEMBLY_BUFFER_BLOCKS);
             memset(&ipv4_state.reassembly_buffers[buf_index], 0, sizeof(ipv4_state.reassembly_buffers[0]));
             
             return packet;
@@ -439,7 +532,7 @@ bool ipv4_add_route(const ipv4_addr_t* network, const ipv4_addr_t* netmask,
     }
     
     // Allocate new route
-    ipv4_route_t* route = pmm_alloc_blocks((sizeof(ipv4_route_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    ipv4_route_t* route = kmalloc(sizeof(ipv4_route_t));
     if (!route) {
         return false;
     }
@@ -477,7 +570,7 @@ bool ipv4_remove_route(const ipv4_addr_t* network, const ipv4_addr_t* netmask) {
             ipv4_addr_equals(&(*ptr)->netmask, netmask)) {
             ipv4_route_t* route = *ptr;
             *ptr = route->next;
-            pmm_free_blocks(route, (sizeof(ipv4_route_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+            kfree(route);
             return true;
         }
         ptr = &(*ptr)->next;
@@ -519,7 +612,7 @@ void ipv4_flush_routes(void) {
     while (ipv4_state.routes) {
         ipv4_route_t* route = ipv4_state.routes;
         ipv4_state.routes = route->next;
-        pmm_free_blocks(route, (sizeof(ipv4_route_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+        kfree(route);
     }
 }
 
@@ -529,14 +622,17 @@ bool ipv4_configure_interface(net_interface_t* iface, const ipv4_config_t* confi
         return false;
     }
     
-    // Store configuration in interface private data
-    ipv4_config_t* iface_config = pmm_alloc_blocks((sizeof(ipv4_config_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    // Store configuration in the interface's IPv4 slot
+    ipv4_config_t* iface_config = (ipv4_config_t*)iface->ipv4_data;
     if (!iface_config) {
-        return false;
+        iface_config = kmalloc(sizeof(ipv4_config_t));
+        if (!iface_config) {
+            return false;
+        }
     }
     
     *iface_config = *config;
-    iface->driver_data = iface_config;
+    iface->ipv4_data = iface_config;
     
     return true;
 }
@@ -546,7 +642,7 @@ bool ipv4_get_interface_config(net_interface_t* iface, ipv4_config_t* config) {
         return false;
     }
     
-    ipv4_config_t* iface_config = (ipv4_config_t*)iface->driver_data;
+    ipv4_config_t* iface_config = (ipv4_config_t*)iface->ipv4_data;
     if (!iface_config) {
         return false;
     }
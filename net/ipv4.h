@@ -88,6 +88,11 @@ typedef struct {
     uint64_t fragmentation_failures;
 } ipv4_stats_t;
 
+// IPv4 header of a received packet whose IP header has been pulled
+static inline ipv4_header_t* ipv4_get_header(const net_packet_t* packet) {
+    return (ipv4_header_t*)packet->network_header;
+}
+
 // Function declarations
 void ipv4_init(void);
 void ipv4_cleanup(void);
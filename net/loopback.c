@@ -0,0 +1,99 @@
+#include "loopback.h"
+#include "ipv4.h"
+#include <string.h>
+
+// Loopback state: a ring of packet pointers. Sent packets are queued as-is
+// and handed back by receive, so no payload is ever copied.
+static struct {
+    net_interface_t iface;
+    net_packet_t* queue[LOOPBACK_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    bool registered;
+} loopback_state;
+
+static bool loopback_iface_init(net_interface_t* iface) {
+    iface->flags |= NET_IF_FLAG_UP | NET_IF_FLAG_RUNNING;
+    return true;
+}
+
+static void loopback_iface_cleanup(net_interface_t* iface) {
+    (void)iface;
+    
+    // Drop anything still queued
+    while (loopback_state.tail != loopback_state.head) {
+        net_free_packet(loopback_state.queue[loopback_state.tail % LOOPBACK_QUEUE_SIZE]);
+        loopback_state.tail++;
+    }
+}
+
+// Queue the packet for reception (takes ownership)
+static bool loopback_send(net_interface_t* iface, net_packet_t* packet) {
+    if (loopback_state.head - loopback_state.tail >= LOOPBACK_QUEUE_SIZE) {
+        iface->stats.tx_dropped++;
+        return false;
+    }
+    
+    loopback_state.queue[loopback_state.head % LOOPBACK_QUEUE_SIZE] = packet;
+    loopback_state.head++;
+    return true;
+}
+
+// Dequeue the next looped-back packet
+static net_packet_t* loopback_receive(net_interface_t* iface) {
+    (void)iface;
+    
+    if (loopback_state.tail == loopback_state.head) {
+        return NULL;
+    }
+    
+    net_packet_t* packet = loopback_state.queue[loopback_state.tail % LOOPBACK_QUEUE_SIZE];
+    loopback_state.tail++;
+    return packet;
+}
+
+// Register the loopback interface
+bool loopback_init(void) {
+    if (loopback_state.registered) {
+        return true;
+    }
+    
+    memset(&loopback_state, 0, sizeof(loopback_state));
+    
+    net_interface_t* iface = &loopback_state.iface;
+    strcpy(iface->name, LOOPBACK_NAME);
+    iface->type = NET_IF_TYPE_LOOPBACK;
+    iface->mtu = LOOPBACK_MTU;
+    iface->init = loopback_iface_init;
+    iface->cleanup = loopback_iface_cleanup;
+    iface->send = loopback_send;
+    iface->receive = loopback_receive;
+    
+    if (!net_register_interface(iface)) {
+        return false;
+    }
+    loopback_state.registered = true;
+    
+    // 127.0.0.1/8
+    ipv4_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.addr = (ipv4_addr_t){ { 127, 0, 0, 1 } };
+    config.netmask = (ipv4_addr_t){ { 255, 0, 0, 0 } };
+    config.broadcast = (ipv4_addr_t){ { 127, 255, 255, 255 } };
+    if (!ipv4_configure_interface(iface, &config)) {
+        return false;
+    }
+    
+    ipv4_addr_t network = { { 127, 0, 0, 0 } };
+    return ipv4_add_route(&network, &config.netmask, NULL, iface, 0);
+}
+
+// Get the loopback interface
+net_interface_t* loopback_get_interface(void) {
+    return loopback_state.registered ? &loopback_state.iface : NULL;
+}
+
+// Number of queued packets
+uint32_t loopback_pending(void) {
+    return loopback_state.head - loopback_state.tail;
+}
@@ -0,0 +1,24 @@
+#ifndef REXUS_LOOPBACK_H
+#define REXUS_LOOPBACK_H
+
+#include "net.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Loopback interface name and MTU
+#define LOOPBACK_NAME "lo"
+#define LOOPBACK_MTU 65535
+
+// Number of packets that can be queued between send and receive
+#define LOOPBACK_QUEUE_SIZE 256
+
+// Register the loopback interface and configure 127.0.0.1/8 on it
+bool loopback_init(void);
+
+// Get the loopback interface (NULL before loopback_init)
+net_interface_t* loopback_get_interface(void);
+
+// Number of packets waiting in the loopback receive queue
+uint32_t loopback_pending(void);
+
+#endif /* REXUS_LOOPBACK_H */
@@ -1,10 +1,14 @@
 #include "net.h"
+#include "capture.h"
 #include "../mem/pmm.h"
+#include "../core/spinlock.h"
 #include "../drivers/vga.h"
 #include <string.h>
 
-// Network subsystem state
+// Network subsystem state. The lock protects changes to the interface
+// list; interfaces are only unlinked, never freed, while it is walked.
 static struct {
+    spinlock_t lock;
     net_interface_t* interfaces;
     uint32_t interface_count;
     net_protocol_handler_t protocol_handlers[16];
@@ -15,10 +19,12 @@ static struct {
 // Initialize network subsystem
 void net_init(void) {
     memset(&net_state, 0, sizeof(net_state));
+    spin_init(&net_state.lock, "net_interfaces");
+    lock_stats_register(&net_state.lock.stats);
     
     // Allocate packet pool (64KB initially)
     net_state.packet_pool_size = 65536;
-    net_state.packet_pool = pmm_alloc_blocks(net_state.packet_pool_size / PAGE_SIZE);
+    net_state.packet_pool = pmm_alloc_blocks_for(net_state.packet_pool_size / PAGE_SIZE, PAGE_OWNER_NET);
     
     if (!net_state.packet_pool) {
         vga_puts("NET: Failed to allocate packet pool\n");
@@ -60,6 +66,7 @@ bool net_register_interface(net_interface_t* iface) {
     }
     
     // Add to interface list
+    unsigned long flags = spin_lock_irqsave(&net_state.lock);
     if (!net_state.interfaces) {
         net_state.interfaces = iface;
     } else {
@@ -71,6 +78,7 @@ bool net_register_interface(net_interface_t* iface) {
     }
     
     net_state.interface_count++;
+    spin_unlock_irqrestore(&net_state.lock, flags);
     
     vga_puts("NET: Registered interface ");
     vga_puts(iface->name);
@@ -86,6 +94,8 @@ void net_unregister_interface(net_interface_t* iface) {
     }
     
     // Remove from interface list
+    unsigned long flags = spin_lock_irqsave(&net_state.lock);
+    bool found = true;
     if (net_state.interfaces == iface) {
         net_state.interfaces = iface->next;
     } else {
@@ -95,39 +105,40 @@ void net_unregister_interface(net_interface_t* iface) {
         }
         if (prev) {
             prev->next = iface->next;
+        } else {
+            found = false;
         }
     }
+    if (found) {
+        net_state.interface_count--;
+    }
+    spin_unlock_irqrestore(&net_state.lock, flags);
     
     // Clean up the interface
     if (iface->cleanup) {
         iface->cleanup(iface);
     }
-    
-    net_state.interface_count--;
 }
 
 // Get interface by name
 net_interface_t* net_get_interface(const char* name) {
+    unsigned long flags = spin_lock_irqsave(&net_state.lock);
     net_interface_t* iface = net_state.interfaces;
-    while (iface) {
-        if (strcmp(iface->name, name) == 0) {
-            return iface;
-        }
+    while (iface && strcmp(iface->name, name) != 0) {
         iface = iface->next;
     }
-    return NULL;
+    spin_unlock_irqrestore(&net_state.lock, flags);
+    return iface;
 }
 
 // Get interface by index
 net_interface_t* net_get_interface_by_index(uint32_t index) {
-    if (index >= net_state.interface_count) {
-        return NULL;
-    }
-    
-    net_interface_t* iface = net_state.interfaces;
+    unsigned long flags = spin_lock_irqsave(&net_state.lock);
+    net_interface_t* iface = index < net_state.interface_count ? net_state.interfaces : NULL;
     while (index-- > 0 && iface) {
         iface = iface->next;
     }
+    spin_unlock_irqrestore(&net_state.lock, flags);
     return iface;
 }
 
@@ -136,26 +147,40 @@ uint32_t net_get_interface_count(void) {
     return net_state.interface_count;
 }
 
-// Allocate a network packet
+// Allocate a network packet with the default headroom
 net_packet_t* net_alloc_packet(size_t size) {
+    return net_alloc_packet_headroom(size, NET_PACKET_HEADROOM);
+}
+
+// Allocate a network packet with size bytes of data and the given headroom
+net_packet_t* net_alloc_packet_headroom(size_t size, size_t headroom) {
     if (size > NET_MAX_PACKET_SIZE) {
         return NULL;
     }
     
     // Allocate packet structure
-    net_packet_t* packet = pmm_alloc_block();
+    net_packet_t* packet = pmm_alloc_block_for(PAGE_OWNER_NET);
     if (!packet) {
         return NULL;
     }
     
-    // Allocate packet data
-    packet->data = pmm_alloc_blocks((size + PAGE_SIZE - 1) / PAGE_SIZE);
-    if (!packet->data) {
+    // Allocate packet buffer (headroom + data)
+    size_t blocks = (headroom + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (blocks == 0) {
+        blocks = 1;
+    }
+    packet->head = pmm_alloc_blocks_for(blocks, PAGE_OWNER_NET);
+    if (!packet->head) {
         pmm_free_block(packet);
         return NULL;
     }
     
+    packet->end = packet->head + blocks * PAGE_SIZE;
+    packet->data = packet->head + headroom;
+    packet->tail = packet->data + size;
     packet->length = size;
+    packet->network_header = NULL;
+    packet->iface = NULL;
     packet->protocol = NET_PROTO_NONE;
     packet->priority = 0;
     packet->private_data = NULL;
@@ -169,16 +194,20 @@ void net_free_packet(net_packet_t* packet) {
         return;
     }
     
-    if (packet->data) {
-        pmm_free_blocks(packet->data, (packet->length + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (packet->head) {
+        pmm_free_blocks(packet->head, (packet->end - packet->head) / PAGE_SIZE);
     }
     
     pmm_free_block(packet);
 }
 
-// Send a packet through an interface
+// Send a packet through an interface (consumes the packet)
 bool net_send_packet(net_interface_t* iface, net_packet_t* packet) {
-    if (!iface || !packet || !iface->send) {
+    if (!packet) {
+        return false;
+    }
+    if (!iface || !iface->send) {
+        net_free_packet(packet);
         return false;
     }
     
@@ -186,10 +215,14 @@ bool net_send_packet(net_interface_t* iface, net_packet_t* packet) {
     iface->stats.tx_packets++;
     iface->stats.tx_bytes += packet->length;
     
-    // Send the packet
+    NET_CAPTURE_TAP(iface, packet, NET_CAPTURE_TX);
+    
+    // Send the packet; the driver owns it on success
+    packet->iface = iface;
     bool success = iface->send(iface, packet);
     if (!success) {
         iface->stats.tx_errors++;
+        net_free_packet(packet);
     }
     
     return success;
@@ -207,11 +240,26 @@ net_packet_t* net_receive_packet(net_interface_t* iface) {
         // Update statistics
         iface->stats.rx_packets++;
         iface->stats.rx_bytes += packet->length;
+        packet->iface = iface;
+        
+        NET_CAPTURE_TAP(iface, packet, NET_CAPTURE_RX);
     }
     
     return packet;
 }
 
+// Hand a packet to the handler registered for packet->protocol
+void net_deliver_packet(net_interface_t* iface, net_packet_t* packet) {
+    if (packet->protocol < sizeof(net_state.protocol_handlers) / sizeof(net_protocol_handler_t) &&
+        net_state.protocol_handlers[packet->protocol]) {
+        net_state.protocol_handlers[packet->protocol](iface, packet);
+    } else {
+        // No handler for this protocol
+        iface->stats.rx_dropped++;
+        net_free_packet(packet);
+    }
+}
+
 // Register a protocol handler
 bool net_register_protocol_handler(net_protocol_t proto, net_protocol_handler_t handler) {
     if (proto >= sizeof(net_state.protocol_handlers) / sizeof(net_protocol_handler_t)) {
@@ -229,20 +277,13 @@ void net_unregister_protocol_handler(net_protocol_t proto) {
     }
 }
 
-// Process received packets
+// Process received packets until every interface's receive queue is empty
 void net_process_rx_queue(void) {
     net_interface_t* iface = net_state.interfaces;
     while (iface) {
-        net_packet_t* packet = net_receive_packet(iface);
-        if (packet) {
-            // Handle the packet based on protocol
-            if (packet->protocol < sizeof(net_state.protocol_handlers) / sizeof(net_protocol_handler_t) &&
-                net_state.protocol_handlers[packet->protocol]) {
-                net_state.protocol_handlers[packet->protocol](iface, packet);
-            } else {
-                // No handler for this protocol
-                net_free_packet(packet);
-            }
+        net_packet_t* packet;
+        while ((packet = net_receive_packet(iface)) != NULL) {
+            net_deliver_packet(iface, packet);
         }
         iface = iface->next;
     }
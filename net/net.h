@@ -5,13 +5,18 @@
 #include <stdbool.h>
 #include <stddef.h>
 
-// Maximum packet size
-#define NET_MAX_PACKET_SIZE 1518
+// Maximum packet size (a reassembled IPv4 datagram; link MTUs are per interface)
+#define NET_MAX_PACKET_SIZE 65535
 #define NET_MIN_PACKET_SIZE 64
 
 // Maximum number of network interfaces
 #define NET_MAX_INTERFACES 4
 
+// Default headroom reserved in front of packet data so that an Ethernet
+// header (14), IPv4 header (up to 60) and TCP header (up to 60) can be
+// prepended without copying. Rounded up to a 16-byte boundary.
+#define NET_PACKET_HEADROOM 144
+
 // Protocol types
 typedef enum {
     NET_PROTO_NONE = 0,
@@ -42,10 +47,25 @@ typedef enum {
 #define NET_IF_FLAG_MULTICAST 0x08
 #define NET_IF_FLAG_BROADCAST 0x10
 
+struct net_interface;
+
 // Network packet structure
+//
+// The buffer is laid out as head <= data <= tail <= end. Protocol layers
+// prepend their headers with net_packet_push() and strip them on receive
+// with net_packet_pull(); length always equals tail - data.
+//
+// Packets are consumed by whoever they are handed to: net_send_packet()
+// and the driver send op take ownership whether or not transmission
+// succeeds, and protocol handlers free the packets delivered to them.
 typedef struct {
-    uint8_t* data;
+    uint8_t* head;      // Start of the allocated buffer
+    uint8_t* data;      // Start of valid data
+    uint8_t* tail;      // End of valid data
+    uint8_t* end;       // End of the allocated buffer
     size_t length;
+    uint8_t* network_header;        // Start of the network layer header
+    struct net_interface* iface;    // Interface the packet was received on / sent through
     net_protocol_t protocol;
     uint8_t priority;
     void* private_data;
@@ -87,6 +107,9 @@ typedef struct net_interface {
     // Private driver data
     void* driver_data;
     
+    // IPv4 configuration (ipv4_config_t), owned by the IPv4 layer
+    void* ipv4_data;
+    
     // Link to next interface
     struct net_interface* next;
 } net_interface_t;
@@ -102,9 +125,70 @@ uint32_t net_get_interface_count(void);
 
 // Packet management
 net_packet_t* net_alloc_packet(size_t size);
+net_packet_t* net_alloc_packet_headroom(size_t size, size_t headroom);
 void net_free_packet(net_packet_t* packet);
 bool net_send_packet(net_interface_t* iface, net_packet_t* packet);
 net_packet_t* net_receive_packet(net_interface_t* iface);
+void net_deliver_packet(net_interface_t* iface, net_packet_t* packet);
+
+// Bytes available in front of the packet data
+static inline size_t net_packet_headroom(const net_packet_t* packet) {
+    return (size_t)(packet->data - packet->head);
+}
+
+// Bytes available after the packet data
+static inline size_t net_packet_tailroom(const net_packet_t* packet) {
+    return (size_t)(packet->end - packet->tail);
+}
+
+// Reserve headroom in an empty packet (moves data and tail forward)
+static inline bool net_packet_reserve(net_packet_t* packet, size_t len) {
+    if (packet->length != 0 || len > net_packet_tailroom(packet)) {
+        return false;
+    }
+    packet->data += len;
+    packet->tail += len;
+    return true;
+}
+
+// Prepend len bytes to the packet, returns the new start of data
+static inline uint8_t* net_packet_push(net_packet_t* packet, size_t len) {
+    if (len > net_packet_headroom(packet)) {
+        return NULL;
+    }
+    packet->data -= len;
+    packet->length += len;
+    return packet->data;
+}
+
+// Remove len bytes from the front of the packet, returns the new start of data
+static inline uint8_t* net_packet_pull(net_packet_t* packet, size_t len) {
+    if (len > packet->length) {
+        return NULL;
+    }
+    packet->data += len;
+    packet->length -= len;
+    return packet->data;
+}
+
+// Append len bytes to the packet, returns a pointer to the appended area
+static inline uint8_t* net_packet_put(net_packet_t* packet, size_t len) {
+    if (len > net_packet_tailroom(packet)) {
+        return NULL;
+    }
+    uint8_t* old_tail = packet->tail;
+    packet->tail += len;
+    packet->length += len;
+    return old_tail;
+}
+
+// Cut the packet down to len bytes (no-op if already shorter)
+static inline void net_packet_trim(net_packet_t* packet, size_t len) {
+    if (len < packet->length) {
+        packet->length = len;
+        packet->tail = packet->data + len;
+    }
+}
 
 // Protocol handlers
 typedef void (*net_protocol_handler_t)(net_interface_t* iface, net_packet_t* packet);
@@ -0,0 +1,166 @@
+#include "netbench.h"
+#include "loopback.h"
+#include "ipv4.h"
+#include "udp.h"
+#include "tcp.h"
+#include "../core/hal.h"
+#include "../arch/x86/cpu.h"
+#include "../drivers/console.h"
+#include <string.h>
+
+// Benchmark parameters
+#define NETBENCH_UDP_PACKETS   10000
+#define NETBENCH_UDP_PAYLOAD   64
+#define NETBENCH_RTT_ROUNDS    1000
+#define NETBENCH_TCP_BYTES     (1024 * 1024)
+#define NETBENCH_TCP_CHUNK     1460
+
+// Ports used by the benchmark sockets
+#define NETBENCH_PORT_A 7000
+#define NETBENCH_PORT_B 7001
+#define NETBENCH_PORT_C 7002
+#define NETBENCH_PORT_D 7003
+
+static const ipv4_addr_t netbench_addr = { { 127, 0, 0, 1 } };
+static uint8_t netbench_buf[2048];
+static uint32_t netbench_khz;
+
+// Events per second for count events that took cycles TSC cycles
+static uint32_t netbench_per_second(uint32_t count, uint32_t cycles) {
+    uint32_t per_event = count ? cycles / count : 0;
+    if (!per_event) {
+        return 0;
+    }
+    return (netbench_khz / per_event) * 1000 +
+           ((netbench_khz % per_event) * 1000) / per_event;
+}
+
+// UDP one-way packet rate: send, loop back, deliver and read
+static void netbench_udp_rate(udp_socket_t* a, udp_socket_t* b) {
+    uint32_t received = 0;
+    
+    uint32_t start = (uint32_t)rdtsc();
+    for (uint32_t i = 0; i < NETBENCH_UDP_PACKETS; i++) {
+        udp_send(a, &netbench_addr, NETBENCH_PORT_B, netbench_buf, NETBENCH_UDP_PAYLOAD);
+        net_process_rx_queue();
+        if (udp_receive(b, NULL, NULL, netbench_buf, sizeof(netbench_buf)) > 0) {
+            received++;
+        }
+    }
+    uint32_t cycles = (uint32_t)rdtsc() - start;
+    
+    console_printf("UDP:  %d/%d packets, %d cycles/packet, %d packets/s\n",
+                   received, NETBENCH_UDP_PACKETS, cycles / NETBENCH_UDP_PACKETS,
+                   netbench_per_second(NETBENCH_UDP_PACKETS, cycles));
+}
+
+// UDP round-trip latency: ping from a to b and back
+static void netbench_udp_rtt(udp_socket_t* a, udp_socket_t* b) {
+    uint32_t completed = 0;
+    
+    uint32_t start = (uint32_t)rdtsc();
+    for (uint32_t i = 0; i < NETBENCH_RTT_ROUNDS; i++) {
+        udp_send(a, &netbench_addr, NETBENCH_PORT_B, netbench_buf, NETBENCH_UDP_PAYLOAD);
+        net_process_rx_queue();
+        if (udp_receive(b, NULL, NULL, netbench_buf, sizeof(netbench_buf)) == 0) {
+            continue;
+        }
+        
+        udp_send(b, &netbench_addr, NETBENCH_PORT_A, netbench_buf, NETBENCH_UDP_PAYLOAD);
+        net_process_rx_queue();
+        if (udp_receive(a, NULL, NULL, netbench_buf, sizeof(netbench_buf)) > 0) {
+            completed++;
+        }
+    }
+    uint32_t cycles = (uint32_t)rdtsc() - start;
+    uint32_t per_rtt = cycles / NETBENCH_RTT_ROUNDS;
+    
+    console_printf("RTT:  %d/%d round trips, %d cycles, %d ns\n",
+                   completed, NETBENCH_RTT_ROUNDS, per_rtt,
+                   netbench_khz ? (per_rtt * 1000) / (netbench_khz / 1000) : 0);
+}
+
+// TCP bulk throughput between two connected endpoints
+static void netbench_tcp_throughput(void) {
+    tcp_conn_t* client = tcp_create_connection(&netbench_addr, NETBENCH_PORT_C,
+                                               &netbench_addr, NETBENCH_PORT_D, NULL);
+    tcp_conn_t* server = tcp_create_connection(&netbench_addr, NETBENCH_PORT_D,
+                                               &netbench_addr, NETBENCH_PORT_C, NULL);
+    if (!client || !server) {
+        console_puts("TCP:  failed to create connections\n");
+        tcp_close_connection(client);
+        tcp_close_connection(server);
+        return;
+    }
+    
+    // There is no handshake yet; both ends start from the same ISN
+    client->state = TCP_STATE_ESTABLISHED;
+    server->state = TCP_STATE_ESTABLISHED;
+    
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    uint32_t stalls = 0;
+    
+    uint32_t start = (uint32_t)rdtsc();
+    while (received < NETBENCH_TCP_BYTES && stalls < 1000) {
+        uint32_t chunk = NETBENCH_TCP_BYTES - sent;
+        if (chunk > NETBENCH_TCP_CHUNK) {
+            chunk = NETBENCH_TCP_CHUNK;
+        }
+        if (chunk && tcp_send(client, netbench_buf, chunk)) {
+            sent += chunk;
+        }
+        
+        net_process_rx_queue();
+        
+        size_t length = tcp_receive(server, netbench_buf, sizeof(netbench_buf));
+        if (length) {
+            received += length;
+            stalls = 0;
+        } else {
+            stalls++;
+        }
+    }
+    uint32_t cycles = (uint32_t)rdtsc() - start;
+    uint32_t kbytes = received / 1024;
+    
+    console_printf("TCP:  %d KB, %d cycles/KB, %d KB/s\n",
+                   kbytes, kbytes ? cycles / kbytes : 0,
+                   netbench_per_second(kbytes, cycles));
+    
+    tcp_close_connection(client);
+    tcp_close_connection(server);
+}
+
+// netbench console command
+int netbench_command(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    
+    if (!loopback_get_interface()) {
+        console_puts("netbench: loopback interface not available\n");
+        return 1;
+    }
+    
+    netbench_khz = hal_get_cpu_khz();
+    memset(netbench_buf, 0xA5, sizeof(netbench_buf));
+    
+    udp_socket_t* a = udp_create_socket(&netbench_addr, NETBENCH_PORT_A, NULL);
+    udp_socket_t* b = udp_create_socket(&netbench_addr, NETBENCH_PORT_B, NULL);
+    if (!a || !b) {
+        console_puts("netbench: failed to create UDP sockets\n");
+        udp_close_socket(a);
+        udp_close_socket(b);
+        return 1;
+    }
+    
+    console_printf("netbench over %s, TSC %d MHz\n", LOOPBACK_NAME, netbench_khz / 1000);
+    netbench_udp_rate(a, b);
+    netbench_udp_rtt(a, b);
+    
+    udp_close_socket(a);
+    udp_close_socket(b);
+    
+    netbench_tcp_throughput();
+    return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef REXUS_NETBENCH_H
+#define REXUS_NETBENCH_H
+
+// Console command: UDP packet rate, TCP throughput and UDP round-trip
+// latency measured over the loopback interface
+int netbench_command(int argc, char* argv[]);
+
+#endif /* REXUS_NETBENCH_H */
@@ -1,5 +1,7 @@
 #include "tcp.h"
 #include "../mem/pmm.h"
+#include "../mem/kmalloc.h"
+#include "../core/spinlock.h"
 #include "../drivers/vga.h"
 #include <string.h>
 #include <stdio.h>
@@ -13,8 +15,9 @@
 #define TCP_DEFAULT_RETRANS_TIME 1000
 #define TCP_DEFAULT_KEEPALIVE    7200000
 
-// TCP subsystem state
+// TCP subsystem state; the lock protects the connection list
 static struct {
+    spinlock_t lock;
     tcp_conn_t* connections;
     uint32_t connection_count;
     uint32_t current_time;  // TODO: Get from system timer
@@ -23,6 +26,9 @@ static struct {
 // Initialize TCP subsystem
 void tcp_init(void) {
     memset(&tcp_state, 0, sizeof(tcp_state));
+    spin_init(&tcp_state.lock, "tcp_connections");
+    lock_stats_register(&tcp_state.lock.stats);
+    net_register_protocol_handler(NET_PROTO_TCP, tcp_receive_packet);
     vga_puts("TCP: Protocol initialized\n");
 }
 
@@ -45,13 +51,8 @@ tcp_conn_t* tcp_create_connection(const ipv4_addr_t* local_addr, uint16_t local_
         return NULL;
     }
     
-    // Check connection limit
-    if (tcp_state.connection_count >= MAX_TCP_CONNECTIONS) {
-        return NULL;
-    }
-    
     // Allocate connection structure
-    tcp_conn_t* conn = pmm_alloc_blocks((sizeof(tcp_conn_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    tcp_conn_t* conn = kmalloc(sizeof(tcp_conn_t));
     if (!conn) {
         return NULL;
     }
@@ -80,12 +81,12 @@ tcp_conn_t* tcp_create_connection(const ipv4_addr_t* local_addr, uint16_t local_
     }
     
     // Allocate buffers
-    conn->send_buf = pmm_alloc_blocks((conn->config.window_size + PAGE_SIZE - 1) / PAGE_SIZE);
-    conn->recv_buf = pmm_alloc_blocks((conn->config.window_size + PAGE_SIZE - 1) / PAGE_SIZE);
+    conn->send_buf = pmm_alloc_blocks_for((conn->config.window_size + PAGE_SIZE - 1) / PAGE_SIZE, PAGE_OWNER_NET);
+    conn->recv_buf = pmm_alloc_blocks_for((conn->config.window_size + PAGE_SIZE - 1) / PAGE_SIZE, PAGE_OWNER_NET);
     if (!conn->send_buf || !conn->recv_buf) {
         if (conn->send_buf) pmm_free_blocks(conn->send_buf, (conn->config.window_size + PAGE_SIZE - 1) / PAGE_SIZE);
         if (conn->recv_buf) pmm_free_blocks(conn->recv_buf, (conn->config.window_size + PAGE_SIZE - 1) / PAGE_SIZE);
-        pmm_free_blocks(conn, (sizeof(tcp_conn_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+        kfree(conn);
         return NULL;
     }
     
@@ -99,10 +100,22 @@ tcp_conn_t* tcp_create_connection(const ipv4_addr_t* local_addr, uint16_t local_
     conn->rto = conn->config.retransmit_time;
     conn->keepalive = tcp_state.current_time + conn->config.keepalive_time;
     
-    // Add to connection list
-    conn->next = tcp_state.connections;
-    tcp_state.connections = conn;
-    tcp_state.connection_count++;
+    // Check the connection limit and add to the connection list
+    unsigned long flags = spin_lock_irqsave(&tcp_state.lock);
+    bool available = tcp_state.connection_count < MAX_TCP_CONNECTIONS;
+    if (available) {
+        conn->next = tcp_state.connections;
+        tcp_state.connections = conn;
+        tcp_state.connection_count++;
+    }
+    spin_unlock_irqrestore(&tcp_state.lock, flags);
+    
+    if (!available) {
+        pmm_free_blocks(conn->send_buf, (conn->config.window_size + PAGE_SIZE - 1) / PAGE_SIZE);
+        pmm_free_blocks(conn->recv_buf, (conn->config.window_size + PAGE_SIZE - 1) / PAGE_SIZE);
+        kfree(conn);
+        return NULL;
+    }
     
     return conn;
 }
@@ -114,6 +127,7 @@ void tcp_close_connection(tcp_conn_t* conn) {
     }
     
     // Remove from connection list
+    unsigned long flags = spin_lock_irqsave(&tcp_state.lock);
     tcp_conn_t** ptr = &tcp_state.connections;
     while (*ptr) {
         if (*ptr == conn) {
@@ -123,6 +137,7 @@ void tcp_close_connection(tcp_conn_t* conn) {
         }
         ptr = &(*ptr)->next;
     }
+    spin_unlock_irqrestore(&tcp_state.lock, flags);
     
     // Free buffers
     if (conn->send_buf) {
@@ -133,7 +148,7 @@ void tcp_close_connection(tcp_conn_t* conn) {
     }
     
     // Free connection structure
-    pmm_free_blocks(conn, (sizeof(tcp_conn_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    kfree(conn);
 }
 
 // Send data over TCP connection
@@ -159,11 +174,74 @@ bool tcp_send(tcp_conn_t* conn, const void* data, size_t length) {
     // Update statistics
     conn->stats.bytes_sent += length;
     
-    // TODO: Schedule transmission
+    // Transmit what the peer's window allows right away
+    tcp_output(conn);
     
     return true;
 }
 
+// Build and send a single segment carrying data[0..length)
+static bool tcp_send_segment(tcp_conn_t* conn, uint8_t flags, uint32_t seq,
+                             const uint8_t* data, size_t length) {
+    net_packet_t* packet = net_alloc_packet(length);
+    if (!packet) {
+        return false;
+    }
+    if (length) {
+        memcpy(packet->data, data, length);
+    }
+    
+    // Prepend TCP header
+    tcp_header_t* header = (tcp_header_t*)net_packet_push(packet, sizeof(tcp_header_t));
+    memset(header, 0, sizeof(tcp_header_t));
+    header->src_port = conn->local_port;
+    header->dest_port = conn->remote_port;
+    header->seq_num = seq;
+    header->ack_num = conn->rcv_nxt;
+    header->data_offset = (sizeof(tcp_header_t) / 4) << 4;
+    header->flags = flags;
+    header->window = conn->rcv_wnd > 0xFFFF ? 0xFFFF : conn->rcv_wnd;
+    header->checksum = tcp_checksum(&conn->local_addr, &conn->remote_addr,
+                                    header, packet->length);
+    
+    packet->protocol = NET_PROTO_TCP;
+    if (!ipv4_send_packet(packet, &conn->remote_addr, IPV4_PROTO_TCP, 0)) {
+        return false;
+    }
+    
+    conn->stats.packets_sent++;
+    return true;
+}
+
+// Transmit buffered data that has not been sent yet, limited by the
+// peer's advertised window and the MSS
+void tcp_output(tcp_conn_t* conn) {
+    if (!conn) {
+        return;
+    }
+    
+    while (conn->state == TCP_STATE_ESTABLISHED) {
+        uint32_t in_flight = conn->snd_nxt - conn->snd_una;
+        if (in_flight >= conn->send_len || in_flight >= conn->snd_wnd) {
+            break;
+        }
+        
+        uint32_t length = conn->send_len - in_flight;
+        if (length > conn->snd_wnd - in_flight) {
+            length = conn->snd_wnd - in_flight;
+        }
+        if (length > conn->config.mss) {
+            length = conn->config.mss;
+        }
+        
+        if (!tcp_send_segment(conn, TCP_FLAG_ACK | TCP_FLAG_PSH, conn->snd_nxt,
+                              conn->send_buf + in_flight, length)) {
+            break;
+        }
+        conn->snd_nxt += length;
+    }
+}
+
 // Receive data from TCP connection
 size_t tcp_receive(tcp_conn_t* conn, void* data, size_t max_length) {
     if (!conn || !data || !max_length) {
@@ -194,30 +272,38 @@ size_t tcp_receive(tcp_conn_t* conn, void* data, size_t max_length) {
     return length;
 }
 
-// Process received TCP packet
+// Process received TCP packet (consumes the packet)
 void tcp_receive_packet(net_interface_t* iface, net_packet_t* packet) {
-    if (!iface || !packet || packet->length < sizeof(tcp_header_t)) {
+    if (!packet) {
+        return;
+    }
+    if (!iface || packet->length < sizeof(tcp_header_t) || !packet->network_header) {
+        net_free_packet(packet);
         return;
     }
     
-    // Get TCP header
+    // Get TCP header and the IPv4 header it arrived with
     tcp_header_t* header = (tcp_header_t*)packet->data;
+    const ipv4_header_t* ip = ipv4_get_header(packet);
     size_t header_len = (header->data_offset >> 4) * 4;
     if (header_len < sizeof(tcp_header_t) || header_len > packet->length) {
+        net_free_packet(packet);
         return;
     }
     
     // Find matching connection
+    unsigned long flags = spin_lock_irqsave(&tcp_state.lock);
     tcp_conn_t* conn = tcp_state.connections;
     while (conn) {
         if (conn->local_port == header->dest_port &&
             conn->remote_port == header->src_port &&
-            ipv4_addr_equals(&conn->local_addr, &packet->dest_addr) &&
-            ipv4_addr_equals(&conn->remote_addr, &packet->src_addr)) {
+            ipv4_addr_equals(&conn->local_addr, &ip->dest_addr) &&
+            ipv4_addr_equals(&conn->remote_addr, &ip->src_addr)) {
             break;
         }
         conn = conn->next;
     }
+    spin_unlock_irqrestore(&tcp_state.lock, flags);
     
     // Handle packet based on connection state
     if (conn) {
@@ -274,12 +360,18 @@ void tcp_receive_packet(net_interface_t* iface, net_packet_t* packet) {
                         // Out of order segment
                         conn->stats.out_of_order++;
                     }
+                    
+                    // Acknowledge what we have so far
+                    tcp_send_segment(conn, TCP_FLAG_ACK, conn->snd_nxt, NULL, 0);
                 }
                 
                 // Handle connection termination
                 if (header->flags & TCP_FLAG_FIN) {
                     // TODO: Handle connection termination
                 }
+                
+                // The window may have opened up
+                tcp_output(conn);
                 break;
                 
             default:
@@ -295,6 +387,8 @@ void tcp_receive_packet(net_interface_t* iface, net_packet_t* packet) {
             // TODO: Send RST
         }
     }
+    
+    net_free_packet(packet);
 }
 
 // Get TCP connection statistics
@@ -387,6 +481,9 @@ bool tcp_parse_options(const tcp_header_t* header, tcp_config_t* config) {
     }
     
     size_t header_len = (header->data_offset >> 4) * 4;
+    if (header_len < sizeof(tcp_header_t)) {
+        return false;
+    }
     size_t options_len = header_len - sizeof(tcp_header_t);
     const uint8_t* options = header->options;
     
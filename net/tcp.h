@@ -166,6 +166,9 @@ void tcp_close_connection(tcp_conn_t* conn);
 // Send data over TCP connection
 bool tcp_send(tcp_conn_t* conn, const void* data, size_t length);
 
+// Transmit buffered, not yet sent data
+void tcp_output(tcp_conn_t* conn);
+
 // Receive data from TCP connection
 size_t tcp_receive(tcp_conn_t* conn, void* data, size_t max_length);
 
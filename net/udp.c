@@ -1,5 +1,7 @@
 #include "udp.h"
 #include "../mem/pmm.h"
+#include "../mem/kmalloc.h"
+#include "../core/spinlock.h"
 #include "../drivers/vga.h"
 #include <string.h>
 #include <stdio.h>
@@ -11,8 +13,9 @@
 #define UDP_DEFAULT_BUFFER_SIZE 8192
 #define UDP_DEFAULT_TIMEOUT     0
 
-// UDP subsystem state
+// UDP subsystem state; the lock protects the socket list
 static struct {
+    spinlock_t lock;
     udp_socket_t* sockets;
     uint32_t socket_count;
 } udp_state;
@@ -20,6 +23,9 @@ static struct {
 // Initialize UDP subsystem
 void udp_init(void) {
     memset(&udp_state, 0, sizeof(udp_state));
+    spin_init(&udp_state.lock, "udp_sockets");
+    lock_stats_register(&udp_state.lock.stats);
+    net_register_protocol_handler(NET_PROTO_UDP, udp_receive_packet);
     vga_puts("UDP: Protocol initialized\n");
 }
 
@@ -41,23 +47,8 @@ udp_socket_t* udp_create_socket(const ipv4_addr_t* local_addr, uint16_t local_po
         return NULL;
     }
     
-    // Check socket limit
-    if (udp_state.socket_count >= MAX_UDP_SOCKETS) {
-        return NULL;
-    }
-    
-    // Check if port is already in use
-    udp_socket_t* socket = udp_state.sockets;
-    while (socket) {
-        if (socket->local_port == local_port &&
-            ipv4_addr_equals(&socket->local_addr, local_addr)) {
-            return NULL;
-        }
-        socket = socket->next;
-    }
-    
     // Allocate socket structure
-    socket = pmm_alloc_blocks((sizeof(udp_socket_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    udp_socket_t* socket = kmalloc(sizeof(udp_socket_t));
     if (!socket) {
         return NULL;
     }
@@ -78,16 +69,33 @@ udp_socket_t* udp_create_socket(const ipv4_addr_t* local_addr, uint16_t local_po
     }
     
     // Allocate receive buffer
-    socket->recv_buf = pmm_alloc_blocks((socket->config.buffer_size + PAGE_SIZE - 1) / PAGE_SIZE);
+    socket->recv_buf = pmm_alloc_blocks_for((socket->config.buffer_size + PAGE_SIZE - 1) / PAGE_SIZE, PAGE_OWNER_NET);
     if (!socket->recv_buf) {
-        pmm_free_blocks(socket, (sizeof(udp_socket_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+        kfree(socket);
         return NULL;
     }
     
-    // Add to socket list
-    socket->next = udp_state.sockets;
-    udp_state.sockets = socket;
-    udp_state.socket_count++;
+    // Check the socket limit and the port, and add to the socket list
+    unsigned long flags = spin_lock_irqsave(&udp_state.lock);
+    bool available = udp_state.socket_count < MAX_UDP_SOCKETS;
+    for (udp_socket_t* other = udp_state.sockets; other && available; other = other->next) {
+        if (other->local_port == local_port &&
+            ipv4_addr_equals(&other->local_addr, local_addr)) {
+            available = false;
+        }
+    }
+    if (available) {
+        socket->next = udp_state.sockets;
+        udp_state.sockets = socket;
+        udp_state.socket_count++;
+    }
+    spin_unlock_irqrestore(&udp_state.lock, flags);
+    
+    if (!available) {
+        pmm_free_blocks(socket->recv_buf, (socket->config.buffer_size + PAGE_SIZE - 1) / PAGE_SIZE);
+        kfree(socket);
+        return NULL;
+    }
     
     return socket;
 }
@@ -99,6 +107,7 @@ void udp_close_socket(udp_socket_t* socket) {
     }
     
     // Remove from socket list
+    unsigned long flags = spin_lock_irqsave(&udp_state.lock);
     udp_socket_t** ptr = &udp_state.sockets;
     while (*ptr) {
         if (*ptr == socket) {
@@ -108,6 +117,7 @@ void udp_close_socket(udp_socket_t* socket) {
         }
         ptr = &(*ptr)->next;
     }
+    spin_unlock_irqrestore(&udp_state.lock, flags);
     
     // Free receive buffer
     if (socket->recv_buf) {
@@ -115,7 +125,7 @@ void udp_close_socket(udp_socket_t* socket) {
     }
     
     // Free socket structure
-    pmm_free_blocks(socket, (sizeof(udp_socket_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    kfree(socket);
 }
 
 // Send UDP datagram
@@ -130,22 +140,20 @@ bool udp_send(udp_socket_t* socket, const ipv4_addr_t* dest_addr, uint16_t dest_
         return false;
     }
     
-    // Allocate packet
-    net_packet_t* packet = net_alloc_packet(sizeof(udp_header_t) + length);
+    // Allocate packet and copy payload
+    net_packet_t* packet = net_alloc_packet(length);
     if (!packet) {
         return false;
     }
+    memcpy(packet->data, data, length);
     
-    // Build UDP header
-    udp_header_t* header = (udp_header_t*)packet->data;
+    // Prepend UDP header
+    udp_header_t* header = (udp_header_t*)net_packet_push(packet, sizeof(udp_header_t));
     header->src_port = socket->local_port;
     header->dest_port = dest_port;
-    header->length = sizeof(udp_header_t) + length;
+    header->length = packet->length;
     header->checksum = 0;
     
-    // Copy data
-    memcpy(packet->data + sizeof(udp_header_t), data, length);
-    
     // Calculate checksum if enabled
     if (socket->config.checksum) {
         header->checksum = udp_checksum(&socket->local_addr, dest_addr,
@@ -154,7 +162,6 @@ bool udp_send(udp_socket_t* socket, const ipv4_addr_t* dest_addr, uint16_t dest_
     
     // Send packet
     packet->protocol = NET_PROTO_UDP;
-    packet->length = header->length;
     bool success = ipv4_send_packet(packet, dest_addr, IPV4_PROTO_UDP, 0);
     
     if (success) {
@@ -199,36 +206,45 @@ size_t udp_receive(udp_socket_t* socket, ipv4_addr_t* src_addr, uint16_t* src_po
     return length;
 }
 
-// Process received UDP packet
+// Process received UDP packet (consumes the packet)
 void udp_receive_packet(net_interface_t* iface, net_packet_t* packet) {
-    if (!iface || !packet || packet->length < sizeof(udp_header_t)) {
+    if (!packet) {
+        return;
+    }
+    if (!iface || packet->length < sizeof(udp_header_t) || !packet->network_header) {
+        net_free_packet(packet);
         return;
     }
     
-    // Get UDP header
+    // Get UDP header and the IPv4 header it arrived with
     udp_header_t* header = (udp_header_t*)packet->data;
-    if (header->length > packet->length) {
+    const ipv4_header_t* ip = ipv4_get_header(packet);
+    if (header->length < sizeof(udp_header_t) || header->length > packet->length) {
+        net_free_packet(packet);
         return;
     }
     
     // Find matching socket
+    unsigned long flags = spin_lock_irqsave(&udp_state.lock);
     udp_socket_t* socket = udp_state.sockets;
     while (socket) {
         if (socket->local_port == header->dest_port &&
-            ipv4_addr_equals(&socket->local_addr, &packet->dest_addr)) {
+            ipv4_addr_equals(&socket->local_addr, &ip->dest_addr)) {
             break;
         }
         socket = socket->next;
     }
+    spin_unlock_irqrestore(&udp_state.lock, flags);
     
     if (socket) {
         // Verify checksum if enabled
         if (socket->config.checksum) {
             uint16_t orig_checksum = header->checksum;
             header->checksum = 0;
-            if (udp_checksum(&packet->src_addr, &packet->dest_addr,
+            if (udp_checksum(&ip->src_addr, &ip->dest_addr,
                            header, header->length) != orig_checksum) {
                 socket->stats.checksum_errors++;
+                net_free_packet(packet);
                 return;
             }
             header->checksum = orig_checksum;
@@ -238,8 +254,9 @@ void udp_receive_packet(net_interface_t* iface, net_packet_t* packet) {
         size_t data_len = header->length - sizeof(udp_header_t);
         
         // Check if there's space in the receive buffer
-        if (socket->recv_len + data_len > socket->config.buffer_size) {
+        if (socket->recv_start + socket->recv_len + data_len > socket->config.buffer_size) {
             socket->stats.buffer_overflows++;
+            net_free_packet(packet);
             return;
         }
         
@@ -255,6 +272,8 @@ void udp_receive_packet(net_interface_t* iface, net_packet_t* packet) {
         // No matching socket
         // TODO: Send ICMP Port Unreachable
     }
+    
+    net_free_packet(packet);
 }
 
 // Get UDP socket statistics
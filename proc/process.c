@@ -1,394 +1,1243 @@
 #include "process.h"
 #include "../arch/x86/gdt.h"
 #include "../mem/pmm.h"
+#include "../arch/x86/cpu.h"
+#include "../arch/x86/smp.h"
+#include "../arch/x86/switch.h"
+#include "../core/spinlock.h"
+#include "sync.h"
+#include "rttrace.h"
 #include "../drivers/vga.h"
 #include <string.h>
 
-// Forward declarations
-static int process_idle(void* arg);
+// The thread running on this CPU
+#define current_thread (this_cpu()->current)
 
-// Process list and current process
-static process_t* process_list = NULL;
-static process_t* current_process = NULL;
+// Per-CPU scheduler state. Each CPU has FIFO run queues of READY
+// threads per priority, with a bitmap of non-empty levels; the running
+// thread is never on a run queue. A thread belongs to the run queue of
+// thread->cpu, and that queue's lock protects its state transitions.
+// Deadline threads sit on a separate queue sorted by absolute deadline,
+// which is served before any priority level (EDF).
+typedef struct {
+    spinlock_t lock;
+    struct {
+        thread_t* head;
+        thread_t* tail;
+    } queues[PROCESS_PRIORITY_LEVELS];
+    uint32_t bitmap;
+    thread_t* edf_head;             // Ready deadline threads, earliest deadline first
+    volatile uint32_t ready;        // Threads on the queues
+    uint32_t rt_utilization;        // Admitted deadline load in 1/1024ths
+    
+    thread_t* idle;                 // This CPU's idle thread
+    thread_t* prev;                 // Thread being switched away from
+    uint32_t slice_ticks;           // Ticks left in the running thread's slice
+    
+    // Statistics
+    uint32_t switches;
+    uint32_t address_switches;
+    uint32_t steals;
+} run_queue_t;
 
-// Next available process ID
+static run_queue_t run_queues[SMP_MAX_CPUS];
+
+// Process list, terminated threads waiting to be freed, and IDs. Thread
+// IDs come from the same counter; a process's first thread has its PID.
+static spinlock_t process_list_lock = SPINLOCK_INIT("process_list");
+static process_t* process_list = NULL;
+static thread_t* zombie_list = NULL;
 static uint32_t next_pid = 1;
 
-// System time (ms)
-static uint32_t system_time = 0;
+// Kernel process owning the idle threads
+static process_t* kernel_process = NULL;
+
+// Timer ticks in a time slice
+#define PROCESS_TIME_SLICE 10
+
+// Serializes admission of deadline threads against every CPU's load
+static spinlock_t rt_admission_lock = SPINLOCK_INIT("rt_admission");
+
+// Insert a deadline thread into the EDF queue behind threads with the
+// same deadline, so equal deadlines run in release order
+static void run_queue_add_edf(run_queue_t* rq, thread_t* thread) {
+    thread_t* prev = NULL;
+    thread_t* next = rq->edf_head;
+    while (next && next->rt_deadline <= thread->rt_deadline) {
+        prev = next;
+        next = next->run_next;
+    }
+    
+    thread->run_prev = prev;
+    thread->run_next = next;
+    if (prev) {
+        prev->run_next = thread;
+    } else {
+        rq->edf_head = thread;
+    }
+    if (next) {
+        next->run_prev = thread;
+    }
+    rq->ready++;
+}
+
+// Append a thread to the tail of its priority's run queue
+static void run_queue_add(run_queue_t* rq, thread_t* thread) {
+    if (thread == rq->idle) {
+        return;
+    }
+    if (thread->rt) {
+        run_queue_add_edf(rq, thread);
+        return;
+    }
+    
+    uint32_t level = thread->priority;
+    thread->run_next = NULL;
+    thread->run_prev = rq->queues[level].tail;
+    if (rq->queues[level].tail) {
+        rq->queues[level].tail->run_next = thread;
+    } else {
+        rq->queues[level].head = thread;
+    }
+    rq->queues[level].tail = thread;
+    rq->bitmap |= 1u << level;
+    rq->ready++;
+}
+
+// Unlink a thread from its run queue
+static void run_queue_remove(run_queue_t* rq, thread_t* thread) {
+    uint32_t level = thread->priority;
+    
+    if (thread->rt) {
+        if (thread->run_prev) {
+            thread->run_prev->run_next = thread->run_next;
+        } else if (rq->edf_head == thread) {
+            rq->edf_head = thread->run_next;
+        } else {
+            return;  // Not queued
+        }
+        if (thread->run_next) {
+            thread->run_next->run_prev = thread->run_prev;
+        }
+        thread->run_next = NULL;
+        thread->run_prev = NULL;
+        rq->ready--;
+        return;
+    }
+    
+    if (thread->run_prev) {
+        thread->run_prev->run_next = thread->run_next;
+    } else if (rq->queues[level].head == thread) {
+        rq->queues[level].head = thread->run_next;
+    } else {
+        return;  // Not queued
+    }
+    if (thread->run_next) {
+        thread->run_next->run_prev = thread->run_prev;
+    } else {
+        rq->queues[level].tail = thread->run_prev;
+    }
+    thread->run_next = NULL;
+    thread->run_prev = NULL;
+    rq->ready--;
+    
+    if (!rq->queues[level].head) {
+        rq->bitmap &= ~(1u << level);
+    }
+}
+
+// Dequeue the deadline thread with the earliest deadline, or else the
+// first thread of the highest non-empty priority level
+static thread_t* run_queue_pop(run_queue_t* rq) {
+    if (rq->edf_head) {
+        thread_t* thread = rq->edf_head;
+        run_queue_remove(rq, thread);
+        return thread;
+    }
+    if (!rq->bitmap) {
+        return NULL;
+    }
+    
+    uint32_t level = 31 - __builtin_clz(rq->bitmap);
+    thread_t* thread = rq->queues[level].head;
+    run_queue_remove(rq, thread);
+    return thread;
+}
+
+// Lock the run queue a thread belongs to. thread->cpu only changes under
+// the old queue's lock, so check it again once the lock is held.
+static run_queue_t* run_queue_lock_thread(thread_t* thread) {
+    for (;;) {
+        uint32_t cpu = thread->cpu;
+        spin_lock(&run_queues[cpu].lock);
+        if (thread->cpu == cpu) {
+            return &run_queues[cpu];
+        }
+        spin_unlock(&run_queues[cpu].lock);
+    }
+}
+
+// Make a blocked thread ready again and kick its CPU if that is another one
+static void thread_make_ready(thread_t* thread) {
+    unsigned long flags = irq_save();
+    run_queue_t* rq = run_queue_lock_thread(thread);
+    uint32_t cpu = thread->cpu;
+    bool queued = false;
+    
+    // A deadline thread waiting for its next release is woken only by it
+    if (thread->state == PROCESS_STATE_BLOCKED && !thread->rt_waiting && !thread->rt_throttled) {
+        timer_cancel(&thread->sleep_timer);
+        thread->state = PROCESS_STATE_READY;
+        run_queue_add(rq, thread);
+        queued = true;
+    }
+    
+    spin_unlock(&rq->lock);
+    if (queued) {
+        smp_send_resched(cpu);
+    }
+    irq_restore(flags);
+}
+
+// Sleep timer callback: put the thread back on its run queue
+static void thread_wake(void* data) {
+    thread_make_ready((thread_t*)data);
+}
+
+// Take a thread off whichever scheduler queue it is on (queue locked)
+static void thread_dequeue(run_queue_t* rq, thread_t* thread) {
+    if (thread->state == PROCESS_STATE_READY) {
+        run_queue_remove(rq, thread);
+    } else if (thread->state == PROCESS_STATE_BLOCKED) {
+        timer_cancel(&thread->sleep_timer);
+    }
+}
+
+// Unlink a process from the process list (list locked)
+static void process_list_remove(process_t* proc) {
+    process_t** link = &process_list;
+    while (*link && *link != proc) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = proc->next;
+    }
+}
+
+// Free terminated threads that no CPU is still running on, and the
+// processes whose last thread they were
+static void process_reap(void) {
+    spin_lock(&process_list_lock);
+    
+    thread_t** link = &zombie_list;
+    while (*link) {
+        thread_t* zombie = *link;
+        
+        // Still on a CPU's stack, or its wake-up or release callback is
+        // under way on CPU 0: leave it for a later pass
+        if (__atomic_load_n(&zombie->on_cpu, __ATOMIC_ACQUIRE) ||
+            timer_running(&zombie->sleep_timer) || timer_running(&zombie->rt_timer)) {
+            link = &zombie->run_next;
+            continue;
+        }
+        *link = zombie->run_next;
+        
+        // Remove from its process
+        process_t* proc = zombie->parent;
+        thread_t** sibling = &proc->threads;
+        while (*sibling && *sibling != zombie) {
+            sibling = &(*sibling)->process_next;
+        }
+        if (*sibling) {
+            *sibling = zombie->process_next;
+        }
+        
+        // Free thread resources
+        fpu_release(&zombie->fpu);
+        if (zombie->stack) {
+            vmm_free_kernel_stack((void*)zombie->stack);
+        }
+        pmm_free_block(zombie);
+        
+        // The address space goes with the last thread
+        if (!proc->threads) {
+            process_list_remove(proc);
+            vm_space_destroy(proc->vm);
+            if (proc->page_directory) {
+                vmm_free_directory(proc->page_directory);
+            }
+            pmm_free_block(proc);
+        }
+    }
+    
+    spin_unlock(&process_list_lock);
+}
+
+// Add a process to the end of the process list (list locked)
+static void process_list_add(process_t* proc) {
+    process_t** link = &process_list;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = proc;
+}
+
+// Add a thread to the end of its process's thread list (list locked)
+static void process_add_thread(process_t* proc, thread_t* thread) {
+    thread_t** link = &proc->threads;
+    while (*link) {
+        link = &(*link)->process_next;
+    }
+    *link = thread;
+}
+
+// Turn the calling context into the idle thread of a CPU. It keeps
+// running on the stack it is on; its context is saved the first time
+// it is switched away from.
+static void process_init_idle(uint32_t cpu) {
+    thread_t* idle = (thread_t*)pmm_alloc_block();
+    memset(idle, 0, sizeof(thread_t));
+    
+    idle->tid = 0;
+    idle->parent = kernel_process;
+    idle->state = PROCESS_STATE_RUNNING;
+    idle->priority = PROCESS_PRIORITY_LOW;
+    idle->is_kernel = true;
+    idle->cpu = cpu;
+    idle->on_cpu = 1;
+    timer_setup(&idle->sleep_timer, thread_wake, idle);
+    
+    run_queue_t* rq = &run_queues[cpu];
+    spin_init(&rq->lock, "run_queue");
+    lock_stats_register(&rq->lock.stats);
+    rq->idle = idle;
+    rq->slice_ticks = PROCESS_TIME_SLICE;
+    
+    // Idle never sits on a run queue
+    spin_lock(&process_list_lock);
+    process_add_thread(kernel_process, idle);
+    spin_unlock(&process_list_lock);
+    cpus[cpu].current = idle;
+    cpus[cpu].vm_space = kernel_process->vm;
+    fpu_switch(NULL, &idle->fpu);
+}
 
 // Initialize process management
 void process_init(void) {
     // Register timer tick handler for task switching
     irq_register_handler(IRQ0, process_timer_tick);
     
-    // Create idle process (pid 0)
-    process_t* idle = (process_t*)pmm_alloc_block();
-    memset(idle, 0, sizeof(process_t));
+    memset(run_queues, 0, sizeof(run_queues));
+    lock_stats_register(&process_list_lock.stats);
     
-    strcpy(idle->name, "idle");
-    idle->pid = 0;
-    idle->state = PROCESS_STATE_RUNNING;
-    idle->priority = PROCESS_PRIORITY_LOW;
-    idle->page_directory = vmm_get_current_directory();
+    // The kernel process holds the idle threads in the boot address space
+    kernel_process = (process_t*)pmm_alloc_block();
+    memset(kernel_process, 0, sizeof(process_t));
+    strcpy(kernel_process->name, "idle");
+    kernel_process->pid = 0;
+    kernel_process->priority = PROCESS_PRIORITY_LOW;
+    kernel_process->page_directory = vmm_get_current_directory();
+    kernel_process->vm = vm_space_create(kernel_process->page_directory);
+    process_list_add(kernel_process);
     
-    // Set up a small kernel stack for the idle process
-    idle->stack_size = 4096;
-    idle->stack = (uint32_t)pmm_alloc_block();
-    idle->esp = idle->stack + idle->stack_size;
+    // The boot context becomes the idle thread of CPU 0
+    process_init_idle(0);
     
-    // Set initial values for registers
-    idle->ebp = idle->esp;
-    idle->eip = (uint32_t)&process_idle;
+    vga_puts("Process: Initialized process manager\n");
+}
+
+// Scheduler setup on an application processor (interrupts disabled)
+void process_init_cpu(uint32_t cpu) {
+    process_init_idle(cpu);
+}
+
+// Take one ready thread from the busiest other CPU for this one
+static bool process_steal(run_queue_t* rq, uint32_t self) {
+    uint32_t victim = self;
+    uint32_t most = 0;
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (cpu != self && run_queues[cpu].ready > most) {
+            most = run_queues[cpu].ready;
+            victim = cpu;
+        }
+    }
+    if (victim == self) {
+        return false;
+    }
     
-    // Add to process list
-    process_list = idle;
-    current_process = idle;
+    // Highest priority first; skip a thread still being switched away from
+    run_queue_t* from = &run_queues[victim];
+    thread_t* thread = NULL;
+    spin_lock(&from->lock);
+    for (int level = PROCESS_PRIORITY_LEVELS - 1; level >= 0 && !thread; level--) {
+        for (thread_t* t = from->queues[level].head; t; t = t->run_next) {
+            if (!__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE)) {
+                thread = t;
+                break;
+            }
+        }
+    }
+    if (thread) {
+        run_queue_remove(from, thread);
+        thread->cpu = self;
+    }
+    spin_unlock(&from->lock);
     
-    vga_puts("Process: Initialized process manager\n");
+    if (!thread) {
+        return false;
+    }
+    
+    // It may have been blocked or terminated while on neither queue
+    spin_lock(&rq->lock);
+    bool queued = thread->state == PROCESS_STATE_READY;
+    if (queued) {
+        run_queue_add(rq, thread);
+        rq->steals++;
+    }
+    spin_unlock(&rq->lock);
+    return queued;
 }
 
-// Idle process - runs when nothing else is ready
-static int process_idle(void* arg) {
-    while (1) {
-        __asm__ volatile("hlt");
+// Does this CPU have threads ready to run?
+static bool process_cpu_has_ready(void) {
+    unsigned long flags = irq_save();
+    bool ready = run_queues[cpu_id()].ready != 0;
+    irq_restore(flags);
+    return ready;
+}
+
+// Halt until the next interrupt, unless there is work for this CPU or
+// work to steal. The tick is only stopped (on CPU 0, which owns the PIT)
+// when nothing is runnable; otherwise it must keep running to preempt.
+void process_idle_wait(void) {
+    // First clear blocks for the zeroed pool, one at a time with
+    // interrupts on, for as long as nothing becomes ready to run
+    while (!process_cpu_has_ready() && pmm_refill_zeroed()) {
     }
-    return 0;
+    
+    unsigned long flags = irq_save();
+    uint32_t cpu = cpu_id();
+    run_queue_t* rq = &run_queues[cpu];
+    
+    if (!rq->ready && smp_cpu_count() > 1) {
+        process_steal(rq, cpu);
+    }
+    
+    if (rq->ready) {
+        irq_restore(flags);
+        process_yield();
+        return;
+    }
+    
+    if (cpu == 0) {
+        timer_idle();
+    } else {
+        cpu_wait_for_interrupt();
+    }
+    
+    irq_restore(flags);
 }
 
-// Create a new process
-process_t* process_create(const char* name, process_entry_t entry, void* arg, process_priority_t priority) {
-    // Allocate memory for process control block
-    process_t* proc = (process_t*)pmm_alloc_block();
-    if (!proc) {
+// Allocate a thread of proc with a stack that starts at entry(arg), not
+// yet visible to the scheduler
+static thread_t* thread_alloc(process_t* proc, process_entry_t entry, void* arg,
+                              process_priority_t priority) {
+    // Allocate a cleared thread control block
+    thread_t* thread = (thread_t*)pmm_alloc_zeroed_block();
+    if (!thread) {
+        return NULL;
+    }
+    
+    // Set thread properties
+    thread->parent = proc;
+    thread->state = PROCESS_STATE_READY;
+    thread->priority = priority;
+    thread->is_kernel = true;
+    timer_setup(&thread->sleep_timer, thread_wake, thread);
+    
+    // Allocate kernel stack
+    thread->stack_size = 16384;  // 16 KB stack
+    thread->stack = (uint32_t)vmm_alloc_kernel_stack(thread->stack_size);
+    if (!thread->stack) {
+        pmm_free_block(thread);
         return NULL;
     }
     
-    // Clear the structure
-    memset(proc, 0, sizeof(process_t));
+    // Set up the initial stack as if switch_to had switched away from
+    // switch_first_run, which then calls entry(arg)
+    uint32_t* stack = (uint32_t*)(thread->stack + thread->stack_size);
+    *--stack = (uint32_t)arg;
+    *--stack = (uint32_t)entry;
+    *--stack = (uint32_t)switch_first_run;
+    *--stack = 0;       // EBP
+    *--stack = 0;       // EBX
+    *--stack = 0;       // ESI
+    *--stack = 0;       // EDI
+    *--stack = 0x002;   // EFLAGS (interrupts enabled by switch_first_run)
+    
+    thread->esp = (uint32_t)stack;
+    
+    return thread;
+}
+
+// Free a thread that never ran
+static void thread_free(thread_t* thread) {
+    vmm_free_kernel_stack((void*)thread->stack);
+    pmm_free_block(thread);
+}
+
+// Allocate a process with its first thread, not yet visible to the scheduler
+static process_t* process_alloc(const char* name, process_entry_t entry, void* arg, process_priority_t priority) {
+    // Allocate a cleared process control block
+    process_t* proc = (process_t*)pmm_alloc_zeroed_block();
+    if (!proc) {
+        return NULL;
+    }
     
     // Set process properties
     strcpy(proc->name, name);
-    proc->pid = next_pid++;
-    proc->state = PROCESS_STATE_READY;
     proc->priority = priority;
     
-    // Create page directory for the process
-    proc->page_directory = vmm_clone_directory(vmm_get_current_directory());
+    // Create page directory for the process, with the creator's regions
+    process_t* creator = process_get_current();
+    proc->page_directory = vmm_clone_directory(creator->page_directory);
     if (!proc->page_directory) {
         pmm_free_block(proc);
         return NULL;
     }
+    proc->vm = vm_space_clone(creator->vm, proc->page_directory);
     
-    // Allocate kernel stack
-    proc->stack_size = 16384;  // 16 KB stack
-    proc->stack = (uint32_t)pmm_alloc_blocks(proc->stack_size / PAGE_SIZE);
-    if (!proc->stack) {
+    proc->threads = proc->vm ? thread_alloc(proc, entry, arg, priority) : NULL;
+    if (!proc->threads) {
+        vm_space_destroy(proc->vm);
         vmm_free_directory(proc->page_directory);
         pmm_free_block(proc);
         return NULL;
     }
     
-    // Set up initial stack for the process
-    uint32_t* stack = (uint32_t*)(proc->stack + proc->stack_size);
+    return proc;
+}
+
+// Free a process that never ran
+static void process_free(process_t* proc) {
+    thread_free(proc->threads);
+    vm_space_destroy(proc->vm);
+    vmm_free_directory(proc->page_directory);
+    pmm_free_block(proc);
+}
+
+// Give a process and its first thread their ID and list entry
+// (interrupts disabled)
+static void process_publish(process_t* proc) {
+    spin_lock(&process_list_lock);
+    proc->pid = next_pid++;
+    proc->threads->tid = proc->pid;
+    process_list_add(proc);
+    spin_unlock(&process_list_lock);
+}
+
+// Queue a new thread on the least loaded CPU, preferring this one
+// (interrupts disabled)
+static void thread_start(thread_t* thread) {
+    uint32_t target = cpu_id();
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (run_queues[cpu].ready < run_queues[target].ready) {
+            target = cpu;
+        }
+    }
+    thread->cpu = target;
     
-    // Push argument
-    *--stack = (uint32_t)arg;
+    spin_lock(&run_queues[target].lock);
+    run_queue_add(&run_queues[target], thread);
+    spin_unlock(&run_queues[target].lock);
+    smp_send_resched(target);
+}
+
+// Create a new process
+process_t* process_create(const char* name, process_entry_t entry, void* arg, process_priority_t priority) {
+    process_t* proc = process_alloc(name, entry, arg, priority);
+    if (!proc) {
+        return NULL;
+    }
     
-    // Push fake return address
-    *--stack = 0;
+    unsigned long flags = irq_save();
+    process_publish(proc);
+    thread_start(proc->threads);
+    irq_restore(flags);
     
-    // Push initial EFLAGS (interrupts enabled)
-    *--stack = 0x202;
+    return proc;
+}
+
+// Share of a CPU a deadline thread may use, in 1/1024ths, rounded up
+static uint32_t process_rt_density(const process_rt_params_t* params) {
+    return (params->budget * 1024 + params->deadline - 1) / params->deadline;
+}
+
+// Release timer callback: start the next job of a deadline thread
+static void process_rt_release(void* data) {
+    thread_t* thread = (thread_t*)data;
+    uint64_t now = timer_now();
     
-    // Push initial CS (code segment)
-    *--stack = 0x08;  // Kernel code segment
+    unsigned long flags = irq_save();
+    run_queue_t* rq = run_queue_lock_thread(thread);
+    if (thread->state == PROCESS_STATE_TERMINATED) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
     
-    // Push entry point
-    *--stack = (uint32_t)entry;
+    // The previous job is still unfinished at its deadline
+    bool missed = thread->rt_pending > 0;
+    uint32_t late = missed && now > thread->rt_deadline ? (uint32_t)(now - thread->rt_deadline) : 0;
+    if (missed) {
+        thread->rt_misses++;
+    }
     
-    // Push fake registers for the first context switch
-    *--stack = 0;  // EAX
-    *--stack = 0;  // ECX
-    *--stack = 0;  // EDX
-    *--stack = 0;  // EBX
-    *--stack = 0;  // ESP (old stack pointer, not used)
-    *--stack = 0;  // EBP
-    *--stack = 0;  // ESI
-    *--stack = 0;  // EDI
+    // Releases are periodic from the first one, so they do not drift
+    thread->rt_release += thread->rt_params.period;
+    thread->rt_deadline = thread->rt_release + thread->rt_params.deadline;
+    thread->rt_budget_left = thread->rt_params.budget;
+    thread->rt_pending++;
+    thread->rt_jobs++;
+    timer_start_at(&thread->rt_timer, thread->rt_release + thread->rt_params.period);
     
-    // Set initial stack pointer
-    proc->esp = (uint32_t)stack;
-    proc->ebp = proc->esp;
-    proc->eip = (uint32_t)entry;
+    bool queued = false;
+    if (thread->state == PROCESS_STATE_BLOCKED && (thread->rt_waiting || thread->rt_throttled)) {
+        thread->rt_waiting = false;
+        thread->rt_throttled = false;
+        thread->rt_wake_tsc = rdtsc();
+        thread->state = PROCESS_STATE_READY;
+        run_queue_add(rq, thread);
+        queued = true;
+    } else if (thread->state == PROCESS_STATE_READY) {
+        // Its deadline moved: put it back in EDF order
+        run_queue_remove(rq, thread);
+        run_queue_add(rq, thread);
+    }
+    uint32_t cpu = thread->cpu;
+    spin_unlock(&rq->lock);
     
-    // Add to process list
-    process_t* p = process_list;
-    while (p->next) {
-        p = p->next;
+    if (missed) {
+        rt_trace_record(RT_TRACE_MISS, thread->tid, late);
+    }
+    if (queued) {
+        smp_send_resched(cpu);
     }
-    p->next = proc;
+    irq_restore(flags);
+}
+
+// Create a process whose thread is a periodic deadline task. Its first
+// job is released at once. Admission control places it on the CPU with
+// the least deadline load whose total density (budget/deadline) stays
+// within PROCESS_RT_UTIL_MAX, which EDF can always schedule; NULL if no
+// CPU has room.
+process_t* process_create_deadline(const char* name, process_entry_t entry, void* arg,
+                                   const process_rt_params_t* params) {
+    if (!params || !params->budget || params->budget > params->deadline ||
+        params->deadline > params->period) {
+        return NULL;
+    }
+    
+    process_t* proc = process_alloc(name, entry, arg, PROCESS_PRIORITY_REAL_TIME);
+    if (!proc) {
+        return NULL;
+    }
+    
+    uint32_t density = process_rt_density(params);
+    unsigned long flags = spin_lock_irqsave(&rt_admission_lock);
+    uint32_t target = SMP_MAX_CPUS;
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        uint32_t load = run_queues[cpu].rt_utilization;
+        if (load + density <= PROCESS_RT_UTIL_MAX &&
+            (target == SMP_MAX_CPUS || load < run_queues[target].rt_utilization)) {
+            target = cpu;
+        }
+    }
+    if (target == SMP_MAX_CPUS) {
+        spin_unlock_irqrestore(&rt_admission_lock, flags);
+        process_free(proc);
+        return NULL;
+    }
+    run_queues[target].rt_utilization += density;
+    spin_unlock(&rt_admission_lock);
+    
+    // Deadline threads stay on the CPU they were admitted to
+    thread_t* thread = proc->threads;
+    thread->rt = true;
+    thread->rt_params = *params;
+    thread->cpu = target;
+    timer_setup(&thread->rt_timer, process_rt_release, thread);
+    process_publish(proc);
     
+    uint64_t now = timer_now();
+    run_queue_t* rq = &run_queues[target];
+    spin_lock(&rq->lock);
+    thread->rt_release = now;
+    thread->rt_deadline = now + params->deadline;
+    thread->rt_budget_left = params->budget;
+    thread->rt_pending = 1;
+    thread->rt_jobs = 1;
+    thread->rt_wake_tsc = rdtsc();
+    timer_start_at(&thread->rt_timer, now + params->period);
+    run_queue_add(rq, thread);
+    spin_unlock(&rq->lock);
+    smp_send_resched(target);
+    
+    irq_restore(flags);
     return proc;
 }
 
-// Exit current process
+// Finish the current job of a deadline thread and block until the next
+// release, unless it is already due. Returns false for other threads.
+bool process_wait_next_period(void) {
+    uint64_t now = timer_now();
+    unsigned long flags = irq_save();
+    thread_t* thread = current_thread;
+    if (!thread->rt) {
+        irq_restore(flags);
+        return false;
+    }
+    
+    run_queue_t* rq = run_queue_lock_thread(thread);
+    if (thread->rt_pending > 0) {
+        thread->rt_pending--;
+    }
+    
+    // A backlog job was already counted as missed when it was released
+    if (thread->rt_pending > 0) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return true;
+    }
+    
+    bool missed = now > thread->rt_deadline;
+    if (missed) {
+        thread->rt_misses++;
+    }
+    thread->rt_waiting = true;
+    thread->state = PROCESS_STATE_BLOCKED;
+    spin_unlock(&rq->lock);
+    
+    if (missed) {
+        rt_trace_record(RT_TRACE_MISS, thread->tid, (uint32_t)(now - thread->rt_deadline));
+    }
+    process_yield();
+    irq_restore(flags);
+    return true;
+}
+
+// Copy the statistics of up to max deadline threads
+uint32_t process_get_rt_stats(process_rt_stats_t* stats, uint32_t max) {
+    uint32_t count = 0;
+    unsigned long flags = spin_lock_irqsave(&process_list_lock);
+    
+    for (process_t* proc = process_list; proc && count < max; proc = proc->next) {
+        for (thread_t* thread = proc->threads; thread && count < max; thread = thread->process_next) {
+            if (!thread->rt || thread->state == PROCESS_STATE_TERMINATED) {
+                continue;
+            }
+            process_rt_stats_t* entry = &stats[count++];
+            entry->pid = proc->pid;
+            entry->tid = thread->tid;
+            strcpy(entry->name, proc->name);
+            entry->cpu = thread->cpu;
+            entry->params = thread->rt_params;
+            entry->jobs = thread->rt_jobs;
+            entry->misses = thread->rt_misses;
+            entry->overruns = thread->rt_overruns;
+            entry->worst_latency = thread->rt_worst_latency;
+        }
+    }
+    
+    spin_unlock_irqrestore(&process_list_lock, flags);
+    return count;
+}
+
+// Exit current process, with all of its threads
 void process_exit(int code) {
-    if (current_process) {
-        current_process->exit_code = code;
-        current_process->state = PROCESS_STATE_TERMINATED;
-        process_yield();
+    process_t* proc = process_get_current();
+    if (proc) {
+        proc->exit_code = code;
+        process_terminate(proc);
     }
 }
 
 // Get current process
 process_t* process_get_current(void) {
-    return current_process;
+    thread_t* thread = thread_get_current();
+    return thread ? thread->parent : NULL;
 }
 
 // Get current process ID
 int process_get_pid(void) {
-    return current_process ? current_process->pid : -1;
+    process_t* proc = process_get_current();
+    return proc ? (int)proc->pid : -1;
 }
 
-// Sleep for a number of milliseconds
+// Sleep the current thread for a number of milliseconds
 void process_sleep(uint32_t ms) {
-    if (current_process) {
-        current_process->sleep_until = system_time + ms;
-        current_process->state = PROCESS_STATE_BLOCKED;
-        process_yield();
+    unsigned long flags = irq_save();
+    thread_t* thread = current_thread;
+    
+    if (thread == run_queues[thread->cpu].idle) {
+        irq_restore(flags);
+        return;
+    }
+    
+    // Blocked before the timer is armed, so its wakeup cannot be missed
+    run_queue_t* rq = run_queue_lock_thread(thread);
+    thread->state = PROCESS_STATE_BLOCKED;
+    if (!timer_start(&thread->sleep_timer, ms ? ms : 1)) {
+        // Nothing would wake the thread: return without sleeping
+        thread->state = PROCESS_STATE_RUNNING;
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
+    spin_unlock(&rq->lock);
+    
+    process_yield();
+    irq_restore(flags);
+}
+
+// Mark a thread blocked (interrupts disabled). Returns true if it was.
+static bool thread_block(thread_t* thread) {
+    run_queue_t* rq = run_queue_lock_thread(thread);
+    bool blocked = thread != rq->idle && thread->state != PROCESS_STATE_TERMINATED;
+    if (blocked) {
+        thread_dequeue(rq, thread);
+        thread->state = PROCESS_STATE_BLOCKED;
     }
+    spin_unlock(&rq->lock);
+    return blocked;
 }
 
-// Block a process
+// Block every thread of a process
 void process_block(process_t* proc) {
-    if (proc) {
-        proc->state = PROCESS_STATE_BLOCKED;
-        if (proc == current_process) {
-            process_yield();
+    if (!proc) {
+        return;
+    }
+    
+    unsigned long flags = irq_save();
+    thread_t* self = current_thread;
+    bool block_self = false;
+    
+    spin_lock(&process_list_lock);
+    for (thread_t* thread = proc->threads; thread; thread = thread->process_next) {
+        if (thread == self) {
+            block_self = true;
+        } else {
+            thread_block(thread);
         }
     }
+    spin_unlock(&process_list_lock);
+    
+    if (block_self && thread_block(self)) {
+        process_yield();
+    }
+    irq_restore(flags);
 }
 
-// Unblock a process
+// Mark the running thread blocked without switching away from it, for
+// callers that must publish where it waits before yielding. Returns false
+// for the idle thread, which cannot block.
+bool thread_prepare_block(void) {
+    unsigned long flags = irq_save();
+    thread_t* thread = current_thread;
+    run_queue_t* rq = run_queue_lock_thread(thread);
+    bool blocked = thread != rq->idle;
+    if (blocked) {
+        thread->state = PROCESS_STATE_BLOCKED;
+    }
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+    return blocked;
+}
+
+// Unblock a thread
+void thread_unblock(thread_t* thread) {
+    if (thread) {
+        thread_make_ready(thread);
+    }
+}
+
+// Unblock every thread of a process
 void process_unblock(process_t* proc) {
-    if (proc && proc->state == PROCESS_STATE_BLOCKED) {
-        proc->state = PROCESS_STATE_READY;
+    if (!proc) {
+        return;
     }
+    
+    unsigned long flags = spin_lock_irqsave(&process_list_lock);
+    for (thread_t* thread = proc->threads; thread; thread = thread->process_next) {
+        thread_make_ready(thread);
+    }
+    spin_unlock_irqrestore(&process_list_lock, flags);
 }
 
-// Terminate a process
-void process_terminate(process_t* proc) {
-    if (proc) {
-        proc->state = PROCESS_STATE_TERMINATED;
-        if (proc == current_process) {
-            process_yield();
+// Stop a thread for good (interrupts disabled). Returns true if it was
+// live; the caller then queues it for reaping.
+static bool thread_kill(thread_t* thread) {
+    wait_queue_cancel(thread);
+    
+    run_queue_t* rq = run_queue_lock_thread(thread);
+    bool killed = thread != rq->idle && thread->state != PROCESS_STATE_TERMINATED;
+    if (killed) {
+        thread_dequeue(rq, thread);
+        thread->state = PROCESS_STATE_TERMINATED;
+        if (thread->rt) {
+            timer_cancel(&thread->rt_timer);
         }
     }
+    uint32_t cpu = thread->cpu;
+    bool running = thread->on_cpu;
+    spin_unlock(&rq->lock);
+    
+    if (!killed) {
+        return false;
+    }
+    
+    // Return the thread's share of its CPU to admission control
+    if (thread->rt) {
+        spin_lock(&rt_admission_lock);
+        run_queues[cpu].rt_utilization -= process_rt_density(&thread->rt_params);
+        spin_unlock(&rt_admission_lock);
+    }
+    
+    // Make another CPU running it switch away
+    if (running && cpu != cpu_id()) {
+        smp_send_resched(cpu);
+    }
+    return true;
 }
 
-// Find next process to run
-static process_t* process_get_next(void) {
-    if (!process_list) {
-        return NULL;
+// Queue a killed thread for process_reap (list locked)
+static void thread_bury(thread_t* thread) {
+    thread->run_next = zombie_list;
+    zombie_list = thread;
+}
+
+// Terminate a thread; the process ends with its last thread
+void thread_terminate(thread_t* thread) {
+    if (!thread) {
+        return;
     }
     
-    // Start with the process after the current one
-    process_t* next = current_process->next;
-    if (!next) {
-        next = process_list;
+    unsigned long flags = irq_save();
+    spin_lock(&process_list_lock);
+    bool killed = thread_kill(thread);
+    if (killed) {
+        thread_bury(thread);
     }
+    spin_unlock(&process_list_lock);
     
-    // Loop until we find a runnable process
-    process_t* start = next;
-    do {
-        // Check if this process is ready
-        if (next->state == PROCESS_STATE_READY) {
-            return next;
-        }
-        
-        // Check if this is a sleeping process that should wake up
-        if (next->state == PROCESS_STATE_BLOCKED && next->sleep_until && next->sleep_until <= system_time) {
-            next->state = PROCESS_STATE_READY;
-            return next;
-        }
-        
-        // Check if this is a terminated process that should be cleaned up
-        if (next->state == PROCESS_STATE_TERMINATED) {
-            // Remove from process list
-            process_t* prev = process_list;
-            while (prev && prev->next != next) {
-                prev = prev->next;
-            }
-            
-            if (prev) {
-                prev->next = next->next;
-            }
-            
-            // Free process resources
-            if (next->stack) {
-                pmm_free_blocks((void*)next->stack, next->stack_size / PAGE_SIZE);
-            }
-            
-            if (next->page_directory) {
-                vmm_free_directory(next->page_directory);
-            }
-            
-            // Save the next process
-            process_t* temp = next->next;
-            if (!temp) {
-                temp = process_list;
-            }
-            
-            // Free the process structure
-            pmm_free_block(next);
-            
-            // Move to the next process
-            next = temp;
-            
-            // If we removed the last process, return the idle process
-            if (!next) {
-                return process_list; // idle
-            }
-            
-            continue;
-        }
-        
-        // Try the next process
-        next = next->next;
-        if (!next) {
-            next = process_list;
+    if (killed && thread == current_thread) {
+        process_yield();
+    }
+    irq_restore(flags);
+}
+
+// Terminate a process and all of its threads
+void process_terminate(process_t* proc) {
+    if (!proc || proc == kernel_process) {
+        return;
+    }
+    
+    unsigned long flags = irq_save();
+    thread_t* self = current_thread;
+    bool kill_self = false;
+    
+    spin_lock(&process_list_lock);
+    proc->exiting = true;
+    for (thread_t* thread = proc->threads; thread; thread = thread->process_next) {
+        if (thread == self) {
+            kill_self = true;
+        } else if (thread_kill(thread)) {
+            thread_bury(thread);
         }
-    } while (next != start);
+    }
+    spin_unlock(&process_list_lock);
     
-    // If no process is ready, return the idle process
-    return process_list;
+    // The calling thread goes last, as it does not come back
+    if (kill_self) {
+        thread_terminate(self);
+    }
+    irq_restore(flags);
 }
 
-// Yield to another process
+// A deadline thread runs for the first time since its release: record
+// the release-to-run latency
+static void process_rt_account_latency(thread_t* thread) {
+    if (!thread->rt_wake_tsc) {
+        return;
+    }
+    
+    uint32_t latency = (uint32_t)(rdtsc() - thread->rt_wake_tsc);
+    thread->rt_wake_tsc = 0;
+    if (latency > thread->rt_worst_latency) {
+        thread->rt_worst_latency = latency;
+        rt_trace_record(RT_TRACE_LATENCY, thread->tid, latency);
+    }
+}
+
+// Switch from prev to next on this CPU. Called with interrupts disabled
+// and rq locked; the lock is released by whichever thread runs next,
+// in process_finish_switch.
+static void process_context_switch(run_queue_t* rq, thread_t* prev, thread_t* next) {
+    cpu_t* cpu = this_cpu();
+    
+    next->state = PROCESS_STATE_RUNNING;
+    next->on_cpu = 1;
+    rq->prev = prev;
+    rq->switches++;
+    cpu->current = next;
+    process_rt_account_latency(next);
+    
+    // Threads of the same process share the address space, so only a
+    // switch to another process reloads CR3 and flushes the TLB
+    if (prev->parent->page_directory != next->parent->page_directory) {
+        vmm_switch_page_directory(next->parent->page_directory);
+        cpu->vm_space = next->parent->vm;
+        rq->address_switches++;
+    }
+    
+    // Ring 3 entries into the kernel start at the top of the kernel stack
+    if (next->stack) {
+        tss_set_kernel_stack(next->stack + next->stack_size);
+    }
+    
+    // FPU state follows lazily, on next's first FPU instruction
+    fpu_switch(&prev->fpu, &next->fpu);
+    
+    // Returns when prev is switched back to
+    switch_to(&prev->esp, next->esp);
+    process_finish_switch();
+}
+
+// Second half of a context switch, run by the thread switched to: the
+// previous thread is now off its stack, so other CPUs may take it
+void process_finish_switch(void) {
+    run_queue_t* rq = &run_queues[cpu_id()];
+    __atomic_store_n(&rq->prev->on_cpu, 0, __ATOMIC_RELEASE);
+    spin_unlock(&rq->lock);
+}
+
+// Yield to another thread
 void process_yield(void) {
-    // Find next process to run
-    process_t* next = process_get_next();
+    unsigned long flags = irq_save();
+    
+    if (zombie_list) {
+        process_reap();
+    }
+    
+    run_queue_t* rq = &run_queues[cpu_id()];
+    spin_lock(&rq->lock);
+    
+    // The running thread goes to the back of its level
+    thread_t* prev = current_thread;
+    if (prev->state == PROCESS_STATE_RUNNING && prev != rq->idle) {
+        prev->state = PROCESS_STATE_READY;
+        run_queue_add(rq, prev);
+    }
     
-    // If no process is ready, run the idle process
+    thread_t* next = run_queue_pop(rq);
     if (!next) {
-        next = process_list;
+        next = rq->idle;
     }
     
-    // If we're switching to the same process, do nothing
-    if (next == current_process) {
+    // If we're switching to the same thread, do nothing
+    if (next == prev) {
+        prev->state = PROCESS_STATE_RUNNING;
+        process_rt_account_latency(prev);
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
         return;
     }
     
-    // Switch to the next process
-    process_switch(next);
+    process_context_switch(rq, prev, next);
+    irq_restore(flags);
 }
 
-// Switch to a specific process
-void process_switch(process_t* next) {
-    if (!next) {
+// Switch to the first thread of a process if it is ready on this CPU
+void process_switch(process_t* proc) {
+    if (!proc || !proc->threads) {
         return;
     }
     
-    // Save current process state
-    process_t* prev = current_process;
-    if (prev->state == PROCESS_STATE_RUNNING) {
+    unsigned long flags = irq_save();
+    run_queue_t* rq = &run_queues[cpu_id()];
+    spin_lock(&rq->lock);
+    
+    thread_t* prev = current_thread;
+    thread_t* next = proc->threads;
+    if (next == prev || next->cpu != cpu_id() ||
+        (next->state != PROCESS_STATE_READY && next != rq->idle)) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
+    
+    // Save current thread state
+    if (prev->state == PROCESS_STATE_RUNNING && prev != rq->idle) {
         prev->state = PROCESS_STATE_READY;
+        run_queue_add(rq, prev);
     }
     
-    // Set next process as current
-    current_process = next;
-    current_process->state = PROCESS_STATE_RUNNING;
+    // The thread we switch to leaves its run queue
+    if (next->state == PROCESS_STATE_READY) {
+        run_queue_remove(rq, next);
+    }
     
-    // Switch address space
-    if (prev->page_directory != next->page_directory) {
-        vmm_switch_page_directory(next->page_directory);
+    process_context_switch(rq, prev, next);
+    irq_restore(flags);
+}
+
+// Preempt the running thread if it was stopped from another CPU, or if a
+// deadline thread with an earlier deadline or a higher priority thread
+// is ready
+static bool process_should_preempt(run_queue_t* rq) {
+    thread_t* current = current_thread;
+    if (current->state == PROCESS_STATE_TERMINATED) {
+        return true;
+    }
+    if (rq->edf_head) {
+        return !current->rt || rq->edf_head->rt_deadline < current->rt_deadline;
     }
+    if (current == rq->idle) {
+        return rq->bitmap != 0;
+    }
+    return !current->rt && (rq->bitmap >> (current->priority + 1)) != 0;
+}
+
+// Charge a timer tick to a running deadline thread. Returns true if that
+// used up its budget and it must wait for its next release.
+static bool process_rt_charge(run_queue_t* rq, thread_t* thread) {
+    bool throttled = false;
     
-    // Switch kernel stack in TSS
-    tss_set_kernel_stack(next->esp);
+    spin_lock(&rq->lock);
+    if (thread->state == PROCESS_STATE_RUNNING && thread->rt_budget_left &&
+        --thread->rt_budget_left == 0) {
+        thread->rt_throttled = true;
+        thread->rt_overruns++;
+        thread->state = PROCESS_STATE_BLOCKED;
+        throttled = true;
+    }
+    spin_unlock(&rq->lock);
     
-    // Save current ESP/EBP and load new ESP/EBP
-    __asm__ volatile(
-        "mov %%esp, %0\n"
-        "mov %%ebp, %1\n"
-        "mov %2, %%esp\n"
-        "mov %3, %%ebp\n"
-        : "=m"(prev->esp), "=m"(prev->ebp)
-        : "m"(next->esp), "m"(next->ebp)
-    );
+    if (throttled) {
+        rt_trace_record(RT_TRACE_OVERRUN, thread->tid, thread->rt_params.budget);
+    }
+    return throttled;
 }
 
-// Timer interrupt handler - task switcher
+// Timer interrupt handler - task switcher. CPU 0 gets the PIT tick and
+// keeps kernel time; the other CPUs get their local APIC timer.
 void process_timer_tick(registers_t* regs) {
-    // Increment system time (assuming 1000Hz timer)
-    system_time++;
+    (void)regs;
+    
+    if (cpu_id() == 0) {
+        // Advance kernel time (1000Hz timer); this wakes sleepers
+        timer_tick();
+    }
+    
+    // Deadline threads run until they finish their job, are preempted by
+    // an earlier deadline or use up their budget
+    run_queue_t* rq = &run_queues[cpu_id()];
+    thread_t* current = current_thread;
+    if (current->rt) {
+        if (process_rt_charge(rq, current) || process_should_preempt(rq)) {
+            process_yield();
+        }
+        return;
+    }
     
-    // Switch tasks every 10ms (10 ticks)
-    if (system_time % 10 == 0) {
+    // Switch threads every 10ms (10 ticks), or at once if a higher
+    // priority thread became ready
+    if (process_should_preempt(rq) || --rq->slice_ticks == 0) {
+        rq->slice_ticks = PROCESS_TIME_SLICE;
         process_yield();
     }
 }
 
-// Create a new thread in a process
+// Reschedule IPI: another CPU queued or stopped a thread here
+void process_resched(void) {
+    if (process_should_preempt(&run_queues[cpu_id()])) {
+        process_yield();
+    }
+}
+
+// Scheduler statistics for one CPU
+bool process_get_cpu_stats(uint32_t cpu, process_cpu_stats_t* stats) {
+    if (cpu >= smp_cpu_count() || !stats) {
+        return false;
+    }
+    
+    run_queue_t* rq = &run_queues[cpu];
+    stats->ready = rq->ready;
+    stats->switches = rq->switches;
+    stats->address_switches = rq->address_switches;
+    stats->steals = rq->steals;
+    stats->rt_utilization = rq->rt_utilization;
+    return true;
+}
+
+// Create a new thread in a process. It shares the process's address
+// space and starts at entry(arg) with the process's priority.
 thread_t* thread_create(process_t* proc, process_entry_t entry, void* arg, bool is_kernel) {
-    if (!proc) {
+    if (!proc || proc == kernel_process) {
         return NULL;
     }
     
-    // Allocate memory for thread control block
-    thread_t* thread = (thread_t*)pmm_alloc_block();
+    thread_t* thread = thread_alloc(proc, entry, arg, proc->priority);
     if (!thread) {
         return NULL;
     }
+    thread->is_kernel = is_kernel;
     
-    // Clear the structure
-    memset(thread, 0, sizeof(thread_t));
+    unsigned long flags = irq_save();
     
-    // Set thread properties
-    thread->tid = next_pid++;  // Use same ID space for now
-    thread->parent = proc;
-    thread->is_kernel = is_kernel;
+    // Add to the process, unless it is being torn down
+    spin_lock(&process_list_lock);
+    bool alive = !proc->exiting;
+    if (alive) {
+        thread->tid = next_pid++;
+        process_add_thread(proc, thread);
+    }
+    spin_unlock(&process_list_lock);
     
-    // Allocate stack
-    thread->stack_size = 16384;  // 16 KB stack
-    thread->stack = (uint32_t)pmm_alloc_blocks(thread->stack_size / PAGE_SIZE);
-    if (!thread->stack) {
-        pmm_free_block(thread);
+    if (!alive) {
+        irq_restore(flags);
+        thread_free(thread);
         return NULL;
     }
     
-    // Set up initial stack for the thread
-    uint32_t* stack = (uint32_t*)(thread->stack + thread->stack_size);
-    
-    // Push argument
-    *--stack = (uint32_t)arg;
-    
-    // Push fake return address
-    *--stack = 0;
-    
-    // Set initial stack pointer
-    thread->esp = (uint32_t)stack;
-    thread->ebp = thread->esp;
-    thread->eip = (uint32_t)entry;
+    thread_start(thread);
+    irq_restore(flags);
     
     return thread;
 }
 
 // Exit current thread
 void thread_exit(int code) {
-    // For now, just exit the whole process
-    process_exit(code);
+    thread_t* thread = thread_get_current();
+    if (!thread) {
+        return;
+    }
+    
+    // The last thread's code becomes the process's
+    thread->exit_code = code;
+    thread->parent->exit_code = code;
+    thread_terminate(thread);
 }
 
 // Get current thread
 thread_t* thread_get_current(void) {
-    // In the current implementation, we don't have separate thread tracking
-    return NULL;
+    unsigned long flags = irq_save();
+    thread_t* thread = current_thread;
+    irq_restore(flags);
+    return thread;
 }
 
 // Yield to another thread
 void thread_yield(void) {
-    // For now, just yield the process
     process_yield();
-} 
\ No newline at end of file
+}
@@ -4,7 +4,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "../mem/vmm.h"
+#include "../mem/vma.h"
+#include "../core/timer.h"
 #include "../arch/x86/isr.h"
+#include "../arch/x86/fpu.h"
 
 // Process states
 typedef enum {
@@ -22,45 +25,115 @@ typedef enum {
     PROCESS_PRIORITY_REAL_TIME = 3
 } process_priority_t;
 
-// Process structure
+// Number of priority levels (one run queue each)
+#define PROCESS_PRIORITY_LEVELS 4
+
+// Largest share of a CPU admitted for deadline tasks, in 1/1024ths
+// (about 90%, leaving the rest for the ordinary priority classes)
+#define PROCESS_RT_UTIL_MAX 920
+
+// Deadline task parameters, in milliseconds. Each period releases a job
+// that may run for budget ms and must finish within deadline ms of its
+// release (budget <= deadline <= period).
+typedef struct {
+    uint32_t period;
+    uint32_t budget;
+    uint32_t deadline;
+} process_rt_params_t;
+
+// Deadline task statistics
+typedef struct {
+    uint32_t pid;
+    uint32_t tid;
+    char name[32];
+    uint32_t cpu;
+    process_rt_params_t params;
+    uint32_t jobs;                  // Jobs released
+    uint32_t misses;                // Deadline misses
+    uint32_t overruns;              // Jobs throttled for using up their budget
+    uint32_t worst_latency;         // Worst release-to-run latency in TSC cycles
+} process_rt_stats_t;
+
+struct thread;
+
+// Process structure: an address space and the threads running in it
 typedef struct process {
     uint32_t pid;                   // Process ID
     char name[32];                  // Process name
-    process_state_t state;          // Current state
-    process_priority_t priority;    // Process priority
-    
-    uint32_t esp;                   // Stack pointer
-    uint32_t ebp;                   // Base pointer
-    uint32_t eip;                   // Instruction pointer
+    process_priority_t priority;    // Priority given to new threads
     
     page_dir_t* page_directory;     // Process page directory
-    uint32_t stack;                 // Kernel stack location
-    uint32_t stack_size;            // Stack size
-    
-    uint32_t sleep_until;           // Wake time for sleeping processes
+    vm_space_t* vm;                 // Regions of the address space paged on demand
+    struct thread* threads;         // Threads not yet reaped, oldest first
+    bool exiting;                   // Terminated; no new threads
     int exit_code;                  // Exit code
     
-    struct process* next;           // Next process in queue
+    struct process* next;           // Next process in the process list
 } process_t;
 
-// Thread structure
-typedef struct {
+// Thread structure: the unit the scheduler runs. Threads of a process
+// share its page directory, so switching between them leaves CR3 alone.
+typedef struct thread {
     uint32_t tid;                   // Thread ID
     process_t* parent;              // Parent process
-    uint32_t esp;                   // Stack pointer
-    uint32_t ebp;                   // Base pointer
-    uint32_t eip;                   // Instruction pointer
-    uint32_t stack;                 // Thread stack
-    uint32_t stack_size;            // Stack size
+    process_state_t state;          // Current state
+    process_priority_t priority;    // Thread priority
     bool is_kernel;                 // Is kernel thread?
+    
+    uint32_t esp;                   // Saved kernel stack pointer (see switch_to)
+    uint32_t cpu;                   // CPU whose run queue owns the thread
+    volatile uint32_t on_cpu;       // Set until switched away from on its CPU
+    
+    uint32_t stack;                 // Kernel stack location
+    uint32_t stack_size;            // Stack size
+    
+    fpu_state_t fpu;                // Saved FPU/SSE state (see fpu_switch)
+    ktimer_t sleep_timer;           // Wakes the thread from process_sleep
+    int exit_code;                  // Exit code
+    
+    struct thread* process_next;    // Next thread of the same process
+    struct thread* run_next;        // Next thread in its run queue
+    struct thread* run_prev;        // Previous thread in its run queue
+    struct wait_queue* wait_queue;  // Wait queue the thread is blocked on
+    struct thread* wait_next;       // Next thread on that wait queue
+    
+    // Deadline scheduling class (EDF), see process_create_deadline
+    bool rt;                        // Scheduled by deadline, ahead of all priorities
+    bool rt_waiting;                // All released jobs done, waiting for the next release
+    bool rt_throttled;              // Budget used up, waiting for the next release
+    uint32_t rt_pending;            // Jobs released but not yet finished
+    process_rt_params_t rt_params;
+    uint64_t rt_release;            // Release time of the current job
+    uint64_t rt_deadline;           // Absolute deadline of the current job
+    uint32_t rt_budget_left;        // Timer ticks the current job may still run
+    uint64_t rt_wake_tsc;           // TSC at release, until the job first runs
+    ktimer_t rt_timer;              // Releases the next job
+    uint32_t rt_jobs;
+    uint32_t rt_misses;
+    uint32_t rt_overruns;
+    uint32_t rt_worst_latency;
 } thread_t;
 
+// Per-CPU scheduler statistics
+typedef struct {
+    uint32_t ready;                 // Threads on the CPU's run queues
+    uint32_t switches;              // Context switches on the CPU
+    uint32_t address_switches;      // Switches that changed the page directory
+    uint32_t steals;                // Threads taken from other CPUs
+    uint32_t rt_utilization;        // Admitted deadline load in 1/1024ths
+} process_cpu_stats_t;
+
 // Function type for process/thread entry points
 typedef int (*process_entry_t)(void* arg);
 
 // Process management functions
 void process_init(void);
+void process_init_cpu(uint32_t cpu);
 process_t* process_create(const char* name, process_entry_t entry, void* arg, process_priority_t priority);
+process_t* process_create_deadline(const char* name, process_entry_t entry, void* arg,
+                                   const process_rt_params_t* params);
+bool process_wait_next_period(void);
+uint32_t process_get_rt_stats(process_rt_stats_t* stats, uint32_t max);
 void process_exit(int code);
 process_t* process_get_current(void);
 int process_get_pid(void);
@@ -71,12 +144,19 @@ void process_terminate(process_t* proc);
 void process_yield(void);
 void process_switch(process_t* next);
 void process_scheduler(void);
+void process_idle_wait(void);
+void process_resched(void);
+void process_finish_switch(void);
+bool process_get_cpu_stats(uint32_t cpu, process_cpu_stats_t* stats);
 
 // Thread functions
 thread_t* thread_create(process_t* proc, process_entry_t entry, void* arg, bool is_kernel);
 void thread_exit(int code);
 thread_t* thread_get_current(void);
 void thread_yield(void);
+void thread_terminate(thread_t* thread);
+void thread_unblock(thread_t* thread);
+bool thread_prepare_block(void);
 
 // Interrupt handler for task switching
 void process_timer_tick(registers_t* regs);
@@ -0,0 +1,57 @@
+#include "rttrace.h"
+#include "../core/spinlock.h"
+#include "../core/timer.h"
+
+// Ring of the most recent events. Written from the scheduler and the
+// release timers on every CPU, read by the console.
+static struct {
+    spinlock_t lock;
+    rt_trace_event_t events[RT_TRACE_SIZE];
+    uint32_t head;          // Total events recorded
+    uint32_t tail;          // Oldest event kept, also the number overwritten
+} rt_trace = { SPINLOCK_INIT("rt_trace"), { { 0, 0, 0, 0 } }, 0, 0 };
+
+// Record an event
+void rt_trace_record(rt_trace_type_t type, uint32_t tid, uint32_t value) {
+    uint32_t now = (uint32_t)timer_now();
+    unsigned long flags = spin_lock_irqsave(&rt_trace.lock);
+    
+    rt_trace_event_t* event = &rt_trace.events[rt_trace.head & (RT_TRACE_SIZE - 1)];
+    event->time = now;
+    event->tid = tid;
+    event->type = type;
+    event->value = value;
+    rt_trace.head++;
+    if (rt_trace.head - rt_trace.tail > RT_TRACE_SIZE) {
+        rt_trace.tail = rt_trace.head - RT_TRACE_SIZE;
+    }
+    
+    spin_unlock_irqrestore(&rt_trace.lock, flags);
+}
+
+// Copy up to max events, oldest first
+uint32_t rt_trace_read(rt_trace_event_t* events, uint32_t max) {
+    unsigned long flags = spin_lock_irqsave(&rt_trace.lock);
+    
+    uint32_t count = 0;
+    for (uint32_t i = rt_trace.tail; i != rt_trace.head && count < max; i++) {
+        events[count++] = rt_trace.events[i & (RT_TRACE_SIZE - 1)];
+    }
+    
+    spin_unlock_irqrestore(&rt_trace.lock, flags);
+    return count;
+}
+
+// Events lost to ring wrap-around
+uint32_t rt_trace_get_overwritten(void) {
+    // Events before the oldest one kept were overwritten
+    return __atomic_load_n(&rt_trace.tail, __ATOMIC_RELAXED);
+}
+
+// Empty the ring
+void rt_trace_clear(void) {
+    unsigned long flags = spin_lock_irqsave(&rt_trace.lock);
+    rt_trace.head = 0;
+    rt_trace.tail = 0;
+    spin_unlock_irqrestore(&rt_trace.lock, flags);
+}
@@ -0,0 +1,37 @@
+#ifndef REXUS_RTTRACE_H
+#define REXUS_RTTRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Number of events kept in the trace ring (power of two)
+#define RT_TRACE_SIZE 128
+
+// Trace event types
+typedef enum {
+    RT_TRACE_MISS,          // Job finished or was released past its deadline; value = ms late
+    RT_TRACE_OVERRUN,       // Job used up its budget and was throttled; value = budget in ms
+    RT_TRACE_LATENCY        // New worst wake-up-to-run latency for the task; value = TSC cycles
+} rt_trace_type_t;
+
+// Trace event
+typedef struct {
+    uint32_t time;          // Milliseconds since boot
+    uint32_t tid;
+    uint32_t type;          // rt_trace_type_t
+    uint32_t value;
+} rt_trace_event_t;
+
+// Record an event, overwriting the oldest once the ring is full
+void rt_trace_record(rt_trace_type_t type, uint32_t tid, uint32_t value);
+
+// Copy up to max events, oldest first, and return how many were copied
+uint32_t rt_trace_read(rt_trace_event_t* events, uint32_t max);
+
+// Events lost to ring wrap-around
+uint32_t rt_trace_get_overwritten(void);
+
+// Empty the ring
+void rt_trace_clear(void);
+
+#endif /* REXUS_RTTRACE_H */
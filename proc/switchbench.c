@@ -0,0 +1,108 @@
+#include "switchbench.h"
+#include "process.h"
+#include "../core/hal.h"
+#include "../arch/x86/cpu.h"
+#include "../arch/x86/smp.h"
+#include "../drivers/console.h"
+#include <string.h>
+
+// Switches measured by each task
+#define SWITCHBENCH_ROUNDS 10000
+
+// TSC stamp taken by the task that is about to yield
+static volatile uint32_t switchbench_stamp;
+
+// Results, updated by whichever task is running
+static uint32_t switchbench_samples;
+static uint32_t switchbench_total;
+static uint32_t switchbench_min;
+static uint32_t switchbench_max;
+static volatile uint32_t switchbench_done;
+
+// Ping-pong task: stamp, yield to the partner, and on resuming record the
+// time since the partner stamped just before yielding back
+static int switchbench_task(void* arg) {
+    (void)arg;
+    
+    for (uint32_t i = 0; i < SWITCHBENCH_ROUNDS; i++) {
+        switchbench_stamp = (uint32_t)rdtsc();
+        process_yield();
+        uint32_t cycles = (uint32_t)rdtsc() - switchbench_stamp;
+        
+        switchbench_samples++;
+        switchbench_total += cycles;
+        if (cycles < switchbench_min) {
+            switchbench_min = cycles;
+        }
+        if (cycles > switchbench_max) {
+            switchbench_max = cycles;
+        }
+    }
+    
+    switchbench_done++;
+    return 0;
+}
+
+// Context switches that reloaded CR3, summed over all CPUs
+static uint32_t switchbench_address_switches(void) {
+    uint32_t total = 0;
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        process_cpu_stats_t stats;
+        if (process_get_cpu_stats(cpu, &stats)) {
+            total += stats.address_switches;
+        }
+    }
+    return total;
+}
+
+// switchbench console command
+int switchbench_command(int argc, char* argv[]) {
+    bool threads = argc > 1 && strcmp(argv[1], "threads") == 0;
+    if (argc > 1 && !threads) {
+        console_puts("usage: switchbench [threads]\n");
+        return 1;
+    }
+    
+    switchbench_samples = 0;
+    switchbench_total = 0;
+    switchbench_min = 0xFFFFFFFF;
+    switchbench_max = 0;
+    switchbench_done = 0;
+    
+    uint32_t address_switches = switchbench_address_switches();
+    
+    // Both tasks share the high priority run queue, so each yield goes
+    // straight to the partner and the console does not run until both exit.
+    // In threads mode they are two threads of one process, so switching
+    // between them keeps the page directory and the TLB.
+    process_t* ping = process_create("ping", switchbench_task, NULL, PROCESS_PRIORITY_HIGH);
+    bool started = false;
+    if (ping && threads) {
+        started = thread_create(ping, switchbench_task, NULL, true) != NULL;
+    } else if (ping) {
+        started = process_create("pong", switchbench_task, NULL, PROCESS_PRIORITY_HIGH) != NULL;
+    }
+    if (!started) {
+        console_puts("switchbench: failed to create tasks\n");
+        if (ping) {
+            process_terminate(ping);
+        }
+        return 1;
+    }
+    
+    while (switchbench_done < 2) {
+        process_yield();
+    }
+    
+    address_switches = switchbench_address_switches() - address_switches;
+    uint32_t mhz = hal_get_cpu_khz() / 1000;
+    uint32_t average = switchbench_samples ? switchbench_total / switchbench_samples : 0;
+    
+    console_printf("switchbench: %d switches between %s, TSC %d MHz\n", switchbench_samples,
+                   threads ? "threads" : "processes", mhz);
+    console_printf("  average %d cycles (%d ns), min %d, max %d\n",
+                   average, mhz ? (average * 1000) / mhz : 0,
+                   switchbench_min, switchbench_max);
+    console_printf("  %d page directory reloads\n", address_switches);
+    return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef REXUS_SWITCHBENCH_H
+#define REXUS_SWITCHBENCH_H
+
+// Console command: context switch latency measured by two kernel tasks
+// yielding to each other and stamping the TSC across each switch. The
+// tasks are two processes, or with "threads" two threads of one process.
+int switchbench_command(int argc, char* argv[]);
+
+#endif /* REXUS_SWITCHBENCH_H */
@@ -0,0 +1,238 @@
+#include "sync.h"
+#include "process.h"
+
+// Initialize a wait queue
+void wait_queue_init(wait_queue_t* wq) {
+    spin_init(&wq->lock, NULL);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+// Unlink a thread from its wait queue (wq->lock held)
+static void wait_queue_remove(wait_queue_t* wq, thread_t* thread) {
+    thread_t** link = &wq->head;
+    thread_t* prev = NULL;
+    while (*link && *link != thread) {
+        prev = *link;
+        link = &prev->wait_next;
+    }
+    if (!*link) {
+        return;
+    }
+    
+    *link = thread->wait_next;
+    if (wq->tail == thread) {
+        wq->tail = prev;
+    }
+    thread->wait_next = NULL;
+    thread->wait_queue = NULL;
+}
+
+// Block the current thread on wq until it is woken
+void wait_queue_sleep_locked(wait_queue_t* wq, unsigned long flags) {
+    thread_t* thread = thread_get_current();
+    
+    thread->wait_next = NULL;
+    if (wq->tail) {
+        wq->tail->wait_next = thread;
+    } else {
+        wq->head = thread;
+    }
+    wq->tail = thread;
+    thread->wait_queue = wq;
+    
+    // A waker takes wq->lock to dequeue us, so marking ourselves blocked
+    // before dropping it cannot miss the wakeup
+    while (__atomic_load_n(&thread->wait_queue, __ATOMIC_ACQUIRE) == wq) {
+        bool blocked = thread_prepare_block();
+        spin_unlock(&wq->lock);
+        if (blocked) {
+            process_yield();
+        } else {
+            irq_restore(flags);
+            process_yield();
+            irq_save();
+        }
+        spin_lock(&wq->lock);
+    }
+    
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Take the longest waiter off wq and make it ready
+thread_t* wait_queue_wake_one_locked(wait_queue_t* wq) {
+    thread_t* thread = wq->head;
+    if (!thread) {
+        return NULL;
+    }
+    
+    wq->head = thread->wait_next;
+    if (!wq->head) {
+        wq->tail = NULL;
+    }
+    thread->wait_next = NULL;
+    __atomic_store_n(&thread->wait_queue, NULL, __ATOMIC_RELEASE);
+    
+    thread_unblock(thread);
+    return thread;
+}
+
+// Block until woken
+void wait_queue_sleep(wait_queue_t* wq) {
+    unsigned long flags = spin_lock_irqsave(&wq->lock);
+    wait_queue_sleep_locked(wq, flags);
+}
+
+// Wake the longest waiter
+bool wait_queue_wake_one(wait_queue_t* wq) {
+    unsigned long flags = spin_lock_irqsave(&wq->lock);
+    bool woken = wait_queue_wake_one_locked(wq) != NULL;
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
+
+// Wake every waiter
+uint32_t wait_queue_wake_all(wait_queue_t* wq) {
+    uint32_t woken = 0;
+    unsigned long flags = spin_lock_irqsave(&wq->lock);
+    while (wait_queue_wake_one_locked(wq)) {
+        woken++;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
+
+// Remove a thread from the queue it waits on, if any
+void wait_queue_cancel(thread_t* thread) {
+    for (;;) {
+        wait_queue_t* wq = __atomic_load_n(&thread->wait_queue, __ATOMIC_ACQUIRE);
+        if (!wq) {
+            return;
+        }
+        
+        // It may have been woken while we took the lock
+        unsigned long flags = spin_lock_irqsave(&wq->lock);
+        bool found = thread->wait_queue == wq;
+        if (found) {
+            wait_queue_remove(wq, thread);
+        }
+        spin_unlock_irqrestore(&wq->lock, flags);
+        if (found) {
+            return;
+        }
+    }
+}
+
+// Initialize a mutex
+void mutex_init(mutex_t* mutex, const char* name) {
+    wait_queue_init(&mutex->waiters);
+    mutex->locked = false;
+    mutex->owner = NULL;
+    mutex->stats.name = name;
+    mutex->stats.acquired = 0;
+    mutex->stats.contended = 0;
+    mutex->stats.next = NULL;
+    if (name) {
+        lock_stats_register(&mutex->stats);
+    }
+}
+
+// Acquire a mutex, sleeping while another thread holds it
+void mutex_lock(mutex_t* mutex) {
+    unsigned long flags = spin_lock_irqsave(&mutex->waiters.lock);
+    
+    if (!mutex->locked) {
+        mutex->locked = true;
+        mutex->owner = thread_get_current();
+        mutex->stats.acquired++;
+        spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+        return;
+    }
+    
+    // mutex_unlock makes us the owner before waking us
+    mutex->stats.contended++;
+    wait_queue_sleep_locked(&mutex->waiters, flags);
+}
+
+// Acquire a mutex only if it is free
+bool mutex_trylock(mutex_t* mutex) {
+    unsigned long flags = spin_lock_irqsave(&mutex->waiters.lock);
+    bool acquired = !mutex->locked;
+    if (acquired) {
+        mutex->locked = true;
+        mutex->owner = thread_get_current();
+        mutex->stats.acquired++;
+    }
+    spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+    return acquired;
+}
+
+// Release a mutex, handing it to the longest waiter
+void mutex_unlock(mutex_t* mutex) {
+    unsigned long flags = spin_lock_irqsave(&mutex->waiters.lock);
+    
+    thread_t* next = wait_queue_wake_one_locked(&mutex->waiters);
+    if (next) {
+        mutex->owner = next;
+        mutex->stats.acquired++;
+    } else {
+        mutex->locked = false;
+        mutex->owner = NULL;
+    }
+    
+    spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+}
+
+// Initialize a semaphore with count units
+void semaphore_init(semaphore_t* sem, const char* name, uint32_t count) {
+    wait_queue_init(&sem->waiters);
+    sem->count = count;
+    sem->stats.name = name;
+    sem->stats.acquired = 0;
+    sem->stats.contended = 0;
+    sem->stats.next = NULL;
+    if (name) {
+        lock_stats_register(&sem->stats);
+    }
+}
+
+// Take a unit, sleeping until one is available
+void semaphore_down(semaphore_t* sem) {
+    unsigned long flags = spin_lock_irqsave(&sem->waiters.lock);
+    
+    if (sem->count > 0) {
+        sem->count--;
+        sem->stats.acquired++;
+        spin_unlock_irqrestore(&sem->waiters.lock, flags);
+        return;
+    }
+    
+    // semaphore_up gives its unit straight to us
+    sem->stats.contended++;
+    wait_queue_sleep_locked(&sem->waiters, flags);
+}
+
+// Take a unit only if one is available
+bool semaphore_trydown(semaphore_t* sem) {
+    unsigned long flags = spin_lock_irqsave(&sem->waiters.lock);
+    bool acquired = sem->count > 0;
+    if (acquired) {
+        sem->count--;
+        sem->stats.acquired++;
+    }
+    spin_unlock_irqrestore(&sem->waiters.lock, flags);
+    return acquired;
+}
+
+// Return a unit, handing it to the longest waiter if there is one
+void semaphore_up(semaphore_t* sem) {
+    unsigned long flags = spin_lock_irqsave(&sem->waiters.lock);
+    
+    if (wait_queue_wake_one_locked(&sem->waiters)) {
+        sem->stats.acquired++;
+    } else {
+        sem->count++;
+    }
+    
+    spin_unlock_irqrestore(&sem->waiters.lock, flags);
+}
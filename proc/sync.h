@@ -0,0 +1,67 @@
+#ifndef REXUS_SYNC_H
+#define REXUS_SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../core/spinlock.h"
+
+struct thread;
+
+// FIFO queue of threads blocked on some condition. The lock also
+// protects the state of whatever the queue is embedded in.
+typedef struct wait_queue {
+    spinlock_t lock;
+    struct thread* head;
+    struct thread* tail;
+} wait_queue_t;
+
+// Sleeping lock with FIFO hand-off: unlock passes ownership straight to
+// the longest waiter, so a waiter cannot be overtaken once queued
+typedef struct {
+    wait_queue_t waiters;
+    bool locked;
+    struct thread* owner;
+    lock_stats_t stats;
+} mutex_t;
+
+// Counting semaphore; up hands the unit straight to the longest waiter
+typedef struct {
+    wait_queue_t waiters;
+    uint32_t count;
+    lock_stats_t stats;
+} semaphore_t;
+
+// Wait queues
+void wait_queue_init(wait_queue_t* wq);
+
+// Block the current thread on wq until it is woken. Called with
+// wq->lock held through spin_lock_irqsave; returns with it released and
+// the interrupt flags restored. The idle thread cannot block, so it
+// keeps yielding until woken instead.
+void wait_queue_sleep_locked(wait_queue_t* wq, unsigned long flags);
+
+// Take the longest waiter off wq and make it ready (wq->lock held).
+// Returns the thread woken, or NULL if nobody was waiting.
+struct thread* wait_queue_wake_one_locked(wait_queue_t* wq);
+
+// Block until woken, or wake waiters
+void wait_queue_sleep(wait_queue_t* wq);
+bool wait_queue_wake_one(wait_queue_t* wq);
+uint32_t wait_queue_wake_all(wait_queue_t* wq);
+
+// Remove a thread from the queue it waits on, if any (thread teardown)
+void wait_queue_cancel(struct thread* thread);
+
+// Mutexes
+void mutex_init(mutex_t* mutex, const char* name);
+void mutex_lock(mutex_t* mutex);
+bool mutex_trylock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+
+// Semaphores
+void semaphore_init(semaphore_t* sem, const char* name, uint32_t count);
+void semaphore_down(semaphore_t* sem);
+bool semaphore_trydown(semaphore_t* sem);
+void semaphore_up(semaphore_t* sem);
+
+#endif /* REXUS_SYNC_H */
@@ -0,0 +1,182 @@
+#include "host.h"
+#include "net/ipv4.h"
+#include "net/udp.h"
+#include "net/tcp.h"
+#include "net/ethernet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Microbenchmarks for the per-packet path of the network stack.
+//
+// usage: bench_net [--filter=substring] [--min_time_ms=N]
+//
+// Each benchmark runs its body for a growing number of iterations until
+// one run takes at least min_time, then reports the time per iteration,
+// in the same spirit as Google Benchmark.
+
+#define BENCH_PORT_A 7000
+#define BENCH_PORT_B 7001
+#define BENCH_PORT_C 7002
+#define BENCH_PORT_D 7003
+
+typedef struct {
+    const char* name;
+    void (*run)(uint64_t iterations);
+    size_t bytes;   // Bytes processed per iteration, 0 if not meaningful
+} bench_t;
+
+static const ipv4_addr_t bench_addr = { { 127, 0, 0, 1 } };
+static uint8_t bench_buf[2048];
+static udp_socket_t* bench_udp_a;
+static udp_socket_t* bench_udp_b;
+static tcp_conn_t* bench_tcp_client;
+static tcp_conn_t* bench_tcp_server;
+static net_packet_t* bench_udp_template;
+
+// Keep the compiler from discarding benchmark results
+static volatile uint32_t bench_sink;
+
+static void bm_ipv4_checksum(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        bench_sink += ipv4_checksum(bench_buf, sizeof(ipv4_header_t));
+    }
+}
+
+static void bm_crc32_1500(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        bench_sink += eth_calculate_crc32(bench_buf, 1500);
+    }
+}
+
+static void bm_packet_alloc_free(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        net_packet_t* packet = net_alloc_packet(64);
+        net_free_packet(packet);
+    }
+}
+
+// Receive side only: a prebuilt IPv4/UDP datagram into a bound socket
+static void bm_ipv4_receive_udp(uint64_t iterations) {
+    size_t length = bench_udp_template->length;
+    
+    for (uint64_t i = 0; i < iterations; i++) {
+        net_packet_t* packet = net_alloc_packet(length);
+        memcpy(packet->data, bench_udp_template->data, length);
+        packet->protocol = NET_PROTO_IPV4;
+        ipv4_receive_packet(bench_udp_template->iface, packet);
+        bench_sink += udp_receive(bench_udp_b, NULL, NULL, bench_buf, sizeof(bench_buf));
+    }
+}
+
+// Full path: udp_send, loopback, IPv4 receive and udp_receive
+static void bm_udp_loopback_64(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        udp_send(bench_udp_a, &bench_addr, BENCH_PORT_B, bench_buf, 64);
+        net_process_rx_queue();
+        bench_sink += udp_receive(bench_udp_b, NULL, NULL, bench_buf, sizeof(bench_buf));
+    }
+}
+
+static void bm_tcp_loopback_1460(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        tcp_send(bench_tcp_client, bench_buf, 1460);
+        net_process_rx_queue();
+        bench_sink += tcp_receive(bench_tcp_server, bench_buf, sizeof(bench_buf));
+    }
+}
+
+static const bench_t benchmarks[] = {
+    { "BM_Ipv4Checksum",        bm_ipv4_checksum,       sizeof(ipv4_header_t) },
+    { "BM_Crc32/1500",          bm_crc32_1500,          1500 },
+    { "BM_PacketAllocFree",     bm_packet_alloc_free,   0 },
+    { "BM_Ipv4ReceiveUdp/64",   bm_ipv4_receive_udp,    64 },
+    { "BM_UdpLoopback/64",      bm_udp_loopback_64,     64 },
+    { "BM_TcpLoopback/1460",    bm_tcp_loopback_1460,   1460 },
+};
+
+// Sockets, connections and a captured datagram shared by the benchmarks
+static bool bench_setup(void) {
+    memset(bench_buf, 0xA5, sizeof(bench_buf));
+    
+    bench_udp_a = udp_create_socket(&bench_addr, BENCH_PORT_A, NULL);
+    bench_udp_b = udp_create_socket(&bench_addr, BENCH_PORT_B, NULL);
+    bench_tcp_client = tcp_create_connection(&bench_addr, BENCH_PORT_C,
+                                             &bench_addr, BENCH_PORT_D, NULL);
+    bench_tcp_server = tcp_create_connection(&bench_addr, BENCH_PORT_D,
+                                             &bench_addr, BENCH_PORT_C, NULL);
+    if (!bench_udp_a || !bench_udp_b || !bench_tcp_client || !bench_tcp_server) {
+        return false;
+    }
+    
+    // There is no handshake yet; pair the endpoints directly
+    bench_tcp_client->state = TCP_STATE_ESTABLISHED;
+    bench_tcp_server->state = TCP_STATE_ESTABLISHED;
+    
+    // Capture one datagram off the loopback queue to use as a template
+    udp_send(bench_udp_a, &bench_addr, BENCH_PORT_B, bench_buf, 64);
+    net_interface_t* lo = net_get_interface("lo");
+    bench_udp_template = lo ? net_receive_packet(lo) : NULL;
+    return bench_udp_template != NULL;
+}
+
+static void bench_run(const bench_t* bench, uint64_t min_time_ns) {
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    
+    for (;;) {
+        uint64_t start = host_now_ns();
+        bench->run(iterations);
+        elapsed = host_now_ns() - start;
+        
+        if (elapsed >= min_time_ns || iterations >= (1ull << 32)) {
+            break;
+        }
+        
+        // Aim a little past min_time, growing at most 10x per step
+        uint64_t next = elapsed ? iterations * min_time_ns * 14 / (elapsed * 10) : iterations * 10;
+        if (next > iterations * 10) {
+            next = iterations * 10;
+        }
+        iterations = next > iterations ? next : iterations + 1;
+    }
+    
+    double ns_per_iter = (double)elapsed / (double)iterations;
+    printf("%-24s %12.1f ns %14llu", bench->name, ns_per_iter, (unsigned long long)iterations);
+    if (bench->bytes) {
+        printf(" %10.1f MB/s", (double)bench->bytes * 1000.0 / ns_per_iter);
+    }
+    printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* filter = NULL;
+    uint64_t min_time_ns = 500ull * 1000 * 1000;
+    
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--filter=", 9)) {
+            filter = argv[i] + 9;
+        } else if (!strncmp(argv[i], "--min_time_ms=", 14)) {
+            min_time_ns = (uint64_t)strtoull(argv[i] + 14, NULL, 10) * 1000 * 1000;
+        } else {
+            fprintf(stderr, "usage: %s [--filter=substring] [--min_time_ms=N]\n", argv[0]);
+            return 2;
+        }
+    }
+    
+    host_log_enabled = false;
+    if (!host_net_init() || !bench_setup()) {
+        fprintf(stderr, "benchmark setup failed\n");
+        return 1;
+    }
+    
+    printf("%-24s %15s %14s\n", "Benchmark", "Time", "Iterations");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (filter && !strstr(benchmarks[i].name, filter)) {
+            continue;
+        }
+        bench_run(&benchmarks[i], min_time_ns);
+    }
+    
+    return 0;
+}
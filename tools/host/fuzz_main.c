@@ -0,0 +1,30 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Standalone driver for the fuzz targets when libFuzzer is not available
+// (e.g. building with gcc). Runs each file named on the command line
+// through the target once, which is enough to replay a corpus or a crash
+// under AddressSanitizer.
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+int main(int argc, char* argv[]) {
+    static uint8_t buf[1 << 20];
+    
+    for (int i = 1; i < argc; i++) {
+        FILE* file = fopen(argv[i], "rb");
+        if (!file) {
+            perror(argv[i]);
+            return 1;
+        }
+        size_t size = fread(buf, 1, sizeof(buf), file);
+        fclose(file);
+        
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+    
+    printf("%d inputs ok\n", argc - 1);
+    return 0;
+}
@@ -0,0 +1,160 @@
+#define _POSIX_C_SOURCE 200809L
+#include "host.h"
+#include "net/ipv4.h"
+#include "net/udp.h"
+#include "net/tcp.h"
+#include "net/loopback.h"
+#include "core/hal.h"
+#include "mem/pmm.h"
+#include "mem/kmalloc.h"
+#include "drivers/vga.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Host replacement for the kernel services that net/ links against.
+// mem/pmm.c hands out pointers into the kernel's direct map, which only
+// works inside the kernel, so page allocations and kmalloc are served
+// from the C heap.
+
+bool host_log_enabled = true;
+
+void* pmm_alloc_block_for(page_owner_t owner) {
+    (void)owner;
+    return aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+}
+
+void pmm_free_block(void* p) {
+    free(p);
+}
+
+void* pmm_alloc_blocks_for(size_t size, page_owner_t owner) {
+    (void)owner;
+    if (size == 0) {
+        return NULL;
+    }
+    return aligned_alloc(PAGE_SIZE, size * PAGE_SIZE);
+}
+
+void pmm_free_blocks(void* p, size_t size) {
+    (void)size;
+    free(p);
+}
+
+void* kmalloc(size_t size) {
+    return size ? malloc(size) : NULL;
+}
+
+void* krealloc(void* p, size_t size) {
+    if (!size) {
+        free(p);
+        return NULL;
+    }
+    return realloc(p, size);
+}
+
+void kfree(void* p) {
+    free(p);
+}
+
+void vga_puts(const char* str) {
+    if (host_log_enabled) {
+        fputs(str, stderr);
+    }
+}
+
+void vga_putint(int n) {
+    if (host_log_enabled) {
+        fprintf(stderr, "%d", n);
+    }
+}
+
+void vga_puthex(uint32_t n) {
+    if (host_log_enabled) {
+        fprintf(stderr, "0x%x", n);
+    }
+}
+
+void vga_putchar(char c) {
+    if (host_log_enabled) {
+        fputc(c, stderr);
+    }
+}
+
+// core/timer.c programs the PIT; the host has no timer interrupt
+void hal_timer_periodic(uint32_t hz) {
+    (void)hz;
+}
+
+void hal_timer_oneshot(uint32_t us) {
+    (void)us;
+}
+
+uint32_t hal_timer_oneshot_elapsed(void) {
+    return 0;
+}
+
+uint64_t host_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+bool host_net_init(void) {
+    net_init();
+    ipv4_init();
+    udp_init();
+    tcp_init();
+    return loopback_init();
+}
+
+static bool host_replay_init(net_interface_t* iface) {
+    iface->flags |= NET_IF_FLAG_UP | NET_IF_FLAG_RUNNING;
+    return true;
+}
+
+// Replies generated while replaying a capture are counted and dropped
+static bool host_replay_send(net_interface_t* iface, net_packet_t* packet) {
+    (void)iface;
+    net_free_packet(packet);
+    return true;
+}
+
+// Captured packets are injected directly, never polled
+static net_packet_t* host_replay_receive(net_interface_t* iface) {
+    (void)iface;
+    return NULL;
+}
+
+net_interface_t* host_replay_interface(const char* addr) {
+    static net_interface_t iface;
+    
+    if (iface.name[0]) {
+        return &iface;
+    }
+    
+    ipv4_config_t config;
+    memset(&config, 0, sizeof(config));
+    if (!ipv4_string_to_addr(addr, &config.addr)) {
+        return NULL;
+    }
+    ipv4_string_to_addr("255.255.255.0", &config.netmask);
+    
+    memset(&iface, 0, sizeof(iface));
+    strncpy(iface.name, "replay0", sizeof(iface.name) - 1);
+    iface.type = NET_IF_TYPE_ETHERNET;
+    iface.mtu = 1500;
+    iface.init = host_replay_init;
+    iface.send = host_replay_send;
+    iface.receive = host_replay_receive;
+    
+    if (!net_register_interface(&iface) || !ipv4_configure_interface(&iface, &config)) {
+        memset(&iface, 0, sizeof(iface));
+        return NULL;
+    }
+    
+    ipv4_addr_t any = { { 0, 0, 0, 0 } };
+    ipv4_add_route(&any, &any, NULL, &iface, 100);
+    return &iface;
+}
@@ -0,0 +1,21 @@
+#ifndef REXUS_HOST_H
+#define REXUS_HOST_H
+
+#include "net/net.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Kernel log output (vga_puts) goes to stderr while this is set
+extern bool host_log_enabled;
+
+// Bring up net, IPv4, UDP, TCP and loopback the same way kmain does
+bool host_net_init(void);
+
+// Register a "replay0" interface that swallows everything sent through it
+net_interface_t* host_replay_interface(const char* addr);
+
+// Monotonic clock in nanoseconds
+uint64_t host_now_ns(void);
+
+#endif /* REXUS_HOST_H */
@@ -0,0 +1,276 @@
+#include "host.h"
+#include "net/ipv4.h"
+#include "net/udp.h"
+#include "net/tcp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Replays the IPv4 packets of a pcap capture through ipv4_receive_packet.
+//
+// usage: pcap_replay [-q] [-a local_addr] [-u udp_port]... capture.pcap
+//
+// The stack keeps header fields in host byte order, so each packet has its
+// IPv4, UDP and TCP header fields converted from wire order before it is
+// injected, and the IPv4 and UDP checksums are recomputed to match.
+
+// pcap file format
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_MAGIC_NSEC     0xA1B23C4D
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_LINKTYPE_RAW      101
+#define PCAP_LINKTYPE_IPV4     228
+
+#define ETHERTYPE_IPV4  0x0800
+#define ETHERTYPE_VLAN  0x8100
+
+#define REPLAY_MAX_UDP_PORTS 16
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} __attribute__((packed)) pcap_file_header_t;
+
+typedef struct {
+    uint32_t ts_sec;
+    uint32_t ts_frac;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} __attribute__((packed)) pcap_record_header_t;
+
+// Replay counters
+static struct {
+    uint32_t records;
+    uint32_t injected;
+    uint32_t not_ipv4;
+    uint32_t truncated;
+    uint32_t with_options;
+} replay_stats;
+
+static uint16_t bswap16(uint16_t v) {
+    return (uint16_t)((v >> 8) | (v << 8));
+}
+
+static uint32_t bswap32(uint32_t v) {
+    return (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+}
+
+static uint16_t be16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+// Convert the transport header of an unfragmented datagram to host order
+static void replay_convert_transport(ipv4_header_t* ip, uint8_t* payload, size_t length) {
+    if (ip->protocol == IPV4_PROTO_UDP && length >= sizeof(udp_header_t)) {
+        udp_header_t* udp = (udp_header_t*)payload;
+        udp->src_port = bswap16(udp->src_port);
+        udp->dest_port = bswap16(udp->dest_port);
+        udp->length = bswap16(udp->length);
+        udp->checksum = 0;
+        if (udp->length >= sizeof(udp_header_t) && udp->length <= length) {
+            udp->checksum = udp_checksum(&ip->src_addr, &ip->dest_addr, udp, udp->length);
+        }
+    } else if (ip->protocol == IPV4_PROTO_TCP && length >= sizeof(tcp_header_t)) {
+        tcp_header_t* tcp = (tcp_header_t*)payload;
+        tcp->src_port = bswap16(tcp->src_port);
+        tcp->dest_port = bswap16(tcp->dest_port);
+        tcp->seq_num = bswap32(tcp->seq_num);
+        tcp->ack_num = bswap32(tcp->ack_num);
+        tcp->window = bswap16(tcp->window);
+        tcp->urgent_ptr = bswap16(tcp->urgent_ptr);
+        tcp->checksum = 0;
+        tcp->checksum = tcp_checksum(&ip->src_addr, &ip->dest_addr, tcp, length);
+    }
+}
+
+// Strip the link layer, convert to host order and inject one packet
+static void replay_packet(net_interface_t* iface, uint32_t linktype,
+                          const uint8_t* frame, size_t length) {
+    if (linktype == PCAP_LINKTYPE_ETHERNET) {
+        if (length < 14) {
+            replay_stats.truncated++;
+            return;
+        }
+        uint16_t ethertype = be16(frame + 12);
+        size_t hdr_len = 14;
+        if (ethertype == ETHERTYPE_VLAN && length >= 18) {
+            ethertype = be16(frame + 16);
+            hdr_len = 18;
+        }
+        if (ethertype != ETHERTYPE_IPV4) {
+            replay_stats.not_ipv4++;
+            return;
+        }
+        frame += hdr_len;
+        length -= hdr_len;
+    }
+    
+    if (length < sizeof(ipv4_header_t)) {
+        replay_stats.truncated++;
+        return;
+    }
+    if ((frame[0] >> 4) != 4) {
+        replay_stats.not_ipv4++;
+        return;
+    }
+    if ((frame[0] & 0x0F) != 5) {
+        // The stack assumes a fixed 20-byte header
+        replay_stats.with_options++;
+        return;
+    }
+    
+    net_packet_t* packet = net_alloc_packet(length);
+    if (!packet) {
+        replay_stats.truncated++;
+        return;
+    }
+    memcpy(packet->data, frame, length);
+    packet->protocol = NET_PROTO_IPV4;
+    
+    ipv4_header_t* ip = (ipv4_header_t*)packet->data;
+    ip->total_length = bswap16(ip->total_length);
+    ip->id = bswap16(ip->id);
+    ip->flags_offset = bswap16(ip->flags_offset);
+    
+    if (!(ip->flags_offset & (IPV4_FLAG_MORE_FRAGMENTS | IPV4_FRAGMENT_OFFSET_MASK)) &&
+        ip->total_length >= sizeof(ipv4_header_t) && ip->total_length <= length) {
+        replay_convert_transport(ip, packet->data + sizeof(ipv4_header_t),
+                                 ip->total_length - sizeof(ipv4_header_t));
+    }
+    
+    ip->checksum = 0;
+    ip->checksum = ipv4_checksum(ip, sizeof(ipv4_header_t));
+    
+    replay_stats.injected++;
+    ipv4_receive_packet(iface, packet);
+    net_process_rx_queue();
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-q] [-a local_addr] [-u udp_port]... capture.pcap\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    const char* local_addr = "10.0.2.15";
+    const char* path = NULL;
+    uint16_t udp_ports[REPLAY_MAX_UDP_PORTS];
+    int udp_port_count = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-q")) {
+            host_log_enabled = false;
+        } else if (!strcmp(argv[i], "-a") && i + 1 < argc) {
+            local_addr = argv[++i];
+        } else if (!strcmp(argv[i], "-u") && i + 1 < argc && udp_port_count < REPLAY_MAX_UDP_PORTS) {
+            udp_ports[udp_port_count++] = (uint16_t)atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+        return 2;
+    }
+    
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+    
+    pcap_file_header_t fh;
+    if (fread(&fh, sizeof(fh), 1, file) != 1) {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        fclose(file);
+        return 1;
+    }
+    bool swapped = false;
+    if (fh.magic == bswap32(PCAP_MAGIC) || fh.magic == bswap32(PCAP_MAGIC_NSEC)) {
+        swapped = true;
+        fh.linktype = bswap32(fh.linktype);
+    } else if (fh.magic != PCAP_MAGIC && fh.magic != PCAP_MAGIC_NSEC) {
+        fprintf(stderr, "%s: bad pcap magic 0x%08x\n", path, fh.magic);
+        fclose(file);
+        return 1;
+    }
+    fh.linktype &= 0xFFFF;
+    if (fh.linktype != PCAP_LINKTYPE_ETHERNET && fh.linktype != PCAP_LINKTYPE_RAW &&
+        fh.linktype != PCAP_LINKTYPE_IPV4) {
+        fprintf(stderr, "%s: unsupported link type %u\n", path, fh.linktype);
+        fclose(file);
+        return 1;
+    }
+    
+    if (!host_net_init()) {
+        fprintf(stderr, "failed to initialize the network stack\n");
+        fclose(file);
+        return 1;
+    }
+    net_interface_t* iface = host_replay_interface(local_addr);
+    if (!iface) {
+        fprintf(stderr, "bad local address %s\n", local_addr);
+        fclose(file);
+        return 1;
+    }
+    
+    ipv4_addr_t addr;
+    ipv4_string_to_addr(local_addr, &addr);
+    udp_socket_t* udp_sockets[REPLAY_MAX_UDP_PORTS];
+    for (int i = 0; i < udp_port_count; i++) {
+        udp_sockets[i] = udp_create_socket(&addr, udp_ports[i], NULL);
+        if (!udp_sockets[i]) {
+            fprintf(stderr, "failed to open UDP port %u\n", udp_ports[i]);
+        }
+    }
+    
+    static uint8_t frame[65536];
+    pcap_record_header_t rh;
+    uint64_t start = host_now_ns();
+    while (fread(&rh, sizeof(rh), 1, file) == 1) {
+        uint32_t incl_len = swapped ? bswap32(rh.incl_len) : rh.incl_len;
+        if (incl_len > sizeof(frame) || fread(frame, 1, incl_len, file) != incl_len) {
+            replay_stats.truncated++;
+            break;
+        }
+        replay_stats.records++;
+        replay_packet(iface, fh.linktype, frame, incl_len);
+    }
+    uint64_t elapsed = host_now_ns() - start;
+    fclose(file);
+    
+    ipv4_stats_t stats;
+    ipv4_get_stats(&stats);
+    
+    printf("records:              %u\n", replay_stats.records);
+    printf("injected:             %u\n", replay_stats.injected);
+    printf("skipped (not IPv4):   %u\n", replay_stats.not_ipv4);
+    printf("skipped (options):    %u\n", replay_stats.with_options);
+    printf("skipped (truncated):  %u\n", replay_stats.truncated);
+    printf("ipv4 received:        %llu\n", (unsigned long long)stats.packets_received);
+    printf("ipv4 dropped:         %llu\n", (unsigned long long)stats.packets_dropped);
+    printf("ipv4 forwarded:       %llu\n", (unsigned long long)stats.packets_forwarded);
+    printf("ipv4 reassembled:     %llu\n", (unsigned long long)stats.fragments_reassembled);
+    printf("ipv4 reassembly fail: %llu\n", (unsigned long long)stats.reassembly_failures);
+    for (int i = 0; i < udp_port_count; i++) {
+        if (!udp_sockets[i]) {
+            continue;
+        }
+        udp_stats_t udp_stats;
+        udp_get_stats(udp_sockets[i], &udp_stats);
+        printf("udp %-5u received:   %llu (%llu checksum errors)\n", udp_ports[i],
+               (unsigned long long)udp_stats.packets_received,
+               (unsigned long long)udp_stats.checksum_errors);
+    }
+    printf("time:                 %llu ns (%llu ns/packet)\n",
+           (unsigned long long)elapsed,
+           (unsigned long long)(replay_stats.injected ? elapsed / replay_stats.injected : 0));
+    return 0;
+}